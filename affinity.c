@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "aoakvm.h"
+#include "affinity.h"
+
+// Static Functions
+static int parse_cpus(const char *list, cpu_set_t *set);
+static int read_schedstat(pid_t tid, uint64_t *run, uint64_t *wait, uint64_t *slices);
+static int alive(pid_t tid);
+
+// Local Variables
+static const char *ROLE_NAMES[THREAD_ROLES] = {
+    [THREAD_STREAM] = "stream",
+    [THREAD_RENDER] = "render",
+    [THREAD_HID] = "hid",
+};
+
+static SDL_SpinLock affinityLock;
+static const struct aoakvmThreadConfig_t *config;
+static pid_t threads[THREAD_ROLES][AFFINITY_MAX_THREADS];
+
+
+void affinity_start(const struct aoakvmThreadConfig_t *cfg) {
+    config = cfg;
+}
+
+static int parse_cpus(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list != '\0') {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list) {
+                return -1;
+            }
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        list = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static int alive(pid_t tid) {
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d", (int)tid);
+    return access(path, F_OK) == 0;
+}
+
+void affinity_apply(int role) {
+    pid_t tid = syscall(SYS_gettid);
+
+    // The stream thread comes and goes with every connection, keep only live ones. The /proc
+    // lookups run outside the lock, a slot is only cleared if it still holds the dead thread.
+    pid_t known[AFFINITY_MAX_THREADS];
+    int dead[AFFINITY_MAX_THREADS];
+    SDL_AtomicLock(&affinityLock);
+    memcpy(known, threads[role], sizeof(known));
+    SDL_AtomicUnlock(&affinityLock);
+    for (int i = 0; i < AFFINITY_MAX_THREADS; i++) {
+        dead[i] = known[i] != 0 && !alive(known[i]);
+    }
+
+    SDL_AtomicLock(&affinityLock);
+    int slot = -1;
+    for (int i = 0; i < AFFINITY_MAX_THREADS; i++) {
+        if (dead[i] && threads[role][i] == known[i]) {
+            threads[role][i] = 0;
+        }
+        if (threads[role][i] == 0 && slot < 0) {
+            slot = i;
+        }
+    }
+    if (slot >= 0) {
+        threads[role][slot] = tid;
+    }
+    SDL_AtomicUnlock(&affinityLock);
+
+    if (config == NULL) {
+        return;
+    }
+
+    const struct aoakvmThreadConfig_t *cfg = &config[role];
+    if (cfg->cpus != NULL) {
+        cpu_set_t set;
+        if (parse_cpus(cfg->cpus, &set) < 0) {
+            log_error("affinity: invalid CPU list '%s' for %s", cfg->cpus, ROLE_NAMES[role]);
+        } else if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            log_warn("affinity: pinning %s to %s failed: %s", ROLE_NAMES[role], cfg->cpus, strerror(errno));
+        }
+    }
+
+    if (cfg->policy == SCHED_FIFO || cfg->policy == SCHED_RR) {
+        struct sched_param param = { .sched_priority = cfg->priority };
+        if (sched_setscheduler(0, cfg->policy, &param) < 0) {
+            log_warn("affinity: %s policy %s/%d refused: %s", ROLE_NAMES[role],
+                     cfg->policy == SCHED_FIFO ? "FIFO" : "RR", cfg->priority, strerror(errno));
+        }
+    } else if (cfg->nice != 0 && setpriority(PRIO_PROCESS, tid, cfg->nice) < 0) {
+        // On Linux PRIO_PROCESS with a thread id only affects that thread
+        log_warn("affinity: nice %d for %s refused: %s", cfg->nice, ROLE_NAMES[role], strerror(errno));
+    }
+    log_debug("affinity: thread %d runs as %s", (int)tid, ROLE_NAMES[role]);
+}
+
+/* schedstat holds ns on a CPU, ns runnable but waiting and the number of timeslices */
+static int read_schedstat(pid_t tid, uint64_t *run, uint64_t *wait, uint64_t *slices) {
+    char path[64];
+    unsigned long long r, w, s;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", (int)tid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int fields = fscanf(file, "%llu %llu %llu", &r, &w, &s);
+    fclose(file);
+    if (fields != 3) {
+        return -1;
+    }
+
+    *run = r / 1000;
+    *wait = w / 1000;
+    *slices = s;
+    return 0;
+}
+
+void affinity_getStats(struct aoakvmThreadStats_t *stats) {
+    pid_t tids[THREAD_ROLES][AFFINITY_MAX_THREADS];
+
+    SDL_AtomicLock(&affinityLock);
+    memcpy(tids, threads, sizeof(tids));
+    SDL_AtomicUnlock(&affinityLock);
+
+    memset(stats, 0, sizeof(*stats) * THREAD_ROLES);
+    for (int role = 0; role < THREAD_ROLES; role++) {
+        for (int i = 0; i < AFFINITY_MAX_THREADS; i++) {
+            uint64_t run, wait, slices;
+            if (tids[role][i] == 0 || read_schedstat(tids[role][i], &run, &wait, &slices) < 0) {
+                continue;
+            }
+            stats[role].threads++;
+            stats[role].runUs += run;
+            stats[role].waitUs += wait;
+            stats[role].timeslices += slices;
+        }
+    }
+}
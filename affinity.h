@@ -0,0 +1,32 @@
+#ifndef AOAKVM_AFFINITY
+#define AOAKVM_AFFINITY
+
+#include "aoakvm.h"
+
+/* Threads per role whose scheduler figures are collected */
+#define AFFINITY_MAX_THREADS 4
+
+/*
+    void affinity_start(const struct aoakvmThreadConfig_t *cfg);
+
+    Sets the placement of each role, cfg holds THREAD_ROLES entries and must stay valid.
+    Without it affinity_apply only registers threads for affinity_getStats.
+*/
+void affinity_start(const struct aoakvmThreadConfig_t*);
+
+/*
+    void affinity_apply(int role);
+
+    Called by a thread of role (aoakvm_thread_role_e) on itself right after it started: pins it
+    to the CPU set, sets policy and priority or nice level and registers it for the statistics.
+*/
+void affinity_apply(int);
+
+/*
+    void affinity_getStats(struct aoakvmThreadStats_t stats[THREAD_ROLES]);
+
+    Sums the scheduler statistics of the registered threads that are still alive.
+*/
+void affinity_getStats(struct aoakvmThreadStats_t*);
+
+#endif
@@ -0,0 +1,311 @@
+#include <sys/time.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "aoa.h"
+#include "hid.h"
+
+#define REQUEST_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR)
+#define REQUEST_IN (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR)
+
+/* How often aoa_run warns and cancels again while it waits for cancelled transfers */
+#define AOA_CANCEL_WAIT_MS 500
+
+// Static Functions
+static int add_step(struct aoaHandshake_t *hs, const char *name, uint8_t requestType, uint8_t request,
+                    uint16_t value, uint16_t index, const unsigned char *data, uint16_t length);
+static int add_hid(struct aoaHandshake_t *hs, const char *name, int hidId,
+                   const unsigned char *descriptor, uint16_t size, uint16_t chunk);
+static int submit_step(struct aoaHandshake_t *hs);
+static void finish(struct aoaHandshake_t *hs, int error);
+static void LIBUSB_CALL step_done(struct libusb_transfer *transfer);
+static int transfer_error(enum libusb_transfer_status status);
+
+
+static int add_step(struct aoaHandshake_t *hs, const char *name, uint8_t requestType, uint8_t request,
+                    uint16_t value, uint16_t index, const unsigned char *data, uint16_t length) {
+    if (hs->count == AOA_MAX_STEPS || length > AOA_MAX_DATA) {
+        log_error("aoa: handshake step %s does not fit", name);
+        return -1;
+    }
+
+    hs->steps[hs->count++] = (struct aoaStep_t) {
+        .name = name,
+        .requestType = requestType,
+        .request = request,
+        .value = value,
+        .index = index,
+        .data = data,
+        .length = length,
+    };
+    return 0;
+}
+
+int aoa_prepareAccessory(struct aoaHandshake_t *hs, const struct usbTransport_t *transport,
+                         libusb_device_handle *handle, struct aoakvmConfig_t *cfg) {
+    const char *strings[] = {
+        cfg->manufacturer, cfg->modelName, cfg->description, cfg->version, cfg->uri, cfg->serialNumber,
+    };
+    const char *names[] = {
+        "manufacturer", "modelName", "description", "version", "uri", "serialNumber",
+    };
+
+    memset(hs, 0, sizeof(*hs));
+    hs->transport = transport;
+    hs->handle = handle;
+
+    if (add_step(hs, "getProtocol", REQUEST_IN, AOA_GET_PROTOCOL, 0, 0, NULL, 2) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < 6; i++) {
+        if (add_step(hs, names[i], REQUEST_OUT, AOA_SEND_STRING, 0, i,
+                     (const unsigned char *)strings[i], strlen(strings[i]) + 1) < 0) {
+            return -1;
+        }
+    }
+    // Phones that dropped AOA2 audio stall the request, they still stream video
+    if (cfg->audio != NULL) {
+        if (add_step(hs, "audioMode", REQUEST_OUT, AOA_SET_AUDIO_MODE, AOA_AUDIO_PCM_44100, 0, NULL, 0) < 0) {
+            return -1;
+        }
+        hs->steps[hs->count - 1].optional = 1;
+    }
+    return add_step(hs, "start", REQUEST_OUT, AOA_START, 0, 0, NULL, 0);
+}
+
+static int add_hid(struct aoaHandshake_t *hs, const char *name, int hidId,
+                   const unsigned char *descriptor, uint16_t size, uint16_t chunk) {
+    if (add_step(hs, name, REQUEST_OUT, AOA_REGISTER_HID, hidId, size, NULL, 0) < 0) {
+        return -1;
+    }
+
+    // Longer descriptors are sent in several AOA_SET_HID_REPORT_DESC requests, index is the offset
+    for (uint16_t offset = 0; offset < size; offset += chunk) {
+        if (add_step(hs, name, REQUEST_OUT, AOA_SET_HID_REPORT_DESC, hidId, offset,
+                     descriptor + offset, SDL_min(chunk, size - offset)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int aoa_prepareHids(struct aoaHandshake_t *hs, const struct usbTransport_t *transport, libusb_device_handle *handle) {
+    struct libusb_device_descriptor desc;
+
+    memset(hs, 0, sizeof(*hs));
+    hs->transport = transport;
+    hs->handle = handle;
+
+    if (transport->getDescriptor(handle, &desc) < 0) {
+        return -1;
+    }
+
+    // SuperSpeed devices encode the endpoint zero size as a power of two
+    uint16_t chunk = desc.bcdUSB >= 0x0300 ? 1 << desc.bMaxPacketSize0 : desc.bMaxPacketSize0;
+    chunk = SDL_max(8, SDL_min(chunk, AOA_MAX_DATA));
+
+    if (add_hid(hs, "mouse", HID_ID_MOUSE, REPORT_DESC_MOUSE, REPORT_DESC_SIZE(REPORT_DESC_MOUSE), chunk) < 0 ||
+        add_hid(hs, "keyboard", HID_ID_KEYBOARD, REPORT_DESC_KB, REPORT_DESC_SIZE(REPORT_DESC_KB), chunk) < 0 ||
+        add_hid(hs, "touchpad", HID_ID_TOUCHPAD, REPORT_DESC_TOUCHPAD, REPORT_DESC_SIZE(REPORT_DESC_TOUCHPAD), chunk) < 0 ||
+        add_hid(hs, "touchscreen", HID_ID_TOUCHSCREEN, REPORT_DESC_TOUCHSCREEN, REPORT_DESC_SIZE(REPORT_DESC_TOUCHSCREEN), chunk) < 0) {
+        return -1;
+    }
+
+    // The boot keyboard stays registered, phones that stall the second keyboard fall back to it
+    int first = hs->count;
+    if (add_hid(hs, "nkroKeyboard", HID_ID_KEYBOARD_NKRO, REPORT_DESC_KB_NKRO, REPORT_DESC_SIZE(REPORT_DESC_KB_NKRO), chunk) < 0) {
+        return -1;
+    }
+    for (int i = first; i < hs->count; i++) {
+        hs->steps[i].optional = 1;
+    }
+    return 0;
+}
+
+static int submit_step(struct aoaHandshake_t *hs) {
+    struct aoaStep_t *step = &hs->steps[hs->current];
+
+    libusb_fill_control_setup(hs->buffer, step->requestType, step->request, step->value, step->index, step->length);
+    if (step->data != NULL) {
+        memcpy(hs->buffer + LIBUSB_CONTROL_SETUP_SIZE, step->data, step->length);
+    }
+    libusb_fill_control_transfer(hs->transfer, hs->handle, hs->buffer, step_done, hs, AOA_STEP_TIMEOUT_MS);
+
+    int ret = hs->transport->submitTransfer(hs->transfer);
+    if (ret < 0) {
+        return ret;
+    }
+    hs->inFlight = 1;
+    return 0;
+}
+
+static void finish(struct aoaHandshake_t *hs, int error) {
+    hs->stats.duration = clock_nowUs() - hs->started;
+    if (error < 0) {
+        hs->state = AOA_HANDSHAKE_FAILED;
+        hs->stats.failedStep = hs->current;
+        hs->stats.failedName = hs->steps[hs->current].name;
+        hs->stats.error = error;
+    } else {
+        hs->state = AOA_HANDSHAKE_DONE;
+    }
+}
+
+static int transfer_error(enum libusb_transfer_status status) {
+    switch (status) {
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return LIBUSB_ERROR_OVERFLOW;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return LIBUSB_ERROR_INTERRUPTED;
+    default:
+        return LIBUSB_ERROR_IO;
+    }
+}
+
+/*
+    Runs inside the handleEvents of the transport on the thread of aoa_run and submits the
+    next step right away, so consecutive steps do not wait for the event loop to come around.
+*/
+static void LIBUSB_CALL step_done(struct libusb_transfer *transfer) {
+    struct aoaHandshake_t *hs = transfer->user_data;
+    struct aoaStep_t *step = &hs->steps[hs->current];
+    uint64_t now = clock_nowUs();
+    int error = transfer->status == LIBUSB_TRANSFER_COMPLETED ? 0 : transfer_error(transfer->status);
+
+    hs->inFlight = 0;
+    if (hs->state != AOA_HANDSHAKE_RUNNING) {
+        return;
+    }
+
+    if (error == 0 && step->request == AOA_GET_PROTOCOL) {
+        unsigned char *data = libusb_control_transfer_get_data(transfer);
+        hs->stats.protocol = transfer->actual_length >= 2 ? (data[1] << 8 | data[0]) : 0;
+        if (hs->stats.protocol == 0) {
+            error = LIBUSB_ERROR_NOT_SUPPORTED;
+        }
+    }
+
+    if (error == LIBUSB_ERROR_PIPE && step->optional) {
+        log_warn("aoa: step %s not supported, skipped", step->name);
+        hs->stats.skipped++;
+        error = 0;
+    }
+
+    if (error < 0) {
+        // A stall means the request is not supported, only timeouts and transient errors are retried
+        int retry = error != LIBUSB_ERROR_PIPE && error != LIBUSB_ERROR_NO_DEVICE &&
+                    error != LIBUSB_ERROR_NOT_SUPPORTED && error != LIBUSB_ERROR_INTERRUPTED;
+        if (retry && hs->attempt < AOA_STEP_RETRIES) {
+            hs->attempt++;
+            hs->stats.retries++;
+            log_debug("aoa: step %s failed with %s, retry %d", step->name, libusb_error_name(error), hs->attempt);
+            if ((error = submit_step(hs)) == 0) {
+                return;
+            }
+        }
+        log_error("aoa: step %d (%s) failed: %s", hs->current, step->name, libusb_error_name(error));
+        finish(hs, error);
+        return;
+    }
+
+    if (now - hs->stepStarted > hs->stats.slowest) {
+        hs->stats.slowest = now - hs->stepStarted;
+        hs->stats.slowestName = step->name;
+    }
+    hs->stats.steps++;
+
+    if (++hs->current == hs->count) {
+        finish(hs, 0);
+        return;
+    }
+
+    hs->attempt = 0;
+    hs->stepStarted = now;
+    if ((error = submit_step(hs)) < 0) {
+        finish(hs, error);
+    }
+}
+
+int aoa_run(const struct usbTransport_t *transport, struct aoaHandshake_t *hs, int count) {
+    uint64_t deadline = clock_nowUs() + AOA_HANDSHAKE_DEADLINE_MS * 1000;
+    int running = 0;
+    int done = 0;
+
+    for (int i = 0; i < count; i++) {
+        hs[i].state = AOA_HANDSHAKE_RUNNING;
+        hs[i].stats.failedStep = -1;
+        hs[i].started = hs[i].stepStarted = clock_nowUs();
+        hs[i].transfer = libusb_alloc_transfer(0);
+
+        int ret = hs[i].transfer != NULL ? submit_step(&hs[i]) : LIBUSB_ERROR_NO_MEM;
+        if (ret < 0) {
+            finish(&hs[i], ret);
+        }
+    }
+
+    do {
+        struct timeval tv = { 0, 10000 };
+        transport->handleEvents(&tv);
+
+        running = 0;
+        for (int i = 0; i < count; i++) {
+            running += hs[i].state == AOA_HANDSHAKE_RUNNING;
+        }
+    } while (running > 0 && clock_nowUs() < deadline);
+
+    // Drop whatever did not make it in time
+    for (int i = 0; i < count; i++) {
+        if (hs[i].state == AOA_HANDSHAKE_RUNNING) {
+            log_error("aoa: handshake deadline passed in step %s", hs[i].steps[hs[i].current].name);
+            finish(&hs[i], LIBUSB_ERROR_TIMEOUT);
+            if (hs[i].inFlight) {
+                transport->cancelTransfer(hs[i].transfer);
+            }
+        }
+    }
+
+    /*
+        A cancelled transfer still calls back with hs as its user data and writes into
+        hs->buffer, so the caller may only free hs and close the handles once all did.
+        libusb calls back even for devices that are gone.
+    */
+    uint64_t nextWarning = clock_nowUs() + AOA_CANCEL_WAIT_MS * 1000;
+    while (1) {
+        int pending = 0;
+        for (int i = 0; i < count; i++) {
+            pending += hs[i].inFlight;
+        }
+        if (pending == 0) {
+            break;
+        }
+        if (clock_nowUs() >= nextWarning) {
+            log_warn("aoa: %d cancelled transfers not back yet", pending);
+            for (int i = 0; i < count; i++) {
+                if (hs[i].inFlight) {
+                    transport->cancelTransfer(hs[i].transfer);
+                }
+            }
+            nextWarning = clock_nowUs() + AOA_CANCEL_WAIT_MS * 1000;
+        }
+        struct timeval tv = { 0, 10000 };
+        transport->handleEvents(&tv);
+    }
+
+    for (int i = 0; i < count; i++) {
+        libusb_free_transfer(hs[i].transfer);
+        hs[i].transfer = NULL;
+
+        done += hs[i].state == AOA_HANDSHAKE_DONE;
+        log_debug("aoa: %d/%d steps in %llu us, %d retries, slowest %s %llu us",
+                  hs[i].stats.steps, hs[i].count, (unsigned long long)hs[i].stats.duration,
+                  hs[i].stats.retries, hs[i].stats.slowestName ? hs[i].stats.slowestName : "-",
+                  (unsigned long long)hs[i].stats.slowest);
+    }
+    return done;
+}
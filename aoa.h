@@ -0,0 +1,100 @@
+#ifndef AOAKVM_AOA
+#define AOAKVM_AOA
+
+#include "aoakvm.h"
+#include "transport.h"
+
+#define AOA_GET_PROTOCOL 51
+#define AOA_SEND_STRING 52
+#define AOA_START 53
+/* AOA2 audio, value 1 streams 44.1 kHz 16 bit stereo PCM on a USB audio class interface */
+#define AOA_SET_AUDIO_MODE 58
+#define AOA_AUDIO_PCM_44100 1
+
+/* Deadline of a single control transfer and how often it is repeated after a timeout */
+#define AOA_STEP_TIMEOUT_MS 500
+#define AOA_STEP_RETRIES 2
+/* Whole handshake, transfers still in flight afterwards are cancelled */
+#define AOA_HANDSHAKE_DEADLINE_MS 3000
+
+#define AOA_MAX_STEPS 128
+#define AOA_MAX_DATA 512
+
+enum aoa_handshake_state_e {
+    AOA_HANDSHAKE_RUNNING,
+    AOA_HANDSHAKE_DONE,
+    AOA_HANDSHAKE_FAILED,
+};
+
+/*
+    struct aoaStep_t
+
+    One control transfer of a handshake. data must stay valid until the handshake finished.
+    A stall of an optional step skips it instead of failing the handshake.
+*/
+struct aoaStep_t {
+    const char *name;
+    uint8_t requestType;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    const unsigned char *data;
+    uint16_t length;
+    int optional;
+};
+
+/*
+    struct aoaHandshake_t
+
+    A sequence of control transfers sent to one device with the asynchronous API of the
+    transport. Each
+    step has its own deadline (AOA_STEP_TIMEOUT_MS) and is retried up to AOA_STEP_RETRIES
+    times, any other failure drops the device. Filled by aoa_prepare*, driven by aoa_run.
+*/
+struct aoaHandshake_t {
+    const struct usbTransport_t *transport;
+    libusb_device_handle *handle;
+    struct aoaStep_t steps[AOA_MAX_STEPS];
+    int count;
+    int current;
+    int attempt;
+    enum aoa_handshake_state_e state;
+    struct libusb_transfer *transfer;
+    int inFlight;
+    uint64_t started;
+    uint64_t stepStarted;
+    struct aoakvmHandshakeStats_t stats;
+    unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + AOA_MAX_DATA];
+};
+
+/*
+    int aoa_prepareAccessory(struct aoaHandshake_t *hs, const struct usbTransport_t *transport,
+                             libusb_device_handle *handle, struct aoakvmConfig_t *cfg);
+
+    Protocol query, the six identification strings of cfg, AOA_SET_AUDIO_MODE if cfg asks for
+    audio and AOA_START.
+*/
+int aoa_prepareAccessory(struct aoaHandshake_t*, const struct usbTransport_t*, libusb_device_handle*,
+                         struct aoakvmConfig_t*);
+
+/*
+    int aoa_prepareHids(struct aoaHandshake_t *hs, const struct usbTransport_t *transport,
+                        libusb_device_handle *handle);
+
+    Registers the HIDs of hid.h (HID_ID_xxx) and sends their report descriptors in chunks of
+    the endpoint zero packet size. HID_ID_KEYBOARD_NKRO comes last and is the only optional
+    one, with stats.skipped > 0 the phone does not have it.
+*/
+int aoa_prepareHids(struct aoaHandshake_t*, const struct usbTransport_t*, libusb_device_handle*);
+
+/*
+    int aoa_run(const struct usbTransport_t *transport, struct aoaHandshake_t *hs, int count);
+
+    Runs count handshakes concurrently until all finished or AOA_HANDSHAKE_DEADLINE_MS passed.
+    Transfers still in flight then are cancelled, aoa_run returns only after all of them called
+    back, so hs can be freed and the handles closed right away. All handshakes must use
+    transport. Returns the number of handshakes that completed every step.
+*/
+int aoa_run(const struct usbTransport_t*, struct aoaHandshake_t*, int);
+
+#endif
@@ -7,15 +7,48 @@
 #include <libusb-1.0/libusb.h>
 
 #include "aoakvm.h"
+#include "aoakvm_clock.h"
 #include "usb.h"
 #include "window.h"
 #include "video.h"
+#include "snapshot.h"
+#include "fanout.h"
+#include "inputserver.h"
+#include "latency.h"
+#include "profile.h"
+#include "watchdog.h"
+#include "memstat.h"
+#include "busmon.h"
+#include "affinity.h"
+#include "wall.h"
+#include "hud.h"
+#include "audio.h"
+#include "keyboard.h"
+
+
+// Static Functions
+static void close_session();
+static int connection_loop(struct aoakvmConfig_t *cfg, SDL_Renderer *screenRenderer);
+static int wall_session_thread(void *data);
+static int event_thread(void *data);
+static int wall_input(const struct aoakvmInputEvent_t *event, void *userdata);
+static void wall_feed(int tile, uint64_t *frames);
+static int wait_event(SDL_Event *event);
+static int forward_mouse(const SDL_Event *event);
 
 
 // Local Variables
 Uint32 DEVICE_CONNECTION_EVENT = ((Uint32)-1);
 Uint32 DEVICE_DISCONNECTION_EVENT = ((Uint32)-1);
 
+/*
+    Figures of the threads waiting in aoakvm_wait_for_device_connection and
+    aoakvm_run_event_loop, cpuUs and wallUs only while they wait
+*/
+static SDL_SpinLock eventLoopLock;
+static struct aoakvmEventLoopStats_t eventLoopStats;
+static uint8_t mouseButtons;
+
 /*
     libav related structures and variables
 */
@@ -31,6 +64,7 @@ SDL_Window *mainwindow;
 SDL_Renderer *renderer;
 
 SDL_Thread *process_event_thread_handler;
+static int (*embedderEventThread)();
 SDL_Thread *read_from_usb_thread_handler;
 
 /*
@@ -46,65 +80,165 @@ int invoke_aoakvm(struct aoakvmConfig_t *cfg, struct aoakvmWindowProperties_t *w
     usbCon = &con;
     struct aoakvmMSGScreens msgscr;
     screens = &msgscr;
+    // The wall keeps its tiles on screen, no message screens over them
+    SDL_Renderer *screenRenderer = NULL;
+    int wallTile = -1;
+
+    // Haptic and joystick are never used, the video subsystem only with a window, audio only if asked for
+    Uint32 sdlFlags = SDL_INIT_EVENTS | SDL_INIT_TIMER;
+    if (!cfg->headless) {
+        sdlFlags |= SDL_INIT_VIDEO;
+    }
+    if (cfg->audio != NULL) {
+        sdlFlags |= SDL_INIT_AUDIO;
+    }
 
     log_info("AOAKV initializing...");
-    if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
+    profile_begin(PHASE_SDL_INIT);
+    if (SDL_Init(sdlFlags) < 0) {
         log_info("SLD init failed");
         return -1;
     }
+    profile_end(PHASE_SDL_INIT);
 
-    if (window_setMsgscreens(&msgscr, cfg->waitForDevice, cfg->aoaInit, cfg->waitForDataTransmission) < 0) {
-        log_error("Setting message screens failed");
-        return -1;
+    if (snapshot_init() < 0) {
+        log_error("Snapshot worker not available");
     }
 
-    if (window_initWindow(screens, windowProps, mainwindow, &renderer) < 0) {
-        log_error("Can't open window");
-        return -1;
+    if (cfg->fanoutAddress != NULL && fanout_start(cfg->fanoutAddress) < 0) {
+        log_error("Could not start stream fan-out on %s", cfg->fanoutAddress);
+    }
+
+    if (cfg->watchdog != NULL) {
+        watchdog_start(cfg->watchdog);
+    }
+
+    if (cfg->bus != NULL) {
+        busmon_start(cfg->bus);
+    }
+
+    video_setPreview(cfg->preview);
+
+    // Threads started from here on place themselves, the render loop runs on this one
+    if (cfg->threads != NULL) {
+        affinity_start(cfg->threads);
+    }
+    affinity_apply(THREAD_RENDER);
+
+    // The wall routes the input of the local tile through the input server's batcher
+    if ((cfg->inputAddress != NULL || cfg->wall != NULL) && inputserver_start(cfg->inputAddress) < 0) {
+        log_error("Could not start input server on %s", cfg->inputAddress ? cfg->inputAddress : "-");
+    }
+
+    if (!cfg->headless) {
+        profile_begin(PHASE_LOAD_SCREENS);
+        if (window_setMsgscreens(&msgscr, cfg->waitForDevice, cfg->aoaInit, cfg->waitForDataTransmission) < 0) {
+            log_error("Setting message screens failed");
+            return -1;
+        }
+        profile_end(PHASE_LOAD_SCREENS);
+
+        if (window_initWindow(screens, windowProps, mainwindow, &renderer) < 0) {
+            log_error("Can't open window");
+            return -1;
+        }
+        video_setIdleKeyframes(cfg->idleKeyframes);
+        video_setJitterBuffer(cfg->jitter);
+        hud_setEnabled(cfg->hud);
+        screenRenderer = renderer;
+
+        if (cfg->wall != NULL) {
+            if (wall_init(cfg->wall, mainwindow, renderer) < 0) {
+                log_error("Can't set up the video wall");
+                return -1;
+            }
+            SDL_SetWindowSize(mainwindow, windowProps->width, windowProps->height);
+            wallTile = wall_addTile(cfg->serialNumber, wall_input, NULL);
+            screenRenderer = NULL;
+        }
     }
 
-    if (window_changeMsgscreenTo(screens, renderer, mainwindow, WAIT_FOR_DEVICE) < 0) {
+    if (window_changeMsgscreenTo(screens, screenRenderer, mainwindow, WAIT_FOR_DEVICE) < 0) {
         log_error("Cant set 'WAIT_FOR_DEVICE' screen");
         return 0;
     }
 
-    process_event_thread_handler = SDL_CreateThread(eventThread, "eventThread", NULL);
+    embedderEventThread = eventThread;
+    process_event_thread_handler = SDL_CreateThread(event_thread, "eventThread", NULL);
     if (process_event_thread_handler == NULL) {
             log_error("Failed to create event_thread.");
             return -1;
     }
 
-    // Main loop for the program.
+    // A simulated device needs no phone, it is measured through the renderer before the first connection
+    if (cfg->latency != NULL && cfg->latency->simulate && latency_runSimulated(cfg->latency, screenRenderer) < 0) {
+        log_error("Could not start latency measurement");
+    }
+
+    if (cfg->wall == NULL || cfg->headless) {
+        return connection_loop(cfg, screenRenderer);
+    }
+
+    // The other tiles keep moving while this session waits for its phone, it connects on its own thread
+    if (SDL_CreateThread(wall_session_thread, "wallSession", cfg) == NULL) {
+        log_error("Failed to create the wall session thread.");
+        return -1;
+    }
+    uint64_t framesBefore = 0;
+    while (1) {
+        wall_feed(wallTile, &framesBefore);
+        if (wall_render() < 0) {
+            SDL_Delay(10);
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Waits for the phone, runs the session until it disconnects and tears it down, forever. Only
+    returns if the message screens fail. Renders the session itself unless it is headless or a
+    tile of the wall.
+*/
+static int connection_loop(struct aoakvmConfig_t *cfg, SDL_Renderer *screenRenderer) {
+    struct aoakvmUSBConnection_t *con = usbCon;
+    int latencyStarted = 0;
+
     while(1) {
-		if (window_changeMsgscreenTo(screens, renderer, mainwindow, WAIT_FOR_DEVICE) < 0) {
+		if (window_changeMsgscreenTo(screens, screenRenderer, mainwindow, WAIT_FOR_DEVICE) < 0) {
             log_error("Cant set 'WAIT_FOR_DEVICE' screen");
             return 0;
         }
+        profile_newConnection();
         do {
-            con.handle = usb_getHandle(cfg);
-        } while (con.handle == NULL);
+            con->handle = usb_getHandle(cfg, screenRenderer);
+        } while (con->handle == NULL);
 
         log_info("Gerät gefunden, initialisiere.");
 
         // Get AVContext to open stream
-        reader = video_setupAVContext(con.handle);
+        reader = video_setupAVContext(con->handle);
         if (reader == NULL) {
             log_info("Failed to set up AVContext");
-            libusb_close(con.handle);
-            con.handle = NULL;
+            close_session();
             continue;
         }
+        fanout_reset();
 
         // Register keyboard and mouse with AOA-device
-        if (usb_registerHIDS(con.handle) < 0) {
+        if (usb_registerHIDS(con->handle) < 0) {
             log_info("Register usb device as AOA failed");
-            libusb_close(con.handle);
-            con.handle = NULL;
+            close_session();
             continue;
         }
 
+        // Without AOA2 audio the session goes on with video only
+        if (cfg->audio != NULL) {
+            audio_start(cfg->audio, con->handle);
+        }
+
         log_debug("changeMsgScreen");
-        if (window_changeMsgscreenTo(screens, renderer, mainwindow, WAIT_FOR_DATA_TRANSMISSION) < 0) {
+        if (window_changeMsgscreenTo(screens, screenRenderer, mainwindow, WAIT_FOR_DATA_TRANSMISSION) < 0) {
                 log_info("Cant set 'WAIT_FOR_DEVICE' screen");
                 return -1;
         }
@@ -113,29 +247,36 @@ int invoke_aoakvm(struct aoakvmConfig_t *cfg, struct aoakvmWindowProperties_t *w
         log_debug("video_openStream");
         if (video_openStream(reader, &((&avCtx)->fmt_ctx), &((&avCtx)->codec_ctx)) < 0) {
             log_info("Failed to open stream");
-            avio_context_free(&reader);
-            libusb_close(con.handle);
-            con.handle = NULL;
+            close_session();
             continue;
         }
 
         // Start reading from stream thread
+        profile_begin(PHASE_FIRST_FRAME);
+        watchdog_newConnection();
         read_from_usb_thread_handler = SDL_CreateThread(usb_read_stream, "readPackagesFromStream", (void *) &avCtx);
         if (!read_from_usb_thread_handler) {
             log_error("Could not start read_from_stream thread!");
         }
 
         // Connect data stream with renderer
-        if (video_initRenderer(&avCtx, &renderer) < 0) {
+        if (!cfg->headless && cfg->wall == NULL && video_initRenderer(&avCtx, &renderer) < 0) {
             log_info("Failed to init renderer");
-            libusb_close(con.handle);
-            avio_context_free(&reader);
-            con.handle = NULL;
+            usb_setConnectionState(NOT_CONNECTED);
+            close_session();
             continue;
         }
 
 
         usb_setConnectionState(CONNECTED);
+        if (cfg->latency != NULL && !cfg->latency->simulate && !latencyStarted) {
+            latencyStarted = latency_start(cfg->latency) == 0;
+        }
+        // Headless there is no presentation, the first decoded frame ends the startup
+        struct aoakvmScreenActivity_t activity = {0};
+        video_getScreenActivity(&activity);
+        uint64_t framesBefore = activity.frames;
+
         // This is the continous rendering loop.
         int err = 0;
         do {
@@ -144,21 +285,31 @@ int invoke_aoakvm(struct aoakvmConfig_t *cfg, struct aoakvmWindowProperties_t *w
                 err = -2;
                 break;
             }
+            if (cfg->headless) {
+                if (video_getScreenActivity(&activity) == 0 && activity.frames > framesBefore &&
+                    profile_end(PHASE_FIRST_FRAME)) {
+                    profile_log();
+                }
+                SDL_Delay(10);
+                continue;
+            }
+            // The main thread draws the wall
+            if (cfg->wall != NULL) {
+                SDL_Delay(10);
+                continue;
+            }
             err = video_rendering(renderer);
         } while(err == 0);
 
-        int status = 0;
         switch (err) {
             case -1:
                 usb_setConnectionState(NOT_CONNECTED);
-                libusb_close(con.handle);
-                SDL_WaitThread(read_from_usb_thread_handler, &status);
+                close_session();
 
             break;
             case -2:
                 usb_setConnectionState(NOT_CONNECTED);
-                libusb_close(con.handle);
-                SDL_WaitThread(read_from_usb_thread_handler, &status);
+                close_session();
             break;
             default:
             break;
@@ -169,6 +320,60 @@ int invoke_aoakvm(struct aoakvmConfig_t *cfg, struct aoakvmWindowProperties_t *w
     return 0;
 }
 
+/* The session of the local wall tile, screens are not shown over the wall */
+static int wall_session_thread(void *data) {
+    return connection_loop(data, NULL);
+}
+
+/* The embedder's event thread sends the HID reports of the local keyboard and mouse */
+static int event_thread(void *data) {
+    affinity_apply(THREAD_HID);
+    return embedderEventThread();
+}
+
+/* Input for the local tile goes to the phone of this process */
+static int wall_input(const struct aoakvmInputEvent_t *event, void *userdata) {
+    return inputserver_inject(event);
+}
+
+/* Hands the newest decoded frame to the wall tile of this session */
+static void wall_feed(int tile, uint64_t *frames) {
+    struct aoakvmScreenActivity_t activity;
+    AVFrame *frame;
+
+    if (video_getScreenActivity(&activity) < 0 || activity.frames == *frames || (frame = av_frame_alloc()) == NULL) {
+        return;
+    }
+    *frames = activity.frames;
+    if (video_refLatestFrame(frame) == 0) {
+        wall_pushFrame(tile, frame);
+        if (profile_end(PHASE_FIRST_FRAME)) {
+            profile_log();
+        }
+    }
+    av_frame_free(&frame);
+}
+
+/*
+    Ends the stream thread, then frees everything the connection allocated and closes the
+    handle, in this order as the thread still reads through both.
+*/
+static void close_session() {
+    int status = 0;
+
+    audio_stop();
+
+    if (read_from_usb_thread_handler != NULL) {
+        video_stopStream(reader);
+        SDL_WaitThread(read_from_usb_thread_handler, &status);
+        read_from_usb_thread_handler = NULL;
+    }
+
+    video_closeStream(&reader, &avCtx);
+    usb_closeHandle();
+    memstat_checkBaseline();
+}
+
 int aoakvm_push_event(Uint32 *eventType, void *data1, void *data2) {
   log_debug("aoakvm_push_event");
   if (*eventType == ((Uint32)-1)) { //New Event
@@ -193,29 +398,166 @@ int aoakvm_wait_for_device_connection() {
   SDL_Event event;
   while (true)
   {
-    while (SDL_PollEvent(&event)) {
-      if (event.type == DEVICE_CONNECTION_EVENT) {
-        //Device has been connected
+    // The connection may have been made before the event type was registered or before this call
+    if (!wait_event(&event)) {
+      if (usbCon != NULL && usbCon->status == CONNECTED) {
         log_debug("event_loop: device connected");
         return 0;
-      } else if (event.type == SDL_KEYDOWN) {
-        SDL_KeyboardEvent *keyevent = (SDL_KeyboardEvent *)&event;
-        if (keyevent->repeat == 0)
-        { // no repeated key
-          if (keyevent->keysym.scancode == 0x29){
-            //ESC-Key
-            exit_request();
-          }
-        }
-      } else if (event.type == SDL_QUIT) {
-        //Window x key pressed
-        exit_request();
       }
+      continue;
+    }
+    if (event.type == DEVICE_CONNECTION_EVENT) {
+      //Device has been connected
+      log_debug("event_loop: device connected");
+      return 0;
+    } else if (event.type == SDL_KEYDOWN) {
+      SDL_KeyboardEvent *keyevent = (SDL_KeyboardEvent *)&event;
+      if (keyevent->repeat == 0)
+      { // no repeated key
+        if (keyevent->keysym.scancode == 0x29){
+          //ESC-Key
+          exit_request();
+        }
+      }
+    } else if (event.type == SDL_QUIT) {
+      //Window x key pressed
+      exit_request();
+    }
+  }
+  return -1;
+}
+
+int aoakvm_run_event_loop() {
+  SDL_Event event;
+
+  while (true) {
+    if (usbCon == NULL || usbCon->status != CONNECTED) {
+      aoakvm_wait_for_device_connection();
+    }
+    if (!wait_event(&event)) {
+      continue;
+    }
+
+    if (event.type == DEVICE_DISCONNECTION_EVENT) {
+      // Nothing is held on a phone that comes back, the empty reports are refused while disconnected
+      keyboard_releaseAll();
+      mouseButtons = 0;
+      log_debug("event_loop: device disconnected");
+    } else if (event.type == SDL_QUIT) {
+      exit_request();
+    } else if (wall_isActive()) {
+      // The wall's event watch routes the input to the focused tile already
+      continue;
+    } else if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_FOCUS_LOST) {
+      // The key and button up events go to the window that has the focus now
+      keyboard_releaseAll();
+      if (mouseButtons) {
+        mouseButtons = 0;
+        forward_mouse(&event);
+      }
+    } else if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
+      keyboard_handleEvent(&event);
+    } else {
+      forward_mouse(&event);
     }
   }
   return -1;
 }
 
+int aoakvm_get_bus_stats(struct aoakvmBusStats_t *stats) {
+  return video_getBusStats(stats);
+}
+
+void aoakvm_set_preview(uint32_t intervalMs) {
+  video_setPreview(intervalMs);
+}
+
+int aoakvm_get_event_loop_stats(struct aoakvmEventLoopStats_t *stats) {
+  SDL_AtomicLock(&eventLoopLock);
+  *stats = eventLoopStats;
+  SDL_AtomicUnlock(&eventLoopLock);
+  return 0;
+}
+
+/*
+    Blocks in SDL_WaitEventTimeout for at most EVENT_LOOP_WAIT_MS and accounts the wait,
+    returns 0 on a timeout. The timeout only bounds how late a missed connection is noticed.
+*/
+static int wait_event(SDL_Event *event) {
+  uint64_t wall = clock_nowUs();
+  uint64_t cpu = clock_threadCpuUs();
+  int got = SDL_WaitEventTimeout(event, EVENT_LOOP_WAIT_MS);
+
+  cpu = clock_threadCpuUs() - cpu;
+  wall = clock_nowUs() - wall;
+  SDL_AtomicLock(&eventLoopLock);
+  eventLoopStats.wakeups++;
+  eventLoopStats.events += got ? 1 : 0;
+  eventLoopStats.cpuUs += cpu;
+  eventLoopStats.wallUs += wall;
+  SDL_AtomicUnlock(&eventLoopLock);
+  return got;
+}
+
+/*
+    Sends a REPORT_DESC_MOUSE report for relative motion, buttons and the wheel. SDL numbers
+    the middle button 2 and the right one 3, HID the other way round. Other events send
+    nothing, a focus loss sends the released buttons.
+*/
+static int forward_mouse(const SDL_Event *event) {
+  int dx = 0, dy = 0, wheel = 0;
+  int ret = 0;
+
+  switch (event->type) {
+    case SDL_MOUSEMOTION:
+      dx = event->motion.xrel;
+      dy = event->motion.yrel;
+      break;
+    case SDL_MOUSEWHEEL:
+      wheel = event->wheel.y;
+      break;
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP: {
+      int button = event->button.button;
+      if (button < 1 || button > 5) {
+        return 0;
+      }
+      button = button == SDL_BUTTON_MIDDLE ? 3 : (button == SDL_BUTTON_RIGHT ? 2 : button);
+      if (event->type == SDL_MOUSEBUTTONDOWN) {
+        mouseButtons |= 1 << (button - 1);
+      } else {
+        mouseButtons &= ~(1 << (button - 1));
+      }
+      break;
+    }
+    case SDL_WINDOWEVENT:
+      if (event->window.event != SDL_WINDOWEVENT_FOCUS_LOST) {
+        return 0;
+      }
+      break;
+    default:
+      return 0;
+  }
+
+  // Relative axes are limited to +-127 per report, send the remainder in further reports
+  do {
+    unsigned char report[HID_REPORT_MOUSE_SIZE];
+    int x = SDL_max(-127, SDL_min(127, dx));
+    int y = SDL_max(-127, SDL_min(127, dy));
+    int w = SDL_max(-127, SDL_min(127, wheel));
+
+    report[0] = mouseButtons;
+    report[1] = (uint8_t)(int8_t)x;
+    report[2] = (uint8_t)(int8_t)y;
+    report[3] = (uint8_t)(int8_t)w;
+    dx -= x;
+    dy -= y;
+    wheel -= w;
+    ret = usb_sendHidEvent(HID_ID_MOUSE, report, sizeof(report));
+  } while (ret >= 0 && (dx || dy || wheel));
+  return ret;
+}
+
 void exit_request() {
   // Close down the Avio Context
   avio_context_free(&reader);
@@ -20,6 +20,25 @@
 #define AOA_SET_HID_REPORT_DESC 56
 #define AOA_SEND_HID_EVENT 57
 
+/* Accessory assigned ids of the HIDs registered by init_HIDS */
+#define HID_ID_MOUSE 0
+#define HID_ID_KEYBOARD 1
+#define HID_ID_TOUCHPAD 2
+#define HID_ID_TOUCHSCREEN 3
+/* Only registered if the phone takes it, see usb_hasNkroKeyboard */
+#define HID_ID_KEYBOARD_NKRO 4
+
+/* Report sizes matching REPORT_DESC_MOUSE, REPORT_DESC_KB, REPORT_DESC_TOUCHPAD, REPORT_DESC_TOUCHSCREEN and REPORT_DESC_KB_NKRO */
+#define HID_REPORT_MOUSE_SIZE 4
+#define HID_REPORT_KB_SIZE 8
+/* Keyboard usages 0x00 to 0xDF, one bit each */
+#define HID_NKRO_USAGES 224
+#define HID_REPORT_KB_NKRO_SIZE (1 + HID_NKRO_USAGES / 8)
+#define HID_REPORT_TOUCHPAD_SIZE 5
+#define HID_TOUCHSCREEN_CONTACTS 10
+#define HID_TOUCHSCREEN_CONTACT_SIZE 6
+#define HID_REPORT_TOUCHSCREEN_SIZE (HID_TOUCHSCREEN_CONTACTS * HID_TOUCHSCREEN_CONTACT_SIZE + 1)
+
 #define DEFAULT_TIMEOUT 1000
 
 /*
@@ -51,6 +70,30 @@ struct aoakvmMSGScreens {
         const char *version;
         const char *uri;
         const char *serialNumber;
+        const char *fanoutAddress;  optional, serve the raw stream on unix:<path> or tcp:[host:]port
+        const char *inputAddress;   optional, accept aoakvmInputEvent_t records on unix:<path> or tcp:[host:]port
+        const struct aoakvmLatencyConfig_t *latency;  optional, run a latency measurement once the
+                                                      stream is up (if simulated before waiting
+                                                      for the phone, present is only measured
+                                                      with a window and without the wall)
+        int headless;               no window and no renderer, only the video subsystem is skipped
+                                    in SDL_Init; frames are still decoded for snapshots and sinks
+        const struct aoakvmMockConfig_t *mock;  optional, talk to a simulated phone instead of libusb
+        const struct aoakvmWatchdogConfig_t *watchdog;  optional, recover from stalled streams
+        const struct aoakvmBusConfig_t *bus;    optional, bus capacity and device priorities
+        const struct aoakvmThreadConfig_t *threads;  optional, THREAD_ROLES entries indexed by
+                                                     aoakvm_thread_role_e
+        int idleKeyframes;          decode only keyframes while the window is hidden or minimized
+                                    (not while it is only covered, SDL2 does not report that)
+        uint32_t preview;           ms between keyframes in preview mode at the start, 0 decodes
+                                    everything, see aoakvm_set_preview
+        const struct aoakvmWallConfig_t *wall;  optional, show the session as a tile of a video wall;
+                                                the main thread draws the wall, the session
+                                                connects on a thread of its own
+        const struct aoakvmJitterConfig_t *jitter;  optional, smooth presentation, NULL presents
+                                                    every frame as soon as it is decoded
+        int hud;                    show the performance overlay, see hud_setEnabled
+        const struct aoakvmAudioConfig_t *audio;  optional, ask for AOA2 audio and play it
 */
 struct aoakvmConfig_t {
     const char *waitForDevice;
@@ -62,6 +105,20 @@ struct aoakvmConfig_t {
     const char *version;
     const char *uri;
     const char *serialNumber;
+    const char *fanoutAddress;
+    const char *inputAddress;
+    const struct aoakvmLatencyConfig_t *latency;
+    int headless;
+    const struct aoakvmMockConfig_t *mock;
+    const struct aoakvmWatchdogConfig_t *watchdog;
+    const struct aoakvmBusConfig_t *bus;
+    const struct aoakvmThreadConfig_t *threads;
+    int idleKeyframes;
+    uint32_t preview;
+    const struct aoakvmWallConfig_t *wall;
+    const struct aoakvmJitterConfig_t *jitter;
+    int hud;
+    const struct aoakvmAudioConfig_t *audio;
 };
 
 /*
@@ -112,6 +169,859 @@ struct aoakvmAVCtx_t {
     AVCodecContext *codec_ctx;
 };
 
+/*
+    aoakvmScreenActivity_t
+
+    This struct holds the change detection state of the decoded luma plane, see
+    video_getScreenActivity. A screen whose lastChange lies far in the past is frozen or static.
+    Fields:
+        uint32_t lastChange;     SDL_GetTicks() of the last frame with changed tiles
+        int changedTiles;        changed tiles of the last decoded frame
+        int totalTiles;          tiles per frame, cols x rows of the TILEHASH_TILE_SIZE grid
+        uint64_t frames;         decoded frames
+        uint64_t changedFrames;  decoded frames with at least one changed tile
+*/
+struct aoakvmScreenActivity_t {
+    uint32_t lastChange;
+    int changedTiles;
+    int totalTiles;
+    uint64_t frames;
+    uint64_t changedFrames;
+};
+
+/*
+    aoakvmCodecStats_t
+
+    Stream and decoder cost of the current session, see video_getCodecStats. Comparing runs
+    with the phone encoding H.264, HEVC or AV1 gives the bitrate and the decode CPU per codec.
+    Fields:
+        enum AVCodecID codec;   detected from the first bytes of the stream, AV_CODEC_ID_NONE
+                                if detection failed and libavformat probed the stream itself
+        int bitDepth;           luma bit depth of the decoded frames
+        uint64_t started;       clock_nowUs() when the stream was set up
+        uint64_t bytes;         bytes read from the bulk endpoint
+        uint64_t frames;        decoded frames
+        uint64_t converted;     frames converted to 8 bit YUV 4:2:0 for the upload path
+        uint64_t decodeCpuUs;   CPU time of the stream thread in the decoder calls
+*/
+struct aoakvmCodecStats_t {
+    enum AVCodecID codec;
+    int bitDepth;
+    uint64_t started;
+    uint64_t bytes;
+    uint64_t frames;
+    uint64_t converted;
+    uint64_t decodeCpuUs;
+};
+
+/*
+    aoakvm_snapshot_format_e
+
+    Output formats of the snapshot worker, see snapshot_request.
+    Values:
+        SNAPSHOT_PNG    lossless, slowest to encode
+        SNAPSHOT_JPEG   baseline JPEG from the decoded YUV planes
+        SNAPSHOT_RGBA   raw RGBA, 4 bytes per pixel, no padding between rows
+*/
+enum aoakvm_snapshot_format_e {
+    SNAPSHOT_PNG,
+    SNAPSHOT_JPEG,
+    SNAPSHOT_RGBA,
+};
+
+/*
+    aoakvmSnapshot_t
+
+    This struct describes an encoded snapshot handed to aoakvmSnapshotCallback_t.
+    data is owned by the snapshot worker and only valid during the callback.
+    Fields:
+        enum aoakvm_snapshot_format_e format;
+        int width;
+        int height;
+        const uint8_t *data;
+        size_t size;
+        int64_t pts;            pts of the decoded frame
+        uint32_t requested;     SDL_GetTicks() of the snapshot_request call
+        uint32_t finished;      SDL_GetTicks() after encoding
+        const char *path;       file the snapshot was written to, or NULL
+*/
+struct aoakvmSnapshot_t {
+    enum aoakvm_snapshot_format_e format;
+    int width;
+    int height;
+    const uint8_t *data;
+    size_t size;
+    int64_t pts;
+    uint32_t requested;
+    uint32_t finished;
+    const char *path;
+};
+
+/*
+    aoakvmSnapshotCallback_t
+
+    Invoked on the snapshot worker thread. status is 0 on success and < 0 if encoding or
+    writing the file failed (snapshot is NULL then).
+*/
+typedef void (*aoakvmSnapshotCallback_t)(int status, struct aoakvmSnapshot_t *snapshot, void *userdata);
+
+/*
+    aoakvm_sink_drop_e
+
+    What a frame sink gives up when its queue is full, see aoakvmSinkConfig_t.
+    Values:
+        SINK_DROP_OLDEST    the oldest queued frame, the sink stays as current as possible (monitoring, OCR)
+        SINK_DROP_NEWEST    the new frame, the sink sees an unbroken run up to the overflow (recorders)
+*/
+enum aoakvm_sink_drop_e {
+    SINK_DROP_OLDEST,
+    SINK_DROP_NEWEST,
+};
+
+/*
+    aoakvmFrameCallback_t
+
+    Invoked on the worker thread of a frame sink with a reference to a decoded 8 bit YUV 4:2:0
+    frame. The reference is dropped after the callback, av_frame_ref it to keep the data longer.
+    The frame data is shared with the renderer and must not be written, yuv_toRgb converts it.
+*/
+typedef void (*aoakvmFrameCallback_t)(AVFrame *frame, void *userdata);
+
+/*
+    aoakvmSinkConfig_t
+
+    One consumer of the decoded frames, see sink_add.
+    Fields:
+        const char *name;                   used in the log
+        aoakvmFrameCallback_t cb;
+        void *userdata;
+        int queueLength;                    frames waiting for the callback, 1 to SINK_MAX_QUEUE,
+                                            0 for SINK_DEFAULT_QUEUE
+        uint32_t maxFps;                    frames per second offered at most, 0 for every frame
+        enum aoakvm_sink_drop_e drop;
+*/
+struct aoakvmSinkConfig_t {
+    const char *name;
+    aoakvmFrameCallback_t cb;
+    void *userdata;
+    int queueLength;
+    uint32_t maxFps;
+    enum aoakvm_sink_drop_e drop;
+};
+
+/*
+    aoakvmSinkStats_t
+
+    Frame counts of one sink since sink_add, see sink_getStats. Every decoded frame is either
+    capped, dropped, delivered or still queued.
+    Fields:
+        uint64_t offered;       decoded frames while the sink was registered
+        uint64_t capped;        skipped by maxFps
+        uint64_t dropped;       given up on a full queue
+        uint64_t delivered;     callbacks that returned
+        int queued;
+        uint64_t callbackUs;    time spent in the callback
+        uint64_t maxCallbackUs; longest callback
+*/
+struct aoakvmSinkStats_t {
+    uint64_t offered;
+    uint64_t capped;
+    uint64_t dropped;
+    uint64_t delivered;
+    int queued;
+    uint64_t callbackUs;
+    uint64_t maxCallbackUs;
+};
+
+/*
+    aoakvmFanoutStats_t
+
+    Counters of the raw stream fan-out server, see fanout_getStats.
+    Fields:
+        int subscribers;        currently connected subscribers
+        uint64_t nals;          NAL units parsed from the stream
+        uint64_t bytes;         bytes parsed from the stream
+        uint64_t droppedGops;   GOPs skipped because a subscriber could not keep up
+        uint64_t droppedBytes;  queued bytes discarded for slow subscribers
+*/
+struct aoakvmFanoutStats_t {
+    int subscribers;
+    uint64_t nals;
+    uint64_t bytes;
+    uint64_t droppedGops;
+    uint64_t droppedBytes;
+};
+
+/*
+    aoakvm_input_type_e
+
+    Event types of the input server wire format, see aoakvmInputEvent_t.
+*/
+enum aoakvm_input_type_e {
+    INPUT_MOUSE_MOVE = 1,
+    INPUT_MOUSE_BUTTON = 2,
+    INPUT_MOUSE_WHEEL = 3,
+    INPUT_TOUCH = 4,
+    INPUT_KEY = 5,
+};
+
+/*
+    aoakvmInputEvent_t
+
+    One 8 byte record of the input server wire format, all fields little endian.
+    Fields:
+        uint8_t type;       aoakvm_input_type_e
+        uint8_t code;       INPUT_MOUSE_BUTTON: button 1-5, INPUT_KEY: HID usage (0xE0-0xE7 are modifiers),
+                            INPUT_TOUCH: contact id 0 to HID_TOUCHSCREEN_CONTACTS - 1
+        int16_t x;          INPUT_MOUSE_MOVE: dx, INPUT_MOUSE_WHEEL: delta, INPUT_TOUCH: 0-10000
+        int16_t y;          INPUT_MOUSE_MOVE: dy, INPUT_TOUCH: 0-10000
+        uint16_t pressed;   INPUT_MOUSE_BUTTON, INPUT_KEY, INPUT_TOUCH: 1 = down, 0 = up
+*/
+struct aoakvmInputEvent_t {
+    uint8_t type;
+    uint8_t code;
+    int16_t x;
+    int16_t y;
+    uint16_t pressed;
+};
+
+/*
+    aoakvmInputStats_t
+
+    Counters of the input server, see inputserver_getStats. Latencies in microseconds.
+    Fields:
+        uint64_t events;        events received
+        uint64_t droppedEvents; events dropped because the queue was full or malformed
+        uint64_t reports;       HID reports sent
+        uint64_t failedReports; HID reports the phone did not accept
+        uint64_t queueAvg;      average time from receiving an event until its report is sent
+        uint64_t queueMax;
+        uint64_t sendAvg;       average duration of the AOA_SEND_HID_EVENT control transfer
+        uint64_t sendMax;
+*/
+struct aoakvmInputStats_t {
+    uint64_t events;
+    uint64_t droppedEvents;
+    uint64_t reports;
+    uint64_t failedReports;
+    uint64_t queueAvg;
+    uint64_t queueMax;
+    uint64_t sendAvg;
+    uint64_t sendMax;
+};
+
+/*
+    aoakvmScriptStats_t
+
+    Result of the last script playback, see script_getStats. Deviations are the time the
+    report was actually sent minus its schedule in microseconds, reports typed at the maximum
+    rate have no schedule and are not part of them.
+    Fields:
+        int running;
+        uint64_t reports;       reports sent
+        uint64_t failed;        reports the phone did not accept
+        uint64_t deviationAvg;
+        uint64_t deviationP99;
+        uint64_t deviationMax;
+        uint64_t duration;      playback time in microseconds
+        uint64_t reportsPerSec; achieved report rate
+*/
+struct aoakvmScriptStats_t {
+    int running;
+    uint64_t reports;
+    uint64_t failed;
+    uint64_t deviationAvg;
+    uint64_t deviationP99;
+    uint64_t deviationMax;
+    uint64_t duration;
+    uint64_t reportsPerSec;
+};
+
+/*
+    aoakvmLatencyConfig_t
+
+    Parameters of an input-to-photon measurement, see latency_start. The watched region must
+    be static while no input is sent, e.g. a test app that inverts its background on touch.
+    Fields:
+        int hid;            HID_ID_TOUCHPAD: alternate touch down and up at (x, y)
+                            HID_ID_MOUSE: alternate moving the pointer by +dx and -dx
+        uint16_t x;         touch position, 0-10000
+        uint16_t y;
+        int8_t dx;          pointer movement per sample
+        SDL_Rect region;    watched area in stream pixels
+        int threshold;      mean absolute luma difference of the region that counts as a change
+        int samples;        number of injected events
+        uint32_t interval;  pause between samples in ms
+        uint32_t timeout;   ms to wait for the change before the sample counts as lost
+        int simulate;       measure against the simulated device instead of the phone
+        uint32_t simDelay;  simulated device: µs between receiving a report and showing it
+*/
+struct aoakvmLatencyConfig_t {
+    int hid;
+    uint16_t x;
+    uint16_t y;
+    int8_t dx;
+    SDL_Rect region;
+    int threshold;
+    int samples;
+    uint32_t interval;
+    uint32_t timeout;
+    int simulate;
+    uint32_t simDelay;
+};
+
+#define LATENCY_HISTOGRAM_BUCKETS 64
+#define LATENCY_BUCKET_US 2000
+
+/*
+    aoakvmLatencyHistogram_t
+
+    Distribution of one latency in microseconds. buckets[i] counts the samples in
+    [i * LATENCY_BUCKET_US, (i + 1) * LATENCY_BUCKET_US), the last bucket everything above.
+*/
+struct aoakvmLatencyHistogram_t {
+    uint64_t count;
+    uint64_t min;
+    uint64_t avg;
+    uint64_t p50;
+    uint64_t p95;
+    uint64_t p99;
+    uint64_t max;
+    uint32_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+};
+
+/*
+    aoakvmLatencyStats_t
+
+    Result of the last latency measurement, see latency_getStats.
+    Fields:
+        int running;
+        uint64_t samples;       events injected
+        uint64_t lost;          events without a detected change within the timeout
+        struct aoakvmLatencyHistogram_t decode;   report sent until the changed frame was decoded
+        struct aoakvmLatencyHistogram_t present;  report sent until that frame was presented
+*/
+struct aoakvmLatencyStats_t {
+    int running;
+    uint64_t samples;
+    uint64_t lost;
+    struct aoakvmLatencyHistogram_t decode;
+    struct aoakvmLatencyHistogram_t present;
+};
+
+/*
+    aoakvmHandshakeStats_t
+
+    Timing of one asynchronous AOA handshake, see usb_getHandshakeStats. Times in microseconds.
+    Fields:
+        int steps;              control transfers completed
+        int retries;            transfers repeated after a timeout or error
+        int failedStep;         index of the step that failed for good, -1 on success
+        int skipped;            optional steps the phone stalled
+        const char *failedName;
+        int error;              libusb error of the failed step
+        uint16_t protocol;      AOA protocol version reported by the phone, 0 if not queried
+        uint64_t duration;      first submit until the last completion
+        uint64_t slowest;       longest single step including its retries
+        const char *slowestName;
+*/
+struct aoakvmHandshakeStats_t {
+    int steps;
+    int retries;
+    int failedStep;
+    int skipped;
+    const char *failedName;
+    int error;
+    uint16_t protocol;
+    uint64_t duration;
+    uint64_t slowest;
+    const char *slowestName;
+};
+
+/* AOA requests 51 (get protocol) to 57 (send HID event) answered by the mock device */
+#define MOCK_AOA_REQUESTS 7
+
+/*
+    aoakvmMockRequest_t
+
+    Behaviour of the mock device for one AOA request, see aoakvmMockConfig_t.
+    Fields:
+        uint32_t delay;     µs until the request completes
+        int failures;       number of the next requests that fail
+        int error;          LIBUSB_ERROR_TIMEOUT: the failing request hangs for its timeout,
+                            any other libusb error is returned after delay (LIBUSB_ERROR_PIPE stalls)
+*/
+struct aoakvmMockRequest_t {
+    uint32_t delay;
+    int failures;
+    int error;
+};
+
+/*
+    aoakvmMockGenerator_t
+
+    Produces bulk IN data of the mock device. Returns the number of bytes written to buf
+    (at most length), < 0 ends the stream.
+*/
+typedef int (*aoakvmMockGenerator_t)(unsigned char *buf, int length, void *userdata);
+
+/*
+    aoakvmMockConfig_t
+
+    A simulated phone behind the transport of usb.c, no USB device is touched. It enumerates
+    as vid:pid, switches to the accessory pid after AOA_START and reenumerateDelay, and then
+    streams from source or generator. Without both the bulk endpoint never sends data. With
+    audio it also offers an AOA2 audio interface whose isochronous endpoint sends silence.
+    Fields:
+        uint16_t vid;               before the switch, 0 selects 0x04e8:0x6860
+        uint16_t pid;
+        uint16_t accessoryPid;      0x2D00 or 0x2D01, 0 selects 0x2D01
+        uint16_t protocol;          answer to AOA_GET_PROTOCOL, 0 selects 2 (HID support)
+        struct aoakvmMockRequest_t requests[MOCK_AOA_REQUESTS];    indexed by request - 51
+        uint32_t reenumerateDelay;  ms the device is gone after AOA_START or a disconnect
+        const char *source;         file served on the bulk IN endpoint
+        int loop;                   start the file over at its end, otherwise the device unplugs
+        aoakvmMockGenerator_t generator;    used if source is NULL
+        void *userdata;
+        uint32_t bulkRate;          bytes per second, 0 unlimited
+        uint32_t disconnectAfter;   ms of streaming until the device unplugs, 0 never
+        uint32_t stallAfter;        ms of streaming until the bulk endpoint stops sending, 0 never
+        uint32_t stallFor;          ms the stall lasts, 0 until the device is reset or unplugged
+        int audio;                  offer the audio interface
+        uint32_t cancelDelay;       ms until a cancelled transfer calls back, like a slow host
+                                    controller
+*/
+struct aoakvmMockConfig_t {
+    uint16_t vid;
+    uint16_t pid;
+    uint16_t accessoryPid;
+    uint16_t protocol;
+    struct aoakvmMockRequest_t requests[MOCK_AOA_REQUESTS];
+    uint32_t reenumerateDelay;
+    const char *source;
+    int loop;
+    aoakvmMockGenerator_t generator;
+    void *userdata;
+    uint32_t bulkRate;
+    uint32_t disconnectAfter;
+    uint32_t stallAfter;
+    uint32_t stallFor;
+    int audio;
+    uint32_t cancelDelay;
+};
+
+/*
+    aoakvm_mem_subsystem_e
+
+    Subsystems with their own allocation counters, see memstat_get.
+    Values:
+        MEM_TRANSPORT       handshake state, mock device handles and audio transfer buffers
+        MEM_AVIO            stream reader context and AVIO buffer of a session
+        MEM_DECODER         format and codec contexts, packet and frame of the stream thread
+        MEM_FRAME_QUEUE     decoded frame data referenced by the frame queue and the renderer
+        MEM_TEXTURES        stream texture and message screen textures (estimated GPU memory)
+        MEM_SINKS           state of the registered frame sinks, outlives sessions and is not
+                            checked by memstat_checkBaseline
+        MEM_HUD             font texture of the performance overlay (estimated GPU memory),
+                            outlives sessions and is not checked by memstat_checkBaseline either
+*/
+enum aoakvm_mem_subsystem_e {
+    MEM_TRANSPORT,
+    MEM_AVIO,
+    MEM_DECODER,
+    MEM_FRAME_QUEUE,
+    MEM_TEXTURES,
+    MEM_SINKS,
+    MEM_HUD,
+    MEM_SUBSYSTEMS,
+};
+
+/*
+    aoakvmMemCounter_t
+
+    Live allocations of one subsystem. Objects allocated by FFmpeg or SDL are counted with
+    their known payload, e.g. the frame buffers they reference, not the internal bookkeeping.
+    Frame buffers referenced twice are counted twice.
+    Fields:
+        int64_t objects;        live objects
+        int64_t bytes;          live bytes
+        uint64_t allocations;   objects allocated so far
+        int64_t peak;           highest bytes seen
+*/
+struct aoakvmMemCounter_t {
+    int64_t objects;
+    int64_t bytes;
+    uint64_t allocations;
+    int64_t peak;
+};
+
+/*
+    aoakvm_watchdog_step_e
+
+    Recovery steps of the stall watchdog in the order they are tried, see watchdog_check.
+    Values:
+        WATCHDOG_RESYNC         flush the decoder, it restarts at the next keyframe
+        WATCHDOG_CANCEL         drop buffered stream data and clear a halt of the bulk endpoint
+        WATCHDOG_RESET          USB port reset of the phone
+        WATCHDOG_REENUMERATE    drop the connection, the main loop connects again
+*/
+enum aoakvm_watchdog_step_e {
+    WATCHDOG_RESYNC,
+    WATCHDOG_CANCEL,
+    WATCHDOG_RESET,
+    WATCHDOG_REENUMERATE,
+    WATCHDOG_STEPS,
+};
+
+/*
+    aoakvmWatchdogConfig_t
+
+    ms after which each step is taken, 0 skips the step: resync without a decoded frame (or a
+    packet skipped on purpose in preview, idle or shedding mode), the USB steps without any
+    data from the bulk endpoint, so a decoder that falls behind never resets the phone.
+    Thresholds must grow from step to step. The phone has to send frames on a static screen too
+    (repeat the previous frame) or the thresholds must lie above its idle interval.
+    Fields:
+        uint32_t resync;
+        uint32_t cancel;
+        uint32_t reset;
+        uint32_t reenumerate;
+*/
+struct aoakvmWatchdogConfig_t {
+    uint32_t resync;
+    uint32_t cancel;
+    uint32_t reset;
+    uint32_t reenumerate;
+};
+
+/*
+    aoakvmWatchdogStep_t
+
+    How often a recovery step was taken and how long until the next frame arrived, in µs.
+    A step followed by the next step did not recover the stream.
+    Fields:
+        uint64_t taken;
+        uint64_t recovered;
+        uint64_t last;
+        uint64_t max;
+        uint64_t total;     sum of all recovery times, total / recovered is the mean
+*/
+struct aoakvmWatchdogStep_t {
+    uint64_t taken;
+    uint64_t recovered;
+    uint64_t last;
+    uint64_t max;
+    uint64_t total;
+};
+
+/*
+    aoakvmWatchdogStats_t
+
+    See watchdog_getStats.
+    Fields:
+        uint64_t stalls;        stalls that needed at least one step
+        uint64_t bytes;         stream bytes received
+        uint64_t frames;        frames decoded
+        struct aoakvmWatchdogStep_t steps[WATCHDOG_STEPS];  indexed by aoakvm_watchdog_step_e
+*/
+struct aoakvmWatchdogStats_t {
+    uint64_t stalls;
+    uint64_t bytes;
+    uint64_t frames;
+    struct aoakvmWatchdogStep_t steps[WATCHDOG_STEPS];
+};
+
+/* Longest port path libusb_get_port_numbers reports, USB allows 7 tiers */
+#define BUS_MAX_PORTS 7
+/* Length of a location string like "3-1.4.2" including the terminator */
+#define BUS_LOCATION_LENGTH 32
+
+/*
+    aoakvmBusPriority_t
+
+    Priority of the device at location, written like the sysfs name of the port
+    ("<bus>-<port>.<port>...", e.g. "3-1.4"). Devices without an entry have priority 0.
+*/
+struct aoakvmBusPriority_t {
+    const char *location;
+    int priority;
+};
+
+/*
+    aoakvmBusConfig_t
+
+    When the streams of a bus together exceed saturation percent of its capacity, the
+    sessions with the lowest priority on that bus shed frames until the load fell below
+    saturation - BUSMON_HYSTERESIS percent. Sessions of equal priority never shed for
+    each other. The sessions of all processes on the host are compared, every process
+    should get the same configuration.
+    Fields:
+        uint64_t capacity;      usable bytes/s of one bus, 0 for the BUSMON_DEFAULT_CAPACITY
+        int saturation;         percent of capacity
+        const struct aoakvmBusPriority_t *priorities;
+        int priorityCount;
+*/
+struct aoakvmBusConfig_t {
+    uint64_t capacity;
+    int saturation;
+    const struct aoakvmBusPriority_t *priorities;
+    int priorityCount;
+};
+
+/*
+    aoakvmBusStats_t
+
+    Throughput and transfer latency of one session and of the bus it shares, see
+    aoakvm_get_bus_stats. Latencies are the µs a bulk read that returned data took.
+    Fields:
+        char location[BUS_LOCATION_LENGTH];
+        int bus;
+        int priority;
+        uint64_t bytes;             stream bytes of the session
+        uint64_t transfers;         bulk reads that returned data
+        uint64_t bytesPerSecond;    of the session over the last BUSMON_WINDOW_MS
+        uint64_t latencyLast;
+        uint64_t latencyMax;
+        uint64_t latencyTotal;      latencyTotal / transfers is the mean
+        int shedding;               the session currently drops frames for others
+        uint64_t shedUs;            time spent shedding
+        int busSessions;            sessions on the same bus
+        uint64_t busBytesPerSecond; of all sessions on the bus
+*/
+struct aoakvmBusStats_t {
+    char location[BUS_LOCATION_LENGTH];
+    int bus;
+    int priority;
+    uint64_t bytes;
+    uint64_t transfers;
+    uint64_t bytesPerSecond;
+    uint64_t latencyLast;
+    uint64_t latencyMax;
+    uint64_t latencyTotal;
+    int shedding;
+    uint64_t shedUs;
+    int busSessions;
+    uint64_t busBytesPerSecond;
+};
+
+/*
+    aoakvmWallConfig_t
+
+    Grid of the video wall compositor, see wall_init. With cols or rows 0, or a grid too small
+    for the tiles, the grid grows with the number of tiles and stays as square as possible.
+    Fields:
+        int cols;
+        int rows;
+        int gap;        px between and around the tiles
+*/
+struct aoakvmWallConfig_t {
+    int cols;
+    int rows;
+    int gap;
+};
+
+/*
+    aoakvmWallInput_t
+
+    Delivers input the wall routed to the focused tile. Touch coordinates are already mapped to
+    0-10000 of the tile's video. Runs on the thread that pumps the SDL events.
+*/
+typedef int (*aoakvmWallInput_t)(const struct aoakvmInputEvent_t *event, void *userdata);
+
+/*
+    aoakvmJitterConfig_t
+
+    Presentation jitter buffer, see video_setJitterBuffer. Frames are held back to the pace of
+    their timestamps plus a target delay that follows the measured arrival jitter. maxDelay 0
+    is the zero-buffer mode: every frame is presented as soon as it is decoded.
+    Fields:
+        uint32_t minDelay;  ms the target delay never goes below
+        uint32_t maxDelay;  ms the target delay never goes above, the latency the buffer may add
+*/
+struct aoakvmJitterConfig_t {
+    uint32_t minDelay;
+    uint32_t maxDelay;
+};
+
+/*
+    aoakvmJitterStats_t
+
+    State of the presentation jitter buffer, see video_getJitterStats.
+    Fields:
+        uint32_t maxDelay;      ms, 0 in zero-buffer mode
+        uint32_t targetDelay;   ms frames are currently held back by
+        uint32_t jitter;        ms, slowly decaying peak of the arrival deviation
+        int timestamps;         1 if the stream's PTS are used, 0 for the arrival cadence
+        int queued;             decoded frames waiting for presentation
+        uint64_t presented;     frames handed to the renderer
+        uint64_t late;          frames dropped as a newer one was already due
+        uint64_t overrun;       frames overwritten in the full queue before the renderer took them
+        uint64_t resets;        re-anchoring of the clock after a timestamp jump or a stall
+*/
+struct aoakvmJitterStats_t {
+    uint32_t maxDelay;
+    uint32_t targetDelay;
+    uint32_t jitter;
+    int timestamps;
+    int queued;
+    uint64_t presented;
+    uint64_t late;
+    uint64_t overrun;
+    uint64_t resets;
+};
+
+/*
+    aoakvmAudioConfig_t
+
+    AOA2 audio playback, see audio_start. The buffer starts at minDelay, grows by an underrun
+    and shrinks back while playback is stable. To stay in sync with the picture it is never
+    shorter than the current delay of the jitter buffer plus offset.
+    Fields:
+        const char *device;     SDL audio device name, NULL for the default output
+        uint32_t minDelay;      ms, 0 selects AUDIO_DEFAULT_MIN_MS
+        uint32_t maxDelay;      ms, 0 selects AUDIO_DEFAULT_MAX_MS
+        int32_t offset;         ms added to the video delay, positive when the phone's encoder
+                                lags behind its audio
+*/
+struct aoakvmAudioConfig_t {
+    const char *device;
+    uint32_t minDelay;
+    uint32_t maxDelay;
+    int32_t offset;
+};
+
+/*
+    aoakvmAudioStats_t
+
+    State of the audio playback of the current session, see audio_getStats.
+    Fields:
+        int running;
+        int rate;               Hz
+        int channels;
+        uint32_t bufferedMs;    received and not yet handed to the audio device
+        uint32_t targetMs;      what the buffer is kept at, the larger of adaptive and sync delay
+        uint32_t syncMs;        delay taken over from the video presentation
+        uint32_t latencyMs;     buffer, audio device buffer and one isochronous transfer
+        uint64_t bytes;         PCM received from the phone
+        uint64_t underruns;     device callbacks that ran out of samples
+        uint64_t dropped;       sample frames dropped to bring the buffer back to the target
+        uint64_t packetErrors;  isochronous packets that arrived broken
+*/
+struct aoakvmAudioStats_t {
+    int running;
+    int rate;
+    int channels;
+    uint32_t bufferedMs;
+    uint32_t targetMs;
+    uint32_t syncMs;
+    uint32_t latencyMs;
+    uint64_t bytes;
+    uint64_t underruns;
+    uint64_t dropped;
+    uint64_t packetErrors;
+};
+
+/*
+    aoakvm_thread_role_e
+
+    Pipeline roles whose threads can be pinned and scheduled, see affinity_apply.
+    Values:
+        THREAD_STREAM   usb_read_stream, reads the bulk endpoint and decodes in one thread
+        THREAD_RENDER   the main loop of invoke_aoakvm, texture upload and presentation
+        THREAD_HID      the event thread of the embedder and the input server's report batcher
+*/
+enum aoakvm_thread_role_e {
+    THREAD_STREAM,
+    THREAD_RENDER,
+    THREAD_HID,
+    THREAD_ROLES,
+};
+
+/*
+    aoakvmThreadConfig_t
+
+    Placement of the threads of one role. Settings the process may not make (SCHED_FIFO and
+    SCHED_RR need CAP_SYS_NICE or an RLIMIT_RTPRIO) are logged and skipped.
+    Fields:
+        const char *cpus;   CPU list like "2-3,6", NULL keeps the inherited affinity
+        int policy;         SCHED_OTHER, SCHED_FIFO or SCHED_RR
+        int priority;       1 to 99 for SCHED_FIFO and SCHED_RR
+        int nice;           -20 to 19 for SCHED_OTHER
+*/
+struct aoakvmThreadConfig_t {
+    const char *cpus;
+    int policy;
+    int priority;
+    int nice;
+};
+
+/*
+    aoakvmThreadStats_t
+
+    Scheduler figures of the live threads of one role from /proc/self/task/<tid>/schedstat,
+    see affinity_getStats. waitUs is the time the threads were runnable but did not get a CPU.
+    Fields:
+        int threads;
+        uint64_t runUs;
+        uint64_t waitUs;
+        uint64_t timeslices;
+*/
+struct aoakvmThreadStats_t {
+    int threads;
+    uint64_t runUs;
+    uint64_t waitUs;
+    uint64_t timeslices;
+};
+
+/*
+    aoakvm_startup_phase_e
+
+    Phases of the cold start and of every (re)connection, see profile_begin. The connection
+    phases from PHASE_ENUMERATE on are cleared when a new connection attempt starts.
+    Values:
+        PHASE_SDL_INIT          SDL_Init with the subsystems of the chosen mode
+        PHASE_LOAD_SCREENS      BMP loading in window_setMsgscreens
+        PHASE_ENUMERATE         device list scan of the usb_getHandle call that found the phone
+        PHASE_AOA_SWITCH        accessory handshake up to AOA_START
+        PHASE_REENUMERATE       waiting for the accessory in usb_get_aoa_handle
+        PHASE_HID_REGISTER      HID registration
+        PHASE_OPEN_INPUT        avformat_open_input
+        PHASE_FIND_STREAM_INFO  avformat_find_stream_info
+        PHASE_DECODER_OPEN      avcodec_alloc_context3 up to avcodec_open2
+        PHASE_FIRST_FRAME       decode thread start until the first frame was presented
+                                (decoded when headless)
+*/
+enum aoakvm_startup_phase_e {
+    PHASE_SDL_INIT,
+    PHASE_LOAD_SCREENS,
+    PHASE_ENUMERATE,
+    PHASE_AOA_SWITCH,
+    PHASE_REENUMERATE,
+    PHASE_HID_REGISTER,
+    PHASE_OPEN_INPUT,
+    PHASE_FIND_STREAM_INFO,
+    PHASE_DECODER_OPEN,
+    PHASE_FIRST_FRAME,
+    PHASE_COUNT,
+};
+
+/*
+    aoakvmStartupProfile_t
+
+    Timeline of the startup phases, clock_nowUs() timestamps, 0 if a phase did not run (yet).
+    Fields:
+        uint64_t origin;                first profile_begin of the process
+        uint64_t begin[PHASE_COUNT];
+        uint64_t end[PHASE_COUNT];
+        int connections;                connection attempts so far
+*/
+struct aoakvmStartupProfile_t {
+    uint64_t origin;
+    uint64_t begin[PHASE_COUNT];
+    uint64_t end[PHASE_COUNT];
+    int connections;
+};
+
 /*
     aoakvm_usb_status_e
 
@@ -148,6 +1058,14 @@ extern struct aoakvmUSBConnection_t *usbCon;
 
 extern Uint32 DEVICE_CONNECTION_EVENT;
 extern Uint32 DEVICE_DISCONNECTION_EVENT;
+
+/*
+    SCREEN_CHANGED_EVENT
+
+    Pushed from the decode thread when a frame changes after at least one static frame.
+    event.user.data1 holds the number of changed tiles cast to a pointer.
+*/
+extern Uint32 SCREEN_CHANGED_EVENT;
 int aoakvm_push_event(Uint32 *eventType, void *data1, void *data2);
 
 /*
@@ -161,6 +1079,66 @@ int aoakvm_push_event(Uint32 *eventType, void *data1, void *data2);
 
 int aoakvm_wait_for_device_connection();
 
+/* Longest block in SDL_WaitEventTimeout before the event loops look at the connection again */
+#define EVENT_LOOP_WAIT_MS 500
+
+/*
+    aoakvmEventLoopStats_t
+
+    Cost of waiting for SDL events in aoakvm_wait_for_device_connection and
+    aoakvm_run_event_loop, see aoakvm_get_event_loop_stats. cpuUs is the thread CPU time spent
+    while wallUs passed in SDL_WaitEventTimeout, their ratio is the idle load of the loop.
+    Fields:
+        uint64_t wakeups;   returns from SDL_WaitEventTimeout, including timeouts
+        uint64_t events;
+        uint64_t cpuUs;
+        uint64_t wallUs;
+*/
+struct aoakvmEventLoopStats_t {
+    uint64_t wakeups;
+    uint64_t events;
+    uint64_t cpuUs;
+    uint64_t wallUs;
+};
+
+/*
+    int aoakvm_run_event_loop();
+
+    Event loop for embedders without one of their own, pass it as the eventThread of
+    invoke_aoakvm. Blocks in SDL_WaitEventTimeout instead of polling. While no phone is
+    connected it is aoakvm_wait_for_device_connection (ESC and closing the window exit), while
+    one is connected keys go through keyboard_handleEvent and relative mouse motion, buttons
+    and the wheel become mouse reports. Held keys and buttons are released when the window
+    loses the focus or the phone disconnects, SDL_QUIT exits. With a video wall nothing is
+    forwarded here, its event watch routes the input to the focused tile. Never returns.
+*/
+int aoakvm_run_event_loop();
+
+/*
+    int aoakvm_get_event_loop_stats(struct aoakvmEventLoopStats_t *stats);
+
+    Totals since start of the waits of both event loops.
+*/
+int aoakvm_get_event_loop_stats(struct aoakvmEventLoopStats_t*);
+
+/*
+    int aoakvm_get_bus_stats(struct aoakvmBusStats_t *stats);
+
+    Throughput, transfer latency and shedding of the current session and the load of its USB
+    bus, counting the phones of other aoakvm processes on it. Returns -1 while no phone
+    streams or if its location is unknown.
+*/
+int aoakvm_get_bus_stats(struct aoakvmBusStats_t*);
+
+/*
+    void aoakvm_set_preview(uint32_t intervalMs);
+
+    Switches the session to preview mode, only one keyframe per intervalMs is decoded while
+    the stream keeps flowing. 0 goes back to full decoding from the next keyframe on. Stays
+    set across reconnections, safe to call from any thread.
+*/
+void aoakvm_set_preview(uint32_t);
+
 struct usbRequest_t {
   uint8_t requestType;
   uint8_t request;
@@ -0,0 +1,24 @@
+#include <errno.h>
+#include <time.h>
+
+#include "aoakvm_clock.h"
+
+uint64_t clock_nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void clock_sleepUntilUs(uint64_t deadline) {
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000,
+        .tv_nsec = (deadline % 1000000) * 1000,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+uint64_t clock_threadCpuUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
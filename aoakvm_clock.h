@@ -0,0 +1,29 @@
+#ifndef AOAKVM_CLOCK
+#define AOAKVM_CLOCK
+
+#include <stdint.h>
+
+/*
+    uint64_t clock_nowUs();
+
+    Monotonic time in microseconds, comparable between all threads of the process.
+*/
+uint64_t clock_nowUs();
+
+/*
+    void clock_sleepUntilUs(uint64_t deadline);
+
+    Sleeps until the monotonic clock reaches deadline (absolute, see clock_nowUs).
+    Returns immediately if the deadline already passed.
+*/
+void clock_sleepUntilUs(uint64_t);
+
+/*
+    uint64_t clock_threadCpuUs();
+
+    CPU time the calling thread has used so far in microseconds, for cost measurements that
+    must not count time spent waiting on the bulk endpoint.
+*/
+uint64_t clock_threadCpuUs();
+
+#endif
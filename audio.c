@@ -0,0 +1,450 @@
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "audio.h"
+#include "usb.h"
+#include "video.h"
+#include "transport.h"
+#include "affinity.h"
+#include "memstat.h"
+
+/* AOA2 audio is always 44.1 kHz 16 bit little endian stereo */
+#define AUDIO_RATE 44100
+#define AUDIO_CHANNELS 2
+#define AUDIO_FRAME_BYTES (AUDIO_CHANNELS * 2)
+/* Transfers kept in flight and isochronous packets (one per ms at full speed) in each */
+#define AUDIO_TRANSFERS 4
+#define AUDIO_PACKETS 4
+#define AUDIO_RING_MS 500
+#define AUDIO_DEVICE_SAMPLES 256
+/* Buffer growth per underrun, shrinking per AUDIO_STABLE_MS without one */
+#define AUDIO_GROW_MS 10
+#define AUDIO_SHRINK_MS 2
+#define AUDIO_STABLE_MS 5000
+/* How often the thread takes over the delay of the video presentation */
+#define AUDIO_SYNC_MS 50
+/* How often a stop that still waits for cancelled transfers warns and cancels them again */
+#define AUDIO_CANCEL_WAIT_MS 500
+
+#define MS_TO_BYTES(ms) ((int)((int64_t)(ms) * AUDIO_RATE / 1000) * AUDIO_FRAME_BYTES)
+#define BYTES_TO_MS(bytes) ((uint32_t)((uint64_t)(bytes) / AUDIO_FRAME_BYTES * 1000 / AUDIO_RATE))
+
+/* USB audio class */
+#define UAC_SUBCLASS_STREAMING 2
+#define UAC_CS_INTERFACE 0x24
+#define UAC_FORMAT_TYPE 0x02
+
+// Struct Definition
+
+/*
+    struct AudioStream
+
+    The ring is written by the transfer callbacks, which run on whichever thread handles libusb
+    events, and read by the SDL audio callback. Both sides take lock.
+    Fields:
+        int interface;          audio streaming interface and the alternate setting that streams
+        int altSetting;
+        unsigned char endpoint; isochronous IN endpoint
+        int packetSize;
+        uint64_t written;       bytes ever written to and read from the ring
+        uint64_t read;
+        int target;             adaptive part of the buffer in bytes
+        SDL_atomic_t sync;      bytes the video presentation is delayed by, set by the thread
+        int priming;            silence until the buffer reached the target again
+        uint64_t lastChange;    clock_nowUs() of the last underrun or shrink step
+*/
+struct AudioStream {
+    libusb_device_handle *handle;
+    int interface;
+    int altSetting;
+    unsigned char endpoint;
+    int packetSize;
+    struct libusb_transfer *transfers[AUDIO_TRANSFERS];
+    SDL_atomic_t inFlight;
+    SDL_atomic_t stop;
+    SDL_Thread *thread;
+    SDL_AudioDeviceID device;
+    int deviceSamples;
+
+    SDL_SpinLock lock;
+    uint8_t *ring;
+    int ringSize;
+    uint64_t written;
+    uint64_t read;
+    int target;
+    SDL_atomic_t sync;
+    int priming;
+    uint64_t lastChange;
+    struct aoakvmAudioStats_t stats;
+};
+
+// Static Functions
+static int find_stream(const struct usbTransport_t *transport, libusb_device_handle *handle);
+static int is_pcm_stereo16(const struct libusb_interface_descriptor *alt);
+static int open_device(const char *name);
+static int audio_thread(void *data);
+static void LIBUSB_CALL transfer_done(struct libusb_transfer *transfer);
+static void ring_push(const uint8_t *data, int length);
+static void SDLCALL audio_callback(void *userdata, Uint8 *stream, int len);
+static void reap_transfers();
+static void release();
+
+// Local Variables
+static const struct aoakvmAudioConfig_t *config;
+static struct AudioStream audio;
+static int minBytes;
+static int maxBytes;
+
+
+int audio_start(const struct aoakvmAudioConfig_t *cfg, libusb_device_handle *handle) {
+    const struct usbTransport_t *transport = usb_transport();
+
+    if (audio.handle != NULL) {
+        return -1;
+    }
+    config = cfg;
+    memset(&audio, 0, sizeof(audio));
+
+    if (find_stream(transport, handle) < 0) {
+        log_info("audio: phone offers no AOA2 audio, video only");
+        return -1;
+    }
+    if (transport->claimInterface(handle, audio.interface) < 0) {
+        log_error("audio: could not claim interface %d", audio.interface);
+        return -1;
+    }
+    if (transport->setAltSetting(handle, audio.interface, audio.altSetting) < 0) {
+        log_error("audio: could not switch on interface %d", audio.interface);
+        transport->releaseInterface(handle, audio.interface);
+        return -1;
+    }
+    audio.handle = handle;
+
+    minBytes = MS_TO_BYTES(cfg->minDelay ? cfg->minDelay : AUDIO_DEFAULT_MIN_MS);
+    maxBytes = MS_TO_BYTES(SDL_min(cfg->maxDelay ? cfg->maxDelay : AUDIO_DEFAULT_MAX_MS, AUDIO_RING_MS / 2));
+    minBytes = SDL_min(minBytes, maxBytes);
+    audio.target = minBytes;
+    audio.priming = 1;
+    audio.lastChange = clock_nowUs();
+    audio.ringSize = MS_TO_BYTES(AUDIO_RING_MS);
+    audio.ring = memstat_alloc(MEM_TRANSPORT, audio.ringSize);
+
+    for (int i = 0; audio.ring != NULL && i < AUDIO_TRANSFERS; i++) {
+        int length = audio.packetSize * AUDIO_PACKETS;
+        unsigned char *buffer = memstat_alloc(MEM_TRANSPORT, length);
+        if (buffer == NULL || (audio.transfers[i] = libusb_alloc_transfer(AUDIO_PACKETS)) == NULL) {
+            memstat_free(MEM_TRANSPORT, buffer);
+            break;
+        }
+        libusb_fill_iso_transfer(audio.transfers[i], handle, audio.endpoint, buffer, length, AUDIO_PACKETS,
+                                 transfer_done, NULL, 0);
+        libusb_set_iso_packet_lengths(audio.transfers[i], audio.packetSize);
+    }
+
+    if (audio.transfers[AUDIO_TRANSFERS - 1] == NULL || open_device(cfg->device) < 0) {
+        release();
+        return -1;
+    }
+
+    audio.stats.running = 1;
+    audio.stats.rate = AUDIO_RATE;
+    audio.stats.channels = AUDIO_CHANNELS;
+    audio.thread = SDL_CreateThread(audio_thread, "audio", NULL);
+    if (audio.thread == NULL) {
+        log_error("audio: could not start the transfer thread");
+        release();
+        return -1;
+    }
+    SDL_PauseAudioDevice(audio.device, 0);
+    log_info("audio: interface %d endpoint 0x%02x, %d byte packets", audio.interface, audio.endpoint, audio.packetSize);
+    return 0;
+}
+
+void audio_stop() {
+    struct aoakvmAudioStats_t stats;
+
+    if (audio.handle == NULL) {
+        return;
+    }
+
+    if (audio_getStats(&stats) == 0) {
+        log_info("audio: %llu kB, %u ms latency, %llu underruns, %llu frames dropped, %llu broken packets",
+                 (unsigned long long)(stats.bytes / 1024), stats.latencyMs, (unsigned long long)stats.underruns,
+                 (unsigned long long)stats.dropped, (unsigned long long)stats.packetErrors);
+    }
+
+    SDL_AtomicSet(&audio.stop, 1);
+    if (audio.thread != NULL) {
+        SDL_WaitThread(audio.thread, NULL);
+    }
+    release();
+}
+
+int audio_getStats(struct aoakvmAudioStats_t *stats) {
+    if (audio.handle == NULL) {
+        return -1;
+    }
+
+    SDL_AtomicLock(&audio.lock);
+    *stats = audio.stats;
+    int buffered = (int)(audio.written - audio.read);
+    int target = SDL_max(audio.target, SDL_AtomicGet(&audio.sync));
+    SDL_AtomicUnlock(&audio.lock);
+
+    stats->bufferedMs = BYTES_TO_MS(buffered);
+    stats->targetMs = BYTES_TO_MS(target);
+    stats->syncMs = BYTES_TO_MS(SDL_AtomicGet(&audio.sync));
+    stats->latencyMs = stats->bufferedMs + audio.deviceSamples * 1000 / AUDIO_RATE + AUDIO_PACKETS;
+    return 0;
+}
+
+/* First alternate setting of an audio streaming interface with an isochronous IN endpoint */
+static int find_stream(const struct usbTransport_t *transport, libusb_device_handle *handle) {
+    struct libusb_config_descriptor *cfg;
+    int ret = -1;
+
+    if (transport->getConfig(handle, &cfg) < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < cfg->bNumInterfaces && ret < 0; i++) {
+        for (int a = 0; a < cfg->interface[i].num_altsetting && ret < 0; a++) {
+            const struct libusb_interface_descriptor *alt = &cfg->interface[i].altsetting[a];
+            if (alt->bInterfaceClass != LIBUSB_CLASS_AUDIO || alt->bInterfaceSubClass != UAC_SUBCLASS_STREAMING ||
+                alt->bNumEndpoints == 0 || !is_pcm_stereo16(alt)) {
+                continue;
+            }
+
+            const struct libusb_endpoint_descriptor *ep = &alt->endpoint[0];
+            if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ||
+                !(ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) || (ep->wMaxPacketSize & 0x7ff) == 0) {
+                continue;
+            }
+            audio.interface = alt->bInterfaceNumber;
+            audio.altSetting = alt->bAlternateSetting;
+            audio.endpoint = ep->bEndpointAddress;
+            audio.packetSize = ep->wMaxPacketSize & 0x7ff;
+            ret = 0;
+        }
+    }
+    transport->freeConfig(cfg);
+    return ret;
+}
+
+/* The format type descriptor, if there is one, has to match what AOA2 promises */
+static int is_pcm_stereo16(const struct libusb_interface_descriptor *alt) {
+    const unsigned char *d = alt->extra;
+    const unsigned char *end = alt->extra + alt->extra_length;
+
+    for (; d + 2 <= end && d[0] >= 2 && d + d[0] <= end; d += d[0]) {
+        if (d[1] == UAC_CS_INTERFACE && d[0] >= 7 && d[2] == UAC_FORMAT_TYPE) {
+            return d[4] == AUDIO_CHANNELS && d[6] == 16;
+        }
+    }
+    return 1;
+}
+
+static int open_device(const char *name) {
+    SDL_AudioSpec want = {0};
+    SDL_AudioSpec have;
+
+    if (!SDL_WasInit(SDL_INIT_AUDIO) && SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+        log_error("audio: SDL audio init failed: %s", SDL_GetError());
+        return -1;
+    }
+
+    want.freq = AUDIO_RATE;
+    want.format = AUDIO_S16LSB;
+    want.channels = AUDIO_CHANNELS;
+    want.samples = AUDIO_DEVICE_SAMPLES;
+    want.callback = audio_callback;
+    // SDL converts if the device wants another format, the buffer size is up to the device
+    audio.device = SDL_OpenAudioDevice(name, 0, &want, &have, SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+    if (audio.device == 0) {
+        log_error("audio: could not open %s: %s", name ? name : "the default device", SDL_GetError());
+        return -1;
+    }
+    audio.deviceSamples = have.samples;
+    return 0;
+}
+
+/*
+    Keeps the transfers going, events are mostly handled here but the stream thread's bulk reads
+    complete transfers too. Picks up the video delay between events.
+*/
+static int audio_thread(void *data) {
+    const struct usbTransport_t *transport = usb_transport();
+    uint64_t lastSync = 0;
+
+    affinity_apply(THREAD_STREAM);
+    for (int i = 0; i < AUDIO_TRANSFERS; i++) {
+        if (transport->submitTransfer(audio.transfers[i]) == 0) {
+            SDL_AtomicAdd(&audio.inFlight, 1);
+        }
+    }
+
+    while (!SDL_AtomicGet(&audio.stop) && SDL_AtomicGet(&audio.inFlight) > 0) {
+        struct timeval tv = { 0, 10000 };
+        transport->handleEvents(&tv);
+
+        uint64_t now = clock_nowUs();
+        if (now - lastSync >= AUDIO_SYNC_MS * 1000) {
+            struct aoakvmJitterStats_t video;
+            int64_t delay = video_getJitterStats(&video) == 0 ? (int64_t)video.targetDelay + config->offset : 0;
+            SDL_AtomicSet(&audio.sync, SDL_min(MS_TO_BYTES(SDL_max(delay, 0)), maxBytes));
+            lastSync = now;
+        }
+    }
+    if (SDL_AtomicGet(&audio.inFlight) == 0 && !SDL_AtomicGet(&audio.stop)) {
+        log_warn("audio: all transfers ended, playback stopped");
+    }
+    reap_transfers();
+    return 0;
+}
+
+/*
+    Every submitted transfer calls back once more, with libusb even after the phone is gone,
+    and only then may its buffer and the ring be released. A callback on the stream thread may
+    have resubmitted before it saw stop, so the cancel is repeated.
+*/
+static void reap_transfers() {
+    const struct usbTransport_t *transport = usb_transport();
+
+    SDL_AtomicSet(&audio.stop, 1);
+    uint64_t started = clock_nowUs();
+    uint64_t nextCancel = started;
+    for (int round = 0; SDL_AtomicGet(&audio.inFlight) > 0; ) {
+        uint64_t now = clock_nowUs();
+        if (now >= nextCancel) {
+            if (round++ > 0) {
+                log_warn("audio: %d transfers not back %llu ms after the cancel", SDL_AtomicGet(&audio.inFlight),
+                         (unsigned long long)((now - started) / 1000));
+            }
+            for (int i = 0; i < AUDIO_TRANSFERS; i++) {
+                transport->cancelTransfer(audio.transfers[i]);
+            }
+            nextCancel = now + AUDIO_CANCEL_WAIT_MS * 1000;
+        }
+        struct timeval tv = { 0, 10000 };
+        transport->handleEvents(&tv);
+    }
+}
+
+static void LIBUSB_CALL transfer_done(struct libusb_transfer *transfer) {
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        for (int i = 0; i < transfer->num_iso_packets; i++) {
+            struct libusb_iso_packet_descriptor *packet = &transfer->iso_packet_desc[i];
+            if (packet->status != LIBUSB_TRANSFER_COMPLETED) {
+                SDL_AtomicLock(&audio.lock);
+                audio.stats.packetErrors++;
+                SDL_AtomicUnlock(&audio.lock);
+                continue;
+            }
+            ring_push(libusb_get_iso_packet_buffer_simple(transfer, i), packet->actual_length);
+        }
+    }
+
+    int resubmit = !SDL_AtomicGet(&audio.stop) && transfer->status != LIBUSB_TRANSFER_NO_DEVICE &&
+                   transfer->status != LIBUSB_TRANSFER_CANCELLED;
+    if (!resubmit || usb_transport()->submitTransfer(transfer) < 0) {
+        SDL_AtomicAdd(&audio.inFlight, -1);
+    }
+}
+
+/* A full ring loses its oldest samples */
+static void ring_push(const uint8_t *data, int length) {
+    length -= length % AUDIO_FRAME_BYTES;
+
+    SDL_AtomicLock(&audio.lock);
+    int overflow = (int)(audio.written - audio.read) + length - audio.ringSize;
+    if (overflow > 0) {
+        audio.read += overflow;
+        audio.stats.dropped += overflow / AUDIO_FRAME_BYTES;
+    }
+    for (int done = 0; done < length; ) {
+        int pos = audio.written % audio.ringSize;
+        int n = SDL_min(length - done, audio.ringSize - pos);
+        memcpy(audio.ring + pos, data + done, n);
+        audio.written += n;
+        done += n;
+    }
+    audio.stats.bytes += length;
+    SDL_AtomicUnlock(&audio.lock);
+}
+
+/*
+    Runs on the SDL audio thread. The buffer is held at the larger of the adaptive target and
+    the video delay: what comes in beyond it, from a burst or the phone's clock running faster
+    than the sound card's, is dropped; an underrun plays silence until the grown target is
+    buffered again.
+*/
+static void SDLCALL audio_callback(void *userdata, Uint8 *stream, int len) {
+    uint64_t now = clock_nowUs();
+    int n = 0;
+
+    SDL_AtomicLock(&audio.lock);
+    int buffered = (int)(audio.written - audio.read);
+    int target = SDL_max(audio.target, SDL_AtomicGet(&audio.sync));
+
+    if (audio.priming && buffered >= target) {
+        audio.priming = 0;
+    }
+    if (!audio.priming) {
+        int excess = buffered - target - len;
+        if (excess > 0) {
+            excess -= excess % AUDIO_FRAME_BYTES;
+            audio.read += excess;
+            audio.stats.dropped += excess / AUDIO_FRAME_BYTES;
+            buffered -= excess;
+        }
+
+        n = SDL_min(buffered, len);
+        for (int done = 0; done < n; ) {
+            int pos = audio.read % audio.ringSize;
+            int chunk = SDL_min(n - done, audio.ringSize - pos);
+            memcpy(stream + done, audio.ring + pos, chunk);
+            audio.read += chunk;
+            done += chunk;
+        }
+
+        if (n < len) {
+            audio.stats.underruns++;
+            audio.target = SDL_min(audio.target + MS_TO_BYTES(AUDIO_GROW_MS), maxBytes);
+            audio.priming = 1;
+            audio.lastChange = now;
+        } else if (now - audio.lastChange >= AUDIO_STABLE_MS * 1000 && audio.target > minBytes) {
+            audio.target = SDL_max(audio.target - MS_TO_BYTES(AUDIO_SHRINK_MS), minBytes);
+            audio.lastChange = now;
+        }
+    }
+    SDL_AtomicUnlock(&audio.lock);
+
+    memset(stream + n, 0, len - n);
+}
+
+/*
+    Called before the transfers were submitted or after audio_thread saw all of them back.
+    Transfers still in flight would call back into the ring, they are reaped here first, so
+    audio.handle is always cleared and the next audio_start can claim the interface again.
+*/
+static void release() {
+    if (SDL_AtomicGet(&audio.inFlight) > 0) {
+        log_warn("audio: %d transfers still in flight, reaping them", SDL_AtomicGet(&audio.inFlight));
+        reap_transfers();
+    }
+
+    if (audio.handle != NULL) {
+        usb_transport()->setAltSetting(audio.handle, audio.interface, 0);
+        usb_transport()->releaseInterface(audio.handle, audio.interface);
+    }
+    if (audio.device != 0) {
+        SDL_CloseAudioDevice(audio.device);
+    }
+    for (int i = 0; i < AUDIO_TRANSFERS; i++) {
+        if (audio.transfers[i] != NULL) {
+            memstat_free(MEM_TRANSPORT, audio.transfers[i]->buffer);
+            libusb_free_transfer(audio.transfers[i]);
+        }
+    }
+    memstat_free(MEM_TRANSPORT, audio.ring);
+    memset(&audio, 0, sizeof(audio));
+}
@@ -0,0 +1,36 @@
+#ifndef AOAKVM_AUDIO
+#define AOAKVM_AUDIO
+
+#include "aoakvm.h"
+
+/* Buffer limits used when aoakvmAudioConfig_t leaves them at 0 */
+#define AUDIO_DEFAULT_MIN_MS 20
+#define AUDIO_DEFAULT_MAX_MS 200
+
+/*
+    int audio_start(const struct aoakvmAudioConfig_t *cfg, libusb_device_handle *handle);
+
+    Looks for the AOA2 audio streaming interface of the accessory, switches it on and plays
+    the PCM it delivers on an SDL audio device. Isochronous transfers are completed by a thread
+    of their own. cfg must stay valid. Returns -1 if the phone offers no audio, the session then
+    continues with video only.
+*/
+int audio_start(const struct aoakvmAudioConfig_t*, libusb_device_handle*);
+
+/*
+    void audio_stop();
+
+    Stops playback and the transfers and releases everything of audio_start. Blocks until every
+    cancelled transfer called back. Must be called before the handle is closed, does nothing if
+    audio is not running.
+*/
+void audio_stop();
+
+/*
+    int audio_getStats(struct aoakvmAudioStats_t *stats);
+
+    Buffer, latency and underruns of the running playback. Returns -1 if audio is not running.
+*/
+int audio_getStats(struct aoakvmAudioStats_t*);
+
+#endif
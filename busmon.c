@@ -0,0 +1,360 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "busmon.h"
+#include "usb.h"
+
+// Struct Definition
+
+/*
+    struct BusSession
+
+    Fields:
+        int used;
+        pid_t pid;                          process that attached the session
+        struct aoakvmBusStats_t stats;      bus and session figures are filled in by busmon_getStats
+        uint64_t windowStart;               clock_nowUs(), CLOCK_MONOTONIC is the same in all processes
+        uint64_t windowBytes;
+        uint64_t shedSince;                 clock_nowUs() when shedding started
+*/
+struct BusSession {
+    int used;
+    pid_t pid;
+    struct aoakvmBusStats_t stats;
+    uint64_t windowStart;
+    uint64_t windowBytes;
+    uint64_t shedSince;
+};
+
+/*
+    struct BusTable
+
+    The sessions of all aoakvm processes of the host, each process drives one phone. Lives in
+    the shared memory BUSMON_SHM_NAME, a new segment is zero filled and so an empty table.
+    The first process to map it sets up the mutex, process shared and robust: a process killed
+    while it holds the lock does not block the others.
+    Fields:
+        SDL_atomic_t state;     TABLE_UNINITIALIZED, TABLE_INITIALIZING or TABLE_READY
+        pthread_mutex_t mutex;
+        struct BusSession sessions[BUSMON_MAX_SESSIONS];
+*/
+struct BusTable {
+    SDL_atomic_t state;
+    pthread_mutex_t mutex;
+    struct BusSession sessions[BUSMON_MAX_SESSIONS];
+};
+
+#define TABLE_UNINITIALIZED 0
+#define TABLE_INITIALIZING 1
+#define TABLE_READY 2
+/* How long a process waits for another one to set up the shared table */
+#define TABLE_INIT_TIMEOUT_MS 1000
+
+// Static Functions
+static struct BusTable *open_table();
+static int init_table(struct BusTable *t, int shared);
+static int lock_table();
+static void unlock_table();
+static int priority_of(const char *location);
+static uint64_t rate_of(struct BusSession *session, uint64_t now);
+static uint64_t bus_rate(int bus, uint64_t now, int *sessions);
+
+// Local Variables
+static const struct aoakvmBusConfig_t *config;
+static struct BusTable *table;
+/* Used if the shared table is not available, only sessions of this process are seen */
+static struct BusTable localTable;
+
+
+void busmon_start(const struct aoakvmBusConfig_t *cfg) {
+    config = cfg;
+}
+
+static struct BusTable *open_table() {
+    int fd = shm_open(BUSMON_SHM_NAME, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        log_warn("busmon: no shared bus table %s: %s, only this process is monitored", BUSMON_SHM_NAME, strerror(errno));
+        return &localTable;
+    }
+
+    // Growing an existing segment to its own size keeps the contents
+    void *shared = MAP_FAILED;
+    if (ftruncate(fd, sizeof(struct BusTable)) == 0) {
+        shared = mmap(NULL, sizeof(struct BusTable), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (shared == MAP_FAILED) {
+        log_warn("busmon: mapping %s failed: %s, only this process is monitored", BUSMON_SHM_NAME, strerror(errno));
+        return &localTable;
+    }
+    if (init_table(shared, 1) < 0) {
+        log_warn("busmon: shared bus table %s not usable, only this process is monitored", BUSMON_SHM_NAME);
+        munmap(shared, sizeof(struct BusTable));
+        return &localTable;
+    }
+    return shared;
+}
+
+/* Sets up the mutex of t once, other processes wait until it is ready */
+static int init_table(struct BusTable *t, int shared) {
+    if (SDL_AtomicCAS(&t->state, TABLE_UNINITIALIZED, TABLE_INITIALIZING)) {
+        pthread_mutexattr_t attr;
+        int ret = pthread_mutexattr_init(&attr);
+        if (ret == 0 && shared) {
+            ret = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            ret = ret == 0 ? pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) : ret;
+        }
+        ret = ret == 0 ? pthread_mutex_init(&t->mutex, &attr) : ret;
+        pthread_mutexattr_destroy(&attr);
+        if (ret != 0) {
+            log_error("busmon: bus table mutex: %s", strerror(ret));
+            SDL_AtomicSet(&t->state, TABLE_UNINITIALIZED);
+            return -1;
+        }
+        SDL_AtomicSet(&t->state, TABLE_READY);
+        return 0;
+    }
+
+    uint32_t deadline = SDL_GetTicks() + TABLE_INIT_TIMEOUT_MS;
+    while (SDL_AtomicGet(&t->state) != TABLE_READY) {
+        if (SDL_TICKS_PASSED(SDL_GetTicks(), deadline)) {
+            return -1;
+        }
+        SDL_Delay(1);
+    }
+    return 0;
+}
+
+/*
+    A process that died inside the lock leaves at most one session with half updated
+    figures, the table stays usable. Returns -1 only if the mutex cannot be recovered.
+*/
+static int lock_table() {
+    int ret = pthread_mutex_lock(&table->mutex);
+    if (ret == EOWNERDEAD) {
+        log_warn("busmon: a process died holding the bus table, recovered");
+        ret = pthread_mutex_consistent(&table->mutex);
+    }
+    return ret == 0 ? 0 : -1;
+}
+
+static void unlock_table() {
+    pthread_mutex_unlock(&table->mutex);
+}
+
+static int priority_of(const char *location) {
+    if (config == NULL) {
+        return 0;
+    }
+
+    for (int i = 0; i < config->priorityCount; i++) {
+        if (strcmp(config->priorities[i].location, location) == 0) {
+            return config->priorities[i].priority;
+        }
+    }
+    return 0;
+}
+
+int busmon_attach(libusb_device_handle *handle) {
+    uint8_t bus;
+    uint8_t ports[BUS_MAX_PORTS];
+    char location[BUS_LOCATION_LENGTH];
+
+    int count = usb_transport()->getLocation(handle, &bus, ports, BUS_MAX_PORTS);
+    if (count < 0) {
+        log_warn("busmon: no location for the device: %s", libusb_error_name(count));
+        return -1;
+    }
+
+    int len = snprintf(location, sizeof(location), "%d-", bus);
+    for (int i = 0; i < count; i++) {
+        len += snprintf(location + len, sizeof(location) - len, i == 0 ? "%d" : ".%d", ports[i]);
+    }
+
+    int priority = priority_of(location);
+    int session = -1;
+    pid_t pids[BUSMON_MAX_SESSIONS];
+    int dead[BUSMON_MAX_SESSIONS];
+
+    if (table == NULL) {
+        table = open_table();
+        if (table == &localTable && init_table(&localTable, 0) < 0) {
+            return -1;
+        }
+    }
+
+    // Sessions of processes that ended without busmon_detach are taken over. The liveness
+    // checks run outside the lock, a session is only taken if it still has the dead pid.
+    if (lock_table() < 0) {
+        return -1;
+    }
+    for (int i = 0; i < BUSMON_MAX_SESSIONS; i++) {
+        pids[i] = table->sessions[i].used ? table->sessions[i].pid : 0;
+    }
+    unlock_table();
+    for (int i = 0; i < BUSMON_MAX_SESSIONS; i++) {
+        dead[i] = pids[i] != 0 && kill(pids[i], 0) < 0 && errno == ESRCH;
+    }
+
+    if (lock_table() < 0) {
+        return -1;
+    }
+    for (int i = 0; i < BUSMON_MAX_SESSIONS; i++) {
+        struct BusSession *s = &table->sessions[i];
+        if (!s->used || (dead[i] && s->pid == pids[i])) {
+            session = i;
+            break;
+        }
+    }
+    if (session >= 0) {
+        struct BusSession *s = &table->sessions[session];
+        memset(s, 0, sizeof(*s));
+        s->used = 1;
+        s->pid = getpid();
+        s->windowStart = clock_nowUs();
+        s->stats.bus = bus;
+        s->stats.priority = priority;
+        SDL_strlcpy(s->stats.location, location, sizeof(s->stats.location));
+    }
+    unlock_table();
+
+    if (session < 0) {
+        log_warn("busmon: more than %d sessions, %s is not monitored", BUSMON_MAX_SESSIONS, location);
+        return -1;
+    }
+    log_debug("busmon: session %d on %s, priority %d", session, location, priority);
+    return session;
+}
+
+void busmon_detach(int session) {
+    if (session < 0) {
+        return;
+    }
+
+    if (lock_table() < 0) {
+        return;
+    }
+    table->sessions[session].used = 0;
+    unlock_table();
+}
+
+void busmon_onTransfer(int session, int bytes, uint64_t latency) {
+    if (session < 0) {
+        return;
+    }
+
+    uint64_t now = clock_nowUs();
+
+    if (lock_table() < 0) {
+        return;
+    }
+    struct BusSession *s = &table->sessions[session];
+    s->stats.bytes += bytes;
+    s->stats.transfers++;
+    s->stats.latencyLast = latency;
+    s->stats.latencyMax = SDL_max(s->stats.latencyMax, latency);
+    s->stats.latencyTotal += latency;
+
+    s->windowBytes += bytes;
+    if (now - s->windowStart >= BUSMON_WINDOW_MS * 1000) {
+        s->stats.bytesPerSecond = s->windowBytes * 1000000 / (now - s->windowStart);
+        s->windowBytes = 0;
+        s->windowStart = now;
+    }
+    unlock_table();
+}
+
+/* A session that stopped reading does not load the bus anymore */
+static uint64_t rate_of(struct BusSession *session, uint64_t now) {
+    if (now - session->windowStart > 2 * BUSMON_WINDOW_MS * 1000) {
+        return 0;
+    }
+    return session->stats.bytesPerSecond;
+}
+
+static uint64_t bus_rate(int bus, uint64_t now, int *count) {
+    uint64_t rate = 0;
+
+    *count = 0;
+    for (int i = 0; i < BUSMON_MAX_SESSIONS; i++) {
+        if (table->sessions[i].used && table->sessions[i].stats.bus == bus) {
+            rate += rate_of(&table->sessions[i], now);
+            (*count)++;
+        }
+    }
+    return rate;
+}
+
+int busmon_shouldShed(int session) {
+    if (session < 0) {
+        return 0;
+    }
+
+    uint64_t now = clock_nowUs();
+    uint64_t capacity = config != NULL && config->capacity > 0 ? config->capacity : BUSMON_DEFAULT_CAPACITY;
+    int saturation = config != NULL && config->saturation > 0 ? config->saturation : BUSMON_DEFAULT_SATURATION;
+    int count;
+
+    if (lock_table() < 0) {
+        return 0;
+    }
+    struct BusSession *s = &table->sessions[session];
+    int higher = 0;
+    for (int i = 0; i < BUSMON_MAX_SESSIONS; i++) {
+        // Only streaming sessions count, shedding for an idle or dead one helps nobody
+        struct BusSession *other = &table->sessions[i];
+        higher |= other->used && other->stats.bus == s->stats.bus &&
+                  other->stats.priority > s->stats.priority && rate_of(other, now) > 0;
+    }
+
+    // Hysteresis, a shedding session lowers the load itself and would flap otherwise
+    uint64_t rate = bus_rate(s->stats.bus, now, &count);
+    int threshold = s->stats.shedding ? saturation - BUSMON_HYSTERESIS : saturation;
+    int shed = higher && rate * 100 >= capacity * threshold;
+
+    int changed = shed != s->stats.shedding;
+    if (changed && shed) {
+        s->shedSince = now;
+    } else if (changed) {
+        s->stats.shedUs += now - s->shedSince;
+    }
+    s->stats.shedding = shed;
+    unlock_table();
+
+    if (changed) {
+        log_info("busmon: bus %d at %llu kB/s, session %d %s shedding frames", s->stats.bus,
+                 (unsigned long long)(rate / 1024), session, shed ? "starts" : "stops");
+    }
+    return shed;
+}
+
+int busmon_getStats(int session, struct aoakvmBusStats_t *stats) {
+    if (session < 0) {
+        return -1;
+    }
+
+    uint64_t now = clock_nowUs();
+    int ret = -1;
+
+    if (lock_table() < 0) {
+        return -1;
+    }
+    struct BusSession *s = &table->sessions[session];
+    if (s->used && s->pid == getpid()) {
+        *stats = s->stats;
+        stats->bytesPerSecond = rate_of(s, now);
+        stats->busBytesPerSecond = bus_rate(s->stats.bus, now, &stats->busSessions);
+        if (s->stats.shedding) {
+            stats->shedUs += now - s->shedSince;
+        }
+        ret = 0;
+    }
+    unlock_table();
+    return ret;
+}
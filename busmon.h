@@ -0,0 +1,60 @@
+#ifndef AOAKVM_BUSMON
+#define AOAKVM_BUSMON
+
+#include "aoakvm.h"
+
+/* Sessions tracked at the same time by all processes of the host, one per phone */
+#define BUSMON_MAX_SESSIONS 64
+/* Shared memory of the session table, the number changes with its layout */
+#define BUSMON_SHM_NAME "/aoakvm-busmon-2"
+/* Throughput is averaged over windows of this length */
+#define BUSMON_WINDOW_MS 500
+/* Shedding stops this many percent below the saturation threshold */
+#define BUSMON_HYSTERESIS 10
+/* What a USB 2.0 high speed bus carries in bulk transfers in practice */
+#define BUSMON_DEFAULT_CAPACITY (35 * 1024 * 1024)
+#define BUSMON_DEFAULT_SATURATION 90
+
+/*
+    void busmon_start(const struct aoakvmBusConfig_t *cfg);
+
+    Sets capacity and device priorities, cfg must stay valid. Without it sessions are still
+    measured, all have priority 0 and never shed.
+*/
+void busmon_start(const struct aoakvmBusConfig_t*);
+
+/*
+    int busmon_attach(libusb_device_handle *handle);
+    void busmon_detach(int session);
+
+    Starts measuring the stream of handle under its bus and port path in the session table
+    shared by all processes of the host, which every process needs to see the other phones
+    on its bus. Returns the session or -1 if the location is unknown or all
+    BUSMON_MAX_SESSIONS are in use; the other functions ignore session -1.
+*/
+int busmon_attach(libusb_device_handle*);
+void busmon_detach(int);
+
+/*
+    void busmon_onTransfer(int session, int bytes, uint64_t latency);
+
+    A bulk read of the session returned bytes after latency µs, called by the stream thread.
+*/
+void busmon_onTransfer(int, int, uint64_t);
+
+/*
+    int busmon_shouldShed(int session);
+
+    Returns 1 while the bus of the session is saturated and a streaming session with a higher
+    priority shares it, in this or another process. The stream thread then drops frames it can, see aoakvmBusConfig_t.
+*/
+int busmon_shouldShed(int);
+
+/*
+    int busmon_getStats(int session, struct aoakvmBusStats_t *stats);
+
+    Returns -1 if session is not attached.
+*/
+int busmon_getStats(int, struct aoakvmBusStats_t*);
+
+#endif
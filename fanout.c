@@ -0,0 +1,645 @@
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "aoakvm.h"
+#include "fanout.h"
+#include "sock.h"
+
+// H.264 NAL unit types
+#define NAL_IDR 5
+#define NAL_SPS 7
+#define NAL_PPS 8
+
+// HEVC NAL unit types, BLA, IDR and CRA pictures are the random access points
+#define HEVC_NAL_IRAP_FIRST 16
+#define HEVC_NAL_IRAP_LAST 23
+#define HEVC_NAL_VPS 32
+#define HEVC_NAL_SPS 33
+#define HEVC_NAL_PPS 34
+
+/* Role of a NAL unit in the GOP cache, the parameter sets are kept in this order */
+enum FanoutNalKind {
+    KIND_VPS,
+    KIND_SPS,
+    KIND_PPS,
+    KIND_PARAM_SETS,
+    KIND_KEY = KIND_PARAM_SETS,
+    KIND_OTHER,
+};
+
+// Struct Definition
+
+/*
+    struct FanoutNal
+
+    One Annex-B NAL unit including its start code, shared by all subscriber queues.
+*/
+struct FanoutNal {
+    SDL_atomic_t refs;
+    enum FanoutNalKind kind;
+    size_t size;
+    uint8_t data[];
+};
+
+/*
+    struct FanoutSubscriber
+
+    Fields:
+        int fd;
+        int waitIdr;            skip everything until the next IDR frame
+        struct FanoutNal *queue[FANOUT_QUEUE_LENGTH];
+        int nextRead;
+        int count;
+        size_t queuedBytes;
+        size_t sendOffset;      bytes of queue[nextRead] already written to fd
+        uint64_t droppedGops;
+*/
+struct FanoutSubscriber {
+    int fd;
+    int waitIdr;
+    struct FanoutNal *queue[FANOUT_QUEUE_LENGTH];
+    int nextRead;
+    int count;
+    size_t queuedBytes;
+    size_t sendOffset;
+    uint64_t droppedGops;
+};
+
+/* Split the byte stream from the bulk endpoint into NAL units, only used by the ingest thread */
+struct FanoutParser {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    size_t scan;
+    long nalStart;
+    enum FanoutNalKind lastKind;
+    enum AVCodecID codec;
+};
+
+struct FanoutServer {
+    SDL_mutex *mutex;
+    SDL_Thread *thread;
+    int running;
+    int listenFd;
+    int wakeFd[2];
+    struct FanoutSubscriber *subscribers[FANOUT_MAX_SUBSCRIBERS];
+
+    struct FanoutNal *params[KIND_PARAM_SETS];
+    struct FanoutNal **gop;
+    int gopCount;
+    int gopCap;
+    size_t gopBytes;
+    int gopValid;
+
+    struct aoakvmFanoutStats_t stats;
+};
+
+// Static Functions
+static int fanout_thread(void *data);
+static void wake_thread(char reason);
+
+static struct FanoutNal *nal_new(const uint8_t *data, size_t size);
+static struct FanoutNal *nal_ref(struct FanoutNal *nal);
+static void nal_unref(struct FanoutNal *nal);
+
+static enum FanoutNalKind nal_kind(const uint8_t *header);
+static void parser_emit(const uint8_t *data, size_t size);
+static void distribute(struct FanoutNal *nal, int gopStart);
+static void gop_clear();
+static void gop_append(struct FanoutNal *nal);
+
+static int sub_push(struct FanoutSubscriber *sub, struct FanoutNal *nal);
+static int sub_pushParams(struct FanoutSubscriber *sub);
+static void sub_dropGop(struct FanoutSubscriber *sub);
+static void sub_startAtIdr(struct FanoutSubscriber *sub);
+static void sub_add(int fd);
+static void sub_remove(int idx);
+static int sub_flush(struct FanoutSubscriber *sub);
+
+// Local Variables
+static struct FanoutServer server = {
+    .listenFd = -1,
+    .wakeFd = { -1, -1 },
+};
+static struct FanoutParser parser = {
+    .nalStart = -1,
+    .codec = AV_CODEC_ID_H264,
+};
+static int wakePending;
+
+
+int fanout_start(const char *address) {
+    if (server.running) {
+        return 0;
+    }
+
+    server.listenFd = sock_listen(address);
+    if (server.listenFd < 0) {
+        return -1;
+    }
+
+    if (pipe(server.wakeFd) < 0 || sock_setNonBlocking(server.wakeFd[0]) < 0 || sock_setNonBlocking(server.wakeFd[1]) < 0) {
+        log_error("fanout: could not create wake pipe");
+        close(server.listenFd);
+        server.listenFd = -1;
+        return -1;
+    }
+
+    server.mutex = SDL_CreateMutex();
+    server.running = 1;
+    server.thread = SDL_CreateThread(fanout_thread, "fanoutServer", NULL);
+    if (server.thread == NULL) {
+        log_error("Failed to create fanout thread: %s", SDL_GetError());
+        server.running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void fanout_stop() {
+    if (!server.running) {
+        return;
+    }
+
+    server.running = 0;
+    wake_thread('q');
+    SDL_WaitThread(server.thread, NULL);
+
+    for (int i = 0; i < FANOUT_MAX_SUBSCRIBERS; i++) {
+        sub_remove(i);
+    }
+    fanout_reset();
+
+    close(server.listenFd);
+    close(server.wakeFd[0]);
+    close(server.wakeFd[1]);
+    server.listenFd = server.wakeFd[0] = server.wakeFd[1] = -1;
+    SDL_DestroyMutex(server.mutex);
+    server.mutex = NULL;
+}
+
+void fanout_reset() {
+    parser.len = 0;
+    parser.scan = 0;
+    parser.nalStart = -1;
+    parser.lastKind = KIND_OTHER;
+    parser.codec = AV_CODEC_ID_H264;
+
+    if (server.mutex == NULL) {
+        return;
+    }
+
+    SDL_LockMutex(server.mutex);
+    gop_clear();
+    for (int i = 0; i < KIND_PARAM_SETS; i++) {
+        nal_unref(server.params[i]);
+        server.params[i] = NULL;
+    }
+    for (int i = 0; i < FANOUT_MAX_SUBSCRIBERS; i++) {
+        if (server.subscribers[i] != NULL) {
+            server.subscribers[i]->waitIdr = 1;
+        }
+    }
+    SDL_UnlockMutex(server.mutex);
+}
+
+int fanout_setCodec(enum AVCodecID codec) {
+    parser.codec = codec;
+    return codec == AV_CODEC_ID_H264 || codec == AV_CODEC_ID_HEVC ? 0 : -1;
+}
+
+void fanout_feed(const uint8_t *data, int size) {
+    if (!server.running || size <= 0 || (parser.codec != AV_CODEC_ID_H264 && parser.codec != AV_CODEC_ID_HEVC)) {
+        return;
+    }
+
+    if (parser.len + size > parser.cap) {
+        size_t cap = parser.cap ? parser.cap : 64 * 1024;
+        while (cap < parser.len + size) {
+            cap *= 2;
+        }
+        uint8_t *buf = realloc(parser.buf, cap);
+        if (buf == NULL) {
+            log_error("fanout: out of memory, resetting parser");
+            parser.len = parser.scan = 0;
+            parser.nalStart = -1;
+            return;
+        }
+        parser.buf = buf;
+        parser.cap = cap;
+    }
+    memcpy(parser.buf + parser.len, data, size);
+    parser.len += size;
+
+    // Look for 00 00 01, every start code terminates the previous NAL unit
+    uint8_t *buf = parser.buf;
+    size_t i = parser.scan;
+    while (i + 2 < parser.len) {
+        uint8_t *one = memchr(buf + i + 2, 1, parser.len - i - 2);
+        if (one == NULL) {
+            i = parser.len - 2;
+            break;
+        }
+
+        size_t pos = one - buf;
+        if (buf[pos - 1] != 0 || buf[pos - 2] != 0) {
+            i = pos - 1;
+            continue;
+        }
+
+        size_t start = pos - 2;
+        if (start > 0 && buf[start - 1] == 0 && (parser.nalStart < 0 || start - 1 > (size_t)parser.nalStart)) {
+            start--;
+        }
+        if (parser.nalStart >= 0) {
+            parser_emit(buf + parser.nalStart, start - parser.nalStart);
+        }
+        parser.nalStart = start;
+        i = pos + 1;
+    }
+    parser.scan = i;
+
+    if (parser.nalStart > 0) {
+        parser.len -= parser.nalStart;
+        parser.scan -= parser.nalStart;
+        memmove(parser.buf, parser.buf + parser.nalStart, parser.len);
+        parser.nalStart = 0;
+    } else if (parser.nalStart < 0 && parser.len > 2) {
+        memmove(parser.buf, parser.buf + parser.len - 2, 2);
+        parser.len = 2;
+        parser.scan = 0;
+    }
+
+    if (wakePending) {
+        wakePending = 0;
+        wake_thread('w');
+    }
+}
+
+int fanout_getStats(struct aoakvmFanoutStats_t *stats) {
+    if (server.mutex == NULL) {
+        return -1;
+    }
+
+    SDL_LockMutex(server.mutex);
+    *stats = server.stats;
+    SDL_UnlockMutex(server.mutex);
+    return 0;
+}
+
+static struct FanoutNal *nal_new(const uint8_t *data, size_t size) {
+    struct FanoutNal *nal = malloc(sizeof(struct FanoutNal) + size);
+    if (nal == NULL) {
+        return NULL;
+    }
+
+    SDL_AtomicSet(&nal->refs, 1);
+    nal->size = size;
+    memcpy(nal->data, data, size);
+    nal->kind = nal_kind(data + (data[2] == 1 ? 3 : 4));
+    return nal;
+}
+
+static enum FanoutNalKind nal_kind(const uint8_t *header) {
+    if (parser.codec == AV_CODEC_ID_HEVC) {
+        int type = (header[0] >> 1) & 0x3f;
+        if (type >= HEVC_NAL_IRAP_FIRST && type <= HEVC_NAL_IRAP_LAST) {
+            return KIND_KEY;
+        }
+        switch (type) {
+        case HEVC_NAL_VPS: return KIND_VPS;
+        case HEVC_NAL_SPS: return KIND_SPS;
+        case HEVC_NAL_PPS: return KIND_PPS;
+        default: return KIND_OTHER;
+        }
+    }
+
+    switch (header[0] & 0x1f) {
+    case NAL_IDR: return KIND_KEY;
+    case NAL_SPS: return KIND_SPS;
+    case NAL_PPS: return KIND_PPS;
+    default: return KIND_OTHER;
+    }
+}
+
+static struct FanoutNal *nal_ref(struct FanoutNal *nal) {
+    SDL_AtomicIncRef(&nal->refs);
+    return nal;
+}
+
+static void nal_unref(struct FanoutNal *nal) {
+    if (nal != NULL && SDL_AtomicDecRef(&nal->refs)) {
+        free(nal);
+    }
+}
+
+static void parser_emit(const uint8_t *data, size_t size) {
+    if (size < 5) {
+        return;
+    }
+
+    struct FanoutNal *nal = nal_new(data, size);
+    if (nal == NULL) {
+        return;
+    }
+
+    // Slices of the same IDR picture belong to the GOP started by the first one
+    int gopStart = nal->kind == KIND_KEY && parser.lastKind != KIND_KEY;
+    parser.lastKind = nal->kind;
+
+    SDL_LockMutex(server.mutex);
+    server.stats.nals++;
+    server.stats.bytes += size;
+
+    switch (nal->kind) {
+    case KIND_VPS:
+    case KIND_SPS:
+    case KIND_PPS:
+        nal_unref(server.params[nal->kind]);
+        server.params[nal->kind] = nal_ref(nal);
+        break;
+    default:
+        if (gopStart) {
+            gop_clear();
+            server.gopValid = 1;
+        }
+        if (server.gopValid) {
+            gop_append(nal);
+        }
+        break;
+    }
+
+    distribute(nal, gopStart);
+    SDL_UnlockMutex(server.mutex);
+    nal_unref(nal);
+}
+
+static void distribute(struct FanoutNal *nal, int gopStart) {
+    for (int i = 0; i < FANOUT_MAX_SUBSCRIBERS; i++) {
+        struct FanoutSubscriber *sub = server.subscribers[i];
+        if (sub == NULL) {
+            continue;
+        }
+
+        if (sub->waitIdr) {
+            if (!gopStart) {
+                continue;
+            }
+            sub->waitIdr = 0;
+            if (sub_pushParams(sub) < 0) {
+                sub_dropGop(sub);
+                continue;
+            }
+        }
+
+        if (sub_push(sub, nal) < 0) {
+            sub_dropGop(sub);
+        }
+        wakePending = 1;
+    }
+}
+
+static void gop_clear() {
+    for (int i = 0; i < server.gopCount; i++) {
+        nal_unref(server.gop[i]);
+    }
+    server.gopCount = 0;
+    server.gopBytes = 0;
+    server.gopValid = 0;
+}
+
+static void gop_append(struct FanoutNal *nal) {
+    if (server.gopBytes + nal->size > FANOUT_GOP_CACHE_BYTES) {
+        // Too long to replay, late subscribers wait for the next IDR instead
+        gop_clear();
+        return;
+    }
+
+    if (server.gopCount == server.gopCap) {
+        int cap = server.gopCap ? server.gopCap * 2 : 256;
+        struct FanoutNal **gop = realloc(server.gop, sizeof(*gop) * cap);
+        if (gop == NULL) {
+            gop_clear();
+            return;
+        }
+        server.gop = gop;
+        server.gopCap = cap;
+    }
+    server.gop[server.gopCount++] = nal_ref(nal);
+    server.gopBytes += nal->size;
+}
+
+static int sub_push(struct FanoutSubscriber *sub, struct FanoutNal *nal) {
+    if (sub->count == FANOUT_QUEUE_LENGTH || sub->queuedBytes + nal->size > FANOUT_QUEUE_BYTES) {
+        return -1;
+    }
+
+    sub->queue[(sub->nextRead + sub->count) % FANOUT_QUEUE_LENGTH] = nal_ref(nal);
+    sub->count++;
+    sub->queuedBytes += nal->size;
+    return 0;
+}
+
+static int sub_pushParams(struct FanoutSubscriber *sub) {
+    for (int i = 0; i < KIND_PARAM_SETS; i++) {
+        if (server.params[i] != NULL && sub_push(sub, server.params[i]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Drops everything queued for a slow subscriber except the head, which the sender thread may
+    be writing, and skips the stream until the next IDR frame.
+*/
+static void sub_dropGop(struct FanoutSubscriber *sub) {
+    while (sub->count > 1) {
+        int last = (sub->nextRead + sub->count - 1) % FANOUT_QUEUE_LENGTH;
+        sub->queuedBytes -= sub->queue[last]->size;
+        server.stats.droppedBytes += sub->queue[last]->size;
+        nal_unref(sub->queue[last]);
+        sub->count--;
+    }
+
+    if (!sub->waitIdr) {
+        sub->droppedGops++;
+        server.stats.droppedGops++;
+        log_debug("fanout: subscriber %d too slow, dropping GOP", sub->fd);
+    }
+    sub->waitIdr = 1;
+}
+
+static void sub_startAtIdr(struct FanoutSubscriber *sub) {
+    sub->waitIdr = 1;
+    if (!server.gopValid || server.gopCount == 0) {
+        return;
+    }
+
+    sub->waitIdr = 0;
+    if (sub_pushParams(sub) < 0) {
+        sub_dropGop(sub);
+        return;
+    }
+    for (int i = 0; i < server.gopCount; i++) {
+        if (sub_push(sub, server.gop[i]) < 0) {
+            sub_dropGop(sub);
+            return;
+        }
+    }
+}
+
+static void sub_add(int fd) {
+    SDL_LockMutex(server.mutex);
+    for (int i = 0; i < FANOUT_MAX_SUBSCRIBERS; i++) {
+        if (server.subscribers[i] != NULL) {
+            continue;
+        }
+
+        struct FanoutSubscriber *sub = calloc(1, sizeof(struct FanoutSubscriber));
+        if (sub == NULL) {
+            break;
+        }
+        sub->fd = fd;
+        sub_startAtIdr(sub);
+        server.subscribers[i] = sub;
+        server.stats.subscribers++;
+        SDL_UnlockMutex(server.mutex);
+        log_info("fanout: subscriber %d connected", fd);
+        return;
+    }
+    SDL_UnlockMutex(server.mutex);
+
+    log_warn("fanout: rejecting subscriber, %d already connected", FANOUT_MAX_SUBSCRIBERS);
+    close(fd);
+}
+
+static void sub_remove(int idx) {
+    SDL_LockMutex(server.mutex);
+    struct FanoutSubscriber *sub = server.subscribers[idx];
+    server.subscribers[idx] = NULL;
+    if (sub != NULL) {
+        server.stats.subscribers--;
+        while (sub->count > 0) {
+            nal_unref(sub->queue[sub->nextRead]);
+            sub->nextRead = (sub->nextRead + 1) % FANOUT_QUEUE_LENGTH;
+            sub->count--;
+        }
+    }
+    SDL_UnlockMutex(server.mutex);
+
+    if (sub != NULL) {
+        log_info("fanout: subscriber %d disconnected, %llu GOPs dropped", sub->fd, (unsigned long long)sub->droppedGops);
+        close(sub->fd);
+        free(sub);
+    }
+}
+
+/*
+    Writes queued NAL units until the socket would block. Only the sender thread removes the
+    head of a queue, so it can be written without holding the lock.
+*/
+static int sub_flush(struct FanoutSubscriber *sub) {
+    while (1) {
+        SDL_LockMutex(server.mutex);
+        if (sub->count == 0) {
+            SDL_UnlockMutex(server.mutex);
+            return 0;
+        }
+        struct FanoutNal *head = sub->queue[sub->nextRead];
+        size_t offset = sub->sendOffset;
+        SDL_UnlockMutex(server.mutex);
+
+        ssize_t sent = send(sub->fd, head->data + offset, head->size - offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        }
+
+        SDL_LockMutex(server.mutex);
+        sub->sendOffset += sent;
+        if (sub->sendOffset == head->size) {
+            sub->sendOffset = 0;
+            sub->queuedBytes -= head->size;
+            sub->nextRead = (sub->nextRead + 1) % FANOUT_QUEUE_LENGTH;
+            sub->count--;
+        } else {
+            head = NULL;
+        }
+        SDL_UnlockMutex(server.mutex);
+        nal_unref(head);
+    }
+}
+
+/*
+    Makes poll() in the fanout thread return. A full pipe already holds a wakeup the thread has
+    not read yet, so EAGAIN is no error.
+*/
+static void wake_thread(char reason) {
+    ssize_t ret;
+
+    do {
+        ret = write(server.wakeFd[1], &reason, 1);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_error("fanout: could not wake the fanout thread: %s", strerror(errno));
+    }
+}
+
+static int fanout_thread(void *data) {
+    struct pollfd fds[FANOUT_MAX_SUBSCRIBERS + 2];
+    int idx[FANOUT_MAX_SUBSCRIBERS + 2];
+    char scratch[256];
+
+    while (server.running) {
+        int n = 0;
+        fds[n++] = (struct pollfd){ .fd = server.listenFd, .events = POLLIN };
+        fds[n++] = (struct pollfd){ .fd = server.wakeFd[0], .events = POLLIN };
+
+        SDL_LockMutex(server.mutex);
+        for (int i = 0; i < FANOUT_MAX_SUBSCRIBERS; i++) {
+            struct FanoutSubscriber *sub = server.subscribers[i];
+            if (sub != NULL) {
+                idx[n] = i;
+                fds[n++] = (struct pollfd){ .fd = sub->fd, .events = POLLIN | (sub->count > 0 ? POLLOUT : 0) };
+            }
+        }
+        SDL_UnlockMutex(server.mutex);
+
+        if (poll(fds, n, 500) < 0 && errno != EINTR) {
+            log_error("fanout: poll failed: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            while (read(server.wakeFd[0], scratch, sizeof(scratch)) > 0);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = sock_accept(server.listenFd)) >= 0) {
+                sub_add(fd);
+            }
+        }
+
+        for (int k = 2; k < n; k++) {
+            struct FanoutSubscriber *sub = server.subscribers[idx[k]];
+            int drop = (fds[k].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+
+            // Subscribers are not expected to send anything, EOF means they went away
+            if (!drop && (fds[k].revents & POLLIN)) {
+                ssize_t r = recv(sub->fd, scratch, sizeof(scratch), MSG_DONTWAIT);
+                drop = r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+            }
+            if (!drop && (fds[k].revents & POLLOUT)) {
+                drop = sub_flush(sub) < 0;
+            }
+            if (drop) {
+                sub_remove(idx[k]);
+            }
+        }
+    }
+    return 0;
+}
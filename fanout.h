@@ -0,0 +1,48 @@
+#ifndef AOAKVM_FANOUT
+#define AOAKVM_FANOUT
+
+#include "aoakvm.h"
+
+#define FANOUT_MAX_SUBSCRIBERS 16
+#define FANOUT_QUEUE_LENGTH 1024
+#define FANOUT_QUEUE_BYTES (4 * 1024 * 1024)
+#define FANOUT_GOP_CACHE_BYTES (8 * 1024 * 1024)
+
+/*
+    int fanout_start(const char *address);
+
+    Starts serving the raw elementary stream on address (see sock_listen). Every subscriber
+    receives Annex-B NAL units, beginning with the cached parameter sets and the current GOP
+    from its IDR frame on. Returns 0 on success, -1 if the socket could not be opened.
+*/
+int fanout_start(const char*);
+void fanout_stop();
+
+/*
+    void fanout_reset();
+
+    Drops parser state and cached parameter sets, called when a new stream starts.
+    Subscribers stay connected and continue with the next IDR frame.
+*/
+void fanout_reset();
+
+/*
+    int fanout_setCodec(enum AVCodecID codec);
+
+    Tells the parser how to read NAL headers, called when the stream codec was detected,
+    fanout_reset goes back to H.264. Returns -1 for codecs without Annex-B NAL units (AV1),
+    their stream is not served.
+*/
+int fanout_setCodec(enum AVCodecID);
+
+/*
+    void fanout_feed(const uint8_t *data, int size);
+
+    Called by read_packet with every chunk read from the bulk endpoint. Only splits the data
+    into NAL units and queues references, it never waits on a subscriber.
+*/
+void fanout_feed(const uint8_t*, int);
+
+int fanout_getStats(struct aoakvmFanoutStats_t*);
+
+#endif
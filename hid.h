@@ -67,6 +67,79 @@ static const uint8_t REPORT_DESC_TOUCHPAD[] =
 
 };
 
+/*
+    One contact of REPORT_DESC_TOUCHSCREEN, 6 bytes:
+    byte 1   -> bit 0 = tip switch (finger down)
+    byte 2   -> contact identifier (0...9)
+    byte 3,4 -> absolute X coordinate (0...10000)
+    byte 5,6 -> absolute Y coordinate (0...10000)
+*/
+#define REPORT_DESC_TOUCHSCREEN_FINGER \
+    0x05, 0x0d,       /* Usage Page (Digitizer) */ \
+    0x09, 0x22,       /* Usage (Finger) */ \
+    0xa1, 0x02,       /* Collection (Logical) */ \
+    0x09, 0x42,       /*   Usage (Tip Switch) */ \
+    0x15, 0x00,       /*   Logical Minimum (0) */ \
+    0x25, 0x01,       /*   Logical Maximum (1) */ \
+    0x75, 0x01,       /*   Report Size (1) */ \
+    0x95, 0x01,       /*   Report Count (1) */ \
+    0x81, 0x02,       /*   Input (Data,Var,Abs) */ \
+    0x95, 0x07,       /*   Report Count (7) */ \
+    0x81, 0x03,       /*   Input (Cnst,Var,Abs) */ \
+    0x09, 0x51,       /*   Usage (Contact Identifier) */ \
+    0x25, 0x09,       /*   Logical Maximum (9) */ \
+    0x75, 0x08,       /*   Report Size (8) */ \
+    0x95, 0x01,       /*   Report Count (1) */ \
+    0x81, 0x02,       /*   Input (Data,Var,Abs) */ \
+    0x05, 0x01,       /*   Usage Page (Generic Desktop) */ \
+    0x09, 0x30,       /*   Usage (X) */ \
+    0x09, 0x31,       /*   Usage (Y) */ \
+    0x16, 0x00, 0x00, /*   Logical Minimum (0) */ \
+    0x26, 0x10, 0x27, /*   Logical Maximum (10000) */ \
+    0x36, 0x00, 0x00, /*   Physical Minimum (0) */ \
+    0x46, 0x10, 0x27, /*   Physical Maximum (10000) */ \
+    0x75, 0x10,       /*   Report Size (16) */ \
+    0x95, 0x02,       /*   Report Count (2) */ \
+    0x81, 0x02,       /*   Input (Data,Var,Abs) */ \
+    0xc0              /* END_COLLECTION */
+
+/*
+    Multi-touch digitizer with ten finger collections followed by the contact count, so
+    all fingers of a gesture step go into a single report. Only the first <contact count>
+    contacts of a report are valid; a lifted finger is reported once with the tip switch
+    cleared.
+*/
+static const uint8_t REPORT_DESC_TOUCHSCREEN[] =
+    {
+        0x05, 0x0d, // USAGE_PAGE (Digitizer)
+        0x09, 0x04, // USAGE (Touch Screen)
+        0xa1, 0x01, // COLLECTION (Application)
+
+        REPORT_DESC_TOUCHSCREEN_FINGER,
+        REPORT_DESC_TOUCHSCREEN_FINGER,
+        REPORT_DESC_TOUCHSCREEN_FINGER,
+        REPORT_DESC_TOUCHSCREEN_FINGER,
+        REPORT_DESC_TOUCHSCREEN_FINGER,
+        REPORT_DESC_TOUCHSCREEN_FINGER,
+        REPORT_DESC_TOUCHSCREEN_FINGER,
+        REPORT_DESC_TOUCHSCREEN_FINGER,
+        REPORT_DESC_TOUCHSCREEN_FINGER,
+        REPORT_DESC_TOUCHSCREEN_FINGER,
+
+        0x05, 0x0d, //   USAGE_PAGE (Digitizer)
+        0x09, 0x54, //   USAGE (Contact Count)
+        0x15, 0x00, //   LOGICAL_MINIMUM (0)
+        0x25, 0x0a, //   LOGICAL_MAXIMUM (10)
+        0x75, 0x08, //   REPORT_SIZE (8)
+        0x95, 0x01, //   REPORT_COUNT (1)
+        0x81, 0x02, //   INPUT (Data,Var,Abs)
+        0xc0        // END_COLLECTION
+
+        // With this declaration a data packet must be sent as:
+        // bytes 1-60 -> ten contacts as described above
+        // byte 61    -> number of valid contacts
+};
+
 /* HID report descriptor (mouse). taken from VBOX */
 static const unsigned char REPORT_DESC_MOUSE[] = {
     // /* Usage Page */                0x05, 0x01,     /* Generic Desktop */
@@ -247,6 +320,32 @@ static const unsigned char REPORT_DESC_KB[] = {
     /* End Collection */ 0xC0,
 };
 
+/*
+    N-key rollover keyboard: the modifier byte of REPORT_DESC_KB followed by one bit per usage
+    from 0x00 to 0xDF instead of six key slots, so any number of held keys is reported.
+    HID_REPORT_KB_NKRO_SIZE bytes:
+    byte 1     -> modifiers, bit 0 = Left Ctrl ... bit 7 = Right GUI
+    bytes 2-29 -> bit (usage % 8) of byte (usage / 8) set while usage is held
+*/
+static const unsigned char REPORT_DESC_KB_NKRO[] = {
+    0x05, 0x01, // USAGE_PAGE (Generic Desktop)
+    0x09, 0x06, // USAGE (Keyboard)
+    0xa1, 0x01, // COLLECTION (Application)
+    0x05, 0x07, //   USAGE_PAGE (Keyboard)
+    0x19, 0xe0, //   USAGE_MINIMUM (Left Control)
+    0x29, 0xe7, //   USAGE_MAXIMUM (Right GUI)
+    0x15, 0x00, //   LOGICAL_MINIMUM (0)
+    0x25, 0x01, //   LOGICAL_MAXIMUM (1)
+    0x75, 0x01, //   REPORT_SIZE (1)
+    0x95, 0x08, //   REPORT_COUNT (8)
+    0x81, 0x02, //   INPUT (Data,Var,Abs)
+    0x19, 0x00, //   USAGE_MINIMUM (0)
+    0x29, 0xdf, //   USAGE_MAXIMUM (0xDF)
+    0x95, 0xe0, //   REPORT_COUNT (224)
+    0x81, 0x02, //   INPUT (Data,Var,Abs)
+    0xc0        // END_COLLECTION
+};
+
 #define REPORT_DESC_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
 int register_hid(libusb_device_handle *handle, uint16_t descriptor_size, int hid_index);
@@ -0,0 +1,247 @@
+#include <ctype.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "hud.h"
+#include "memstat.h"
+#include "video.h"
+
+/* 5x7 font from ' ' to 'Z', one byte per column with bit 0 as the top row */
+#define GLYPH_W 5
+#define GLYPH_H 7
+#define GLYPH_FIRST ' '
+#define GLYPH_LAST 'Z'
+#define GLYPH_COUNT (GLYPH_LAST - GLYPH_FIRST + 1)
+#define HUD_SCALE 2
+#define HUD_MARGIN 8
+#define HUD_LINES 7
+#define HUD_LINE_LENGTH 24
+/* Latency samples the p95 is taken from, the newest replace the oldest */
+#define HUD_SAMPLES 256
+#define ATLAS_BYTES ((int64_t)GLYPH_COUNT * GLYPH_W * GLYPH_H * 4)
+
+// Struct Definition
+struct HudSamples {
+    uint64_t us[HUD_SAMPLES];
+    int next;
+    int count;
+};
+
+// Static Functions
+static int build_atlas(SDL_Renderer *renderer);
+static void update_text(uint64_t now);
+static void draw_text(SDL_Renderer *renderer, const char *text, int x, int y);
+static void add_sample(struct HudSamples *s, uint64_t us);
+static uint64_t p95(const struct HudSamples *s);
+static int compare_u64(const void *a, const void *b);
+
+// Local Variables
+static const uint8_t font[GLYPH_COUNT][GLYPH_W] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5F, 0x00, 0x00}, {0x00, 0x07, 0x00, 0x07, 0x00},
+    {0x14, 0x7F, 0x14, 0x7F, 0x14}, {0x24, 0x2A, 0x7F, 0x2A, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62},
+    {0x36, 0x49, 0x55, 0x22, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00}, {0x00, 0x1C, 0x22, 0x41, 0x00},
+    {0x00, 0x41, 0x22, 0x1C, 0x00}, {0x08, 0x2A, 0x1C, 0x2A, 0x08}, {0x08, 0x08, 0x3E, 0x08, 0x08},
+    {0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08}, {0x00, 0x60, 0x60, 0x00, 0x00},
+    {0x20, 0x10, 0x08, 0x04, 0x02}, {0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00},
+    {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4B, 0x31}, {0x18, 0x14, 0x12, 0x7F, 0x10},
+    {0x27, 0x45, 0x45, 0x45, 0x39}, {0x3C, 0x4A, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+    {0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1E}, {0x00, 0x36, 0x36, 0x00, 0x00},
+    {0x00, 0x56, 0x36, 0x00, 0x00}, {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14},
+    {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06}, {0x32, 0x49, 0x79, 0x41, 0x3E},
+    {0x7E, 0x11, 0x11, 0x11, 0x7E}, {0x7F, 0x49, 0x49, 0x49, 0x36}, {0x3E, 0x41, 0x41, 0x41, 0x22},
+    {0x7F, 0x41, 0x41, 0x22, 0x1C}, {0x7F, 0x49, 0x49, 0x49, 0x41}, {0x7F, 0x09, 0x09, 0x01, 0x01},
+    {0x3E, 0x41, 0x41, 0x51, 0x32}, {0x7F, 0x08, 0x08, 0x08, 0x7F}, {0x00, 0x41, 0x7F, 0x41, 0x00},
+    {0x20, 0x40, 0x41, 0x3F, 0x01}, {0x7F, 0x08, 0x14, 0x22, 0x41}, {0x7F, 0x40, 0x40, 0x40, 0x40},
+    {0x7F, 0x02, 0x04, 0x02, 0x7F}, {0x7F, 0x04, 0x08, 0x10, 0x7F}, {0x3E, 0x41, 0x41, 0x41, 0x3E},
+    {0x7F, 0x09, 0x09, 0x09, 0x06}, {0x3E, 0x41, 0x51, 0x21, 0x5E}, {0x7F, 0x09, 0x19, 0x29, 0x46},
+    {0x46, 0x49, 0x49, 0x49, 0x31}, {0x01, 0x01, 0x7F, 0x01, 0x01}, {0x3F, 0x40, 0x40, 0x40, 0x3F},
+    {0x1F, 0x20, 0x40, 0x20, 0x1F}, {0x7F, 0x20, 0x18, 0x20, 0x7F}, {0x63, 0x14, 0x08, 0x14, 0x63},
+    {0x03, 0x04, 0x78, 0x04, 0x03}, {0x61, 0x51, 0x49, 0x45, 0x43},
+};
+
+static SDL_atomic_t enabled;
+static SDL_Renderer *atlasRenderer;
+static SDL_Texture *atlas;
+
+/* Written by the render thread and whichever thread sends HID reports */
+static SDL_SpinLock samplesLock;
+static struct HudSamples presentLatency;
+static struct HudSamples hidLatency;
+static uint64_t presents;
+
+/* Render thread only */
+static char lines[HUD_LINES][HUD_LINE_LENGTH];
+static uint64_t lastUpdate;
+static uint64_t lastBytes;
+static uint64_t lastFrames;
+static uint64_t lastPresents;
+
+
+void hud_setEnabled(int enable) {
+    SDL_AtomicSet(&enabled, enable);
+}
+
+int hud_isDue() {
+    return SDL_AtomicGet(&enabled) && clock_nowUs() - lastUpdate >= HUD_UPDATE_MS * 1000;
+}
+
+void hud_draw(SDL_Renderer *renderer) {
+    if (!SDL_AtomicGet(&enabled)) {
+        return;
+    }
+
+    if (atlasRenderer != renderer && build_atlas(renderer) < 0) {
+        log_error("hud: no font texture, overlay disabled: %s", SDL_GetError());
+        SDL_AtomicSet(&enabled, 0);
+        return;
+    }
+
+    uint64_t now = clock_nowUs();
+    if (now - lastUpdate >= HUD_UPDATE_MS * 1000) {
+        update_text(now);
+    }
+
+    int step = (GLYPH_H + 2) * HUD_SCALE;
+    SDL_Rect background = {
+        HUD_MARGIN, HUD_MARGIN,
+        (HUD_LINE_LENGTH - 1) * (GLYPH_W + 1) * HUD_SCALE + 2 * HUD_SCALE,
+        HUD_LINES * step + HUD_SCALE,
+    };
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+    SDL_RenderFillRect(renderer, &background);
+
+    for (int i = 0; i < HUD_LINES; i++) {
+        draw_text(renderer, lines[i], background.x + 2 * HUD_SCALE, background.y + 2 * HUD_SCALE + i * step);
+    }
+}
+
+void hud_onPresent(uint64_t decoded) {
+    uint64_t now = clock_nowUs();
+
+    SDL_AtomicLock(&samplesLock);
+    presents++;
+    if (decoded != 0 && now > decoded) {
+        add_sample(&presentLatency, now - decoded);
+    }
+    SDL_AtomicUnlock(&samplesLock);
+}
+
+void hud_onHidSend(uint64_t us) {
+    if (!SDL_AtomicGet(&enabled)) {
+        return;
+    }
+
+    SDL_AtomicLock(&samplesLock);
+    add_sample(&hidLatency, us);
+    SDL_AtomicUnlock(&samplesLock);
+}
+
+/* White glyphs on transparent pixels, side by side in one row */
+static int build_atlas(SDL_Renderer *renderer) {
+    SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, GLYPH_COUNT * GLYPH_W, GLYPH_H, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (surface == NULL) {
+        return -1;
+    }
+
+    for (int g = 0; g < GLYPH_COUNT; g++) {
+        for (int x = 0; x < GLYPH_W; x++) {
+            for (int y = 0; y < GLYPH_H; y++) {
+                Uint32 *pixel = (Uint32 *)((uint8_t *)surface->pixels + y * surface->pitch) + g * GLYPH_W + x;
+                *pixel = font[g][x] & (1 << y) ? 0xFFFFFFFF : 0;
+            }
+        }
+    }
+
+    if (atlas != NULL) {
+        SDL_DestroyTexture(atlas);
+        memstat_track(MEM_HUD, -1, -ATLAS_BYTES);
+    }
+    atlas = SDL_CreateTextureFromSurface(renderer, surface);
+    SDL_FreeSurface(surface);
+    if (atlas == NULL) {
+        atlasRenderer = NULL;
+        return -1;
+    }
+    memstat_track(MEM_HUD, 1, ATLAS_BYTES);
+    SDL_SetTextureBlendMode(atlas, SDL_BLENDMODE_BLEND);
+    atlasRenderer = renderer;
+    return 0;
+}
+
+static void update_text(uint64_t now) {
+    struct aoakvmCodecStats_t codec = {0};
+    struct aoakvmJitterStats_t queue = {0};
+    static struct HudSamples present, hid;
+    uint64_t presented;
+
+    video_getCodecStats(&codec);
+    video_getJitterStats(&queue);
+
+    // Sorted outside the lock, the HID thread must not wait for it
+    SDL_AtomicLock(&samplesLock);
+    presented = presents;
+    present = presentLatency;
+    hid = hidLatency;
+    SDL_AtomicUnlock(&samplesLock);
+    uint64_t presentP95 = p95(&present);
+    uint64_t hidP95 = p95(&hid);
+
+    // A new stream restarts the counters
+    if (codec.bytes < lastBytes || codec.frames < lastFrames) {
+        lastBytes = lastFrames = 0;
+    }
+
+    uint64_t elapsed = lastUpdate != 0 ? SDL_max(now - lastUpdate, 1) : 0;
+    if (elapsed > 0) {
+        snprintf(lines[0], HUD_LINE_LENGTH, "IN      %5.1f MBIT/S", (codec.bytes - lastBytes) * 8.0 / elapsed);
+        snprintf(lines[1], HUD_LINE_LENGTH, "DECODE  %5.1f FPS", (codec.frames - lastFrames) * 1e6 / elapsed);
+        snprintf(lines[2], HUD_LINE_LENGTH, "PRESENT %5.1f FPS", (presented - lastPresents) * 1e6 / elapsed);
+    }
+    snprintf(lines[3], HUD_LINE_LENGTH, "QUEUE   %5d", queue.queued);
+    snprintf(lines[4], HUD_LINE_LENGTH, "DROPPED %5llu", (unsigned long long)(queue.late + queue.overrun));
+    snprintf(lines[5], HUD_LINE_LENGTH, "D>P P95 %5.1f MS", presentP95 / 1000.0);
+    snprintf(lines[6], HUD_LINE_LENGTH, "HID P95 %5.1f MS", hidP95 / 1000.0);
+
+    lastUpdate = now;
+    lastBytes = codec.bytes;
+    lastFrames = codec.frames;
+    lastPresents = presented;
+}
+
+static void draw_text(SDL_Renderer *renderer, const char *text, int x, int y) {
+    for (; *text != '\0'; text++, x += (GLYPH_W + 1) * HUD_SCALE) {
+        int c = toupper((unsigned char)*text);
+        if (c == ' ') {
+            continue;
+        }
+        c = c >= GLYPH_FIRST && c <= GLYPH_LAST ? c : '?';
+
+        SDL_Rect src = { (c - GLYPH_FIRST) * GLYPH_W, 0, GLYPH_W, GLYPH_H };
+        SDL_Rect dst = { x, y, GLYPH_W * HUD_SCALE, GLYPH_H * HUD_SCALE };
+        SDL_RenderCopy(renderer, atlas, &src, &dst);
+    }
+}
+
+static void add_sample(struct HudSamples *s, uint64_t us) {
+    s->us[s->next] = us;
+    s->next = (s->next + 1) % HUD_SAMPLES;
+    s->count = SDL_min(s->count + 1, HUD_SAMPLES);
+}
+
+static uint64_t p95(const struct HudSamples *s) {
+    uint64_t sorted[HUD_SAMPLES];
+
+    if (s->count == 0) {
+        return 0;
+    }
+    memcpy(sorted, s->us, s->count * sizeof(uint64_t));
+    qsort(sorted, s->count, sizeof(uint64_t), compare_u64);
+    return sorted[(s->count - 1) * 95 / 100];
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y);
+}
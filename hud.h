@@ -0,0 +1,47 @@
+#ifndef AOAKVM_HUD
+#define AOAKVM_HUD
+
+#include "aoakvm.h"
+
+/* How often the figures of the overlay are recomputed */
+#define HUD_UPDATE_MS 250
+
+/*
+    void hud_setEnabled(int enabled);
+
+    Shows or hides the performance overlay in the corner of the video: ingest bitrate, decode
+    and present rate, queue depth, dropped frames, p95 of decode to present and of HID sends.
+    Safe to call from any thread, e.g. from a hotkey of the embedder.
+*/
+void hud_setEnabled(int);
+
+/*
+    int hud_isDue();
+
+    1 if the overlay is shown and its figures are older than HUD_UPDATE_MS, video_rendering and
+    wall_render then present even without a new frame.
+*/
+int hud_isDue();
+
+/*
+    void hud_draw(SDL_Renderer *renderer);
+
+    Draws the overlay after the video or the tiles of the wall were copied, before
+    SDL_RenderPresent. The text is only formatted every HUD_UPDATE_MS, glyphs come from a font
+    texture created on the first call and counted as MEM_HUD.
+*/
+void hud_draw(SDL_Renderer*);
+
+/*
+    void hud_onPresent(uint64_t decoded);
+    void hud_onHidSend(uint64_t us);
+
+    Samples of the overlay. hud_onPresent is called by the render thread after a present with
+    the clock_nowUs() the frame was decoded at, 0 if the same frame was presented again or
+    for a present of the wall.
+    hud_onHidSend takes the duration of one report's control transfer, from any thread.
+*/
+void hud_onPresent(uint64_t);
+void hud_onHidSend(uint64_t);
+
+#endif
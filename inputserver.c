@@ -0,0 +1,534 @@
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "inputserver.h"
+#include "sock.h"
+#include "usb.h"
+#include "affinity.h"
+
+#define INPUT_RECORD_SIZE 8
+#define CONTACT_TIP 0x01
+
+// Struct Definition
+
+struct InputClient {
+    int fd;
+    int len;
+    uint8_t buf[INPUT_RECORD_SIZE];
+};
+
+struct TouchContact {
+    uint8_t tip;
+    int released;
+    uint16_t x;
+    uint16_t y;
+};
+
+struct QueuedInput {
+    struct aoakvmInputEvent_t event;
+    uint64_t received;
+};
+
+/*
+    struct InputQueue
+
+    Events handed from the socket thread (or inputserver_inject) to the batcher.
+*/
+struct InputQueue {
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    int nextRead;
+    int count;
+    struct QueuedInput events[INPUTSERVER_QUEUE_LENGTH];
+};
+
+/*
+    struct HidState
+
+    Current state of mouse, keyboard and touchscreen, only touched by the batcher thread.
+    *Oldest holds the receive time of the oldest event folded into the pending report, 0 if
+    nothing is pending. *Toggled is set when the pending report changes a button or a tip
+    switch, touchToggled has one bit per contact. A released contact is sent once more with
+    its tip switch cleared.
+*/
+struct HidState {
+    uint8_t mouseButtons;
+    int mouseToggled;
+    int mouseDx;
+    int mouseDy;
+    int mouseWheel;
+    uint64_t mouseOldest;
+
+    uint8_t kbModifiers;
+    uint8_t kbKeys[6];
+    uint8_t kbToggled[32];
+    uint64_t kbOldest;
+
+    struct TouchContact contacts[HID_TOUCHSCREEN_CONTACTS];
+    uint16_t touchToggled;
+    uint16_t touchMoved;
+    uint64_t touchOldest;
+};
+
+// Static Functions
+static int server_thread(void *data);
+static int batch_thread(void *data);
+
+static int queue_push(const struct aoakvmInputEvent_t *event, uint64_t received);
+static void client_read(struct InputClient *client);
+
+static void apply_event(struct QueuedInput *in);
+static void apply_key(uint8_t usage, int pressed, uint64_t received);
+static void apply_touch(struct aoakvmInputEvent_t *ev, uint64_t received);
+static void flush_mouse();
+static void flush_keyboard();
+static void flush_touch();
+static void send_report(int hidId, uint8_t *report, uint16_t length, uint64_t oldest);
+
+// Local Variables
+static struct InputQueue inputQueue;
+static struct HidState hidState;
+static struct QueuedInput batch[INPUTSERVER_QUEUE_LENGTH];
+static struct InputClient clients[INPUTSERVER_MAX_CLIENTS];
+
+static SDL_Thread *serverThread;
+static SDL_Thread *batchThread;
+static int running;
+static int listenFd = -1;
+
+static SDL_mutex *statsMutex;
+static struct aoakvmInputStats_t inputStats;
+static uint64_t queueTotal;
+static uint64_t sendTotal;
+
+
+int inputserver_start(const char *address) {
+    if (running) {
+        return 0;
+    }
+
+    if (address != NULL) {
+        listenFd = sock_listen(address);
+        if (listenFd < 0) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < INPUTSERVER_MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+    inputQueue.mutex = SDL_CreateMutex();
+    inputQueue.cond = SDL_CreateCond();
+    statsMutex = SDL_CreateMutex();
+    running = 1;
+
+    batchThread = SDL_CreateThread(batch_thread, "inputBatcher", NULL);
+    if (listenFd >= 0) {
+        serverThread = SDL_CreateThread(server_thread, "inputServer", NULL);
+    }
+    if (batchThread == NULL || (listenFd >= 0 && serverThread == NULL)) {
+        log_error("Failed to create input server threads: %s", SDL_GetError());
+        inputserver_stop();
+        return -1;
+    }
+    return 0;
+}
+
+void inputserver_stop() {
+    running = 0;
+
+    SDL_LockMutex(inputQueue.mutex);
+    SDL_CondSignal(inputQueue.cond);
+    SDL_UnlockMutex(inputQueue.mutex);
+
+    SDL_WaitThread(batchThread, NULL);
+    SDL_WaitThread(serverThread, NULL);
+    batchThread = serverThread = NULL;
+
+    for (int i = 0; i < INPUTSERVER_MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) {
+            close(clients[i].fd);
+            clients[i].fd = -1;
+        }
+    }
+    if (listenFd >= 0) {
+        close(listenFd);
+        listenFd = -1;
+    }
+}
+
+int inputserver_inject(const struct aoakvmInputEvent_t *event) {
+    if (!running) {
+        return -1;
+    }
+    return queue_push(event, clock_nowUs());
+}
+
+int inputserver_getStats(struct aoakvmInputStats_t *stats) {
+    if (statsMutex == NULL) {
+        return -1;
+    }
+
+    SDL_LockMutex(statsMutex);
+    *stats = inputStats;
+    SDL_UnlockMutex(statsMutex);
+    return 0;
+}
+
+static int queue_push(const struct aoakvmInputEvent_t *event, uint64_t received) {
+    SDL_LockMutex(inputQueue.mutex);
+    if (inputQueue.count == INPUTSERVER_QUEUE_LENGTH) {
+        SDL_UnlockMutex(inputQueue.mutex);
+        SDL_LockMutex(statsMutex);
+        inputStats.droppedEvents++;
+        SDL_UnlockMutex(statsMutex);
+        return -1;
+    }
+
+    struct QueuedInput *in = &inputQueue.events[(inputQueue.nextRead + inputQueue.count) % INPUTSERVER_QUEUE_LENGTH];
+    in->event = *event;
+    in->received = received;
+    inputQueue.count++;
+    SDL_CondSignal(inputQueue.cond);
+    SDL_UnlockMutex(inputQueue.mutex);
+
+    SDL_LockMutex(statsMutex);
+    inputStats.events++;
+    SDL_UnlockMutex(statsMutex);
+    return 0;
+}
+
+static void client_read(struct InputClient *client) {
+    uint8_t buf[INPUT_RECORD_SIZE * 64];
+    uint64_t now = clock_nowUs();
+
+    ssize_t r = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        log_info("input: client %d disconnected", client->fd);
+        close(client->fd);
+        client->fd = -1;
+        return;
+    }
+
+    for (ssize_t i = 0; i < r; i++) {
+        client->buf[client->len++] = buf[i];
+        if (client->len < INPUT_RECORD_SIZE) {
+            continue;
+        }
+        client->len = 0;
+
+        struct aoakvmInputEvent_t event;
+        uint16_t word;
+        event.type = client->buf[0];
+        event.code = client->buf[1];
+        memcpy(&word, &client->buf[2], 2);
+        event.x = (int16_t)le16toh(word);
+        memcpy(&word, &client->buf[4], 2);
+        event.y = (int16_t)le16toh(word);
+        memcpy(&word, &client->buf[6], 2);
+        event.pressed = le16toh(word);
+
+        if (event.type < INPUT_MOUSE_MOVE || event.type > INPUT_KEY) {
+            SDL_LockMutex(statsMutex);
+            inputStats.droppedEvents++;
+            SDL_UnlockMutex(statsMutex);
+            continue;
+        }
+        queue_push(&event, now);
+    }
+}
+
+static int server_thread(void *data) {
+    struct pollfd fds[INPUTSERVER_MAX_CLIENTS + 1];
+    int idx[INPUTSERVER_MAX_CLIENTS + 1];
+
+    while (running) {
+        int n = 0;
+        fds[n++] = (struct pollfd){ .fd = listenFd, .events = POLLIN };
+        for (int i = 0; i < INPUTSERVER_MAX_CLIENTS; i++) {
+            if (clients[i].fd >= 0) {
+                idx[n] = i;
+                fds[n++] = (struct pollfd){ .fd = clients[i].fd, .events = POLLIN };
+            }
+        }
+
+        if (poll(fds, n, 200) <= 0) {
+            continue;
+        }
+
+        for (int k = 1; k < n; k++) {
+            if (fds[k].revents & (POLLIN | POLLERR | POLLHUP)) {
+                client_read(&clients[idx[k]]);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = sock_accept(listenFd)) >= 0) {
+                int slot = -1;
+                for (int i = 0; i < INPUTSERVER_MAX_CLIENTS && slot < 0; i++) {
+                    if (clients[i].fd < 0) {
+                        slot = i;
+                    }
+                }
+                if (slot < 0) {
+                    log_warn("input: rejecting client, %d already connected", INPUTSERVER_MAX_CLIENTS);
+                    close(fd);
+                    continue;
+                }
+                clients[slot].fd = fd;
+                clients[slot].len = 0;
+                log_info("input: client %d connected", fd);
+            }
+        }
+    }
+    return 0;
+}
+
+static int batch_thread(void *data) {
+    affinity_apply(THREAD_HID);
+
+    while (running) {
+        SDL_LockMutex(inputQueue.mutex);
+        while (running && inputQueue.count == 0) {
+            SDL_CondWaitTimeout(inputQueue.cond, inputQueue.mutex, 200);
+        }
+        SDL_UnlockMutex(inputQueue.mutex);
+        if (!running) {
+            break;
+        }
+
+        // Collect everything that arrives until the end of the current interval
+        uint64_t now = clock_nowUs();
+        clock_sleepUntilUs((now / INPUTSERVER_INTERVAL_US + 1) * INPUTSERVER_INTERVAL_US);
+
+        SDL_LockMutex(inputQueue.mutex);
+        int n = inputQueue.count;
+        for (int i = 0; i < n; i++) {
+            batch[i] = inputQueue.events[(inputQueue.nextRead + i) % INPUTSERVER_QUEUE_LENGTH];
+        }
+        inputQueue.nextRead = (inputQueue.nextRead + n) % INPUTSERVER_QUEUE_LENGTH;
+        inputQueue.count = 0;
+        SDL_UnlockMutex(inputQueue.mutex);
+
+        for (int i = 0; i < n; i++) {
+            apply_event(&batch[i]);
+        }
+        flush_mouse();
+        flush_keyboard();
+        flush_touch();
+    }
+    return 0;
+}
+
+/*
+    Folds an event into the pending reports. Changes that would be lost by merging (a key
+    toggled twice, movement after a button or tip change) send the pending report first.
+*/
+static void apply_event(struct QueuedInput *in) {
+    struct aoakvmInputEvent_t *ev = &in->event;
+    uint8_t bit;
+
+    switch (ev->type) {
+    case INPUT_MOUSE_MOVE:
+    case INPUT_MOUSE_WHEEL:
+        if (hidState.mouseToggled) {
+            flush_mouse();
+        }
+        if (ev->type == INPUT_MOUSE_MOVE) {
+            hidState.mouseDx += ev->x;
+            hidState.mouseDy += ev->y;
+        } else {
+            hidState.mouseWheel += ev->x;
+        }
+        if (!hidState.mouseOldest) {
+            hidState.mouseOldest = in->received;
+        }
+        break;
+
+    case INPUT_MOUSE_BUTTON:
+        if (ev->code < 1 || ev->code > 5) {
+            break;
+        }
+        bit = 1 << (ev->code - 1);
+        if (!!(hidState.mouseButtons & bit) == !!ev->pressed) {
+            break;
+        }
+        if (hidState.mouseOldest) {
+            flush_mouse();
+        }
+        hidState.mouseButtons ^= bit;
+        hidState.mouseToggled = 1;
+        hidState.mouseOldest = in->received;
+        break;
+
+    case INPUT_TOUCH:
+        apply_touch(ev, in->received);
+        break;
+
+    case INPUT_KEY:
+        apply_key(ev->code, ev->pressed, in->received);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void apply_key(uint8_t usage, int pressed, uint64_t received) {
+    if (hidState.kbToggled[usage / 8] & (1 << (usage % 8))) {
+        flush_keyboard();
+    }
+
+    if (usage >= 0xE0 && usage <= 0xE7) {
+        uint8_t bit = 1 << (usage - 0xE0);
+        hidState.kbModifiers = pressed ? hidState.kbModifiers | bit : hidState.kbModifiers & ~bit;
+    } else {
+        int slot = -1;
+        for (int i = 0; i < 6; i++) {
+            if (hidState.kbKeys[i] == usage) {
+                slot = i;
+            }
+        }
+        if (pressed && slot < 0) {
+            for (int i = 0; i < 6 && slot < 0; i++) {
+                if (hidState.kbKeys[i] == 0) {
+                    slot = i;
+                    hidState.kbKeys[i] = usage;
+                }
+            }
+        } else if (!pressed && slot >= 0) {
+            hidState.kbKeys[slot] = 0;
+        }
+    }
+
+    hidState.kbToggled[usage / 8] |= 1 << (usage % 8);
+    if (!hidState.kbOldest) {
+        hidState.kbOldest = received;
+    }
+}
+
+/*
+    All contacts share one report. A contact that toggles its tip switch while it already moved
+    or toggled in the pending report sends that report first, other contacts keep coalescing.
+*/
+static void apply_touch(struct aoakvmInputEvent_t *ev, uint64_t received) {
+    if (ev->code >= HID_TOUCHSCREEN_CONTACTS) {
+        return;
+    }
+
+    struct TouchContact *c = &hidState.contacts[ev->code];
+    uint16_t bit = 1 << ev->code;
+    int toggles = !!c->tip != !!ev->pressed;
+
+    if ((hidState.touchToggled & bit) || (toggles && (hidState.touchMoved & bit))) {
+        flush_touch();
+    }
+
+    if (toggles) {
+        hidState.touchToggled |= bit;
+        c->released = !ev->pressed;
+    }
+    hidState.touchMoved |= bit;
+    c->tip = ev->pressed ? CONTACT_TIP : 0;
+    c->x = ev->x < 0 ? 0 : (ev->x > 10000 ? 10000 : ev->x);
+    c->y = ev->y < 0 ? 0 : (ev->y > 10000 ? 10000 : ev->y);
+    if (!hidState.touchOldest) {
+        hidState.touchOldest = received;
+    }
+}
+
+static void flush_mouse() {
+    if (!hidState.mouseOldest) {
+        return;
+    }
+
+    // Relative axes are limited to +-127 per report, send the remainder in further reports
+    do {
+        uint8_t report[HID_REPORT_MOUSE_SIZE];
+        int dx = SDL_max(-127, SDL_min(127, hidState.mouseDx));
+        int dy = SDL_max(-127, SDL_min(127, hidState.mouseDy));
+        int wheel = SDL_max(-127, SDL_min(127, hidState.mouseWheel));
+
+        report[0] = hidState.mouseButtons;
+        report[1] = (uint8_t)(int8_t)dx;
+        report[2] = (uint8_t)(int8_t)dy;
+        report[3] = (uint8_t)(int8_t)wheel;
+        hidState.mouseDx -= dx;
+        hidState.mouseDy -= dy;
+        hidState.mouseWheel -= wheel;
+        send_report(HID_ID_MOUSE, report, sizeof(report), hidState.mouseOldest);
+    } while (hidState.mouseDx || hidState.mouseDy || hidState.mouseWheel);
+
+    hidState.mouseToggled = 0;
+    hidState.mouseOldest = 0;
+}
+
+static void flush_keyboard() {
+    if (!hidState.kbOldest) {
+        return;
+    }
+
+    uint8_t report[HID_REPORT_KB_SIZE] = { hidState.kbModifiers, 0 };
+    memcpy(&report[2], hidState.kbKeys, 6);
+    send_report(HID_ID_KEYBOARD, report, sizeof(report), hidState.kbOldest);
+
+    memset(hidState.kbToggled, 0, sizeof(hidState.kbToggled));
+    hidState.kbOldest = 0;
+}
+
+static void flush_touch() {
+    if (!hidState.touchOldest) {
+        return;
+    }
+
+    // Contacts that are down or were just lifted, packed at the start of the report
+    uint8_t report[HID_REPORT_TOUCHSCREEN_SIZE] = { 0 };
+    int count = 0;
+    for (int i = 0; i < HID_TOUCHSCREEN_CONTACTS; i++) {
+        struct TouchContact *c = &hidState.contacts[i];
+        if (!c->tip && !c->released) {
+            continue;
+        }
+
+        uint8_t *contact = &report[count++ * HID_TOUCHSCREEN_CONTACT_SIZE];
+        contact[0] = c->tip;
+        contact[1] = i;
+        contact[2] = c->x & 0xff;
+        contact[3] = c->x >> 8;
+        contact[4] = c->y & 0xff;
+        contact[5] = c->y >> 8;
+        c->released = 0;
+    }
+    report[HID_REPORT_TOUCHSCREEN_SIZE - 1] = count;
+
+    send_report(HID_ID_TOUCHSCREEN, report, sizeof(report), hidState.touchOldest);
+    hidState.touchToggled = 0;
+    hidState.touchMoved = 0;
+    hidState.touchOldest = 0;
+}
+
+static void send_report(int hidId, uint8_t *report, uint16_t length, uint64_t oldest) {
+    uint64_t start = clock_nowUs();
+    int ret = usb_sendHidEvent(hidId, report, length);
+    uint64_t end = clock_nowUs();
+
+    SDL_LockMutex(statsMutex);
+    if (ret < 0) {
+        inputStats.failedReports++;
+    } else {
+        inputStats.reports++;
+        queueTotal += start - oldest;
+        sendTotal += end - start;
+        inputStats.queueAvg = queueTotal / inputStats.reports;
+        inputStats.sendAvg = sendTotal / inputStats.reports;
+        inputStats.queueMax = SDL_max(inputStats.queueMax, start - oldest);
+        inputStats.sendMax = SDL_max(inputStats.sendMax, end - start);
+    }
+    SDL_UnlockMutex(statsMutex);
+}
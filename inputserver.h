@@ -0,0 +1,31 @@
+#ifndef AOAKVM_INPUTSERVER
+#define AOAKVM_INPUTSERVER
+
+#include "aoakvm.h"
+
+#define INPUTSERVER_MAX_CLIENTS 8
+#define INPUTSERVER_QUEUE_LENGTH 4096
+/* One full speed USB frame, events received within one interval share a report */
+#define INPUTSERVER_INTERVAL_US 1000
+
+/*
+    int inputserver_start(const char *address);
+
+    Accepts aoakvmInputEvent_t records from up to INPUTSERVER_MAX_CLIENTS clients on address
+    (see sock_listen). Events are folded into mouse, keyboard and touchscreen state and sent
+    as one AOA_SEND_HID_EVENT report per HID and INPUTSERVER_INTERVAL_US; all touch contacts
+    share one report. Returns -1 if the socket could not be opened.
+*/
+int inputserver_start(const char*);
+void inputserver_stop();
+
+/*
+    int inputserver_inject(const struct aoakvmInputEvent_t *event);
+
+    Queues an event as if it was received from a client. Returns -1 if the queue is full.
+*/
+int inputserver_inject(const struct aoakvmInputEvent_t*);
+
+int inputserver_getStats(struct aoakvmInputStats_t*);
+
+#endif
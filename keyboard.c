@@ -0,0 +1,165 @@
+#include "aoakvm.h"
+#include "keyboard.h"
+#include "usb.h"
+
+// Struct Definition
+
+/*
+    struct KeyboardState
+
+    Fields:
+        uint8_t held[32];       bitmap of every held usage, modifiers included
+        uint8_t order[256];     held non-modifier usages in the order they went down
+        int count;
+        uint8_t modifiers;
+        uint8_t report[HID_REPORT_KB_SIZE];  last boot report built
+        uint8_t nkro[HID_REPORT_KB_NKRO_SIZE];  last NKRO report built
+*/
+struct KeyboardState {
+    uint8_t held[32];
+    uint8_t order[256];
+    int count;
+    uint8_t modifiers;
+    uint8_t report[HID_REPORT_KB_SIZE];
+    uint8_t nkro[HID_REPORT_KB_NKRO_SIZE];
+};
+
+// Static Functions
+static int translate(struct KeyboardState *state, SDL_Scancode scancode, int pressed, int nkro);
+static int send_report(int nkro);
+
+// Local Variables
+
+/* SDL numbers its scancodes after the HID keyboard page, keys without a usage stay 0 */
+static const uint8_t SCANCODE_TO_USAGE[SDL_NUM_SCANCODES] = {
+    /* 0x04-0x65 letters, digits, Enter to Slash, Caps Lock, F1-F12, navigation, keypad */
+    [0x04] = 0x04, [0x05] = 0x05, [0x06] = 0x06, [0x07] = 0x07, [0x08] = 0x08, [0x09] = 0x09,
+    [0x0A] = 0x0A, [0x0B] = 0x0B, [0x0C] = 0x0C, [0x0D] = 0x0D, [0x0E] = 0x0E, [0x0F] = 0x0F,
+    [0x10] = 0x10, [0x11] = 0x11, [0x12] = 0x12, [0x13] = 0x13, [0x14] = 0x14, [0x15] = 0x15,
+    [0x16] = 0x16, [0x17] = 0x17, [0x18] = 0x18, [0x19] = 0x19, [0x1A] = 0x1A, [0x1B] = 0x1B,
+    [0x1C] = 0x1C, [0x1D] = 0x1D, [0x1E] = 0x1E, [0x1F] = 0x1F, [0x20] = 0x20, [0x21] = 0x21,
+    [0x22] = 0x22, [0x23] = 0x23, [0x24] = 0x24, [0x25] = 0x25, [0x26] = 0x26, [0x27] = 0x27,
+    [0x28] = 0x28, [0x29] = 0x29, [0x2A] = 0x2A, [0x2B] = 0x2B, [0x2C] = 0x2C, [0x2D] = 0x2D,
+    [0x2E] = 0x2E, [0x2F] = 0x2F, [0x30] = 0x30, [0x31] = 0x31, [0x32] = 0x32, [0x33] = 0x33,
+    [0x34] = 0x34, [0x35] = 0x35, [0x36] = 0x36, [0x37] = 0x37, [0x38] = 0x38, [0x39] = 0x39,
+    [0x3A] = 0x3A, [0x3B] = 0x3B, [0x3C] = 0x3C, [0x3D] = 0x3D, [0x3E] = 0x3E, [0x3F] = 0x3F,
+    [0x40] = 0x40, [0x41] = 0x41, [0x42] = 0x42, [0x43] = 0x43, [0x44] = 0x44, [0x45] = 0x45,
+    [0x46] = 0x46, [0x47] = 0x47, [0x48] = 0x48, [0x49] = 0x49, [0x4A] = 0x4A, [0x4B] = 0x4B,
+    [0x4C] = 0x4C, [0x4D] = 0x4D, [0x4E] = 0x4E, [0x4F] = 0x4F, [0x50] = 0x50, [0x51] = 0x51,
+    [0x52] = 0x52, [0x53] = 0x53, [0x54] = 0x54, [0x55] = 0x55, [0x56] = 0x56, [0x57] = 0x57,
+    [0x58] = 0x58, [0x59] = 0x59, [0x5A] = 0x5A, [0x5B] = 0x5B, [0x5C] = 0x5C, [0x5D] = 0x5D,
+    [0x5E] = 0x5E, [0x5F] = 0x5F, [0x60] = 0x60, [0x61] = 0x61, [0x62] = 0x62, [0x63] = 0x63,
+    [0x64] = 0x64, [0x65] = 0x65,
+    /* 0x66-0x67 Power, keypad = */
+    [0x66] = 0x66, [0x67] = 0x67,
+    /* 0x68-0x73 F13-F24 */
+    [0x68] = 0x68, [0x69] = 0x69, [0x6A] = 0x6A, [0x6B] = 0x6B, [0x6C] = 0x6C, [0x6D] = 0x6D,
+    [0x6E] = 0x6E, [0x6F] = 0x6F, [0x70] = 0x70, [0x71] = 0x71, [0x72] = 0x72, [0x73] = 0x73,
+    /* 0x74-0x81 Execute to Volume Down */
+    [0x74] = 0x74, [0x75] = 0x75, [0x76] = 0x76, [0x77] = 0x77, [0x78] = 0x78, [0x79] = 0x79,
+    [0x7A] = 0x7A, [0x7B] = 0x7B, [0x7C] = 0x7C, [0x7D] = 0x7D, [0x7E] = 0x7E, [0x7F] = 0x7F,
+    [0x80] = 0x80, [0x81] = 0x81,
+    /* 0x85-0x98 keypad comma, international and language keys */
+    [0x85] = 0x85, [0x86] = 0x86, [0x87] = 0x87, [0x88] = 0x88, [0x89] = 0x89, [0x8A] = 0x8A,
+    [0x8B] = 0x8B, [0x8C] = 0x8C, [0x8D] = 0x8D, [0x8E] = 0x8E, [0x8F] = 0x8F, [0x90] = 0x90,
+    [0x91] = 0x91, [0x92] = 0x92, [0x93] = 0x93, [0x94] = 0x94, [0x95] = 0x95, [0x96] = 0x96,
+    [0x97] = 0x97, [0x98] = 0x98,
+    /* 0x99-0xA4 Alt Erase to ExSel */
+    [0x99] = 0x99, [0x9A] = 0x9A, [0x9B] = 0x9B, [0x9C] = 0x9C, [0x9D] = 0x9D, [0x9E] = 0x9E,
+    [0x9F] = 0x9F, [0xA0] = 0xA0, [0xA1] = 0xA1, [0xA2] = 0xA2, [0xA3] = 0xA3, [0xA4] = 0xA4,
+    /* 0xB0-0xDD extended keypad */
+    [0xB0] = 0xB0, [0xB1] = 0xB1, [0xB2] = 0xB2, [0xB3] = 0xB3, [0xB4] = 0xB4, [0xB5] = 0xB5,
+    [0xB6] = 0xB6, [0xB7] = 0xB7, [0xB8] = 0xB8, [0xB9] = 0xB9, [0xBA] = 0xBA, [0xBB] = 0xBB,
+    [0xBC] = 0xBC, [0xBD] = 0xBD, [0xBE] = 0xBE, [0xBF] = 0xBF, [0xC0] = 0xC0, [0xC1] = 0xC1,
+    [0xC2] = 0xC2, [0xC3] = 0xC3, [0xC4] = 0xC4, [0xC5] = 0xC5, [0xC6] = 0xC6, [0xC7] = 0xC7,
+    [0xC8] = 0xC8, [0xC9] = 0xC9, [0xCA] = 0xCA, [0xCB] = 0xCB, [0xCC] = 0xCC, [0xCD] = 0xCD,
+    [0xCE] = 0xCE, [0xCF] = 0xCF, [0xD0] = 0xD0, [0xD1] = 0xD1, [0xD2] = 0xD2, [0xD3] = 0xD3,
+    [0xD4] = 0xD4, [0xD5] = 0xD5, [0xD6] = 0xD6, [0xD7] = 0xD7, [0xD8] = 0xD8, [0xD9] = 0xD9,
+    [0xDA] = 0xDA, [0xDB] = 0xDB, [0xDC] = 0xDC, [0xDD] = 0xDD,
+    /* 0xE0-0xE7 modifiers */
+    [0xE0] = 0xE0, [0xE1] = 0xE1, [0xE2] = 0xE2, [0xE3] = 0xE3, [0xE4] = 0xE4, [0xE5] = 0xE5,
+    [0xE6] = 0xE6, [0xE7] = 0xE7,
+};
+
+static struct KeyboardState keyboard;
+
+
+uint8_t keyboard_usage(SDL_Scancode scancode) {
+    return (unsigned)scancode < SDL_NUM_SCANCODES ? SCANCODE_TO_USAGE[scancode] : 0;
+}
+
+int keyboard_handleEvent(const SDL_Event *event) {
+    if ((event->type != SDL_KEYDOWN && event->type != SDL_KEYUP) || event->key.repeat) {
+        return 0;
+    }
+
+    int nkro = usb_hasNkroKeyboard();
+    if (!translate(&keyboard, event->key.keysym.scancode, event->type == SDL_KEYDOWN, nkro)) {
+        return 0;
+    }
+    return send_report(nkro);
+}
+
+int keyboard_releaseAll() {
+    if (keyboard.count == 0 && keyboard.modifiers == 0) {
+        return 0;
+    }
+
+    memset(&keyboard, 0, sizeof(keyboard));
+    return send_report(usb_hasNkroKeyboard());
+}
+
+/*
+    Updates the held keys and rebuilds the NKRO report if nkro is set, else the boot report.
+    Returns 1 if the report changed, a repeated down or an up of a key that is not held
+    changes nothing.
+*/
+static int translate(struct KeyboardState *state, SDL_Scancode scancode, int pressed, int nkro) {
+    uint8_t usage = keyboard_usage(scancode);
+    uint8_t bit = 1 << (usage % 8);
+
+    if (usage == 0 || !!(state->held[usage / 8] & bit) == !!pressed) {
+        return 0;
+    }
+    state->held[usage / 8] ^= bit;
+
+    if (usage >= 0xE0) {
+        state->modifiers ^= 1 << (usage - 0xE0);
+    } else if (pressed) {
+        state->order[state->count++] = usage;
+    } else {
+        for (int i = 0; i < state->count; i++) {
+            if (state->order[i] == usage) {
+                state->count--;
+                memmove(&state->order[i], &state->order[i + 1], state->count - i);
+                break;
+            }
+        }
+    }
+
+    // The held bitmap is the NKRO report, every change of it is a new report
+    if (nkro) {
+        state->nkro[0] = state->modifiers;
+        memcpy(&state->nkro[1], state->held, HID_REPORT_KB_NKRO_SIZE - 1);
+        return 1;
+    }
+
+    uint8_t report[HID_REPORT_KB_SIZE] = { state->modifiers, 0 };
+    if (state->count > KEYBOARD_REPORT_KEYS) {
+        memset(&report[2], KEYBOARD_ERROR_ROLLOVER, KEYBOARD_REPORT_KEYS);
+    } else {
+        memcpy(&report[2], state->order, state->count);
+    }
+
+    if (memcmp(report, state->report, sizeof(report)) == 0) {
+        return 0;
+    }
+    memcpy(state->report, report, sizeof(report));
+    return 1;
+}
+
+static int send_report(int nkro) {
+    int ret = nkro ? usb_sendHidEvent(HID_ID_KEYBOARD_NKRO, keyboard.nkro, sizeof(keyboard.nkro))
+                   : usb_sendHidEvent(HID_ID_KEYBOARD, keyboard.report, sizeof(keyboard.report));
+    return ret < 0 ? ret : 1;
+}
@@ -0,0 +1,41 @@
+#ifndef AOAKVM_KEYBOARD
+#define AOAKVM_KEYBOARD
+
+#include "aoakvm.h"
+
+/* Keys the REPORT_DESC_KB boot report holds besides the modifiers */
+#define KEYBOARD_REPORT_KEYS 6
+/* Reported in every key slot while more keys are held than fit, see the HID usage tables */
+#define KEYBOARD_ERROR_ROLLOVER 0x01
+
+/*
+    uint8_t keyboard_usage(SDL_Scancode scancode);
+
+    HID keyboard usage of scancode from a static table, 0 for keys the keyboard page does not
+    have (media keys are on the consumer page).
+*/
+uint8_t keyboard_usage(SDL_Scancode);
+
+/*
+    int keyboard_handleEvent(const SDL_Event *event);
+
+    Translates SDL_KEYDOWN and SDL_KEYUP into keyboard reports and sends them with
+    usb_sendHidEvent, one per change of the pressed keys; key repeats and other events send
+    nothing. If the phone took HID_ID_KEYBOARD_NKRO (usb_hasNkroKeyboard) every held key is
+    in the REPORT_DESC_KB_NKRO bitmap. Otherwise the REPORT_DESC_KB boot report is the
+    fallback: with more than KEYBOARD_REPORT_KEYS held keys the phone sees a rollover error
+    instead of wrong keys and gets the right set again once enough are released. Returns 1
+    if a report was sent, 0 if nothing changed, < 0 on a send error. Call from the thread
+    that handles the SDL events.
+*/
+int keyboard_handleEvent(const SDL_Event*);
+
+/*
+    int keyboard_releaseAll();
+
+    Forgets all held keys and sends an empty report if any were down, e.g. when the window
+    loses the focus and the key up events go elsewhere.
+*/
+int keyboard_releaseAll();
+
+#endif
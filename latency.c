@@ -0,0 +1,531 @@
+#include <stdlib.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "latency.h"
+#include "usb.h"
+#include "video.h"
+
+#define SIM_PENDING_LENGTH 64
+
+// Struct Definition
+
+enum probe_state_e {
+    PROBE_IDLE,
+    PROBE_WAITING,
+    PROBE_DETECTED,
+    PROBE_PRESENTED,
+};
+
+/*
+    struct LatencyProbe
+
+    Shared between the measurement thread and the hooks in the video pipeline. state is read
+    without the lock first so frames are not slowed down while no sample is pending.
+    Fields:
+        SDL_atomic_t state;         probe_state_e
+        uint8_t *reference;         luma of the watched region before the report was sent
+        SDL_Rect region;            watched region clamped to the reference frame
+        uint64_t sent;              clock_nowUs() right before the report was sent
+        uint64_t decoded;           clock_nowUs() when the changed frame was decoded
+        uint64_t presented;         clock_nowUs() after that frame was presented
+        uintptr_t detectedFrame;    sequence number of the changed frame
+*/
+struct LatencyProbe {
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    SDL_Thread *thread;
+    volatile int stopRequested;
+    struct aoakvmLatencyConfig_t cfg;
+    SDL_atomic_t state;
+    uint8_t *reference;
+    int refWidth;
+    int refHeight;
+    SDL_Rect region;
+    uint64_t sent;
+    uint64_t decoded;
+    uint64_t presented;
+    uintptr_t detectedFrame;
+    struct aoakvmLatencyStats_t stats;
+};
+
+struct SimReport {
+    uint64_t at;
+    int hid;
+    uint8_t report[HID_REPORT_KB_SIZE];
+};
+
+/*
+    struct SimDevice
+
+    Stand-in for a phone: receives HID reports, applies them simDelay µs later and renders
+    LATENCY_SIM_FPS frames per second showing a square at the touch or pointer position.
+    The frames enter the pipeline where decoded frames do, at fq_pushFrameIntoQueue.
+*/
+struct SimDevice {
+    SDL_mutex *mutex;
+    SDL_Thread *thread;
+    volatile int running;
+    struct SimReport pending[SIM_PENDING_LENGTH];
+    int nextRead;
+    int count;
+    int touching;
+    int x;
+    int y;
+};
+
+// Static Functions
+static int latency_thread(void *data);
+static int take_reference(struct LatencyProbe *p);
+static int region_changed(struct LatencyProbe *p, const AVFrame *frame);
+static int send_sample(struct LatencyProbe *p, int n);
+static void fill_histogram(struct aoakvmLatencyHistogram_t *h, uint64_t *samples, int count);
+static int compare_u64(const void *a, const void *b);
+
+static int sim_start();
+static void sim_stop();
+static int sim_sendHidEvent(int hidId, unsigned char *report, uint16_t length);
+static int sim_thread(void *data);
+static void sim_apply(struct SimReport *r);
+static void sim_render(AVFrame *frame);
+
+// Local Variables
+static struct LatencyProbe probe;
+static struct SimDevice sim;
+static uintptr_t frameSeq;
+
+
+int latency_start(const struct aoakvmLatencyConfig_t *cfg) {
+    if (cfg->samples <= 0 || cfg->region.w <= 0 || cfg->region.h <= 0 ||
+        (cfg->hid != HID_ID_TOUCHPAD && cfg->hid != HID_ID_MOUSE)) {
+        log_error("latency: invalid configuration");
+        return -1;
+    }
+
+    if (probe.mutex == NULL) {
+        probe.mutex = SDL_CreateMutex();
+        probe.cond = SDL_CreateCond();
+        if (probe.mutex == NULL || probe.cond == NULL) {
+            return -1;
+        }
+    }
+
+    SDL_LockMutex(probe.mutex);
+    if (probe.stats.running) {
+        SDL_UnlockMutex(probe.mutex);
+        return -1;
+    }
+    memset(&probe.stats, 0, sizeof(probe.stats));
+    probe.stats.running = 1;
+    probe.cfg = *cfg;
+    SDL_UnlockMutex(probe.mutex);
+
+    // Reap the previous measurement, it finished already
+    SDL_WaitThread(probe.thread, NULL);
+
+    if (cfg->simulate && sim_start() < 0) {
+        probe.stats.running = 0;
+        return -1;
+    }
+
+    probe.stopRequested = 0;
+    probe.thread = SDL_CreateThread(latency_thread, "latencyProbe", &probe);
+    if (probe.thread == NULL) {
+        log_error("Failed to create latency thread: %s", SDL_GetError());
+        sim_stop();
+        probe.stats.running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int latency_runSimulated(const struct aoakvmLatencyConfig_t *cfg, SDL_Renderer *renderer) {
+    struct aoakvmLatencyStats_t stats;
+    struct aoakvmAVCtx_t av = { NULL, NULL };
+    AVIOContext *reader = NULL;
+
+    if (!cfg->simulate || latency_start(cfg) < 0) {
+        return -1;
+    }
+
+    if (renderer != NULL && video_initRendererSize(&renderer, LATENCY_SIM_WIDTH, LATENCY_SIM_HEIGHT) < 0) {
+        log_error("latency: no texture for the simulated device, only decode is measured");
+        renderer = NULL;
+    }
+    while (renderer != NULL && latency_getStats(&stats) == 0 && stats.running) {
+        if (video_rendering(renderer) < 0) {
+            latency_stop();
+            break;
+        }
+    }
+    latency_wait();
+
+    // Leave an empty frame queue and no texture to the first session
+    video_closeStream(&reader, &av);
+    return 0;
+}
+
+void latency_stop() {
+    probe.stopRequested = 1;
+    if (probe.cond != NULL) {
+        SDL_LockMutex(probe.mutex);
+        SDL_CondBroadcast(probe.cond);
+        SDL_UnlockMutex(probe.mutex);
+    }
+}
+
+void latency_wait() {
+    SDL_WaitThread(probe.thread, NULL);
+    probe.thread = NULL;
+}
+
+int latency_getStats(struct aoakvmLatencyStats_t *stats) {
+    if (probe.mutex == NULL) {
+        return -1;
+    }
+
+    SDL_LockMutex(probe.mutex);
+    *stats = probe.stats;
+    SDL_UnlockMutex(probe.mutex);
+    return 0;
+}
+
+void latency_onFrame(AVFrame *frame) {
+    frame->opaque = (void *)++frameSeq;
+
+    if (SDL_AtomicGet(&probe.state) != PROBE_WAITING) {
+        return;
+    }
+
+    SDL_LockMutex(probe.mutex);
+    if (SDL_AtomicGet(&probe.state) == PROBE_WAITING && region_changed(&probe, frame)) {
+        probe.decoded = clock_nowUs();
+        probe.detectedFrame = frameSeq;
+        SDL_AtomicSet(&probe.state, PROBE_DETECTED);
+        SDL_CondBroadcast(probe.cond);
+    }
+    SDL_UnlockMutex(probe.mutex);
+}
+
+void latency_onPresent(const AVFrame *frame) {
+    if (SDL_AtomicGet(&probe.state) != PROBE_DETECTED) {
+        return;
+    }
+
+    SDL_LockMutex(probe.mutex);
+    if (SDL_AtomicGet(&probe.state) == PROBE_DETECTED && (uintptr_t)frame->opaque >= probe.detectedFrame) {
+        probe.presented = clock_nowUs();
+        SDL_AtomicSet(&probe.state, PROBE_PRESENTED);
+        SDL_CondBroadcast(probe.cond);
+    }
+    SDL_UnlockMutex(probe.mutex);
+}
+
+/*
+    Copies the watched region out of the last decoded frame. Waits up to the sample timeout
+    for the first frame.
+*/
+static int take_reference(struct LatencyProbe *p) {
+    AVFrame *frame = av_frame_alloc();
+    uint32_t deadline = SDL_GetTicks() + p->cfg.timeout;
+    int ret = -1;
+
+    if (frame == NULL) {
+        return -1;
+    }
+
+    while (video_refLatestFrame(frame) < 0) {
+        if (p->stopRequested || SDL_TICKS_PASSED(SDL_GetTicks(), deadline)) {
+            av_frame_free(&frame);
+            return -1;
+        }
+        SDL_Delay(10);
+    }
+
+    SDL_Rect bounds = { 0, 0, frame->width, frame->height };
+    SDL_Rect region;
+    if (SDL_IntersectRect(&p->cfg.region, &bounds, &region)) {
+        uint8_t *reference = realloc(p->reference, region.w * region.h);
+        if (reference != NULL) {
+            for (int y = 0; y < region.h; y++) {
+                memcpy(reference + y * region.w,
+                       frame->data[0] + (region.y + y) * frame->linesize[0] + region.x, region.w);
+            }
+            p->reference = reference;
+            p->region = region;
+            p->refWidth = frame->width;
+            p->refHeight = frame->height;
+            ret = 0;
+        }
+    } else {
+        log_error("latency: region lies outside of the %dx%d stream", frame->width, frame->height);
+    }
+
+    av_frame_free(&frame);
+    return ret;
+}
+
+static int region_changed(struct LatencyProbe *p, const AVFrame *frame) {
+    if (frame->width != p->refWidth || frame->height != p->refHeight) {
+        return 0;
+    }
+
+    uint64_t sum = 0;
+    for (int y = 0; y < p->region.h; y++) {
+        const uint8_t *a = frame->data[0] + (p->region.y + y) * frame->linesize[0] + p->region.x;
+        const uint8_t *b = p->reference + y * p->region.w;
+        for (int x = 0; x < p->region.w; x++) {
+            sum += abs(a[x] - b[x]);
+        }
+    }
+    return sum > (uint64_t)p->cfg.threshold * p->region.w * p->region.h;
+}
+
+/* Even samples press (touch down, move by +dx), odd samples release (touch up, move back) */
+static int send_sample(struct LatencyProbe *p, int n) {
+    int (*send)(int, unsigned char*, uint16_t) = p->cfg.simulate ? sim_sendHidEvent : usb_sendHidEvent;
+    int press = (n % 2) == 0;
+
+    if (p->cfg.hid == HID_ID_TOUCHPAD) {
+        unsigned char report[HID_REPORT_TOUCHPAD_SIZE] = {
+            press ? 0x03 : 0x00, p->cfg.x & 0xff, p->cfg.x >> 8, p->cfg.y & 0xff, p->cfg.y >> 8
+        };
+        return send(HID_ID_TOUCHPAD, report, sizeof(report));
+    }
+
+    unsigned char report[HID_REPORT_MOUSE_SIZE] = { 0, (uint8_t)(press ? p->cfg.dx : -p->cfg.dx), 0, 0 };
+    return send(HID_ID_MOUSE, report, sizeof(report));
+}
+
+static int latency_thread(void *data) {
+    struct LatencyProbe *p = data;
+    uint64_t *decodeSamples = malloc(sizeof(uint64_t) * p->cfg.samples);
+    uint64_t *presentSamples = malloc(sizeof(uint64_t) * p->cfg.samples);
+    int decodeCount = 0;
+    int presentCount = 0;
+    int i;
+
+    if (decodeSamples == NULL || presentSamples == NULL) {
+        p->stopRequested = 1;
+    }
+
+    for (i = 0; i < p->cfg.samples && !p->stopRequested; i++) {
+        if (i > 0) {
+            SDL_Delay(p->cfg.interval);
+        }
+
+        if (take_reference(p) < 0) {
+            SDL_LockMutex(p->mutex);
+            p->stats.samples++;
+            p->stats.lost++;
+            SDL_UnlockMutex(p->mutex);
+            continue;
+        }
+
+        SDL_LockMutex(p->mutex);
+        p->sent = clock_nowUs();
+        SDL_AtomicSet(&p->state, PROBE_WAITING);
+        SDL_UnlockMutex(p->mutex);
+
+        int ret = send_sample(p, i);
+
+        SDL_LockMutex(p->mutex);
+        p->stats.samples++;
+        if (ret >= 0) {
+            uint32_t deadline = SDL_GetTicks() + p->cfg.timeout;
+            while (SDL_AtomicGet(&p->state) == PROBE_WAITING && !p->stopRequested &&
+                   !SDL_TICKS_PASSED(SDL_GetTicks(), deadline)) {
+                SDL_CondWaitTimeout(p->cond, p->mutex, deadline - SDL_GetTicks());
+            }
+
+            deadline = SDL_GetTicks() + LATENCY_PRESENT_WAIT_MS;
+            while (SDL_AtomicGet(&p->state) == PROBE_DETECTED && !p->stopRequested &&
+                   !SDL_TICKS_PASSED(SDL_GetTicks(), deadline)) {
+                SDL_CondWaitTimeout(p->cond, p->mutex, deadline - SDL_GetTicks());
+            }
+        }
+
+        int state = SDL_AtomicGet(&p->state);
+        if (state == PROBE_WAITING || ret < 0) {
+            p->stats.lost++;
+        }
+        if (state >= PROBE_DETECTED) {
+            decodeSamples[decodeCount++] = p->decoded - p->sent;
+        }
+        if (state == PROBE_PRESENTED) {
+            presentSamples[presentCount++] = p->presented - p->sent;
+        }
+        SDL_AtomicSet(&p->state, PROBE_IDLE);
+        SDL_UnlockMutex(p->mutex);
+    }
+
+    // Do not leave a finger on the screen
+    if (i % 2 == 1) {
+        send_sample(p, i);
+    }
+
+    if (p->cfg.simulate) {
+        sim_stop();
+    }
+
+    SDL_LockMutex(p->mutex);
+    fill_histogram(&p->stats.decode, decodeSamples, decodeCount);
+    fill_histogram(&p->stats.present, presentSamples, presentCount);
+    p->stats.running = 0;
+    SDL_UnlockMutex(p->mutex);
+
+    log_info("latency: %llu samples, %llu lost, decode p50 %llu us p99 %llu us, present p50 %llu us p99 %llu us",
+             (unsigned long long)p->stats.samples, (unsigned long long)p->stats.lost,
+             (unsigned long long)p->stats.decode.p50, (unsigned long long)p->stats.decode.p99,
+             (unsigned long long)p->stats.present.p50, (unsigned long long)p->stats.present.p99);
+
+    free(decodeSamples);
+    free(presentSamples);
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y);
+}
+
+static void fill_histogram(struct aoakvmLatencyHistogram_t *h, uint64_t *samples, int count) {
+    uint64_t total = 0;
+
+    memset(h, 0, sizeof(*h));
+    if (count == 0) {
+        return;
+    }
+
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+    for (int i = 0; i < count; i++) {
+        total += samples[i];
+        h->buckets[SDL_min(samples[i] / LATENCY_BUCKET_US, LATENCY_HISTOGRAM_BUCKETS - 1)]++;
+    }
+
+    h->count = count;
+    h->min = samples[0];
+    h->max = samples[count - 1];
+    h->avg = total / count;
+    h->p50 = samples[(count - 1) * 50 / 100];
+    h->p95 = samples[(count - 1) * 95 / 100];
+    h->p99 = samples[(count - 1) * 99 / 100];
+}
+
+static int sim_start() {
+    if (sim.mutex == NULL && (sim.mutex = SDL_CreateMutex()) == NULL) {
+        return -1;
+    }
+    if (video_initFrameQueue() < 0) {
+        return -1;
+    }
+
+    sim.nextRead = 0;
+    sim.count = 0;
+    sim.touching = 0;
+    sim.x = LATENCY_SIM_WIDTH / 2;
+    sim.y = LATENCY_SIM_HEIGHT / 2;
+    sim.running = 1;
+    sim.thread = SDL_CreateThread(sim_thread, "simDevice", &sim);
+    if (sim.thread == NULL) {
+        log_error("Failed to create simulated device: %s", SDL_GetError());
+        sim.running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static void sim_stop() {
+    sim.running = 0;
+    SDL_WaitThread(sim.thread, NULL);
+    sim.thread = NULL;
+}
+
+static int sim_sendHidEvent(int hidId, unsigned char *report, uint16_t length) {
+    int ret = LIBUSB_ERROR_BUSY;
+
+    SDL_LockMutex(sim.mutex);
+    if (sim.count < SIM_PENDING_LENGTH) {
+        struct SimReport *r = &sim.pending[(sim.nextRead + sim.count++) % SIM_PENDING_LENGTH];
+        r->at = clock_nowUs() + probe.cfg.simDelay;
+        r->hid = hidId;
+        memcpy(r->report, report, SDL_min(length, sizeof(r->report)));
+        ret = length;
+    }
+    SDL_UnlockMutex(sim.mutex);
+    return ret;
+}
+
+static void sim_apply(struct SimReport *r) {
+    if (r->hid == HID_ID_TOUCHPAD) {
+        sim.touching = r->report[0] & 0x01;
+        sim.x = (r->report[1] | r->report[2] << 8) * (LATENCY_SIM_WIDTH - 1) / 10000;
+        sim.y = (r->report[3] | r->report[4] << 8) * (LATENCY_SIM_HEIGHT - 1) / 10000;
+    } else if (r->hid == HID_ID_MOUSE) {
+        sim.x = SDL_max(0, SDL_min(sim.x + (int8_t)r->report[1], LATENCY_SIM_WIDTH - 1));
+        sim.y = SDL_max(0, SDL_min(sim.y + (int8_t)r->report[2], LATENCY_SIM_HEIGHT - 1));
+    }
+}
+
+/* Black frame, the touch point or the pointer is a white square */
+static void sim_render(AVFrame *frame) {
+    for (int y = 0; y < frame->height; y++) {
+        memset(frame->data[0] + y * frame->linesize[0], 16, frame->width);
+    }
+    for (int y = 0; y < frame->height / 2; y++) {
+        memset(frame->data[1] + y * frame->linesize[1], 128, frame->width / 2);
+        memset(frame->data[2] + y * frame->linesize[2], 128, frame->width / 2);
+    }
+
+    if (probe.cfg.hid == HID_ID_TOUCHPAD && !sim.touching) {
+        return;
+    }
+
+    SDL_Rect bounds = { 0, 0, frame->width, frame->height };
+    SDL_Rect square = { sim.x - LATENCY_SIM_CURSOR / 2, sim.y - LATENCY_SIM_CURSOR / 2,
+                        LATENCY_SIM_CURSOR, LATENCY_SIM_CURSOR };
+    if (SDL_IntersectRect(&square, &bounds, &square)) {
+        for (int y = square.y; y < square.y + square.h; y++) {
+            memset(frame->data[0] + y * frame->linesize[0] + square.x, 235, square.w);
+        }
+    }
+}
+
+static int sim_thread(void *data) {
+    uint64_t period = 1000000 / LATENCY_SIM_FPS;
+    uint64_t next = clock_nowUs();
+    int64_t pts = 0;
+
+    while (sim.running) {
+        clock_sleepUntilUs(next);
+        next += period;
+
+        uint64_t now = clock_nowUs();
+        SDL_LockMutex(sim.mutex);
+        while (sim.count > 0 && sim.pending[sim.nextRead].at <= now) {
+            sim_apply(&sim.pending[sim.nextRead]);
+            sim.nextRead = (sim.nextRead + 1) % SIM_PENDING_LENGTH;
+            sim.count--;
+        }
+        SDL_UnlockMutex(sim.mutex);
+
+        AVFrame *frame = av_frame_alloc();
+        if (frame == NULL) {
+            break;
+        }
+        frame->format = AV_PIX_FMT_YUV420P;
+        frame->width = LATENCY_SIM_WIDTH;
+        frame->height = LATENCY_SIM_HEIGHT;
+        frame->pts = pts++;
+        if (av_frame_get_buffer(frame, 32) < 0) {
+            av_frame_free(&frame);
+            break;
+        }
+
+        sim_render(frame);
+        fq_pushFrameIntoQueue(frame);
+        av_frame_free(&frame);
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef AOAKVM_LATENCY
+#define AOAKVM_LATENCY
+
+#include "aoakvm.h"
+
+/* Simulated device, see aoakvmLatencyConfig_t.simulate */
+#define LATENCY_SIM_WIDTH 640
+#define LATENCY_SIM_HEIGHT 360
+#define LATENCY_SIM_FPS 60
+#define LATENCY_SIM_CURSOR 32
+/* How long a detected change may take to reach SDL_RenderPresent before only decode is recorded */
+#define LATENCY_PRESENT_WAIT_MS 100
+
+/*
+    int latency_start(const struct aoakvmLatencyConfig_t *cfg);
+
+    Starts a measurement on a dedicated thread. Each sample snapshots the watched region of
+    the last decoded frame, sends one report through usb_sendHidEvent (or to the simulated
+    device) and waits until a decoded frame differs from the snapshot. Returns -1 if a
+    measurement is already running or the configuration is invalid.
+*/
+int latency_start(const struct aoakvmLatencyConfig_t*);
+
+/*
+    int latency_runSimulated(const struct aoakvmLatencyConfig_t *cfg, SDL_Renderer *renderer);
+
+    Runs a whole measurement against the simulated device and returns when it is done. The
+    simulated frames go through video_rendering on renderer, which has to belong to the calling
+    thread, so both histograms fill. Without a renderer only decode is recorded. Called
+    before the first connection as the simulated frames use the frame queue of the session.
+    Returns -1 if the measurement could not be started.
+*/
+int latency_runSimulated(const struct aoakvmLatencyConfig_t*, SDL_Renderer*);
+void latency_stop();
+void latency_wait();
+
+int latency_getStats(struct aoakvmLatencyStats_t*);
+
+/*
+    void latency_onFrame(AVFrame *frame);
+    void latency_onPresent(const AVFrame *frame);
+
+    Hooks of the video pipeline. latency_onFrame runs on the decode thread for every frame
+    once it is converted to 8 bit YUV 4:2:0, before it is queued, and tags it with a sequence
+    number in frame->opaque, latency_onPresent
+    runs after the frame was handed to SDL_RenderPresent.
+*/
+void latency_onFrame(AVFrame*);
+void latency_onPresent(const AVFrame*);
+
+#endif
@@ -0,0 +1,118 @@
+#include <stddef.h>
+
+#include "aoakvm.h"
+#include "memstat.h"
+
+/* Keeps the blocks aligned like malloc does */
+#define MEMSTAT_HEADER sizeof(max_align_t)
+
+// Local Variables
+static const char *SUBSYSTEM_NAMES[MEM_SUBSYSTEMS] = {
+    [MEM_TRANSPORT] = "transport",
+    [MEM_AVIO] = "avio",
+    [MEM_DECODER] = "decoder",
+    [MEM_FRAME_QUEUE] = "frame queue",
+    [MEM_TEXTURES] = "textures",
+    [MEM_SINKS] = "sinks",
+    [MEM_HUD] = "hud",
+};
+
+static SDL_SpinLock memstatLock;
+static struct aoakvmMemCounter_t counters[MEM_SUBSYSTEMS];
+static int baselineChecks;
+static int baselineFailed;
+
+
+void memstat_track(enum aoakvm_mem_subsystem_e subsystem, int objects, int64_t bytes) {
+    struct aoakvmMemCounter_t *c = &counters[subsystem];
+
+    SDL_AtomicLock(&memstatLock);
+    c->objects += objects;
+    c->bytes += bytes;
+    if (objects > 0) {
+        c->allocations += objects;
+    }
+    if (c->bytes > c->peak) {
+        c->peak = c->bytes;
+    }
+    SDL_AtomicUnlock(&memstatLock);
+}
+
+void *memstat_alloc(enum aoakvm_mem_subsystem_e subsystem, size_t size) {
+    unsigned char *block = malloc(MEMSTAT_HEADER + size);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    *(size_t *)block = size;
+    memstat_track(subsystem, 1, size);
+    return block + MEMSTAT_HEADER;
+}
+
+void *memstat_calloc(enum aoakvm_mem_subsystem_e subsystem, size_t count, size_t size) {
+    if (size != 0 && count > (SIZE_MAX - MEMSTAT_HEADER) / size) {
+        return NULL;
+    }
+
+    void *ptr = memstat_alloc(subsystem, count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void memstat_free(enum aoakvm_mem_subsystem_e subsystem, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    unsigned char *block = (unsigned char *)ptr - MEMSTAT_HEADER;
+    memstat_track(subsystem, -1, -(int64_t)*(size_t *)block);
+    free(block);
+}
+
+int64_t memstat_frameSize(const AVFrame *frame) {
+    int64_t size = 0;
+
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i] != NULL; i++) {
+        size += frame->buf[i]->size;
+    }
+    return size;
+}
+
+void memstat_get(struct aoakvmMemCounter_t out[MEM_SUBSYSTEMS]) {
+    SDL_AtomicLock(&memstatLock);
+    memcpy(out, counters, sizeof(counters));
+    SDL_AtomicUnlock(&memstatLock);
+}
+
+int memstat_checkBaseline() {
+    struct aoakvmMemCounter_t c[MEM_SUBSYSTEMS];
+    int ret = 0;
+
+    memstat_get(c);
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+        log_debug("memory %-12s %lld objects, %lld bytes, peak %lld bytes", SUBSYSTEM_NAMES[i],
+                  (long long)c[i].objects, (long long)c[i].bytes, (long long)c[i].peak);
+        // Sinks are registered by the application and the overlay's font stays with the renderer
+        if (i != MEM_SINKS && i != MEM_HUD && (c[i].objects != 0 || c[i].bytes != 0)) {
+            log_warn("memory: %s still holds %lld objects (%lld bytes) after teardown", SUBSYSTEM_NAMES[i],
+                     (long long)c[i].objects, (long long)c[i].bytes);
+            ret = -1;
+        }
+    }
+
+    SDL_AtomicLock(&memstatLock);
+    baselineChecks++;
+    baselineFailed += ret < 0;
+    SDL_AtomicUnlock(&memstatLock);
+    return ret;
+}
+
+int memstat_getBaselineChecks(int *failed) {
+    SDL_AtomicLock(&memstatLock);
+    int checks = baselineChecks;
+    *failed = baselineFailed;
+    SDL_AtomicUnlock(&memstatLock);
+    return checks;
+}
@@ -0,0 +1,49 @@
+#ifndef AOAKVM_MEMSTAT
+#define AOAKVM_MEMSTAT
+
+#include "aoakvm.h"
+
+/*
+    void *memstat_alloc(enum aoakvm_mem_subsystem_e subsystem, size_t size);
+    void *memstat_calloc(enum aoakvm_mem_subsystem_e subsystem, size_t count, size_t size);
+    void memstat_free(enum aoakvm_mem_subsystem_e subsystem, void *ptr);
+
+    malloc, calloc and free that count the block for subsystem. Blocks must be freed with
+    memstat_free of the same subsystem, NULL is ignored.
+*/
+void *memstat_alloc(enum aoakvm_mem_subsystem_e, size_t);
+void *memstat_calloc(enum aoakvm_mem_subsystem_e, size_t, size_t);
+void memstat_free(enum aoakvm_mem_subsystem_e, void*);
+
+/*
+    void memstat_track(enum aoakvm_mem_subsystem_e subsystem, int objects, int64_t bytes);
+
+    Accounts objects allocated elsewhere (FFmpeg, SDL), negative values when they are released.
+*/
+void memstat_track(enum aoakvm_mem_subsystem_e, int, int64_t);
+
+/*
+    int64_t memstat_frameSize(const AVFrame *frame);
+
+    Bytes of the buffers a frame references, 0 for an empty frame.
+*/
+int64_t memstat_frameSize(const AVFrame*);
+
+void memstat_get(struct aoakvmMemCounter_t counters[MEM_SUBSYSTEMS]);
+
+/*
+    int memstat_checkBaseline();
+
+    Called after a session was torn down. Logs the counters and returns -1 if anything of the
+    session is still allocated.
+*/
+int memstat_checkBaseline();
+
+/*
+    int memstat_getBaselineChecks(int *failed);
+
+    Number of memstat_checkBaseline calls so far, *failed of them found memory of a session.
+*/
+int memstat_getBaselineChecks(int*);
+
+#endif
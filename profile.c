@@ -0,0 +1,82 @@
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "profile.h"
+
+// Local Variables
+
+static const char *PHASE_NAMES[PHASE_COUNT] = {
+    [PHASE_SDL_INIT] = "SDL_Init",
+    [PHASE_LOAD_SCREENS] = "load message screens",
+    [PHASE_ENUMERATE] = "enumerate",
+    [PHASE_AOA_SWITCH] = "AOA switch",
+    [PHASE_REENUMERATE] = "re-enumerate",
+    [PHASE_HID_REGISTER] = "HID registration",
+    [PHASE_OPEN_INPUT] = "avformat_open_input",
+    [PHASE_FIND_STREAM_INFO] = "avformat_find_stream_info",
+    [PHASE_DECODER_OPEN] = "decoder open",
+    [PHASE_FIRST_FRAME] = "first frame",
+};
+
+/* Spinlock instead of a mutex, the first phase begins before SDL_Init */
+static SDL_SpinLock profileLock;
+static struct aoakvmStartupProfile_t profile;
+
+
+void profile_begin(enum aoakvm_startup_phase_e phase) {
+    uint64_t now = clock_nowUs();
+
+    SDL_AtomicLock(&profileLock);
+    if (profile.origin == 0) {
+        profile.origin = now;
+    }
+    profile.begin[phase] = now;
+    profile.end[phase] = 0;
+    SDL_AtomicUnlock(&profileLock);
+}
+
+int profile_end(enum aoakvm_startup_phase_e phase) {
+    uint64_t now = clock_nowUs();
+    int recorded = 0;
+
+    SDL_AtomicLock(&profileLock);
+    if (profile.begin[phase] != 0 && profile.end[phase] == 0) {
+        profile.end[phase] = now;
+        recorded = 1;
+    }
+    SDL_AtomicUnlock(&profileLock);
+    return recorded;
+}
+
+void profile_newConnection() {
+    SDL_AtomicLock(&profileLock);
+    for (int i = PHASE_ENUMERATE; i < PHASE_COUNT; i++) {
+        profile.begin[i] = 0;
+        profile.end[i] = 0;
+    }
+    profile.connections++;
+    SDL_AtomicUnlock(&profileLock);
+}
+
+void profile_get(struct aoakvmStartupProfile_t *out) {
+    SDL_AtomicLock(&profileLock);
+    *out = profile;
+    SDL_AtomicUnlock(&profileLock);
+}
+
+void profile_log() {
+    struct aoakvmStartupProfile_t p;
+    profile_get(&p);
+
+    log_info("Startup timeline (connection %d):", p.connections);
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        if (p.begin[i] == 0) {
+            continue;
+        }
+        if (p.end[i] == 0) {
+            log_info("  %-26s +%8.1f ms  (not finished)", PHASE_NAMES[i], (p.begin[i] - p.origin) / 1000.0);
+        } else {
+            log_info("  %-26s +%8.1f ms  %8.1f ms", PHASE_NAMES[i], (p.begin[i] - p.origin) / 1000.0,
+                     (p.end[i] - p.begin[i]) / 1000.0);
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef AOAKVM_PROFILE
+#define AOAKVM_PROFILE
+
+#include "aoakvm.h"
+
+/*
+    void profile_begin(enum aoakvm_startup_phase_e phase);
+    int profile_end(enum aoakvm_startup_phase_e phase);
+
+    Record the monotonic start and end of a phase. Beginning a phase again overwrites the
+    previous run, ending a phase that was not begun or already ended is ignored.
+    profile_end returns 1 if it recorded the end, 0 if it was ignored.
+*/
+void profile_begin(enum aoakvm_startup_phase_e);
+int profile_end(enum aoakvm_startup_phase_e);
+
+/*
+    void profile_newConnection();
+
+    Clears the connection phases (PHASE_ENUMERATE and later) before a connection attempt.
+*/
+void profile_newConnection();
+
+void profile_get(struct aoakvmStartupProfile_t*);
+
+/*
+    void profile_log();
+
+    Logs the timeline, offsets relative to the first phase of the process.
+*/
+void profile_log();
+
+#endif
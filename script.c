@@ -0,0 +1,499 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <strings.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "script.h"
+#include "usb.h"
+
+#define STEP_ASAP 0x01
+#define KB_LEFT_SHIFT 0x02
+#define TOUCH_TIP 0x03
+
+// Struct Definition
+
+struct ScriptStep {
+    uint64_t at;
+    uint32_t seq;
+    uint8_t flags;
+    uint8_t hid;
+    uint8_t length;
+    uint8_t report[HID_REPORT_TOUCHSCREEN_SIZE];
+};
+
+struct aoakvmScript_t {
+    struct ScriptStep *steps;
+    int count;
+    int cap;
+};
+
+struct KeyMapping {
+    uint8_t usage;
+    uint8_t shift;
+};
+
+struct KeyName {
+    const char *name;
+    uint8_t usage;
+};
+
+// Static Functions
+static int script_thread(void *data);
+static struct ScriptStep *add_step(struct aoakvmScript_t *s, uint64_t at, int hid, const uint8_t *report, int length);
+static int add_touch(struct aoakvmScript_t *s, uint64_t at, int down, uint16_t x, uint16_t y);
+static int add_pinch(struct aoakvmScript_t *s, uint64_t at, int down, uint16_t cx, uint16_t cy, int radius);
+static int add_keys(struct aoakvmScript_t *s, uint64_t at, int asap, uint8_t modifiers, const uint8_t *keys, int count);
+static int compare_steps(const void *a, const void *b);
+static int compare_u64(const void *a, const void *b);
+static int parse_key(const char *name, uint8_t *usage, uint8_t *modifiers);
+static int parse_line(struct aoakvmScript_t *s, char *line);
+
+// Local Variables
+
+/* US layout, characters without an entry cannot be typed */
+static const struct KeyMapping ASCII_TO_HID[128] = {
+    ['a'] = {0x04, 0}, ['b'] = {0x05, 0}, ['c'] = {0x06, 0}, ['d'] = {0x07, 0}, ['e'] = {0x08, 0},
+    ['f'] = {0x09, 0}, ['g'] = {0x0a, 0}, ['h'] = {0x0b, 0}, ['i'] = {0x0c, 0}, ['j'] = {0x0d, 0},
+    ['k'] = {0x0e, 0}, ['l'] = {0x0f, 0}, ['m'] = {0x10, 0}, ['n'] = {0x11, 0}, ['o'] = {0x12, 0},
+    ['p'] = {0x13, 0}, ['q'] = {0x14, 0}, ['r'] = {0x15, 0}, ['s'] = {0x16, 0}, ['t'] = {0x17, 0},
+    ['u'] = {0x18, 0}, ['v'] = {0x19, 0}, ['w'] = {0x1a, 0}, ['x'] = {0x1b, 0}, ['y'] = {0x1c, 0},
+    ['z'] = {0x1d, 0},
+    ['A'] = {0x04, 1}, ['B'] = {0x05, 1}, ['C'] = {0x06, 1}, ['D'] = {0x07, 1}, ['E'] = {0x08, 1},
+    ['F'] = {0x09, 1}, ['G'] = {0x0a, 1}, ['H'] = {0x0b, 1}, ['I'] = {0x0c, 1}, ['J'] = {0x0d, 1},
+    ['K'] = {0x0e, 1}, ['L'] = {0x0f, 1}, ['M'] = {0x10, 1}, ['N'] = {0x11, 1}, ['O'] = {0x12, 1},
+    ['P'] = {0x13, 1}, ['Q'] = {0x14, 1}, ['R'] = {0x15, 1}, ['S'] = {0x16, 1}, ['T'] = {0x17, 1},
+    ['U'] = {0x18, 1}, ['V'] = {0x19, 1}, ['W'] = {0x1a, 1}, ['X'] = {0x1b, 1}, ['Y'] = {0x1c, 1},
+    ['Z'] = {0x1d, 1},
+    ['1'] = {0x1e, 0}, ['2'] = {0x1f, 0}, ['3'] = {0x20, 0}, ['4'] = {0x21, 0}, ['5'] = {0x22, 0},
+    ['6'] = {0x23, 0}, ['7'] = {0x24, 0}, ['8'] = {0x25, 0}, ['9'] = {0x26, 0}, ['0'] = {0x27, 0},
+    ['!'] = {0x1e, 1}, ['@'] = {0x1f, 1}, ['#'] = {0x20, 1}, ['$'] = {0x21, 1}, ['%'] = {0x22, 1},
+    ['^'] = {0x23, 1}, ['&'] = {0x24, 1}, ['*'] = {0x25, 1}, ['('] = {0x26, 1}, [')'] = {0x27, 1},
+    ['\n'] = {0x28, 0}, ['\b'] = {0x2a, 0}, ['\t'] = {0x2b, 0}, [' '] = {0x2c, 0},
+    ['-'] = {0x2d, 0}, ['_'] = {0x2d, 1}, ['='] = {0x2e, 0}, ['+'] = {0x2e, 1},
+    ['['] = {0x2f, 0}, ['{'] = {0x2f, 1}, [']'] = {0x30, 0}, ['}'] = {0x30, 1},
+    ['\\'] = {0x31, 0}, ['|'] = {0x31, 1}, [';'] = {0x33, 0}, [':'] = {0x33, 1},
+    ['\''] = {0x34, 0}, ['"'] = {0x34, 1}, ['`'] = {0x35, 0}, ['~'] = {0x35, 1},
+    [','] = {0x36, 0}, ['<'] = {0x36, 1}, ['.'] = {0x37, 0}, ['>'] = {0x37, 1},
+    ['/'] = {0x38, 0}, ['?'] = {0x38, 1},
+};
+
+static const struct KeyName KEY_NAMES[] = {
+    {"enter", 0x28}, {"esc", 0x29}, {"backspace", 0x2a}, {"tab", 0x2b}, {"space", 0x2c},
+    {"f1", 0x3a}, {"f2", 0x3b}, {"f3", 0x3c}, {"f4", 0x3d}, {"f5", 0x3e}, {"f6", 0x3f},
+    {"f7", 0x40}, {"f8", 0x41}, {"f9", 0x42}, {"f10", 0x43}, {"f11", 0x44}, {"f12", 0x45},
+    {"home", 0x4a}, {"pageup", 0x4b}, {"delete", 0x4c}, {"end", 0x4d}, {"pagedown", 0x4e},
+    {"right", 0x4f}, {"left", 0x50}, {"down", 0x51}, {"up", 0x52},
+    {"ctrl", 0xe0}, {"shift", 0xe1}, {"alt", 0xe2}, {"gui", 0xe3},
+    {"rctrl", 0xe4}, {"rshift", 0xe5}, {"ralt", 0xe6}, {"rgui", 0xe7},
+};
+
+static SDL_Thread *playThread;
+static volatile int stopRequested;
+static SDL_mutex *statsMutex;
+static struct aoakvmScriptStats_t scriptStats;
+
+
+struct aoakvmScript_t *script_new() {
+    return calloc(1, sizeof(struct aoakvmScript_t));
+}
+
+void script_free(struct aoakvmScript_t *s) {
+    if (s != NULL) {
+        free(s->steps);
+        free(s);
+    }
+}
+
+static struct ScriptStep *add_step(struct aoakvmScript_t *s, uint64_t at, int hid, const uint8_t *report, int length) {
+    if (s->count == s->cap) {
+        int cap = s->cap ? s->cap * 2 : 256;
+        struct ScriptStep *steps = realloc(s->steps, sizeof(struct ScriptStep) * cap);
+        if (steps == NULL) {
+            return NULL;
+        }
+        s->steps = steps;
+        s->cap = cap;
+    }
+
+    struct ScriptStep *step = &s->steps[s->count];
+    step->at = at;
+    step->seq = s->count++;
+    step->flags = 0;
+    step->hid = hid;
+    step->length = length;
+    memcpy(step->report, report, length);
+    return step;
+}
+
+static int add_touch(struct aoakvmScript_t *s, uint64_t at, int down, uint16_t x, uint16_t y) {
+    x = SDL_min(x, 10000);
+    y = SDL_min(y, 10000);
+    uint8_t report[HID_REPORT_TOUCHPAD_SIZE] = { down ? TOUCH_TIP : 0, x & 0xff, x >> 8, y & 0xff, y >> 8 };
+    return add_step(s, at, HID_ID_TOUCHPAD, report, sizeof(report)) ? 0 : -1;
+}
+
+/* Two touchscreen contacts left and right of (cx, cy), both in one report */
+static int add_pinch(struct aoakvmScript_t *s, uint64_t at, int down, uint16_t cx, uint16_t cy, int radius) {
+    uint8_t report[HID_REPORT_TOUCHSCREEN_SIZE] = { 0 };
+    int x[2] = { SDL_max(0, cx - radius), SDL_min(10000, cx + radius) };
+
+    for (int i = 0; i < 2; i++) {
+        uint8_t *contact = &report[i * HID_TOUCHSCREEN_CONTACT_SIZE];
+        contact[0] = down ? 0x01 : 0x00;
+        contact[1] = i;
+        contact[2] = x[i] & 0xff;
+        contact[3] = x[i] >> 8;
+        contact[4] = SDL_min(cy, 10000) & 0xff;
+        contact[5] = SDL_min(cy, 10000) >> 8;
+    }
+    report[HID_REPORT_TOUCHSCREEN_SIZE - 1] = 2;
+    return add_step(s, at, HID_ID_TOUCHSCREEN, report, sizeof(report)) ? 0 : -1;
+}
+
+static int add_keys(struct aoakvmScript_t *s, uint64_t at, int asap, uint8_t modifiers, const uint8_t *keys, int count) {
+    uint8_t report[HID_REPORT_KB_SIZE] = { modifiers, 0 };
+    memcpy(&report[2], keys, SDL_min(count, 6));
+
+    struct ScriptStep *step = add_step(s, at, HID_ID_KEYBOARD, report, sizeof(report));
+    if (step == NULL) {
+        return -1;
+    }
+    step->flags = asap ? STEP_ASAP : 0;
+    return 0;
+}
+
+int script_tap(struct aoakvmScript_t *s, uint64_t at, uint16_t x, uint16_t y, uint32_t hold) {
+    if (add_touch(s, at, 1, x, y) < 0 || add_touch(s, at + hold, 0, x, y) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int script_swipe(struct aoakvmScript_t *s, uint64_t at, uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1, uint32_t duration, int rate) {
+    if (rate <= 0) {
+        rate = SCRIPT_DEFAULT_RATE;
+    }
+    if (rate > SCRIPT_MAX_RATE) {
+        return -1;
+    }
+
+    uint64_t period = 1000000 / rate;
+    uint64_t steps = duration / period;
+    if (steps == 0) {
+        steps = 1;
+    }
+
+    for (uint64_t i = 0; i <= steps; i++) {
+        int x = x0 + ((int)x1 - x0) * (int64_t)i / (int64_t)steps;
+        int y = y0 + ((int)y1 - y0) * (int64_t)i / (int64_t)steps;
+        if (add_touch(s, at + duration * i / steps, 1, x, y) < 0) {
+            return -1;
+        }
+    }
+    return add_touch(s, at + duration, 0, x1, y1);
+}
+
+int script_pinch(struct aoakvmScript_t *s, uint64_t at, uint16_t cx, uint16_t cy, uint16_t r0, uint16_t r1, uint32_t duration, int rate) {
+    if (rate <= 0) {
+        rate = SCRIPT_DEFAULT_RATE;
+    }
+    if (rate > SCRIPT_MAX_RATE) {
+        return -1;
+    }
+
+    uint64_t period = 1000000 / rate;
+    uint64_t steps = duration / period;
+    if (steps == 0) {
+        steps = 1;
+    }
+
+    for (uint64_t i = 0; i <= steps; i++) {
+        int r = r0 + ((int)r1 - r0) * (int64_t)i / (int64_t)steps;
+        if (add_pinch(s, at + duration * i / steps, 1, cx, cy, r) < 0) {
+            return -1;
+        }
+    }
+    return add_pinch(s, at + duration, 0, cx, cy, r1);
+}
+
+int script_chord(struct aoakvmScript_t *s, uint64_t at, uint8_t modifiers, const uint8_t *keys, int count, uint32_t hold) {
+    if (count < 0 || count > 6) {
+        return -1;
+    }
+    if (add_keys(s, at, 0, modifiers, keys, count) < 0 || add_keys(s, at + hold, 0, 0, NULL, 0) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int script_text(struct aoakvmScript_t *s, uint64_t at, const char *text, uint32_t interval) {
+    int asap = interval == SCRIPT_TEXT_MAX_RATE;
+
+    for (int i = 0; text[i] != '\0'; i++) {
+        unsigned char c = text[i];
+        if (c >= 128 || ASCII_TO_HID[c].usage == 0) {
+            log_warn("script: cannot type character 0x%02x", c);
+            continue;
+        }
+
+        uint64_t t = asap ? at : at + (uint64_t)i * interval;
+        uint8_t modifiers = ASCII_TO_HID[c].shift ? KB_LEFT_SHIFT : 0;
+        if (add_keys(s, t, asap, modifiers, &ASCII_TO_HID[c].usage, 1) < 0 ||
+            add_keys(s, t + interval / 2, asap, 0, NULL, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int parse_key(const char *name, uint8_t *usage, uint8_t *modifiers) {
+    if (strlen(name) == 1 && (unsigned char)name[0] < 128 && ASCII_TO_HID[(unsigned char)name[0]].usage) {
+        *usage = ASCII_TO_HID[(unsigned char)name[0]].usage;
+        return 0;
+    }
+
+    for (size_t i = 0; i < SDL_arraysize(KEY_NAMES); i++) {
+        if (strcasecmp(name, KEY_NAMES[i].name) == 0) {
+            if (KEY_NAMES[i].usage >= 0xe0) {
+                *modifiers |= 1 << (KEY_NAMES[i].usage - 0xe0);
+                *usage = 0;
+            } else {
+                *usage = KEY_NAMES[i].usage;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int parse_line(struct aoakvmScript_t *s, char *line) {
+    char cmd[16];
+    double at, a, b, c, d, e, f;
+    int n;
+
+    while (isspace((unsigned char)*line)) {
+        line++;
+    }
+    if (*line == '\0' || *line == '#') {
+        return 0;
+    }
+    if (sscanf(line, "%15s %lf%n", cmd, &at, &n) < 2) {
+        return -1;
+    }
+    line += n;
+    uint64_t atUs = at * 1000;
+
+    if (strcmp(cmd, "tap") == 0) {
+        int r = sscanf(line, "%lf %lf %lf", &a, &b, &c);
+        if (r < 2) {
+            return -1;
+        }
+        return script_tap(s, atUs, a, b, r == 3 ? c * 1000 : 50000);
+    } else if (strcmp(cmd, "swipe") == 0) {
+        int r = sscanf(line, "%lf %lf %lf %lf %lf %lf", &a, &b, &c, &d, &e, &f);
+        if (r < 5 || (r == 6 && (f < 1 || f > SCRIPT_MAX_RATE))) {
+            return -1;
+        }
+        return script_swipe(s, atUs, a, b, c, d, e * 1000, r == 6 ? (int)f : SCRIPT_DEFAULT_RATE);
+    } else if (strcmp(cmd, "pinch") == 0) {
+        int r = sscanf(line, "%lf %lf %lf %lf %lf %lf", &a, &b, &c, &d, &e, &f);
+        if (r < 5 || (r == 6 && (f < 1 || f > SCRIPT_MAX_RATE))) {
+            return -1;
+        }
+        return script_pinch(s, atUs, a, b, c, d, e * 1000, r == 6 ? (int)f : SCRIPT_DEFAULT_RATE);
+    } else if (strcmp(cmd, "chord") == 0) {
+        char keys[128];
+        uint8_t usages[6];
+        uint8_t modifiers = 0;
+        int count = 0;
+
+        if (sscanf(line, "%lf %127s", &a, keys) < 2) {
+            return -1;
+        }
+        for (char *tok = strtok(keys, "+"); tok != NULL; tok = strtok(NULL, "+")) {
+            uint8_t usage;
+            if (parse_key(tok, &usage, &modifiers) < 0 || (usage && count == 6)) {
+                return -1;
+            }
+            if (usage) {
+                usages[count++] = usage;
+            }
+        }
+        return script_chord(s, atUs, modifiers, usages, count, a * 1000);
+    } else if (strcmp(cmd, "text") == 0) {
+        char rate[16];
+        if (sscanf(line, "%15s%n", rate, &n) < 1) {
+            return -1;
+        }
+        line += n;
+        if (*line == ' ') {
+            line++;
+        }
+        uint32_t interval = strcmp(rate, "max") == 0 ? SCRIPT_TEXT_MAX_RATE : (uint32_t)(atof(rate) * 1000);
+        return script_text(s, atUs, line, interval);
+    }
+    return -1;
+}
+
+int script_parse(struct aoakvmScript_t *s, const char *source) {
+    char *copy = strdup(source);
+    char *save = NULL;
+    int lineNo = 0;
+    int ret = 0;
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    for (char *line = strtok_r(copy, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        lineNo++;
+        if (parse_line(s, line) < 0) {
+            log_error("script: invalid line %d: %s", lineNo, line);
+            ret = lineNo;
+            break;
+        }
+    }
+    free(copy);
+    return ret;
+}
+
+static int compare_steps(const void *a, const void *b) {
+    const struct ScriptStep *x = a;
+    const struct ScriptStep *y = b;
+    if (x->at != y->at) {
+        return x->at < y->at ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y);
+}
+
+int script_play(struct aoakvmScript_t *s) {
+    if (statsMutex == NULL) {
+        statsMutex = SDL_CreateMutex();
+    }
+
+    SDL_LockMutex(statsMutex);
+    if (scriptStats.running) {
+        SDL_UnlockMutex(statsMutex);
+        return -1;
+    }
+    memset(&scriptStats, 0, sizeof(scriptStats));
+    scriptStats.running = 1;
+    SDL_UnlockMutex(statsMutex);
+
+    // Reap the previous playback thread, it finished already
+    SDL_WaitThread(playThread, NULL);
+
+    qsort(s->steps, s->count, sizeof(struct ScriptStep), compare_steps);
+    stopRequested = 0;
+    playThread = SDL_CreateThread(script_thread, "scriptPlayer", s);
+    if (playThread == NULL) {
+        log_error("Failed to create script thread: %s", SDL_GetError());
+        SDL_LockMutex(statsMutex);
+        scriptStats.running = 0;
+        SDL_UnlockMutex(statsMutex);
+        return -1;
+    }
+    return 0;
+}
+
+void script_stop() {
+    stopRequested = 1;
+}
+
+void script_wait() {
+    SDL_WaitThread(playThread, NULL);
+    playThread = NULL;
+}
+
+int script_getStats(struct aoakvmScriptStats_t *stats) {
+    if (statsMutex == NULL) {
+        return -1;
+    }
+
+    SDL_LockMutex(statsMutex);
+    *stats = scriptStats;
+    SDL_UnlockMutex(statsMutex);
+    return 0;
+}
+
+static int script_thread(void *data) {
+    struct aoakvmScript_t *s = data;
+    uint64_t *deviation = malloc(sizeof(uint64_t) * (s->count ? s->count : 1));
+    int scheduled = 0;
+    uint64_t sent = 0;
+    uint64_t failed = 0;
+    uint64_t total = 0;
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_TIME_CRITICAL);
+
+    // Leave some lead time so the first step is not late already
+    uint64_t start = clock_nowUs() + 1000;
+    uint64_t offset = 0;
+
+    for (int i = 0; i < s->count && !stopRequested; i++) {
+        struct ScriptStep *step = &s->steps[i];
+        uint64_t target = start + step->at + offset;
+        // A max rate block waits for its time, only the steps after its first go back-to-back
+        int scheduledStep = !(step->flags & STEP_ASAP) || i == 0 || !(s->steps[i - 1].flags & STEP_ASAP) ||
+                            s->steps[i - 1].at != step->at;
+
+        if (scheduledStep) {
+            if (target > clock_nowUs() + SCRIPT_SPIN_US) {
+                clock_sleepUntilUs(target - SCRIPT_SPIN_US);
+            }
+            while (clock_nowUs() < target);
+        }
+
+        uint64_t now = clock_nowUs();
+        int ret = usb_sendHidEvent(step->hid, step->report, step->length);
+        if (ret < 0) {
+            failed++;
+        } else {
+            sent++;
+        }
+
+        if (step->flags & STEP_ASAP) {
+            // Everything after a max rate block is shifted by the time the block took
+            uint64_t done = clock_nowUs();
+            if (done > target) {
+                offset += done - target;
+            }
+        }
+        if (scheduledStep && deviation != NULL) {
+            deviation[scheduled++] = now - target;
+            total += now - target;
+        }
+    }
+
+    uint64_t duration = clock_nowUs() - start;
+
+    SDL_LockMutex(statsMutex);
+    scriptStats.reports = sent;
+    scriptStats.failed = failed;
+    scriptStats.duration = duration;
+    scriptStats.reportsPerSec = duration ? (sent + failed) * 1000000 / duration : 0;
+    if (scheduled > 0) {
+        qsort(deviation, scheduled, sizeof(uint64_t), compare_u64);
+        scriptStats.deviationAvg = total / scheduled;
+        scriptStats.deviationP99 = deviation[(scheduled - 1) * 99 / 100];
+        scriptStats.deviationMax = deviation[scheduled - 1];
+    }
+    scriptStats.running = 0;
+    // The next script_start may reset the stats as soon as the lock is released
+    struct aoakvmScriptStats_t done = scriptStats;
+    SDL_UnlockMutex(statsMutex);
+
+    log_info("script: %llu reports in %llu us, deviation avg %llu us, p99 %llu us, max %llu us",
+             (unsigned long long)(sent + failed), (unsigned long long)duration,
+             (unsigned long long)done.deviationAvg, (unsigned long long)done.deviationP99,
+             (unsigned long long)done.deviationMax);
+    free(deviation);
+    return 0;
+}
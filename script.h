@@ -0,0 +1,76 @@
+#ifndef AOAKVM_SCRIPT
+#define AOAKVM_SCRIPT
+
+#include "aoakvm.h"
+
+/* Scheduled sends sleep until this many microseconds before their deadline and spin the rest */
+#define SCRIPT_SPIN_US 200
+#define SCRIPT_DEFAULT_RATE 120
+/* Highest swipe and pinch rate, one report per microsecond */
+#define SCRIPT_MAX_RATE 1000000
+#define SCRIPT_TEXT_MAX_RATE 0
+
+/*
+    struct aoakvmScript_t
+
+    A compiled list of timed HID reports. Times are microseconds relative to the start of
+    the playback, touch coordinates use the touchpad range 0-10000.
+*/
+struct aoakvmScript_t;
+
+struct aoakvmScript_t *script_new();
+void script_free(struct aoakvmScript_t*);
+
+/*
+    int script_tap(struct aoakvmScript_t *s, uint64_t at, uint16_t x, uint16_t y, uint32_t hold);
+    int script_swipe(struct aoakvmScript_t *s, uint64_t at, uint16_t x0, uint16_t y0,
+                     uint16_t x1, uint16_t y1, uint32_t duration, int rate);
+    int script_pinch(struct aoakvmScript_t *s, uint64_t at, uint16_t cx, uint16_t cy,
+                     uint16_t r0, uint16_t r1, uint32_t duration, int rate);
+    int script_chord(struct aoakvmScript_t *s, uint64_t at, uint8_t modifiers,
+                     const uint8_t *keys, int count, uint32_t hold);
+    int script_text(struct aoakvmScript_t *s, uint64_t at, const char *text, uint32_t interval);
+
+    Append gestures to a script. A swipe sends one position report per 1/rate seconds, moving
+    linearly from (x0, y0) to (x1, y1); rate is at most SCRIPT_MAX_RATE, 0 or less takes
+    SCRIPT_DEFAULT_RATE. A pinch puts two touchscreen contacts r0 left and right
+    of (cx, cy) and moves them to r1 with the same rate, one report per step for both fingers.
+    A chord presses up to six HID usages together with the
+    modifier bits of REPORT_DESC_KB. Text is mapped to US layout keyboard reports, one character
+    per interval; SCRIPT_TEXT_MAX_RATE types as fast as the phone accepts the reports, starting
+    at the given time.
+    All return 0 on success and -1 on invalid arguments or allocation failure.
+*/
+int script_tap(struct aoakvmScript_t*, uint64_t, uint16_t, uint16_t, uint32_t);
+int script_swipe(struct aoakvmScript_t*, uint64_t, uint16_t, uint16_t, uint16_t, uint16_t, uint32_t, int);
+int script_pinch(struct aoakvmScript_t*, uint64_t, uint16_t, uint16_t, uint16_t, uint16_t, uint32_t, int);
+int script_chord(struct aoakvmScript_t*, uint64_t, uint8_t, const uint8_t*, int, uint32_t);
+int script_text(struct aoakvmScript_t*, uint64_t, const char*, uint32_t);
+
+/*
+    int script_parse(struct aoakvmScript_t *s, const char *source);
+
+    Appends a textual script, one command per line, times in milliseconds:
+        tap <at> <x> <y> [hold]
+        swipe <at> <x0> <y0> <x1> <y1> <duration> [rate]    rate 1 to SCRIPT_MAX_RATE
+        pinch <at> <cx> <cy> <r0> <r1> <duration> [rate]
+        chord <at> <hold> <key>[+<key>...]      e.g. ctrl+shift+t, gui+enter, f5
+        text <at> <interval|max> <text until end of line>
+    Empty lines and lines starting with # are ignored. Returns the number of the first invalid
+    line, or 0 if the whole source was parsed.
+*/
+int script_parse(struct aoakvmScript_t*, const char*);
+
+/*
+    int script_play(struct aoakvmScript_t *s);
+
+    Starts playing the script on a dedicated thread. The script must not be modified or freed
+    until script_wait returned. Returns -1 if another script is still playing.
+*/
+int script_play(struct aoakvmScript_t*);
+void script_stop();
+void script_wait();
+
+int script_getStats(struct aoakvmScriptStats_t*);
+
+#endif
@@ -0,0 +1,279 @@
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "memstat.h"
+#include "sink.h"
+
+// Struct Definition
+
+/*
+    struct FrameSink
+
+    One registered consumer. The decode thread appends to the ring, the worker takes from it,
+    both under mutex. current is owned by the worker and holds the frame of the callback.
+    users counts the callers that took the sink from the table and still use it.
+*/
+struct FrameSink {
+    struct aoakvmSinkConfig_t cfg;
+    char name[32];
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    SDL_Thread *thread;
+    int running;
+    int nextRead;
+    int count;
+    uint64_t nextDue;   // clock_nowUs() from which maxFps lets the next frame in
+    AVFrame *frames[SINK_MAX_QUEUE];
+    AVFrame *current;
+    struct aoakvmSinkStats_t stats;
+    SDL_atomic_t users;
+};
+
+// Static Functions
+static int sink_worker(void *data);
+static void sink_offer(struct FrameSink *sink, const AVFrame *frame, uint64_t now);
+static int sink_acquire(struct FrameSink *acquired[SINK_MAX_SINKS], int id);
+static void sink_free(struct FrameSink *sink);
+
+// Local Variables
+
+/*
+    Registered sinks, guarded by sinksLock. The lock is only held to take a sink from the table
+    and count it as used, never across its mutex or av_frame_ref. sink_remove waits until a
+    sink it took out of the table has no users left before stopping it.
+*/
+static struct FrameSink *sinks[SINK_MAX_SINKS];
+static SDL_SpinLock sinksLock;
+static SDL_atomic_t registered;
+
+
+int sink_add(const struct aoakvmSinkConfig_t *cfg) {
+    if (cfg->cb == NULL || cfg->queueLength < 0 || cfg->queueLength > SINK_MAX_QUEUE) {
+        log_error("sink: invalid configuration");
+        return -1;
+    }
+
+    struct FrameSink *sink = memstat_calloc(MEM_SINKS, 1, sizeof(*sink));
+    if (sink == NULL) {
+        return -1;
+    }
+    sink->cfg = *cfg;
+    SDL_strlcpy(sink->name, cfg->name ? cfg->name : "sink", sizeof(sink->name));
+    sink->cfg.name = sink->name;
+    if (sink->cfg.queueLength == 0) {
+        sink->cfg.queueLength = SINK_DEFAULT_QUEUE;
+    }
+
+    sink->mutex = SDL_CreateMutex();
+    sink->cond = SDL_CreateCond();
+    sink->current = av_frame_alloc();
+    int ok = sink->mutex && sink->cond && sink->current;
+    for (int i = 0; i < sink->cfg.queueLength && ok; i++) {
+        ok = (sink->frames[i] = av_frame_alloc()) != NULL;
+    }
+    if (!ok) {
+        log_error("sink: failed to allocate state of %s", sink->name);
+        sink_free(sink);
+        return -1;
+    }
+
+    sink->running = 1;
+    sink->thread = SDL_CreateThread(sink_worker, "frameSink", sink);
+    if (sink->thread == NULL) {
+        log_error("Failed to create worker of sink %s: %s", sink->name, SDL_GetError());
+        sink_free(sink);
+        return -1;
+    }
+
+    int id = -1;
+    SDL_AtomicLock(&sinksLock);
+    for (int i = 0; i < SINK_MAX_SINKS && id < 0; i++) {
+        if (sinks[i] == NULL) {
+            sinks[i] = sink;
+            id = i;
+        }
+    }
+    SDL_AtomicUnlock(&sinksLock);
+
+    if (id < 0) {
+        log_error("sink: %d sinks are registered already", SINK_MAX_SINKS);
+        SDL_LockMutex(sink->mutex);
+        sink->running = 0;
+        SDL_CondSignal(sink->cond);
+        SDL_UnlockMutex(sink->mutex);
+        SDL_WaitThread(sink->thread, NULL);
+        sink_free(sink);
+        return -1;
+    }
+    SDL_AtomicAdd(&registered, 1);
+    log_info("sink: %s registered, %d frames queue, %u fps cap", sink->name, sink->cfg.queueLength, sink->cfg.maxFps);
+    return id;
+}
+
+void sink_remove(int id) {
+    struct FrameSink *sink = NULL;
+
+    if (id < 0 || id >= SINK_MAX_SINKS) {
+        return;
+    }
+    SDL_AtomicLock(&sinksLock);
+    sink = sinks[id];
+    sinks[id] = NULL;
+    SDL_AtomicUnlock(&sinksLock);
+    if (sink == NULL) {
+        return;
+    }
+    SDL_AtomicAdd(&registered, -1);
+
+    // sink_offer takes the sink mutex only briefly, so yielding until it is done is enough
+    while (SDL_AtomicGet(&sink->users) > 0) {
+        SDL_Delay(1);
+    }
+
+    SDL_LockMutex(sink->mutex);
+    sink->running = 0;
+    SDL_CondSignal(sink->cond);
+    SDL_UnlockMutex(sink->mutex);
+    SDL_WaitThread(sink->thread, NULL);
+
+    // Whatever is still queued was accepted but will not be delivered any more
+    sink->stats.dropped += sink->count;
+    log_info("sink: %s removed, %llu frames offered, %llu delivered, %llu capped, %llu dropped, %llu us longest callback",
+        sink->name, sink->stats.offered, sink->stats.delivered, sink->stats.capped, sink->stats.dropped,
+        sink->stats.maxCallbackUs);
+    sink_free(sink);
+}
+
+int sink_getStats(int id, struct aoakvmSinkStats_t *stats) {
+    struct FrameSink *sink[SINK_MAX_SINKS];
+
+    if (id < 0 || id >= SINK_MAX_SINKS || sink_acquire(sink, id) == 0) {
+        return -1;
+    }
+    SDL_LockMutex(sink[0]->mutex);
+    *stats = sink[0]->stats;
+    stats->queued = sink[0]->count;
+    SDL_UnlockMutex(sink[0]->mutex);
+    SDL_AtomicAdd(&sink[0]->users, -1);
+    return 0;
+}
+
+void sink_pushFrame(const AVFrame *frame) {
+    struct FrameSink *active[SINK_MAX_SINKS];
+
+    if (SDL_AtomicGet(&registered) == 0) {
+        return;
+    }
+
+    uint64_t now = clock_nowUs();
+    int count = sink_acquire(active, -1);
+    for (int i = 0; i < count; i++) {
+        sink_offer(active[i], frame, now);
+        SDL_AtomicAdd(&active[i]->users, -1);
+    }
+}
+
+/*
+    Copies the sink with the given id, or all sinks for -1, from the table into acquired and
+    counts them as used. The caller releases each with SDL_AtomicAdd(&users, -1). Returns the
+    number of sinks acquired.
+*/
+static int sink_acquire(struct FrameSink *acquired[SINK_MAX_SINKS], int id) {
+    int count = 0;
+
+    SDL_AtomicLock(&sinksLock);
+    for (int i = 0; i < SINK_MAX_SINKS; i++) {
+        if (sinks[i] != NULL && (id < 0 || id == i)) {
+            SDL_AtomicAdd(&sinks[i]->users, 1);
+            acquired[count++] = sinks[i];
+        }
+    }
+    SDL_AtomicUnlock(&sinksLock);
+    return count;
+}
+
+/*
+    Adds a reference to frame to the ring of sink. maxFps keeps a schedule instead of a minimum
+    gap, with a quarter interval of slack, so a 60 fps stream capped to 30 fps gives every
+    second frame even with jittery arrival. The schedule restarts after a gap in the stream.
+*/
+static void sink_offer(struct FrameSink *sink, const AVFrame *frame, uint64_t now) {
+    SDL_LockMutex(sink->mutex);
+    sink->stats.offered++;
+
+    if (sink->cfg.maxFps > 0) {
+        uint64_t interval = 1000000 / sink->cfg.maxFps;
+        if (now + interval / 4 < sink->nextDue) {
+            sink->stats.capped++;
+            SDL_UnlockMutex(sink->mutex);
+            return;
+        }
+        sink->nextDue = sink->nextDue + interval > now ? sink->nextDue + interval : now + interval;
+    }
+
+    if (sink->count == sink->cfg.queueLength) {
+        sink->stats.dropped++;
+        if (sink->cfg.drop == SINK_DROP_NEWEST) {
+            SDL_UnlockMutex(sink->mutex);
+            return;
+        }
+        av_frame_unref(sink->frames[sink->nextRead]);
+        sink->nextRead = (sink->nextRead + 1) % sink->cfg.queueLength;
+        sink->count--;
+    }
+
+    AVFrame *slot = sink->frames[(sink->nextRead + sink->count) % sink->cfg.queueLength];
+    if (av_frame_ref(slot, frame) < 0) {
+        sink->stats.dropped++;
+        SDL_UnlockMutex(sink->mutex);
+        return;
+    }
+    sink->count++;
+    SDL_CondSignal(sink->cond);
+    SDL_UnlockMutex(sink->mutex);
+}
+
+static int sink_worker(void *data) {
+    struct FrameSink *sink = data;
+
+    SDL_LockMutex(sink->mutex);
+    while (sink->running) {
+        if (sink->count == 0) {
+            SDL_CondWait(sink->cond, sink->mutex);
+            continue;
+        }
+
+        av_frame_move_ref(sink->current, sink->frames[sink->nextRead]);
+        sink->nextRead = (sink->nextRead + 1) % sink->cfg.queueLength;
+        sink->count--;
+
+        // The decode thread keeps queueing (or dropping) while the callback runs
+        SDL_UnlockMutex(sink->mutex);
+        uint64_t started = clock_nowUs();
+        sink->cfg.cb(sink->current, sink->cfg.userdata);
+        uint64_t us = clock_nowUs() - started;
+        av_frame_unref(sink->current);
+        SDL_LockMutex(sink->mutex);
+
+        sink->stats.delivered++;
+        sink->stats.callbackUs += us;
+        if (us > sink->stats.maxCallbackUs) {
+            sink->stats.maxCallbackUs = us;
+        }
+    }
+    SDL_UnlockMutex(sink->mutex);
+    return 0;
+}
+
+static void sink_free(struct FrameSink *sink) {
+    for (int i = 0; i < SINK_MAX_QUEUE; i++) {
+        av_frame_free(&sink->frames[i]);
+    }
+    av_frame_free(&sink->current);
+    if (sink->cond != NULL) {
+        SDL_DestroyCond(sink->cond);
+    }
+    if (sink->mutex != NULL) {
+        SDL_DestroyMutex(sink->mutex);
+    }
+    memstat_free(MEM_SINKS, sink);
+}
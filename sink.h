@@ -0,0 +1,43 @@
+#ifndef AOAKVM_SINK
+#define AOAKVM_SINK
+
+#include "aoakvm.h"
+
+#define SINK_MAX_SINKS 8
+#define SINK_MAX_QUEUE 16
+#define SINK_DEFAULT_QUEUE 4
+
+/*
+    int sink_add(const struct aoakvmSinkConfig_t *cfg);
+
+    Registers a consumer of the decoded frames, e.g. OCR, a recorder or a monitoring tap. Each
+    sink gets a worker thread and a bounded queue of frame references; the decode thread only
+    references the frame, never copies it and never waits for a callback. cfg is copied.
+    Returns the id of the sink or -1 if SINK_MAX_SINKS are registered.
+*/
+int sink_add(const struct aoakvmSinkConfig_t*);
+
+/*
+    void sink_remove(int id);
+
+    Unregisters the sink and waits for a running callback to return. Queued frames are dropped
+    without calling back, the counts are logged.
+*/
+void sink_remove(int);
+
+/*
+    int sink_getStats(int id, struct aoakvmSinkStats_t *stats);
+
+    Delivery and drop counts of the sink. Returns -1 if id is not registered.
+*/
+int sink_getStats(int, struct aoakvmSinkStats_t*);
+
+/*
+    void sink_pushFrame(const AVFrame *frame);
+
+    Offers frame to every sink, called by fq_pushFrameIntoQueue on the decode thread. Takes a
+    sink's lock only for the queue update, a full queue drops according to its policy.
+*/
+void sink_pushFrame(const AVFrame*);
+
+#endif
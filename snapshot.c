@@ -0,0 +1,354 @@
+#include <stdio.h>
+
+#include <libswscale/swscale.h>
+
+#include "aoakvm.h"
+#include "snapshot.h"
+#include "video.h"
+#include "yuv.h"
+
+// Struct Definition
+
+struct SnapshotJob {
+    AVFrame *frame;
+    enum aoakvm_snapshot_format_e format;
+    char *path;
+    aoakvmSnapshotCallback_t cb;
+    void *userdata;
+    uint32_t requested;
+};
+
+/*
+    struct SnapshotQueue
+
+    Bounded ring of pending requests. Only snapshot_request and the worker touch it.
+*/
+struct SnapshotQueue {
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    SDL_Thread *thread;
+    int running;
+    int nextRead;
+    int count;
+    struct SnapshotJob jobs[SNAPSHOT_QUEUE_LENGTH];
+};
+
+/*
+    struct SnapshotEncoder
+
+    Conversion and encoder state, owned by the worker thread and reused as long as the
+    stream resolution does not change.
+*/
+struct SnapshotEncoder {
+    struct SwsContext *sws;
+    AVCodecContext *png;
+    AVCodecContext *jpeg;
+    AVFrame *converted;
+    AVPacket *pkt;
+    uint8_t *rgba;
+    size_t rgbaSize;
+    int64_t pts;
+};
+
+// Static Functions
+static int snapshot_worker(void *data);
+static void snapshot_process(struct SnapshotJob *job);
+static void snapshot_freeJob(struct SnapshotJob *job);
+
+static int convert_frame(AVFrame *src, enum AVPixelFormat fmt, AVFrame *dst);
+static AVCodecContext *open_encoder(AVCodecContext **ctx, enum AVCodecID id, enum AVPixelFormat fmt, int w, int h);
+static int encode_rgba(AVFrame *frame, const uint8_t **data, size_t *size);
+static int encode_image(AVFrame *frame, enum aoakvm_snapshot_format_e format, const uint8_t **data, size_t *size);
+
+// Local Variables
+static struct SnapshotQueue snapshotQueue;
+static struct SnapshotEncoder encoder;
+
+
+int snapshot_init() {
+    if (snapshotQueue.thread != NULL) {
+        return 0;
+    }
+
+    snapshotQueue.mutex = SDL_CreateMutex();
+    snapshotQueue.cond = SDL_CreateCond();
+    encoder.converted = av_frame_alloc();
+    encoder.pkt = av_packet_alloc();
+    if (!snapshotQueue.mutex || !snapshotQueue.cond || !encoder.converted || !encoder.pkt) {
+        log_error("failed to allocate snapshot worker state");
+        return -1;
+    }
+
+    snapshotQueue.running = 1;
+    snapshotQueue.thread = SDL_CreateThread(snapshot_worker, "snapshotWorker", NULL);
+    if (snapshotQueue.thread == NULL) {
+        log_error("Failed to create snapshot worker: %s", SDL_GetError());
+        return -1;
+    }
+    return 0;
+}
+
+void snapshot_quit() {
+    if (snapshotQueue.thread == NULL) {
+        return;
+    }
+
+    SDL_LockMutex(snapshotQueue.mutex);
+    snapshotQueue.running = 0;
+    SDL_CondSignal(snapshotQueue.cond);
+    SDL_UnlockMutex(snapshotQueue.mutex);
+    SDL_WaitThread(snapshotQueue.thread, NULL);
+    snapshotQueue.thread = NULL;
+
+    while (snapshotQueue.count > 0) {
+        snapshot_freeJob(&snapshotQueue.jobs[snapshotQueue.nextRead]);
+        snapshotQueue.nextRead = (snapshotQueue.nextRead + 1) % SNAPSHOT_QUEUE_LENGTH;
+        snapshotQueue.count--;
+    }
+
+    sws_freeContext(encoder.sws);
+    avcodec_free_context(&encoder.png);
+    avcodec_free_context(&encoder.jpeg);
+    av_frame_free(&encoder.converted);
+    av_packet_free(&encoder.pkt);
+    free(encoder.rgba);
+    memset(&encoder, 0, sizeof(encoder));
+
+    SDL_DestroyCond(snapshotQueue.cond);
+    SDL_DestroyMutex(snapshotQueue.mutex);
+    memset(&snapshotQueue, 0, sizeof(snapshotQueue));
+}
+
+int snapshot_request(enum aoakvm_snapshot_format_e format, const char *path, aoakvmSnapshotCallback_t cb, void *userdata) {
+    if (snapshotQueue.thread == NULL) {
+        return -1;
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    if (frame == NULL || video_refLatestFrame(frame) < 0) {
+        av_frame_free(&frame);
+        return -1;
+    }
+
+    SDL_LockMutex(snapshotQueue.mutex);
+    if (snapshotQueue.count == SNAPSHOT_QUEUE_LENGTH) {
+        SDL_UnlockMutex(snapshotQueue.mutex);
+        av_frame_free(&frame);
+        return -2;
+    }
+
+    struct SnapshotJob *job = &snapshotQueue.jobs[(snapshotQueue.nextRead + snapshotQueue.count) % SNAPSHOT_QUEUE_LENGTH];
+    job->frame = frame;
+    job->format = format;
+    job->path = path ? strdup(path) : NULL;
+    job->cb = cb;
+    job->userdata = userdata;
+    job->requested = SDL_GetTicks();
+    snapshotQueue.count++;
+    SDL_CondSignal(snapshotQueue.cond);
+    SDL_UnlockMutex(snapshotQueue.mutex);
+    return 0;
+}
+
+static int snapshot_worker(void *data) {
+    struct SnapshotJob job;
+
+    SDL_LockMutex(snapshotQueue.mutex);
+    while (snapshotQueue.running) {
+        if (snapshotQueue.count == 0) {
+            SDL_CondWait(snapshotQueue.cond, snapshotQueue.mutex);
+            continue;
+        }
+
+        job = snapshotQueue.jobs[snapshotQueue.nextRead];
+        snapshotQueue.nextRead = (snapshotQueue.nextRead + 1) % SNAPSHOT_QUEUE_LENGTH;
+        snapshotQueue.count--;
+
+        // Encode without holding the lock so requests are never blocked by the encoder
+        SDL_UnlockMutex(snapshotQueue.mutex);
+        snapshot_process(&job);
+        snapshot_freeJob(&job);
+        SDL_LockMutex(snapshotQueue.mutex);
+    }
+    SDL_UnlockMutex(snapshotQueue.mutex);
+    return 0;
+}
+
+static void snapshot_process(struct SnapshotJob *job) {
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    int64_t pts = job->frame->pts;
+    int ret;
+
+    if (job->format == SNAPSHOT_RGBA) {
+        ret = encode_rgba(job->frame, &data, &size);
+    } else {
+        ret = encode_image(job->frame, job->format, &data, &size);
+    }
+
+    if (ret >= 0 && job->path != NULL) {
+        FILE *fp = fopen(job->path, "wb");
+        if (fp == NULL || fwrite(data, 1, size, fp) != size) {
+            log_error("Could not write snapshot to %s", job->path);
+            ret = -1;
+        }
+        if (fp != NULL) {
+            fclose(fp);
+        }
+    }
+
+    if (job->cb == NULL) {
+        return;
+    }
+
+    if (ret < 0) {
+        job->cb(ret, NULL, job->userdata);
+        return;
+    }
+
+    struct aoakvmSnapshot_t snapshot = {
+        .format = job->format,
+        .width = job->frame->width,
+        .height = job->frame->height,
+        .data = data,
+        .size = size,
+        .pts = pts,
+        .requested = job->requested,
+        .finished = SDL_GetTicks(),
+        .path = job->path,
+    };
+    job->cb(0, &snapshot, job->userdata);
+}
+
+static void snapshot_freeJob(struct SnapshotJob *job) {
+    av_frame_free(&job->frame);
+    free(job->path);
+    job->path = NULL;
+}
+
+static int convert_frame(AVFrame *src, enum AVPixelFormat fmt, AVFrame *dst) {
+    if (dst->width != src->width || dst->height != src->height || dst->format != fmt) {
+        av_frame_unref(dst);
+        dst->width = src->width;
+        dst->height = src->height;
+        dst->format = fmt;
+        if (av_frame_get_buffer(dst, 0) < 0) {
+            log_error("failed to allocate snapshot conversion buffer");
+            av_frame_unref(dst);
+            return -1;
+        }
+    }
+
+    encoder.sws = sws_getCachedContext(encoder.sws, src->width, src->height, src->format,
+                                       dst->width, dst->height, fmt, SWS_POINT, NULL, NULL, NULL);
+    if (encoder.sws == NULL) {
+        log_error("No conversion from %s for snapshots", av_get_pix_fmt_name(src->format));
+        return -1;
+    }
+
+    sws_scale(encoder.sws, (const uint8_t * const *)src->data, src->linesize, 0, src->height, dst->data, dst->linesize);
+    return 0;
+}
+
+static AVCodecContext *open_encoder(AVCodecContext **ctx, enum AVCodecID id, enum AVPixelFormat fmt, int w, int h) {
+    if (*ctx != NULL && (*ctx)->width == w && (*ctx)->height == h) {
+        return *ctx;
+    }
+    avcodec_free_context(ctx);
+
+    AVCodec *codec = avcodec_find_encoder(id);
+    if (codec == NULL) {
+        log_error("No %s encoder available for snapshots", avcodec_get_name(id));
+        return NULL;
+    }
+
+    *ctx = avcodec_alloc_context3(codec);
+    if (*ctx == NULL) {
+        return NULL;
+    }
+    (*ctx)->width = w;
+    (*ctx)->height = h;
+    (*ctx)->pix_fmt = fmt;
+    (*ctx)->time_base = (AVRational){1, 25};
+    // Favour encode time over size, snapshots are taken many times per second
+    (*ctx)->compression_level = 1;
+
+    if (avcodec_open2(*ctx, codec, NULL) < 0) {
+        log_error("could not open %s encoder", avcodec_get_name(id));
+        avcodec_free_context(ctx);
+        return NULL;
+    }
+    return *ctx;
+}
+
+static int encode_rgba(AVFrame *frame, const uint8_t **data, size_t *size) {
+    size_t needed = (size_t)frame->width * frame->height * 4;
+    if (needed > encoder.rgbaSize) {
+        uint8_t *buf = realloc(encoder.rgba, needed);
+        if (buf == NULL) {
+            return AVERROR(ENOMEM);
+        }
+        encoder.rgba = buf;
+        encoder.rgbaSize = needed;
+    }
+
+    *data = encoder.rgba;
+    *size = needed;
+
+    // The SIMD kernels cover the decoder's formats, libswscale anything else
+    if (yuv_toRgb(frame, AV_PIX_FMT_RGBA, encoder.rgba, frame->width * 4) == 0) {
+        return 0;
+    }
+
+    encoder.sws = sws_getCachedContext(encoder.sws, frame->width, frame->height, frame->format,
+                                       frame->width, frame->height, AV_PIX_FMT_RGBA, SWS_POINT, NULL, NULL, NULL);
+    if (encoder.sws == NULL) {
+        return -1;
+    }
+
+    uint8_t *dst[4] = { encoder.rgba, NULL, NULL, NULL };
+    int dstStride[4] = { frame->width * 4, 0, 0, 0 };
+    sws_scale(encoder.sws, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height, dst, dstStride);
+    return 0;
+}
+
+static int encode_image(AVFrame *frame, enum aoakvm_snapshot_format_e format, const uint8_t **data, size_t *size) {
+    AVCodecContext *ctx;
+    AVFrame *in = frame;
+
+    if (format == SNAPSHOT_PNG) {
+        ctx = open_encoder(&encoder.png, AV_CODEC_ID_PNG, AV_PIX_FMT_RGB24, frame->width, frame->height);
+        if (ctx == NULL || convert_frame(frame, AV_PIX_FMT_RGB24, encoder.converted) < 0) {
+            return -1;
+        }
+        in = encoder.converted;
+    } else {
+        ctx = open_encoder(&encoder.jpeg, AV_CODEC_ID_MJPEG, AV_PIX_FMT_YUVJ420P, frame->width, frame->height);
+        if (ctx == NULL) {
+            return -1;
+        }
+        // The decoder's YUV420P planes are used as is, only the range flag differs
+        if (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P) {
+            frame->format = AV_PIX_FMT_YUVJ420P;
+        } else if (convert_frame(frame, AV_PIX_FMT_YUVJ420P, encoder.converted) < 0) {
+            return -1;
+        } else {
+            in = encoder.converted;
+        }
+    }
+
+    in->pts = encoder.pts++;
+    av_packet_unref(encoder.pkt);
+    int ret = avcodec_send_frame(ctx, in);
+    if (ret >= 0) {
+        ret = avcodec_receive_packet(ctx, encoder.pkt);
+    }
+    if (ret < 0) {
+        log_error("Encoding snapshot failed: %d", ret);
+        return ret;
+    }
+
+    *data = encoder.pkt->data;
+    *size = encoder.pkt->size;
+    return 0;
+}
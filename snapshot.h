@@ -0,0 +1,34 @@
+#ifndef AOAKVM_SNAPSHOT
+#define AOAKVM_SNAPSHOT
+
+#include "aoakvm.h"
+
+#define SNAPSHOT_QUEUE_LENGTH 8
+
+/*
+    int snapshot_init();
+
+    Starts the snapshot worker thread. Called by invoke_aoakvm, calling it again is a no-op.
+*/
+int snapshot_init();
+
+/*
+    void snapshot_quit();
+
+    Stops the worker. Pending requests are dropped without invoking their callbacks.
+*/
+void snapshot_quit();
+
+/*
+    int snapshot_request(enum aoakvm_snapshot_format_e format, const char *path,
+                         aoakvmSnapshotCallback_t cb, void *userdata);
+
+    Takes a reference to the last decoded frame and queues it for encoding. The frame is never
+    copied on the calling thread and neither the decoder nor the renderer wait for the encoder.
+    If path is not NULL the result is written to that file, if cb is not NULL it is called with
+    the encoded data. Returns 0 if queued, -1 if no frame is available yet and -2 if
+    SNAPSHOT_QUEUE_LENGTH requests are already pending.
+*/
+int snapshot_request(enum aoakvm_snapshot_format_e, const char*, aoakvmSnapshotCallback_t, void*);
+
+#endif
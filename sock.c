@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "aoakvm_log.h"
+#include "sock.h"
+
+#define SOCK_BACKLOG 16
+
+// Static Functions
+static int listen_unix(const char *path);
+static int listen_tcp(const char *hostport);
+
+
+int sock_setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int sock_listen(const char *address) {
+    int fd;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        fd = listen_unix(address + 5);
+    } else if (strncmp(address, "tcp:", 4) == 0) {
+        fd = listen_tcp(address + 4);
+    } else {
+        log_error("Unknown socket address %s (expected unix:<path> or tcp:[host:]port)", address);
+        return -1;
+    }
+
+    if (fd >= 0) {
+        log_info("Listening on %s", address);
+    }
+    return fd;
+}
+
+int sock_accept(int listenFd) {
+    int fd = accept(listenFd, NULL, NULL);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (sock_setNonBlocking(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Only meaningful for TCP, fails harmlessly on unix sockets
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("Socket path too long: %s", path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_error("socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOCK_BACKLOG) < 0 || sock_setNonBlocking(fd) < 0) {
+        log_error("Could not listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_tcp(const char *hostport) {
+    char host[256] = "127.0.0.1";
+    const char *port = hostport;
+    const char *colon = strrchr(hostport, ':');
+
+    if (colon != NULL) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - hostport), hostport);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int ret = getaddrinfo(host, port, &hints, &res);
+    if (ret != 0) {
+        log_error("Could not resolve %s: %s", hostport, gai_strerror(ret));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOCK_BACKLOG) == 0 && sock_setNonBlocking(fd) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        log_error("Could not listen on tcp:%s", hostport);
+    }
+    return fd;
+}
@@ -0,0 +1,24 @@
+#ifndef AOAKVM_SOCK
+#define AOAKVM_SOCK
+
+/*
+    int sock_listen(const char *address);
+
+    Opens a non-blocking listening socket. Supported addresses:
+        unix:/path/to/socket    Unix domain socket, an existing file at the path is replaced
+        tcp:port                TCP on 127.0.0.1
+        tcp:host:port           TCP on the given host
+    Returns the file descriptor or -1.
+*/
+int sock_listen(const char*);
+
+/*
+    int sock_accept(int listenFd);
+
+    Accepts a pending connection and makes it non-blocking. Returns -1 if there is none.
+*/
+int sock_accept(int);
+
+int sock_setNonBlocking(int);
+
+#endif
@@ -0,0 +1,99 @@
+/*
+    audio_test
+
+    Plays the silence of the mock phone's audio interface and stops it ROUNDS times while the
+    mock takes CANCEL_DELAY_MS to report cancelled transfers back. audio_stop has to wait for
+    them, and afterwards the transport memory has to be back where it was before audio_start.
+    Exits with 1 on the first failure:
+
+        cc -O2 -I.. audio_test.c ../[a-z]*.c \
+            $(pkg-config --cflags --libs sdl2 libavformat libavcodec libavutil libswscale libusb-1.0) \
+            -o audio_test
+        ./audio_test
+*/
+#include <stdio.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "audio.h"
+#include "memstat.h"
+#include "usb.h"
+
+#define ROUNDS 3
+#define PLAY_MS 300
+/* Longer than a transfer and than the interval of audio_stop's repeated cancels */
+#define CANCEL_DELAY_MS 700
+
+// Static Functions
+static int play_and_stop(const struct aoakvmAudioConfig_t *cfg, libusb_device_handle *handle);
+
+
+int main() {
+    struct aoakvmMockConfig_t mock = { .audio = 1, .cancelDelay = CANCEL_DELAY_MS };
+    struct aoakvmAudioConfig_t audioCfg = { .device = NULL };
+    struct aoakvmConfig_t cfg = {
+        .manufacturer = "aoakvm", .modelName = "audio_test", .description = "audio test",
+        .version = "1", .uri = "-", .serialNumber = "0", .headless = 1, .mock = &mock, .audio = &audioCfg,
+    };
+    libusb_device_handle *handle = NULL;
+    int ret = 0;
+
+    // Tests run without a sound card
+    SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+    if (SDL_Init(SDL_INIT_EVENTS) < 0) {
+        fprintf(stderr, "audio_test: %s\n", SDL_GetError());
+        return 1;
+    }
+    for (int i = 0; i < 10 && handle == NULL; i++) {
+        handle = usb_getHandle(&cfg, NULL);
+    }
+    if (handle == NULL) {
+        fprintf(stderr, "audio_test: the mock phone did not switch to accessory mode\n");
+        return 1;
+    }
+
+    for (int i = 0; i < ROUNDS && ret == 0; i++) {
+        ret = play_and_stop(&audioCfg, handle);
+    }
+    usb_transport()->close(handle);
+    if (ret == 0) {
+        printf("audio_test: %d rounds passed\n", ROUNDS);
+    }
+    return ret;
+}
+
+static int play_and_stop(const struct aoakvmAudioConfig_t *cfg, libusb_device_handle *handle) {
+    struct aoakvmMemCounter_t before[MEM_SUBSYSTEMS];
+    struct aoakvmMemCounter_t after[MEM_SUBSYSTEMS];
+    struct aoakvmAudioStats_t stats;
+
+    memstat_get(before);
+    if (audio_start(cfg, handle) < 0) {
+        fprintf(stderr, "audio_test: audio_start failed\n");
+        return 1;
+    }
+    SDL_Delay(PLAY_MS);
+    if (audio_getStats(&stats) < 0 || stats.bytes == 0) {
+        fprintf(stderr, "audio_test: no audio arrived in %d ms\n", PLAY_MS);
+        return 1;
+    }
+
+    uint64_t started = clock_nowUs();
+    audio_stop();
+    uint64_t waited = clock_nowUs() - started;
+    memstat_get(after);
+
+    printf("audio_test: %llu bytes played, stop took %llu ms\n", (unsigned long long)stats.bytes,
+        (unsigned long long)(waited / 1000));
+    if (waited < CANCEL_DELAY_MS * 1000) {
+        fprintf(stderr, "audio_test: audio_stop returned before the cancelled transfers called back\n");
+        return 1;
+    }
+    if (after[MEM_TRANSPORT].objects != before[MEM_TRANSPORT].objects ||
+        after[MEM_TRANSPORT].bytes != before[MEM_TRANSPORT].bytes) {
+        fprintf(stderr, "audio_test: %lld transport objects before audio_start, %lld after audio_stop\n",
+            (long long)before[MEM_TRANSPORT].objects, (long long)after[MEM_TRANSPORT].objects);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,227 @@
+/*
+    codec_benchmark [width height [frames]]
+
+    Encodes the same synthetic screen content, a scrolling page under a moving window, with
+    the H.264, HEVC and AV1 encoders of this libavcodec at the same CRF and without B-frames,
+    like a phone streams. Decodes it again with the decoder and the flags video_openStream
+    uses and prints per codec the bitrate at FPS frames per second and the decode CPU time
+    per frame. Codecs without an encoder are skipped. Defaults to 1280x720 and 300 frames:
+
+        cc -O2 -I.. codec_benchmark.c ../aoakvm_log.c ../aoakvm_clock.c \
+            $(pkg-config --cflags --libs sdl2 libavcodec libavutil) -o codec_benchmark
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libavutil/opt.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+
+#define FPS 30
+#define CRF "28"
+#define GOP_FRAMES (2 * FPS)
+
+/* The encoded clip, one packet after the other */
+struct clip_t {
+    AVPacket **packets;
+    int count;
+    uint64_t bytes;
+};
+
+// Static Functions
+static int encode(enum AVCodecID id, int width, int height, int frames, struct clip_t *clip);
+static int drain_encoder(AVCodecContext *enc, AVPacket *pkt, struct clip_t *clip);
+static int decode(enum AVCodecID id, const struct clip_t *clip, int *decoded, uint64_t *cpuUs);
+static void draw_content(AVFrame *frame, int n);
+static void free_clip(struct clip_t *clip);
+
+// Local Variables
+static const enum AVCodecID codecs[] = { AV_CODEC_ID_H264, AV_CODEC_ID_HEVC, AV_CODEC_ID_AV1 };
+
+
+int main(int argc, char **argv) {
+    int width = argc > 2 ? atoi(argv[1]) : 1280;
+    int height = argc > 2 ? atoi(argv[2]) : 720;
+    int frames = argc > 3 ? atoi(argv[3]) : 300;
+    int ret = 0;
+
+    if (width <= 0 || height <= 0 || frames <= 0 || width % 2 || height % 2) {
+        fprintf(stderr, "usage: codec_benchmark [width height [frames]], even sizes\n");
+        return 1;
+    }
+
+    for (int i = 0; i < (int)(sizeof(codecs) / sizeof(codecs[0])); i++) {
+        struct clip_t clip = { NULL, 0, 0 };
+        uint64_t cpuUs = 0;
+        int decoded = 0;
+
+        if (avcodec_find_encoder(codecs[i]) == NULL) {
+            printf("%-5s no encoder in this libavcodec\n", avcodec_get_name(codecs[i]));
+            continue;
+        }
+        if (encode(codecs[i], width, height, frames, &clip) < 0 || decode(codecs[i], &clip, &decoded, &cpuUs) < 0) {
+            fprintf(stderr, "codec_benchmark: %s failed\n", avcodec_get_name(codecs[i]));
+            free_clip(&clip);
+            ret = 1;
+            continue;
+        }
+        printf("%-5s %dx%d: %6llu kbit/s, %6llu us decode CPU per frame, %d of %d frames decoded\n",
+            avcodec_get_name(codecs[i]), width, height,
+            (unsigned long long)(clip.bytes * 8 * FPS / frames / 1000),
+            (unsigned long long)(decoded > 0 ? cpuUs / decoded : 0), decoded, frames);
+        free_clip(&clip);
+    }
+    return ret;
+}
+
+static int encode(enum AVCodecID id, int width, int height, int frames, struct clip_t *clip) {
+    const AVCodec *codec = avcodec_find_encoder(id);
+    AVCodecContext *enc = avcodec_alloc_context3(codec);
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *pkt = av_packet_alloc();
+    int ret = -1;
+
+    if (enc == NULL || frame == NULL || pkt == NULL) {
+        goto done;
+    }
+    enc->width = width;
+    enc->height = height;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->time_base = (AVRational){ 1, FPS };
+    enc->framerate = (AVRational){ FPS, 1 };
+    enc->gop_size = GOP_FRAMES;
+    enc->max_b_frames = 0;
+    // Same quality for all, the encoders without a CRF option fall back to their default rate
+    if (enc->priv_data == NULL || av_opt_set(enc->priv_data, "crf", CRF, 0) < 0) {
+        log_warn("codec_benchmark: %s has no crf option", codec->name);
+    }
+    if (avcodec_open2(enc, codec, NULL) < 0) {
+        goto done;
+    }
+
+    frame->format = enc->pix_fmt;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        goto done;
+    }
+    for (int n = 0; n < frames; n++) {
+        if (av_frame_make_writable(frame) < 0) {
+            goto done;
+        }
+        draw_content(frame, n);
+        frame->pts = n;
+        if (avcodec_send_frame(enc, frame) < 0 || drain_encoder(enc, pkt, clip) < 0) {
+            goto done;
+        }
+    }
+    if (avcodec_send_frame(enc, NULL) < 0 || drain_encoder(enc, pkt, clip) < 0) {
+        goto done;
+    }
+    log_info("codec_benchmark: %s encoded with %s", avcodec_get_name(id), codec->name);
+    ret = 0;
+
+done:
+    avcodec_free_context(&enc);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+static int drain_encoder(AVCodecContext *enc, AVPacket *pkt, struct clip_t *clip) {
+    int ret;
+
+    while ((ret = avcodec_receive_packet(enc, pkt)) == 0) {
+        // Without B-frames an encoder gives at most one packet per frame, plus a few when flushed
+        AVPacket **packets = realloc(clip->packets, (clip->count + 1) * sizeof(AVPacket *));
+        if (packets == NULL) {
+            av_packet_unref(pkt);
+            return -1;
+        }
+        clip->packets = packets;
+        clip->bytes += pkt->size;
+        clip->packets[clip->count++] = av_packet_clone(pkt);
+        av_packet_unref(pkt);
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/* Thread CPU time of avcodec_send_packet and avcodec_receive_frame, as video_countDecodeTime counts it */
+static int decode(enum AVCodecID id, const struct clip_t *clip, int *decoded, uint64_t *cpuUs) {
+    const AVCodec *codec = avcodec_find_decoder(id);
+    AVCodecContext *dec = codec != NULL ? avcodec_alloc_context3(codec) : NULL;
+    AVFrame *frame = av_frame_alloc();
+    int ret = -1;
+
+    if (dec == NULL || frame == NULL) {
+        goto done;
+    }
+    dec->flags2 |= AV_CODEC_FLAG2_FAST;
+    if (avcodec_open2(dec, codec, NULL) < 0) {
+        goto done;
+    }
+
+    for (int i = 0; i <= clip->count; i++) {
+        uint64_t cpu = clock_threadCpuUs();
+        // NULL after the last packet flushes the decoder
+        int sent = avcodec_send_packet(dec, i < clip->count ? clip->packets[i] : NULL);
+        while (sent >= 0 && avcodec_receive_frame(dec, frame) == 0) {
+            (*decoded)++;
+            av_frame_unref(frame);
+        }
+        *cpuUs += clock_threadCpuUs() - cpu;
+        if (sent < 0) {
+            goto done;
+        }
+    }
+    ret = 0;
+
+done:
+    avcodec_free_context(&dec);
+    av_frame_free(&frame);
+    return ret;
+}
+
+/*
+    A light page of text lines that scrolls up by 2 pixels per frame, and a dark window with a
+    coloured title bar that moves across it. Typical of a phone screen: mostly static detail,
+    some of it moving.
+*/
+static void draw_content(AVFrame *frame, int n) {
+    int winW = frame->width / 3;
+    int winH = frame->height / 3;
+    int winX = (n * 4) % (frame->width - winW);
+    int winY = frame->height / 4 + (n % 60 < 30 ? n % 30 : 30 - n % 30) * 2;
+
+    for (int y = 0; y < frame->height; y++) {
+        uint8_t *row = frame->data[0] + y * frame->linesize[0];
+        int line = (y + n * 2) % 24;
+        for (int x = 0; x < frame->width; x++) {
+            // Words of varying length on every text line
+            int ink = line >= 6 && line < 16 && ((x / 7 + (y + n * 2) / 24 * 3) % 11) < 8 && (x / 3) % 3;
+            row[x] = ink ? 60 : 220;
+            if (x >= winX && x < winX + winW && y >= winY && y < winY + winH) {
+                row[x] = y < winY + 24 ? 110 : 40 + ((x - winX) ^ (y - winY)) % 32;
+            }
+        }
+    }
+    for (int y = 0; y < frame->height / 2; y++) {
+        uint8_t *u = frame->data[1] + y * frame->linesize[1];
+        uint8_t *v = frame->data[2] + y * frame->linesize[2];
+        for (int x = 0; x < frame->width / 2; x++) {
+            int title = x * 2 >= winX && x * 2 < winX + winW && y * 2 >= winY && y * 2 < winY + 24;
+            u[x] = title ? 170 : 128;
+            v[x] = title ? 90 : 128;
+        }
+    }
+}
+
+static void free_clip(struct clip_t *clip) {
+    for (int i = 0; i < clip->count; i++) {
+        av_packet_free(&clip->packets[i]);
+    }
+    free(clip->packets);
+    clip->packets = NULL;
+    clip->count = 0;
+}
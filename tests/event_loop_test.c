@@ -0,0 +1,54 @@
+/*
+    event_loop_test
+
+    Runs aoakvm_run_event_loop with a connected phone and no input for IDLE_MS and checks with
+    aoakvm_get_event_loop_stats that it sleeps: at most one wakeup per EVENT_LOOP_WAIT_MS and
+    less than MAX_CPU_PERMILLE of the wall time on the CPU. Exits with 1 if it busy-waits:
+
+        cc -O2 -I.. event_loop_test.c ../[a-z]*.c \
+            $(pkg-config --cflags --libs sdl2 libavformat libavcodec libavutil libswscale libusb-1.0) \
+            -o event_loop_test
+        SDL_VIDEODRIVER=dummy ./event_loop_test
+*/
+#include <stdio.h>
+
+#include "aoakvm.h"
+
+#define IDLE_MS 3000
+#define MAX_CPU_PERMILLE 10
+
+// Static Functions
+static int loop_thread(void *data);
+
+
+int main() {
+    struct aoakvmUSBConnection_t con = { .handle = NULL, .status = CONNECTED };
+    struct aoakvmEventLoopStats_t stats;
+
+    if (SDL_Init(SDL_INIT_EVENTS) < 0) {
+        fprintf(stderr, "event_loop_test: %s\n", SDL_GetError());
+        return 1;
+    }
+    usbCon = &con;
+    if (SDL_CreateThread(loop_thread, "eventLoop", NULL) == NULL) {
+        fprintf(stderr, "event_loop_test: %s\n", SDL_GetError());
+        return 1;
+    }
+    SDL_Delay(IDLE_MS);
+
+    // The loop never returns, the process exit ends it
+    aoakvm_get_event_loop_stats(&stats);
+    printf("event_loop_test: %llu wakeups, %llu events, %llu us CPU in %llu us\n",
+        (unsigned long long)stats.wakeups, (unsigned long long)stats.events,
+        (unsigned long long)stats.cpuUs, (unsigned long long)stats.wallUs);
+    if (stats.wallUs == 0 || stats.wakeups > IDLE_MS / EVENT_LOOP_WAIT_MS + 2 ||
+        stats.cpuUs * 1000 > stats.wallUs * MAX_CPU_PERMILLE) {
+        fprintf(stderr, "event_loop_test: the idle loop does not sleep\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int loop_thread(void *data) {
+    return aoakvm_run_event_loop();
+}
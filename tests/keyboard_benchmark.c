@@ -0,0 +1,78 @@
+/*
+    keyboard_benchmark [events]
+
+    Feeds key down and up events through keyboard_handleEvent in boot and in NKRO mode and
+    prints the events per second of each. Every key is held while the next three go down and
+    every 16th key is a shift, so reports carry modifiers and several keys. The usb functions
+    are replaced by stubs that only count the reports. Defaults to 1000000 events:
+
+        cc -O2 -I.. keyboard_benchmark.c ../keyboard.c ../aoakvm_log.c ../aoakvm_clock.c \
+            $(pkg-config --cflags --libs sdl2 libavcodec libavformat libusb-1.0) -o keyboard_benchmark
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "keyboard.h"
+#include "usb.h"
+
+// Static Functions
+static SDL_Scancode key_at(int key);
+static uint64_t time_events(int events);
+
+// Local Variables
+static int nkro;
+static int reports;
+
+
+int main(int argc, char **argv) {
+    int events = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    if (events <= 0) {
+        fprintf(stderr, "usage: keyboard_benchmark [events]\n");
+        return 1;
+    }
+
+    for (nkro = 0; nkro < 2; nkro++) {
+        reports = 0;
+        uint64_t us = time_events(events);
+        keyboard_releaseAll();
+        printf("%s: %10llu events/s, %d reports\n", nkro ? "nkro" : "boot",
+            (unsigned long long)(us > 0 ? events * 1000000ULL / us : 0), reports);
+    }
+    return 0;
+}
+
+int usb_sendHidEvent(int hidId, unsigned char *report, uint16_t length) {
+    (void)hidId;
+    (void)report;
+    (void)length;
+    reports++;
+    return 0;
+}
+
+int usb_hasNkroKeyboard() {
+    return nkro;
+}
+
+static SDL_Scancode key_at(int key) {
+    if (key % 16 == 0) {
+        return SDL_SCANCODE_LSHIFT;
+    }
+    return SDL_SCANCODE_A + (key % 36 + 36) % 36;
+}
+
+/* Every event is a key down of key i or the key up of key i - 3 */
+static uint64_t time_events(int events) {
+    SDL_Event event = { 0 };
+    uint64_t started = clock_nowUs();
+
+    for (int i = 0; i < events; i++) {
+        int key = i / 2;
+        event.type = i % 2 == 0 ? SDL_KEYDOWN : SDL_KEYUP;
+        event.key.keysym.scancode = key_at(i % 2 == 0 ? key : key - 3);
+        keyboard_handleEvent(&event);
+    }
+    return clock_nowUs() - started;
+}
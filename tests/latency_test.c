@@ -0,0 +1,62 @@
+/*
+    latency_test
+
+    Measures SAMPLES touches against the simulated device with latency_runSimulated on a
+    software renderer. Every sample has to show up in both the decode and the present
+    histogram, and presenting cannot come before decoding. Exits with 1 otherwise:
+
+        cc -O2 -I.. latency_test.c ../[a-z]*.c \
+            $(pkg-config --cflags --libs sdl2 libavformat libavcodec libavutil libswscale libusb-1.0) \
+            -o latency_test
+        SDL_VIDEODRIVER=dummy ./latency_test
+*/
+#include <stdio.h>
+
+#include "aoakvm.h"
+#include "latency.h"
+
+#define SAMPLES 10
+/* Between a report and the frame that shows it */
+#define SIM_DELAY_US 5000
+
+
+int main() {
+    struct aoakvmLatencyConfig_t cfg = {
+        .hid = HID_ID_TOUCHPAD, .x = 5000, .y = 5000,
+        // The touch square of the simulated device is drawn around the center of its frame
+        .region = { LATENCY_SIM_WIDTH / 2 - LATENCY_SIM_CURSOR / 4, LATENCY_SIM_HEIGHT / 2 - LATENCY_SIM_CURSOR / 4,
+                    LATENCY_SIM_CURSOR / 2, LATENCY_SIM_CURSOR / 2 },
+        .threshold = 20, .samples = SAMPLES, .interval = 50, .timeout = 500,
+        .simulate = 1, .simDelay = SIM_DELAY_US,
+    };
+    struct aoakvmLatencyStats_t stats;
+
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        fprintf(stderr, "latency_test: %s\n", SDL_GetError());
+        return 1;
+    }
+    mainwindow = SDL_CreateWindow("latency_test", 0, 0, LATENCY_SIM_WIDTH, LATENCY_SIM_HEIGHT, SDL_WINDOW_HIDDEN);
+    renderer = mainwindow != NULL ? SDL_CreateRenderer(mainwindow, -1, SDL_RENDERER_SOFTWARE) : NULL;
+    if (renderer == NULL) {
+        fprintf(stderr, "latency_test: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    if (latency_runSimulated(&cfg, renderer) < 0 || latency_getStats(&stats) < 0) {
+        fprintf(stderr, "latency_test: the measurement did not start\n");
+        return 1;
+    }
+    printf("latency_test: %llu samples, %llu lost, decode p50 %llu us, present p50 %llu us\n",
+        (unsigned long long)stats.samples, (unsigned long long)stats.lost,
+        (unsigned long long)stats.decode.p50, (unsigned long long)stats.present.p50);
+    if (stats.lost > 0 || stats.decode.count != SAMPLES || stats.present.count != SAMPLES) {
+        fprintf(stderr, "latency_test: %llu decoded and %llu presented of %d samples\n",
+            (unsigned long long)stats.decode.count, (unsigned long long)stats.present.count, SAMPLES);
+        return 1;
+    }
+    if (stats.decode.min < SIM_DELAY_US || stats.present.min < stats.decode.min) {
+        fprintf(stderr, "latency_test: a change was seen before it was made\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+    mock_benchmark [cycles [reenumerateMs]]
+
+    Connects to the mock phone, reads its stream through the AVIO reader of the session until
+    it unplugs after STREAM_MS and tears the session down, cycles times (default 10). Prints
+    for every connection the phases of the startup profile, the time from the unplug to the
+    new handle and the ingest throughput of the unthrottled bulk endpoint. reenumerateMs
+    (default 0) is how long the phone is gone after AOA_START and after the unplug, with 0
+    only the host side is measured:
+
+        cc -O2 -I.. mock_benchmark.c ../[a-z]*.c \
+            $(pkg-config --cflags --libs sdl2 libavformat libavcodec libavutil libswscale libusb-1.0) \
+            -o mock_benchmark
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "profile.h"
+#include "usb.h"
+#include "video.h"
+
+#define STREAM_MS 500
+#define CONNECT_TIMEOUT_US 5000000
+
+// Static Functions
+static int fill_pattern(unsigned char *buf, int length, void *userdata);
+static uint64_t phase_us(const struct aoakvmStartupProfile_t *profile, enum aoakvm_startup_phase_e phase);
+
+// Local Variables
+static const struct { enum aoakvm_startup_phase_e phase; const char *name; } phases[] = {
+    { PHASE_ENUMERATE, "enumerate" },
+    { PHASE_AOA_SWITCH, "aoa" },
+    { PHASE_REENUMERATE, "reenumerate" },
+    { PHASE_HID_REGISTER, "hid" },
+};
+
+
+int main(int argc, char **argv) {
+    int cycles = argc > 1 ? atoi(argv[1]) : 10;
+    struct aoakvmMockConfig_t mock = {
+        .reenumerateDelay = argc > 2 ? atoi(argv[2]) : 0,
+        .generator = fill_pattern,
+        .disconnectAfter = STREAM_MS,
+    };
+    struct aoakvmConfig_t cfg = {
+        .manufacturer = "aoakvm", .modelName = "mock_benchmark", .description = "mock benchmark",
+        .version = "1", .uri = "-", .serialNumber = "0", .headless = 1, .mock = &mock,
+    };
+    struct aoakvmUSBConnection_t con = { .handle = NULL, .status = NOT_CONNECTED };
+    struct aoakvmAVCtx_t av = { NULL, NULL };
+    uint64_t unplugged = 0;
+    uint64_t reconnectTotal = 0, reconnectMax = 0, bytesTotal = 0, streamTotal = 0, cpuTotal = 0;
+
+    if (cycles <= 0) {
+        fprintf(stderr, "usage: mock_benchmark [cycles [reenumerateMs]]\n");
+        return 1;
+    }
+    if (SDL_Init(SDL_INIT_EVENTS) < 0) {
+        fprintf(stderr, "mock_benchmark: %s\n", SDL_GetError());
+        return 1;
+    }
+    usbCon = &con;
+
+    for (int i = 0; i < cycles; i++) {
+        struct aoakvmStartupProfile_t profile;
+        uint64_t started = clock_nowUs();
+
+        profile_newConnection();
+        while ((con.handle = usb_getHandle(&cfg, NULL)) == NULL) {
+            if (clock_nowUs() - started > CONNECT_TIMEOUT_US) {
+                fprintf(stderr, "mock_benchmark: no connection within %d ms\n", CONNECT_TIMEOUT_US / 1000);
+                return 1;
+            }
+        }
+        uint64_t connected = clock_nowUs();
+        if (usb_registerHIDS(con.handle) < 0) {
+            fprintf(stderr, "mock_benchmark: HID registration failed\n");
+            return 1;
+        }
+        profile_get(&profile);
+        printf("connection %2d: %6llu us to the handle", i + 1, (unsigned long long)(connected - started));
+        for (int p = 0; p < (int)(sizeof(phases) / sizeof(phases[0])); p++) {
+            printf(", %s %llu us", phases[p].name, (unsigned long long)phase_us(&profile, phases[p].phase));
+        }
+        if (unplugged != 0) {
+            uint64_t reconnect = connected - unplugged;
+            reconnectTotal += reconnect;
+            reconnectMax = SDL_max(reconnectMax, reconnect);
+            printf(", %llu us since the unplug", (unsigned long long)reconnect);
+        }
+        printf("\n");
+
+        AVIOContext *reader = video_setupAVContext(con.handle);
+        if (reader == NULL) {
+            fprintf(stderr, "mock_benchmark: no reader\n");
+            return 1;
+        }
+        unsigned char buf[16 * 1024];
+        uint64_t bytes = 0;
+        uint64_t cpu = clock_threadCpuUs();
+        uint64_t streaming = clock_nowUs();
+        int n;
+        while ((n = avio_read(reader, buf, sizeof(buf))) > 0) {
+            bytes += n;
+        }
+        unplugged = clock_nowUs();
+        bytesTotal += bytes;
+        streamTotal += unplugged - streaming;
+        cpuTotal += clock_threadCpuUs() - cpu;
+
+        video_closeStream(&reader, &av);
+        usb_closeHandle();
+    }
+
+    printf("%d connections, reconnect avg %llu us max %llu us, ingest %llu MB/s at %llu us CPU per MB\n",
+        cycles, (unsigned long long)(cycles > 1 ? reconnectTotal / (cycles - 1) : 0), (unsigned long long)reconnectMax,
+        (unsigned long long)(bytesTotal / SDL_max(streamTotal, 1)),
+        (unsigned long long)(cpuTotal * 1000000 / SDL_max(bytesTotal, 1)));
+    return 0;
+}
+
+/* An unthrottled phone, the content does not matter to the reader */
+static int fill_pattern(unsigned char *buf, int length, void *userdata) {
+    memset(buf, 0x5a, length);
+    return length;
+}
+
+static uint64_t phase_us(const struct aoakvmStartupProfile_t *profile, enum aoakvm_startup_phase_e phase) {
+    return profile->end[phase] > profile->begin[phase] ? profile->end[phase] - profile->begin[phase] : 0;
+}
@@ -0,0 +1,76 @@
+/*
+    reconnect_test [stream]
+
+    Runs invoke_aoakvm headless against the mock phone, which unplugs after SESSION_MS of
+    streaming and comes back, until CYCLES sessions were torn down. Every teardown has to
+    leave memstat at its baseline. Without a stream file the phone sends zeros and the
+    sessions end at video_openStream, with a raw H.264, HEVC or AV1 file they also decode:
+
+        cc -O2 -I.. reconnect_test.c ../[a-z]*.c \
+            $(pkg-config --cflags --libs sdl2 libavformat libavcodec libavutil libswscale libusb-1.0) \
+            -o reconnect_test
+        ffmpeg -f lavfi -i testsrc=size=640x360:rate=30 -t 2 -c:v libx264 stream.h264
+        ./reconnect_test stream.h264
+*/
+#include <stdio.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "memstat.h"
+
+#define CYCLES 5
+#define SESSION_MS 300
+#define REENUMERATE_MS 20
+#define TIMEOUT_MS 30000
+
+// Static Functions
+static int session_thread(void *data);
+static int no_events();
+static int fill_zeros(unsigned char *buf, int length, void *userdata);
+
+
+int main(int argc, char **argv) {
+    struct aoakvmMockConfig_t mock = {
+        .reenumerateDelay = REENUMERATE_MS,
+        .source = argc > 1 ? argv[1] : NULL,
+        .loop = 1,
+        .generator = fill_zeros,
+        .disconnectAfter = SESSION_MS,
+    };
+    struct aoakvmConfig_t cfg = {
+        .manufacturer = "aoakvm", .modelName = "reconnect_test", .description = "reconnect test",
+        .version = "1", .uri = "-", .serialNumber = "0", .headless = 1, .mock = &mock,
+    };
+    uint32_t deadline = SDL_GetTicks() + TIMEOUT_MS;
+    int checks, failed;
+
+    if (SDL_CreateThread(session_thread, "session", &cfg) == NULL) {
+        fprintf(stderr, "reconnect_test: %s\n", SDL_GetError());
+        return 1;
+    }
+    while ((checks = memstat_getBaselineChecks(&failed)) < CYCLES && !SDL_TICKS_PASSED(SDL_GetTicks(), deadline)) {
+        SDL_Delay(10);
+    }
+
+    // invoke_aoakvm never returns, the process exit ends it
+    printf("reconnect_test: %d sessions torn down, %d of them left memory behind\n", checks, failed);
+    if (checks < CYCLES) {
+        fprintf(stderr, "reconnect_test: only %d of %d sessions ended within %d ms\n", checks, CYCLES, TIMEOUT_MS);
+        return 1;
+    }
+    return failed > 0;
+}
+
+static int session_thread(void *data) {
+    return invoke_aoakvm(data, NULL, no_events);
+}
+
+/* Nothing sends input */
+static int no_events() {
+    return 0;
+}
+
+static int fill_zeros(unsigned char *buf, int length, void *userdata) {
+    memset(buf, 0, length);
+    return length;
+}
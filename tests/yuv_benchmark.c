@@ -0,0 +1,109 @@
+/*
+    yuv_benchmark [width height [frames]]
+
+    Converts random YUV420P frames to RGBA with every yuv kernel this CPU supports and with
+    libswscale (SWS_POINT, as snapshot.c falls back to) and prints the time per frame of each.
+    Defaults to 2560x1440 and 100 frames:
+
+        cc -O2 -I.. yuv_benchmark.c ../yuv.c ../aoakvm_log.c ../aoakvm_clock.c \
+            $(pkg-config --cflags --libs sdl2 libavutil libswscale) -o yuv_benchmark
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libswscale/swscale.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "yuv.h"
+
+// Static Functions
+static void fill_random(AVFrame *src);
+static uint64_t time_kernel(AVFrame *src, uint8_t *rgba, int frames);
+static uint64_t time_swscale(AVFrame *src, uint8_t *rgba, int frames);
+
+// Local Variables
+static const char *kernels[] = { "avx2", "sse4.1", "neon", "scalar" };
+
+
+int main(int argc, char **argv) {
+    int width = argc > 2 ? atoi(argv[1]) : 2560;
+    int height = argc > 2 ? atoi(argv[2]) : 1440;
+    int frames = argc > 3 ? atoi(argv[3]) : 100;
+    AVFrame *src = av_frame_alloc();
+    uint8_t *rgba = malloc((size_t)width * height * 4);
+    int ret = 1;
+
+    if (src == NULL || rgba == NULL || width <= 0 || height <= 0 || frames <= 0) {
+        fprintf(stderr, "usage: yuv_benchmark [width height [frames]]\n");
+        goto done;
+    }
+    src->format = AV_PIX_FMT_YUV420P;
+    src->width = width;
+    src->height = height;
+    if (av_frame_get_buffer(src, 0) < 0) {
+        goto done;
+    }
+    fill_random(src);
+
+    for (int i = 0; i < (int)(sizeof(kernels) / sizeof(kernels[0])); i++) {
+        if (yuv_setKernel(kernels[i]) == 0) {
+            printf("%dx%d to RGBA: %8llu us per frame with the %s kernel\n", width, height,
+                (unsigned long long)time_kernel(src, rgba, frames), kernels[i]);
+        }
+    }
+    uint64_t us = time_swscale(src, rgba, frames);
+    if (us == UINT64_MAX) {
+        fprintf(stderr, "yuv_benchmark: failed to create the swscale context\n");
+        goto done;
+    }
+    printf("%dx%d to RGBA: %8llu us per frame with libswscale\n", width, height, (unsigned long long)us);
+    ret = 0;
+
+done:
+    av_frame_free(&src);
+    free(rgba);
+    return ret;
+}
+
+static void fill_random(AVFrame *src) {
+    uint32_t seed = 1;
+
+    for (int p = 0; p < 3; p++) {
+        int rows = p == 0 ? src->height : (src->height + 1) / 2;
+        for (int row = 0; row < rows; row++) {
+            for (int x = 0; x < src->linesize[p]; x++) {
+                seed = seed * 1664525 + 1013904223;
+                src->data[p][row * src->linesize[p] + x] = seed >> 24;
+            }
+        }
+    }
+}
+
+static uint64_t time_kernel(AVFrame *src, uint8_t *rgba, int frames) {
+    uint64_t started = clock_nowUs();
+
+    for (int i = 0; i < frames; i++) {
+        yuv_toRgb(src, AV_PIX_FMT_RGBA, rgba, src->width * 4);
+    }
+    return (clock_nowUs() - started) / frames;
+}
+
+/* UINT64_MAX if the context could not be created */
+static uint64_t time_swscale(AVFrame *src, uint8_t *rgba, int frames) {
+    struct SwsContext *sws = sws_getContext(src->width, src->height, src->format, src->width, src->height,
+                                            AV_PIX_FMT_RGBA, SWS_POINT, NULL, NULL, NULL);
+    uint8_t *dst[4] = { rgba, NULL, NULL, NULL };
+    int dstStride[4] = { src->width * 4, 0, 0, 0 };
+
+    if (sws == NULL) {
+        return UINT64_MAX;
+    }
+    uint64_t started = clock_nowUs();
+    for (int i = 0; i < frames; i++) {
+        sws_scale(sws, (const uint8_t * const *)src->data, src->linesize, 0, src->height, dst, dstStride);
+    }
+    uint64_t us = (clock_nowUs() - started) / frames;
+    sws_freeContext(sws);
+    return us;
+}
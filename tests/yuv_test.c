@@ -0,0 +1,152 @@
+/*
+    yuv_test
+
+    Runs every yuv kernel this CPU supports on random frames of odd and even sizes in all
+    supported input and output formats. The scalar kernel has to be within YUV_TOLERANCE of
+    the matrix in double precision, all others have to give its exact bytes. Exits with the
+    number of kernels that failed. Build it on every target, the NEON kernel only runs on ARM:
+
+        cc -O2 -I.. yuv_test.c ../yuv.c ../aoakvm_log.c ../aoakvm_clock.c \
+            $(pkg-config --cflags --libs sdl2 libavutil) -o yuv_test
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "aoakvm.h"
+#include "yuv.h"
+
+/* Largest difference of the scalar kernel to the exact matrix */
+#define YUV_TOLERANCE 2
+
+// Static Functions
+static int test_kernel(const char *name);
+static int test_frame(const char *name, enum AVPixelFormat srcFmt, enum AVColorSpace space, enum AVPixelFormat fmt, int width, int height, uint32_t *seed);
+static int check_exact(const AVFrame *src, enum AVPixelFormat fmt, const uint8_t *rgb);
+
+// Local Variables
+static const char *kernels[] = { "avx2", "sse4.1", "neon", "scalar" };
+
+
+int main() {
+    int failed = 0;
+
+    for (int i = 0; i < (int)(sizeof(kernels) / sizeof(kernels[0])); i++) {
+        if (yuv_setKernel(kernels[i]) != 0) {
+            log_info("yuv_test: %s kernel not available", kernels[i]);
+            continue;
+        }
+        failed += test_kernel(kernels[i]) != 0;
+    }
+    yuv_setKernel(NULL);
+    return failed;
+}
+
+static int test_kernel(const char *name) {
+    static const enum AVPixelFormat srcFmts[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUVJ420P, AV_PIX_FMT_NV12 };
+    static const enum AVColorSpace spaces[] = { AVCOL_SPC_SMPTE170M, AVCOL_SPC_BT709 };
+    static const enum AVPixelFormat fmts[] = { AV_PIX_FMT_RGBA, AV_PIX_FMT_BGRA };
+    // Below, at and past the step widths of the kernels, and a 1440p row
+    static const int widths[] = { 1, 15, 16, 17, 31, 32, 33, 63, 97, 1440 };
+    uint32_t seed = 1;
+    int bad = 0;
+
+    for (int a = 0; a < 3; a++) {
+        for (int b = 0; b < 2; b++) {
+            for (int c = 0; c < 2; c++) {
+                for (int w = 0; w < (int)(sizeof(widths) / sizeof(widths[0])); w++) {
+                    bad += test_frame(name, srcFmts[a], spaces[b], fmts[c], widths[w], 1 + w % 4, &seed) != 0;
+                }
+            }
+        }
+    }
+    if (bad) {
+        log_error("yuv_test: %s kernel wrong in %d test frames", name, bad);
+    } else {
+        log_info("yuv_test: %s kernel matches the reference", name);
+    }
+    return bad;
+}
+
+/*
+    Converts a random frame with the named kernel and with the scalar kernel, which has to be
+    within YUV_TOLERANCE of the exact matrix. Returns the number of differing bytes.
+*/
+static int test_frame(const char *name, enum AVPixelFormat srcFmt, enum AVColorSpace space, enum AVPixelFormat fmt, int width, int height, uint32_t *seed) {
+    int chromaWidth = (width + 1) / 2;
+    int chromaHeight = (height + 1) / 2;
+    int nv12 = srcFmt == AV_PIX_FMT_NV12;
+    // Odd linesizes catch kernels that assume aligned rows
+    int linesize[3] = { width + 3, nv12 ? chromaWidth * 2 + 5 : chromaWidth + 1, chromaWidth + 7 };
+    size_t size = (size_t)linesize[0] * height + (size_t)(linesize[1] + linesize[2]) * chromaHeight;
+    uint8_t *planes = malloc(size);
+    uint8_t *ref = malloc((size_t)width * height * 4);
+    uint8_t *out = malloc((size_t)width * height * 4);
+    AVFrame src;
+    int bad = -1;
+
+    if (planes != NULL && ref != NULL && out != NULL) {
+        for (size_t i = 0; i < size; i++) {
+            *seed = *seed * 1664525 + 1013904223;
+            planes[i] = *seed >> 24;
+        }
+        memset(&src, 0, sizeof(src));
+        src.format = srcFmt;
+        src.width = width;
+        src.height = height;
+        src.colorspace = space;
+        src.color_range = AVCOL_RANGE_UNSPECIFIED;
+        src.data[0] = planes;
+        src.data[1] = planes + (size_t)linesize[0] * height;
+        src.data[2] = nv12 ? NULL : src.data[1] + (size_t)linesize[1] * chromaHeight;
+        memcpy(src.linesize, linesize, sizeof(linesize));
+
+        yuv_setKernel("scalar");
+        yuv_toRgb(&src, fmt, ref, width * 4);
+        yuv_setKernel(name);
+        yuv_toRgb(&src, fmt, out, width * 4);
+        bad = check_exact(&src, fmt, ref);
+        for (size_t i = 0; i < (size_t)width * height * 4; i++) {
+            bad += ref[i] != out[i];
+        }
+    }
+    free(planes);
+    free(ref);
+    free(out);
+    return bad;
+}
+
+/* Bytes of rgb further than YUV_TOLERANCE from the matrix in double precision */
+static int check_exact(const AVFrame *src, enum AVPixelFormat fmt, const uint8_t *rgb) {
+    int full = src->format == AV_PIX_FMT_YUVJ420P || src->color_range == AVCOL_RANGE_JPEG;
+    double kr = src->colorspace == AVCOL_SPC_BT709 ? 0.2126 : 0.299;
+    double kb = src->colorspace == AVCOL_SPC_BT709 ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    double ymul = full ? 1.0 : 255.0 / 219.0;
+    double cmul = full ? 1.0 : 255.0 / 224.0;
+    int bad = 0;
+
+    for (int row = 0; row < src->height; row++) {
+        for (int x = 0; x < src->width; x++) {
+            const uint8_t *c = src->data[1] + (row / 2) * src->linesize[1];
+            int u = src->format == AV_PIX_FMT_NV12 ? c[(x / 2) * 2] : c[x / 2];
+            int v = src->format == AV_PIX_FMT_NV12 ? c[(x / 2) * 2 + 1] : src->data[2][(row / 2) * src->linesize[2] + x / 2];
+            double y = (src->data[0][row * src->linesize[0] + x] - (full ? 0 : 16)) * ymul;
+            double cb = (u - 128) * cmul;
+            double cr = (v - 128) * cmul;
+            double rgb3[3] = {
+                y + 2 * (1 - kr) * cr,
+                y - 2 * (1 - kb) * kb / kg * cb - 2 * (1 - kr) * kr / kg * cr,
+                y + 2 * (1 - kb) * cb,
+            };
+            const uint8_t *p = rgb + ((size_t)row * src->width + x) * 4;
+
+            for (int ch = 0; ch < 3; ch++) {
+                double want = rgb3[fmt == AV_PIX_FMT_BGRA ? 2 - ch : ch];
+                want = want < 0 ? 0 : (want > 255 ? 255 : want);
+                bad += p[ch] - want > YUV_TOLERANCE || want - p[ch] > YUV_TOLERANCE;
+            }
+            bad += p[3] != 255;
+        }
+    }
+    return bad;
+}
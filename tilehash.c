@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "tilehash.h"
+
+/*
+    Every tile is hashed with TILE_CHUNKS independent accumulators of 8 x 16 bit lanes, one per
+    16 byte column chunk of the tile. A step is acc = mix(acc ^ data) where mix is a multiply
+    with an odd constant followed by an xorshift. Both are bijective, so a tile in which a
+    single chunk changed is always reported as changed.
+*/
+#define TILE_CHUNKS (TILEHASH_TILE_SIZE / 16)
+#define MIX_MUL 0x9E37
+#define MIX_SHIFT 7
+
+static void hash_tile(const uint8_t *p, int linesize, int w, int h, uint64_t *out);
+
+static const uint8_t *load_chunk(const uint8_t *p, int avail, uint8_t *tail) {
+    if (avail >= 16) {
+        return p;
+    }
+    memset(tail, 0, 16);
+    memcpy(tail, p, avail);
+    return tail;
+}
+
+#if defined(__SSE2__)
+
+static inline __m128i mix(__m128i acc, __m128i v) {
+    __m128i x = _mm_xor_si128(acc, v);
+    x = _mm_mullo_epi16(x, _mm_set1_epi16((short)MIX_MUL));
+    return _mm_xor_si128(x, _mm_srli_epi16(x, MIX_SHIFT));
+}
+
+static void hash_tile(const uint8_t *p, int linesize, int w, int h, uint64_t *out) {
+    uint8_t tail[16];
+    int chunks = (w + 15) / 16;
+    __m128i acc[TILE_CHUNKS];
+
+    for (int k = 0; k < TILE_CHUNKS; k++) {
+        acc[k] = _mm_set1_epi16((short)((k + 1) * MIX_MUL));
+    }
+
+    for (int y = 0; y < h; y++) {
+        const uint8_t *row = p + (size_t)y * linesize;
+        for (int k = 0; k < chunks; k++) {
+            const uint8_t *c = load_chunk(row + k * 16, w - k * 16, tail);
+            acc[k] = mix(acc[k], _mm_loadu_si128((const __m128i *)c));
+        }
+    }
+
+    __m128i r = acc[0];
+    for (int k = 1; k < TILE_CHUNKS; k++) {
+        r = mix(r, acc[k]);
+    }
+    _mm_storeu_si128((__m128i *)out, r);
+}
+
+#elif defined(__ARM_NEON)
+
+static inline uint16x8_t mix(uint16x8_t acc, uint16x8_t v) {
+    uint16x8_t x = veorq_u16(acc, v);
+    x = vmulq_n_u16(x, MIX_MUL);
+    return veorq_u16(x, vshrq_n_u16(x, MIX_SHIFT));
+}
+
+static void hash_tile(const uint8_t *p, int linesize, int w, int h, uint64_t *out) {
+    uint8_t tail[16];
+    int chunks = (w + 15) / 16;
+    uint16x8_t acc[TILE_CHUNKS];
+
+    for (int k = 0; k < TILE_CHUNKS; k++) {
+        acc[k] = vdupq_n_u16((uint16_t)((k + 1) * MIX_MUL));
+    }
+
+    for (int y = 0; y < h; y++) {
+        const uint8_t *row = p + (size_t)y * linesize;
+        for (int k = 0; k < chunks; k++) {
+            const uint8_t *c = load_chunk(row + k * 16, w - k * 16, tail);
+            acc[k] = mix(acc[k], vreinterpretq_u16_u8(vld1q_u8(c)));
+        }
+    }
+
+    uint16x8_t r = acc[0];
+    for (int k = 1; k < TILE_CHUNKS; k++) {
+        r = mix(r, acc[k]);
+    }
+    vst1q_u8((uint8_t *)out, vreinterpretq_u8_u16(r));
+}
+
+#else
+
+static inline void mix(uint16_t *acc, const uint16_t *v) {
+    for (int l = 0; l < 8; l++) {
+        uint16_t x = (uint16_t)((acc[l] ^ v[l]) * MIX_MUL);
+        acc[l] = x ^ (x >> MIX_SHIFT);
+    }
+}
+
+static void hash_tile(const uint8_t *p, int linesize, int w, int h, uint64_t *out) {
+    uint8_t tail[16];
+    int chunks = (w + 15) / 16;
+    uint16_t acc[TILE_CHUNKS][8];
+    uint16_t v[8];
+
+    for (int k = 0; k < TILE_CHUNKS; k++) {
+        for (int l = 0; l < 8; l++) {
+            acc[k][l] = (uint16_t)((k + 1) * MIX_MUL);
+        }
+    }
+
+    for (int y = 0; y < h; y++) {
+        const uint8_t *row = p + (size_t)y * linesize;
+        for (int k = 0; k < chunks; k++) {
+            const uint8_t *c = load_chunk(row + k * 16, w - k * 16, tail);
+            for (int l = 0; l < 8; l++) {
+                v[l] = (uint16_t)(c[2 * l] | (c[2 * l + 1] << 8));
+            }
+            mix(acc[k], v);
+        }
+    }
+
+    for (int k = 1; k < TILE_CHUNKS; k++) {
+        mix(acc[0], acc[k]);
+    }
+    out[0] = out[1] = 0;
+    for (int l = 0; l < 8; l++) {
+        out[l / 4] |= (uint64_t)acc[0][l] << (16 * (l % 4));
+    }
+}
+
+#endif
+
+int tilehash_alloc(struct tilehash_t *th, int width, int height) {
+    int cols = (width + TILEHASH_TILE_SIZE - 1) / TILEHASH_TILE_SIZE;
+    int rows = (height + TILEHASH_TILE_SIZE - 1) / TILEHASH_TILE_SIZE;
+
+    if (th->hash != NULL && th->width == width && th->height == height) {
+        return 0;
+    }
+
+    uint64_t *hash = realloc(th->hash, sizeof(uint64_t) * 2 * cols * rows);
+    if (hash == NULL) {
+        return -1;
+    }
+
+    th->hash = hash;
+    th->width = width;
+    th->height = height;
+    th->cols = cols;
+    th->rows = rows;
+    th->valid = 0;
+    return 1;
+}
+
+void tilehash_free(struct tilehash_t *th) {
+    free(th->hash);
+    memset(th, 0, sizeof(*th));
+}
+
+void tilehash_compute(struct tilehash_t *th, const uint8_t *plane, int linesize) {
+    for (int r = 0; r < th->rows; r++) {
+        int y = r * TILEHASH_TILE_SIZE;
+        int h = th->height - y < TILEHASH_TILE_SIZE ? th->height - y : TILEHASH_TILE_SIZE;
+
+        for (int c = 0; c < th->cols; c++) {
+            int x = c * TILEHASH_TILE_SIZE;
+            int w = th->width - x < TILEHASH_TILE_SIZE ? th->width - x : TILEHASH_TILE_SIZE;
+
+            hash_tile(plane + (size_t)y * linesize + x, linesize, w, h, &th->hash[2 * (r * th->cols + c)]);
+        }
+    }
+    th->valid = 1;
+}
+
+int tilehash_diff(const struct tilehash_t *a, const struct tilehash_t *b, uint8_t *dirty) {
+    int tiles = a->cols * a->rows;
+    int changed = 0;
+
+    if (!a->valid || !b->valid || a->width != b->width || a->height != b->height) {
+        if (dirty != NULL) {
+            memset(dirty, 1, tiles);
+        }
+        return tiles;
+    }
+
+    for (int i = 0; i < tiles; i++) {
+        int d = a->hash[2 * i] != b->hash[2 * i] || a->hash[2 * i + 1] != b->hash[2 * i + 1];
+        if (dirty != NULL) {
+            dirty[i] = d;
+        }
+        changed += d;
+    }
+    return changed;
+}
+
+void tilehash_copy(struct tilehash_t *dst, const struct tilehash_t *src) {
+    if (tilehash_alloc(dst, src->width, src->height) < 0) {
+        dst->valid = 0;
+        return;
+    }
+    memcpy(dst->hash, src->hash, sizeof(uint64_t) * 2 * src->cols * src->rows);
+    dst->valid = src->valid;
+}
@@ -0,0 +1,57 @@
+#ifndef AOAKVM_TILEHASH
+#define AOAKVM_TILEHASH
+
+#include <stdint.h>
+
+#define TILEHASH_TILE_SIZE 64
+
+/*
+    struct tilehash_t
+
+    Holds one 128 bit hash per TILEHASH_TILE_SIZE x TILEHASH_TILE_SIZE tile of a plane.
+    Fields:
+        int width;      width of the hashed plane in px
+        int height;     height of the hashed plane in px
+        int cols;       number of tiles per row
+        int rows;       number of tile rows
+        int valid;      0 until tilehash_compute has filled the hashes
+        uint64_t *hash; cols * rows * 2 words, tile (c, r) at index 2 * (r * cols + c)
+*/
+struct tilehash_t {
+    int width;
+    int height;
+    int cols;
+    int rows;
+    int valid;
+    uint64_t *hash;
+};
+
+/*
+    int tilehash_alloc(struct tilehash_t *th, int width, int height);
+
+    (Re)allocates the hash storage for a plane of the given size. Returns 0 if nothing had
+    to be done, 1 if the layout changed (hashes are invalid afterwards) and -1 on failure.
+*/
+int tilehash_alloc(struct tilehash_t*, int, int);
+void tilehash_free(struct tilehash_t*);
+
+/*
+    void tilehash_compute(struct tilehash_t *th, const uint8_t *plane, int linesize);
+
+    Hashes every tile of an 8 bit plane. Uses SSE2 or NEON when the compiler targets them,
+    the scalar path produces bit identical results.
+*/
+void tilehash_compute(struct tilehash_t*, const uint8_t*, int);
+
+/*
+    int tilehash_diff(const struct tilehash_t *a, const struct tilehash_t *b, uint8_t *dirty);
+
+    Compares two hash sets of the same layout. If dirty is not NULL it receives one byte per
+    tile (1 = changed). Returns the number of changed tiles, or all tiles if one of the sets
+    is invalid or the layouts differ.
+*/
+int tilehash_diff(const struct tilehash_t*, const struct tilehash_t*, uint8_t*);
+
+void tilehash_copy(struct tilehash_t*, const struct tilehash_t*);
+
+#endif
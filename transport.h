@@ -0,0 +1,69 @@
+#ifndef AOAKVM_TRANSPORT
+#define AOAKVM_TRANSPORT
+
+#include <sys/time.h>
+
+#include "aoakvm.h"
+
+/* Devices reported by one getDevices call */
+#define TRANSPORT_MAX_DEVICES 128
+
+/*
+    struct usbTransport_t
+
+    The USB operations of usb.c, video.c and aoa.c. The libusb backend passes them straight
+    through, the mock backend hands out handles that only it understands and must never be
+    given to libusb. Return values follow libusb (LIBUSB_ERROR_xxx).
+
+    getDevices      fills descs with the attached devices, the index is the argument of open.
+                    Indices are valid until the next call.
+    submitTransfer  control transfers filled with libusb_fill_control_transfer and isochronous
+                    ones; the callback runs inside handleEvents like with libusb.
+    resetDevice     LIBUSB_ERROR_NOT_FOUND if the device re-enumerated and the handle is gone.
+    getLocation     bus number and port path of the device, returns the number of ports.
+    getConfig       active configuration descriptor, release it with freeConfig. The mock
+                    device only describes its audio interface and answers NOT_SUPPORTED
+                    without one.
+    claimInterface  detaches a kernel driver bound to the interface, e.g. snd-usb-audio.
+    releaseInterface gives it back, the libusb backend reattaches the kernel driver.
+*/
+struct usbTransport_t {
+    const char *name;
+    int (*init)();
+    void (*exit)();
+    int (*getDevices)(struct libusb_device_descriptor *descs, int max);
+    int (*open)(int index, libusb_device_handle **handle);
+    void (*close)(libusb_device_handle *handle);
+    int (*claimInterface)(libusb_device_handle *handle, int interface);
+    int (*releaseInterface)(libusb_device_handle *handle, int interface);
+    int (*getDescriptor)(libusb_device_handle *handle, struct libusb_device_descriptor *desc);
+    int (*controlTransfer)(libusb_device_handle *handle, uint8_t requestType, uint8_t request, uint16_t value,
+                           uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout);
+    int (*bulkTransfer)(libusb_device_handle *handle, unsigned char endpoint, unsigned char *data, int length,
+                        int *transferred, unsigned int timeout);
+    int (*clearHalt)(libusb_device_handle *handle, unsigned char endpoint);
+    int (*resetDevice)(libusb_device_handle *handle);
+    int (*getLocation)(libusb_device_handle *handle, uint8_t *bus, uint8_t *ports, int maxPorts);
+    int (*getConfig)(libusb_device_handle *handle, struct libusb_config_descriptor **config);
+    void (*freeConfig)(struct libusb_config_descriptor *config);
+    int (*setAltSetting)(libusb_device_handle *handle, int interface, int altSetting);
+    int (*submitTransfer)(struct libusb_transfer *transfer);
+    int (*cancelTransfer)(struct libusb_transfer *transfer);
+    int (*handleEvents)(struct timeval *tv);
+};
+
+/*
+    const struct usbTransport_t *transport_libusb();
+
+    Real devices through libusb and its default context.
+*/
+const struct usbTransport_t *transport_libusb();
+
+/*
+    const struct usbTransport_t *transport_mock(const struct aoakvmMockConfig_t *cfg);
+
+    One simulated phone as described by cfg, which must stay valid while the transport is used.
+*/
+const struct usbTransport_t *transport_mock(const struct aoakvmMockConfig_t*);
+
+#endif
@@ -0,0 +1,115 @@
+#include "aoakvm.h"
+#include "transport.h"
+
+// Static Functions
+static int libusb_backend_init();
+static void libusb_backend_exit();
+static int libusb_backend_getDevices(struct libusb_device_descriptor *descs, int max);
+static int libusb_backend_open(int index, libusb_device_handle **handle);
+static int libusb_backend_getDescriptor(libusb_device_handle *handle, struct libusb_device_descriptor *desc);
+static int libusb_backend_getLocation(libusb_device_handle *handle, uint8_t *bus, uint8_t *ports, int maxPorts);
+static int libusb_backend_getConfig(libusb_device_handle *handle, struct libusb_config_descriptor **config);
+static int libusb_backend_claimInterface(libusb_device_handle *handle, int interface);
+static int libusb_backend_handleEvents(struct timeval *tv);
+
+// Local Variables
+static libusb_context *context;
+static libusb_device **list;
+static int listCount;
+
+static const struct usbTransport_t backend = {
+    .name = "libusb",
+    .init = libusb_backend_init,
+    .exit = libusb_backend_exit,
+    .getDevices = libusb_backend_getDevices,
+    .open = libusb_backend_open,
+    .close = libusb_close,
+    .claimInterface = libusb_backend_claimInterface,
+    .releaseInterface = libusb_release_interface,
+    .getDescriptor = libusb_backend_getDescriptor,
+    .controlTransfer = libusb_control_transfer,
+    .bulkTransfer = libusb_bulk_transfer,
+    .clearHalt = libusb_clear_halt,
+    .resetDevice = libusb_reset_device,
+    .getLocation = libusb_backend_getLocation,
+    .getConfig = libusb_backend_getConfig,
+    .freeConfig = libusb_free_config_descriptor,
+    .setAltSetting = libusb_set_interface_alt_setting,
+    .submitTransfer = libusb_submit_transfer,
+    .cancelTransfer = libusb_cancel_transfer,
+    .handleEvents = libusb_backend_handleEvents,
+};
+
+
+const struct usbTransport_t *transport_libusb() {
+    return &backend;
+}
+
+static int libusb_backend_init() {
+    return libusb_init(&context);
+}
+
+static void libusb_backend_exit() {
+    if (list != NULL) {
+        libusb_free_device_list(list, 1);
+        list = NULL;
+        listCount = 0;
+    }
+    libusb_exit(context);
+    context = NULL;
+}
+
+static int libusb_backend_getDevices(struct libusb_device_descriptor *descs, int max) {
+    // Opened handles keep their own reference, the previous list can go
+    if (list != NULL) {
+        libusb_free_device_list(list, 1);
+        list = NULL;
+    }
+
+    ssize_t count = libusb_get_device_list(context, &list);
+    if (count < 0) {
+        list = NULL;
+        listCount = 0;
+        return count;
+    }
+
+    listCount = SDL_min(count, max);
+    for (int i = 0; i < listCount; i++) {
+        if (libusb_get_device_descriptor(list[i], &descs[i]) < 0) {
+            memset(&descs[i], 0, sizeof(descs[i]));
+        }
+    }
+    return listCount;
+}
+
+static int libusb_backend_open(int index, libusb_device_handle **handle) {
+    if (index < 0 || index >= listCount) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    return libusb_open(list[index], handle);
+}
+
+static int libusb_backend_getDescriptor(libusb_device_handle *handle, struct libusb_device_descriptor *desc) {
+    return libusb_get_device_descriptor(libusb_get_device(handle), desc);
+}
+
+static int libusb_backend_getLocation(libusb_device_handle *handle, uint8_t *bus, uint8_t *ports, int maxPorts) {
+    libusb_device *device = libusb_get_device(handle);
+
+    *bus = libusb_get_bus_number(device);
+    return libusb_get_port_numbers(device, ports, maxPorts);
+}
+
+static int libusb_backend_getConfig(libusb_device_handle *handle, struct libusb_config_descriptor **config) {
+    return libusb_get_active_config_descriptor(libusb_get_device(handle), config);
+}
+
+/* The audio interface of an AOA2 accessory is bound to the audio class driver of the kernel */
+static int libusb_backend_claimInterface(libusb_device_handle *handle, int interface) {
+    libusb_set_auto_detach_kernel_driver(handle, 1);
+    return libusb_claim_interface(handle, interface);
+}
+
+static int libusb_backend_handleEvents(struct timeval *tv) {
+    return libusb_handle_events_timeout_completed(context, tv, NULL);
+}
@@ -0,0 +1,667 @@
+#include <stdio.h>
+
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "aoa.h"
+#include "transport.h"
+#include "memstat.h"
+
+#define MOCK_VID                0x04e8
+#define MOCK_PID                0x6860
+#define MOCK_ACCESSORY_VID      0x18D1
+#define MOCK_ACCESSORY_PID      0x2D01
+#define MOCK_PROTOCOL           2
+
+/* Asynchronous transfers in flight, one handshake only ever has a single one */
+#define MOCK_MAX_PENDING        16
+/* A hanging request with an infinite timeout gives up after this */
+#define MOCK_HANG_US            1000000
+/* Bulk reads without data source return after this */
+#define MOCK_IDLE_US            10000
+/* Audio streaming interface, 44.1 kHz 16 bit stereo in 1 ms packets */
+#define MOCK_AUDIO_INTERFACE    1
+#define MOCK_AUDIO_ENDPOINT     0x81
+#define MOCK_AUDIO_PACKET       192
+#define MOCK_AUDIO_BYTES_PER_MS 176
+
+enum mock_mode_e {
+    MOCK_GONE,
+    MOCK_PHONE,
+    MOCK_ACCESSORY,
+};
+
+/* What the handles of this backend point to, a handle dies when the device unplugs */
+struct mockHandle_t {
+    int generation;
+};
+
+struct mockPending_t {
+    struct libusb_transfer *transfer;
+    uint64_t due;
+    enum libusb_transfer_status status;
+    int actualLength;
+};
+
+// Static Functions
+static int mock_init();
+static void mock_exit();
+static int mock_getDevices(struct libusb_device_descriptor *descs, int max);
+static int mock_open(int index, libusb_device_handle **handle);
+static void mock_close(libusb_device_handle *handle);
+static int mock_claimInterface(libusb_device_handle *handle, int interface);
+static int mock_releaseInterface(libusb_device_handle *handle, int interface);
+static int mock_getDescriptor(libusb_device_handle *handle, struct libusb_device_descriptor *desc);
+static int mock_controlTransfer(libusb_device_handle *handle, uint8_t requestType, uint8_t request, uint16_t value,
+                                uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout);
+static int mock_bulkTransfer(libusb_device_handle *handle, unsigned char endpoint, unsigned char *data, int length,
+                             int *transferred, unsigned int timeout);
+static int mock_clearHalt(libusb_device_handle *handle, unsigned char endpoint);
+static int mock_resetDevice(libusb_device_handle *handle);
+static int mock_getLocation(libusb_device_handle *handle, uint8_t *bus, uint8_t *ports, int maxPorts);
+static int mock_getConfig(libusb_device_handle *handle, struct libusb_config_descriptor **config);
+static void mock_freeConfig(struct libusb_config_descriptor *config);
+static int mock_setAltSetting(libusb_device_handle *handle, int interface, int altSetting);
+static int mock_submitTransfer(struct libusb_transfer *transfer);
+static int mock_cancelTransfer(struct libusb_transfer *transfer);
+static int mock_handleEvents(struct timeval *tv);
+
+static void update_mode(uint64_t now);
+static void unplug(uint64_t now, uint64_t delay, enum mock_mode_e reappearAs);
+static int alive(libusb_device_handle *handle);
+static void fill_descriptor(struct libusb_device_descriptor *desc);
+static int handle_request(libusb_device_handle *handle, uint8_t requestType, uint8_t request, uint16_t value,
+                          uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout,
+                          uint64_t now, uint64_t *delay);
+static int read_source(unsigned char *data, int length);
+static void fill_iso(struct libusb_transfer *transfer);
+
+// Local Variables
+static const struct usbTransport_t backend = {
+    .name = "mock",
+    .init = mock_init,
+    .exit = mock_exit,
+    .getDevices = mock_getDevices,
+    .open = mock_open,
+    .close = mock_close,
+    .claimInterface = mock_claimInterface,
+    .releaseInterface = mock_releaseInterface,
+    .getDescriptor = mock_getDescriptor,
+    .controlTransfer = mock_controlTransfer,
+    .bulkTransfer = mock_bulkTransfer,
+    .clearHalt = mock_clearHalt,
+    .resetDevice = mock_resetDevice,
+    .getLocation = mock_getLocation,
+    .getConfig = mock_getConfig,
+    .freeConfig = mock_freeConfig,
+    .setAltSetting = mock_setAltSetting,
+    .submitTransfer = mock_submitTransfer,
+    .cancelTransfer = mock_cancelTransfer,
+    .handleEvents = mock_handleEvents,
+};
+
+static const struct aoakvmMockConfig_t *config;
+static SDL_mutex *mockMutex;
+
+/* Alternate setting 0 of the audio interface streams nothing, 1 streams on the endpoint */
+static const struct libusb_endpoint_descriptor audioEndpoint = {
+    .bLength = 7,
+    .bDescriptorType = LIBUSB_DT_ENDPOINT,
+    .bEndpointAddress = MOCK_AUDIO_ENDPOINT,
+    .bmAttributes = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS,
+    .wMaxPacketSize = MOCK_AUDIO_PACKET,
+    .bInterval = 1,
+};
+static const struct libusb_interface_descriptor audioAltSettings[2] = {
+    { .bLength = 9, .bDescriptorType = LIBUSB_DT_INTERFACE, .bInterfaceNumber = MOCK_AUDIO_INTERFACE,
+      .bAlternateSetting = 0, .bInterfaceClass = LIBUSB_CLASS_AUDIO, .bInterfaceSubClass = 2 },
+    { .bLength = 9, .bDescriptorType = LIBUSB_DT_INTERFACE, .bInterfaceNumber = MOCK_AUDIO_INTERFACE,
+      .bAlternateSetting = 1, .bNumEndpoints = 1, .bInterfaceClass = LIBUSB_CLASS_AUDIO,
+      .bInterfaceSubClass = 2, .endpoint = &audioEndpoint },
+};
+static const struct libusb_interface audioInterface = { .altsetting = audioAltSettings, .num_altsetting = 2 };
+static struct libusb_config_descriptor audioConfig = {
+    .bLength = 9,
+    .bDescriptorType = LIBUSB_DT_CONFIG,
+    .bNumInterfaces = 1,
+    .bConfigurationValue = 1,
+    .interface = &audioInterface,
+};
+
+static enum mock_mode_e mode;
+static enum mock_mode_e nextMode;
+static uint64_t reappearAt;
+static int generation;
+
+static int failures[MOCK_AOA_REQUESTS];
+static char strings[6][256];
+static uint32_t registeredHids;
+static uint64_t hidEvents;
+
+/* Only touched by the single bulk reader, except rewindSource */
+static FILE *source;
+static int rewindSource;
+static uint64_t streamStart;
+static uint64_t streamBytes;
+static uint64_t stallStart;
+
+static struct mockPending_t pending[MOCK_MAX_PENDING];
+static int pendingCount;
+static uint64_t isoDue;
+
+
+const struct usbTransport_t *transport_mock(const struct aoakvmMockConfig_t *cfg) {
+    config = cfg;
+    return &backend;
+}
+
+static int mock_init() {
+    if (mockMutex == NULL && (mockMutex = SDL_CreateMutex()) == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    if (config->source != NULL && source == NULL && (source = fopen(config->source, "rb")) == NULL) {
+        log_error("mock: cannot open %s", config->source);
+        return LIBUSB_ERROR_IO;
+    }
+
+    SDL_LockMutex(mockMutex);
+    mode = MOCK_PHONE;
+    generation++;
+    registeredHids = 0;
+    hidEvents = 0;
+    streamStart = 0;
+    pendingCount = 0;
+    for (int i = 0; i < MOCK_AOA_REQUESTS; i++) {
+        failures[i] = config->requests[i].failures;
+    }
+    SDL_UnlockMutex(mockMutex);
+
+    log_info("mock: simulated phone %04x:%04x", config->vid ? config->vid : MOCK_VID,
+             config->pid ? config->pid : MOCK_PID);
+    return 0;
+}
+
+static void mock_exit() {
+    SDL_LockMutex(mockMutex);
+    mode = MOCK_GONE;
+    nextMode = MOCK_GONE;
+    generation++;
+    pendingCount = 0;
+    SDL_UnlockMutex(mockMutex);
+
+    if (source != NULL) {
+        fclose(source);
+        source = NULL;
+    }
+    log_debug("mock: %llu HID events received", (unsigned long long)hidEvents);
+}
+
+static void update_mode(uint64_t now) {
+    if (mode == MOCK_GONE && nextMode != MOCK_GONE && now >= reappearAt) {
+        mode = nextMode;
+        nextMode = MOCK_GONE;
+        log_debug("mock: enumerated as %s", mode == MOCK_ACCESSORY ? "accessory" : "phone");
+    }
+}
+
+/* Open handles die at once, the device shows up again after delay and reenumerateDelay */
+static void unplug(uint64_t now, uint64_t delay, enum mock_mode_e reappearAs) {
+    mode = MOCK_GONE;
+    nextMode = reappearAs;
+    reappearAt = now + delay + (uint64_t)config->reenumerateDelay * 1000;
+    generation++;
+    registeredHids = 0;
+    streamStart = 0;
+    stallStart = 0;
+    rewindSource = 1;
+}
+
+static int alive(libusb_device_handle *handle) {
+    struct mockHandle_t *h = (struct mockHandle_t *)handle;
+    return mode != MOCK_GONE && h->generation == generation;
+}
+
+static void fill_descriptor(struct libusb_device_descriptor *desc) {
+    memset(desc, 0, sizeof(*desc));
+    desc->bLength = sizeof(*desc);
+    desc->bDescriptorType = LIBUSB_DT_DEVICE;
+    desc->bcdUSB = 0x0200;
+    desc->bMaxPacketSize0 = 64;
+    desc->bNumConfigurations = 1;
+    if (mode == MOCK_ACCESSORY) {
+        desc->idVendor = MOCK_ACCESSORY_VID;
+        desc->idProduct = config->accessoryPid ? config->accessoryPid : MOCK_ACCESSORY_PID;
+    } else {
+        desc->idVendor = config->vid ? config->vid : MOCK_VID;
+        desc->idProduct = config->pid ? config->pid : MOCK_PID;
+    }
+}
+
+static int mock_getDevices(struct libusb_device_descriptor *descs, int max) {
+    int count = 0;
+
+    SDL_LockMutex(mockMutex);
+    update_mode(clock_nowUs());
+    if (mode != MOCK_GONE && max > 0) {
+        fill_descriptor(&descs[0]);
+        count = 1;
+    }
+    SDL_UnlockMutex(mockMutex);
+    return count;
+}
+
+static int mock_open(int index, libusb_device_handle **handle) {
+    struct mockHandle_t *h = memstat_alloc(MEM_TRANSPORT, sizeof(struct mockHandle_t));
+    if (h == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    SDL_LockMutex(mockMutex);
+    update_mode(clock_nowUs());
+    h->generation = generation;
+    int ret = index == 0 && mode != MOCK_GONE ? 0 : LIBUSB_ERROR_NO_DEVICE;
+    SDL_UnlockMutex(mockMutex);
+
+    if (ret < 0) {
+        memstat_free(MEM_TRANSPORT, h);
+        return ret;
+    }
+    *handle = (libusb_device_handle *)h;
+    return 0;
+}
+
+static void mock_close(libusb_device_handle *handle) {
+    memstat_free(MEM_TRANSPORT, handle);
+}
+
+static int mock_claimInterface(libusb_device_handle *handle, int interface) {
+    SDL_LockMutex(mockMutex);
+    int ret = alive(handle) ? 0 : LIBUSB_ERROR_NO_DEVICE;
+    SDL_UnlockMutex(mockMutex);
+    return ret;
+}
+
+static int mock_releaseInterface(libusb_device_handle *handle, int interface) {
+    return mock_claimInterface(handle, interface);
+}
+
+static int mock_getDescriptor(libusb_device_handle *handle, struct libusb_device_descriptor *desc) {
+    int ret = LIBUSB_ERROR_NO_DEVICE;
+
+    SDL_LockMutex(mockMutex);
+    if (alive(handle)) {
+        fill_descriptor(desc);
+        ret = 0;
+    }
+    SDL_UnlockMutex(mockMutex);
+    return ret;
+}
+
+/*
+    Answers one control request, called with mockMutex held. Returns the number of bytes
+    transferred or a libusb error, and in delay the µs until the answer arrives.
+*/
+static int handle_request(libusb_device_handle *handle, uint8_t requestType, uint8_t request, uint16_t value,
+                          uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout,
+                          uint64_t now, uint64_t *delay) {
+    *delay = 0;
+    update_mode(now);
+    if (!alive(handle)) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+
+    if ((requestType & LIBUSB_REQUEST_TYPE_VENDOR) != 0 && request == AOA_SET_AUDIO_MODE) {
+        return config->audio ? 0 : LIBUSB_ERROR_PIPE;
+    }
+
+    int slot = request - AOA_GET_PROTOCOL;
+    if ((requestType & LIBUSB_REQUEST_TYPE_VENDOR) == 0 || slot < 0 || slot >= MOCK_AOA_REQUESTS) {
+        return LIBUSB_ERROR_PIPE;
+    }
+
+    const struct aoakvmMockRequest_t *behaviour = &config->requests[slot];
+    *delay = behaviour->delay;
+    if (failures[slot] > 0) {
+        failures[slot]--;
+        if (behaviour->error == LIBUSB_ERROR_TIMEOUT) {
+            *delay = timeout > 0 ? (uint64_t)timeout * 1000 : MOCK_HANG_US;
+        }
+        return behaviour->error < 0 ? behaviour->error : LIBUSB_ERROR_IO;
+    }
+
+    uint16_t protocol = config->protocol ? config->protocol : MOCK_PROTOCOL;
+    switch (request) {
+    case AOA_GET_PROTOCOL:
+        if (length < 2) {
+            return LIBUSB_ERROR_OVERFLOW;
+        }
+        data[0] = protocol & 0xff;
+        data[1] = protocol >> 8;
+        return 2;
+
+    case AOA_SEND_STRING:
+        if (index >= 6) {
+            return LIBUSB_ERROR_PIPE;
+        }
+        SDL_strlcpy(strings[index], (const char *)data, SDL_min(length, sizeof(strings[index])));
+        return length;
+
+    case AOA_START:
+        log_debug("mock: accessory mode for %s %s", strings[0], strings[1]);
+        unplug(now, *delay, MOCK_ACCESSORY);
+        return 0;
+
+    case AOA_REGISTER_HID:
+        if (mode != MOCK_ACCESSORY || protocol < 2 || value >= 32) {
+            return LIBUSB_ERROR_PIPE;
+        }
+        registeredHids |= 1u << value;
+        return 0;
+
+    case AOA_UNREGISTER_HID:
+        if (value < 32) {
+            registeredHids &= ~(1u << value);
+        }
+        return 0;
+
+    case AOA_SET_HID_REPORT_DESC:
+    case AOA_SEND_HID_EVENT:
+        if (value >= 32 || !(registeredHids & (1u << value))) {
+            return LIBUSB_ERROR_PIPE;
+        }
+        hidEvents += request == AOA_SEND_HID_EVENT;
+        return length;
+
+    default:
+        return LIBUSB_ERROR_PIPE;
+    }
+}
+
+static int mock_clearHalt(libusb_device_handle *handle, unsigned char endpoint) {
+    SDL_LockMutex(mockMutex);
+    int ret = alive(handle) ? 0 : LIBUSB_ERROR_NO_DEVICE;
+    SDL_UnlockMutex(mockMutex);
+    return ret;
+}
+
+/* Keeps the accessory mode and HIDs, the stream starts over */
+static int mock_resetDevice(libusb_device_handle *handle) {
+    int ret = LIBUSB_ERROR_NOT_FOUND;
+
+    SDL_LockMutex(mockMutex);
+    if (alive(handle)) {
+        streamStart = 0;
+        stallStart = 0;
+        rewindSource = 1;
+        ret = 0;
+    }
+    SDL_UnlockMutex(mockMutex);
+    return ret;
+}
+
+static int mock_controlTransfer(libusb_device_handle *handle, uint8_t requestType, uint8_t request, uint16_t value,
+                                uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout) {
+    uint64_t now = clock_nowUs();
+    uint64_t delay;
+
+    SDL_LockMutex(mockMutex);
+    int ret = handle_request(handle, requestType, request, value, index, data, length, timeout, now, &delay);
+    SDL_UnlockMutex(mockMutex);
+
+    clock_sleepUntilUs(now + delay);
+    return ret;
+}
+
+/* The simulated phone sits on port 1 of bus 1 */
+static int mock_getLocation(libusb_device_handle *handle, uint8_t *bus, uint8_t *ports, int maxPorts) {
+    SDL_LockMutex(mockMutex);
+    int ret = alive(handle) ? 1 : LIBUSB_ERROR_NO_DEVICE;
+    SDL_UnlockMutex(mockMutex);
+    if (ret < 0) {
+        return ret;
+    }
+    if (maxPorts < 1) {
+        return LIBUSB_ERROR_OVERFLOW;
+    }
+
+    *bus = 1;
+    ports[0] = 1;
+    return ret;
+}
+
+/* Only the audio interface is described, the accessory interface is never looked up */
+static int mock_getConfig(libusb_device_handle *handle, struct libusb_config_descriptor **desc) {
+    SDL_LockMutex(mockMutex);
+    int ret = alive(handle) ? (config->audio ? 0 : LIBUSB_ERROR_NOT_SUPPORTED) : LIBUSB_ERROR_NO_DEVICE;
+    SDL_UnlockMutex(mockMutex);
+    *desc = ret == 0 ? &audioConfig : NULL;
+    return ret;
+}
+
+static void mock_freeConfig(struct libusb_config_descriptor *desc) {
+}
+
+static int mock_setAltSetting(libusb_device_handle *handle, int interface, int altSetting) {
+    int known = (interface == 0 && altSetting == 0) ||
+                (config->audio && interface == MOCK_AUDIO_INTERFACE && altSetting >= 0 && altSetting <= 1);
+
+    SDL_LockMutex(mockMutex);
+    int ret = alive(handle) ? (known ? 0 : LIBUSB_ERROR_NOT_FOUND) : LIBUSB_ERROR_NO_DEVICE;
+    SDL_UnlockMutex(mockMutex);
+    return ret;
+}
+
+static int mock_submitTransfer(struct libusb_transfer *transfer) {
+    unsigned char *setup = transfer->buffer;
+    uint64_t now = clock_nowUs();
+    uint64_t delay;
+    int ret = 0;
+
+    SDL_LockMutex(mockMutex);
+    update_mode(now);
+    if (!alive(transfer->dev_handle)) {
+        ret = LIBUSB_ERROR_NO_DEVICE;
+    } else if (pendingCount == MOCK_MAX_PENDING) {
+        ret = LIBUSB_ERROR_BUSY;
+    } else if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+        // One packet per ms after the transfers queued before, filled in when it completes
+        struct mockPending_t *p = &pending[pendingCount++];
+        p->transfer = transfer;
+        p->due = SDL_max(now, isoDue) + (uint64_t)transfer->num_iso_packets * 1000;
+        isoDue = p->due;
+        p->status = LIBUSB_TRANSFER_COMPLETED;
+        p->actualLength = 0;
+    } else {
+        // Setup packet fields are little endian
+        int result = handle_request(transfer->dev_handle, setup[0], setup[1], setup[2] | setup[3] << 8,
+                                    setup[4] | setup[5] << 8, libusb_control_transfer_get_data(transfer),
+                                    setup[6] | setup[7] << 8, transfer->timeout, now, &delay);
+
+        struct mockPending_t *p = &pending[pendingCount++];
+        p->transfer = transfer;
+        p->due = now + delay;
+        p->actualLength = SDL_max(result, 0);
+        switch (result) {
+        case LIBUSB_ERROR_TIMEOUT:
+            p->status = LIBUSB_TRANSFER_TIMED_OUT;
+            break;
+        case LIBUSB_ERROR_PIPE:
+            p->status = LIBUSB_TRANSFER_STALL;
+            break;
+        case LIBUSB_ERROR_NO_DEVICE:
+            p->status = LIBUSB_TRANSFER_NO_DEVICE;
+            break;
+        case LIBUSB_ERROR_OVERFLOW:
+            p->status = LIBUSB_TRANSFER_OVERFLOW;
+            break;
+        default:
+            p->status = result >= 0 ? LIBUSB_TRANSFER_COMPLETED : LIBUSB_TRANSFER_ERROR;
+            break;
+        }
+    }
+    SDL_UnlockMutex(mockMutex);
+    return ret;
+}
+
+static int mock_cancelTransfer(struct libusb_transfer *transfer) {
+    int ret = LIBUSB_ERROR_NOT_FOUND;
+
+    SDL_LockMutex(mockMutex);
+    for (int i = 0; i < pendingCount; i++) {
+        // Cancelling again does not delay the callback any further
+        if (pending[i].transfer == transfer && pending[i].status != LIBUSB_TRANSFER_CANCELLED) {
+            pending[i].due = clock_nowUs() + (uint64_t)config->cancelDelay * 1000;
+            pending[i].status = LIBUSB_TRANSFER_CANCELLED;
+            pending[i].actualLength = 0;
+            ret = 0;
+        }
+    }
+    SDL_UnlockMutex(mockMutex);
+    return ret;
+}
+
+/*
+    Completes every transfer that is due, sleeping up to tv for the first one. Callbacks run
+    without the lock held, so they can submit the next transfer like they do with libusb.
+*/
+static int mock_handleEvents(struct timeval *tv) {
+    uint64_t deadline = clock_nowUs() + (tv != NULL ? (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec : 0);
+    int handled = 0;
+
+    while (1) {
+        uint64_t now = clock_nowUs();
+        int next = -1;
+
+        SDL_LockMutex(mockMutex);
+        for (int i = 0; i < pendingCount; i++) {
+            if (next < 0 || pending[i].due < pending[next].due) {
+                next = i;
+            }
+        }
+
+        if (next >= 0 && pending[next].due <= now) {
+            struct mockPending_t done = pending[next];
+            pending[next] = pending[--pendingCount];
+            int iso = done.transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+            if (iso && done.status == LIBUSB_TRANSFER_COMPLETED && !alive(done.transfer->dev_handle)) {
+                done.status = LIBUSB_TRANSFER_NO_DEVICE;
+            }
+            SDL_UnlockMutex(mockMutex);
+
+            if (iso && done.status == LIBUSB_TRANSFER_COMPLETED) {
+                fill_iso(done.transfer);
+            }
+            done.transfer->status = done.status;
+            done.transfer->actual_length = done.actualLength;
+            done.transfer->callback(done.transfer);
+            handled = 1;
+            continue;
+        }
+
+        uint64_t wake = next >= 0 ? SDL_min(pending[next].due, deadline) : deadline;
+        SDL_UnlockMutex(mockMutex);
+
+        if (handled || now >= deadline) {
+            return 0;
+        }
+        clock_sleepUntilUs(wake);
+    }
+}
+
+/* A millisecond of silence in every packet */
+static void fill_iso(struct libusb_transfer *transfer) {
+    for (int i = 0; i < transfer->num_iso_packets; i++) {
+        struct libusb_iso_packet_descriptor *packet = &transfer->iso_packet_desc[i];
+        packet->actual_length = SDL_min(packet->length, MOCK_AUDIO_BYTES_PER_MS);
+        packet->status = LIBUSB_TRANSFER_COMPLETED;
+        memset(libusb_get_iso_packet_buffer_simple(transfer, i), 0, packet->actual_length);
+    }
+}
+
+/* File or generator output, < 0 at the end of the stream */
+static int read_source(unsigned char *data, int length) {
+    if (source == NULL) {
+        return config->generator(data, length, config->userdata);
+    }
+
+    size_t n = fread(data, 1, length, source);
+    if (n == 0 && config->loop) {
+        rewind(source);
+        n = fread(data, 1, length, source);
+    }
+    return n > 0 ? (int)n : -1;
+}
+
+/*
+    Serves the bulk IN endpoint, paced to bulkRate. Only one thread may read at a time.
+*/
+static int mock_bulkTransfer(libusb_device_handle *handle, unsigned char endpoint, unsigned char *data, int length,
+                             int *transferred, unsigned int timeout) {
+    uint64_t now = clock_nowUs();
+
+    *transferred = 0;
+
+    SDL_LockMutex(mockMutex);
+    update_mode(now);
+    if (!alive(handle) || mode != MOCK_ACCESSORY) {
+        SDL_UnlockMutex(mockMutex);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+
+    if (streamStart == 0) {
+        streamStart = now;
+        streamBytes = 0;
+    }
+    if (config->disconnectAfter > 0 && now - streamStart >= (uint64_t)config->disconnectAfter * 1000) {
+        log_info("mock: unplugged after %u ms of streaming", config->disconnectAfter);
+        unplug(now, 0, MOCK_PHONE);
+        SDL_UnlockMutex(mockMutex);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+
+    // The stall ends after stallFor or with a reset, then the stream restarts with a new stallAfter
+    if (config->stallAfter > 0 && stallStart == 0 && now - streamStart >= (uint64_t)config->stallAfter * 1000) {
+        log_info("mock: bulk endpoint stalled after %u ms of streaming", config->stallAfter);
+        stallStart = now;
+    }
+    if (stallStart > 0) {
+        if (config->stallFor == 0 || now - stallStart < (uint64_t)config->stallFor * 1000) {
+            SDL_UnlockMutex(mockMutex);
+            clock_sleepUntilUs(now + (timeout > 0 ? SDL_min((uint64_t)timeout * 1000, MOCK_IDLE_US) : MOCK_IDLE_US));
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        streamStart = now;
+        streamBytes = 0;
+        stallStart = 0;
+    }
+
+    int restart = rewindSource;
+    rewindSource = 0;
+    uint64_t due = config->bulkRate > 0 ? streamStart + streamBytes * 1000000 / config->bulkRate : now;
+    SDL_UnlockMutex(mockMutex);
+
+    if (source == NULL && config->generator == NULL) {
+        clock_sleepUntilUs(now + MOCK_IDLE_US);
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    if (restart && source != NULL) {
+        rewind(source);
+    }
+    clock_sleepUntilUs(due);
+
+    int n = read_source(data, length);
+    SDL_LockMutex(mockMutex);
+    if (n < 0) {
+        // The recording is over, the phone goes away like on a cable pull
+        log_info("mock: end of stream");
+        unplug(clock_nowUs(), 0, MOCK_PHONE);
+        SDL_UnlockMutex(mockMutex);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    streamBytes += n;
+    SDL_UnlockMutex(mockMutex);
+
+    *transferred = n;
+    return 0;
+}
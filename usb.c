@@ -2,112 +2,129 @@
 #include <libavformat/avio.h>
 
 #include "aoakvm.h"
+#include "aoakvm_clock.h"
 #include "usb.h"
 #include "hid.h"
 #include "video.h"
 #include "aoakvm_log.h"
 #include "window.h"
+#include "aoa.h"
+#include "profile.h"
+#include "transport.h"
+#include "memstat.h"
+#include "affinity.h"
+#include "hud.h"
+#include "watchdog.h"
 
 /*
 	Accessory PID:      0x2D00 if phone is in AOA mode
 	Accessory PID_ALT:  0x2D01 if phone is in AOA and ADB mode
+	Audio PID:          0x2D04 if phone is in AOA mode with AOA2 audio
+	Audio PID_ALT:      0x2D05 if phone is in AOA and ADB mode with AOA2 audio
 	Accessory VID:      0x18D1 for all phones in AOA mode.
 */
 
 #define ACCESSORY_PID       0x2D01
 #define ACCESSORY_PID_ALT   0x2D00
+#define ACCESSORY_AUDIO_PID     0x2D04
+#define ACCESSORY_AUDIO_PID_ALT 0x2D05
+#define IS_ACCESSORY(pid)   ((pid) == ACCESSORY_PID || (pid) == ACCESSORY_PID_ALT || \
+                             (pid) == ACCESSORY_AUDIO_PID || (pid) == ACCESSORY_AUDIO_PID_ALT)
 #define ACCESSORY_VID       0x18D1
 
+/* Devices handed to one round of concurrent AOA handshakes */
+#define USB_MAX_CANDIDATES  8
+
 // Static Functions
-static int usb_initAOA(libusb_device_handle *handle, struct aoakvmConfig_t *cfg);
+static int usb_initAOA(libusb_device_handle **handles, int count, struct aoakvmConfig_t *cfg);
 
 static int init_HIDS(libusb_device_handle *handle);
+static void free_decode_buffers(AVFrame **frame, AVPacket **pkt);
 
 
 // Local Variables
 
-libusb_context *context;
+static const struct usbTransport_t *transport;
+/* Held while a report is written and while usb_closeHandle closes the handle */
+static SDL_mutex *writeMutex;
+
+static struct aoakvmHandshakeStats_t accessoryStats;
+static struct aoakvmHandshakeStats_t hidStats;
+static SDL_atomic_t nkroKeyboard;
 
 
 static int init_HIDS(libusb_device_handle *handle)
 {
-  int r;
+  struct aoaHandshake_t *hs = memstat_alloc(MEM_TRANSPORT, sizeof(struct aoaHandshake_t));
+  int ret = -1;
+
   // HID Inputs
   log_debug("Registering HID...");
-  if ((r = register_hid(handle, REPORT_DESC_SIZE(REPORT_DESC_MOUSE), 0)))
-  {
-	log_error("Registering HID Mouse failed with %d", r);
-  }
-  if ((r = register_hid(handle, REPORT_DESC_SIZE(REPORT_DESC_KB), 1)))
-  {
-	log_error("Registering HID Keyoard failed with %d", r);
-  }
-  if ((r = register_hid(handle, REPORT_DESC_SIZE(REPORT_DESC_TOUCHPAD), 2)))
-  {
-	log_error("Registering HID Touchpad failed with %d", r);
-  }
-
-  struct libusb_device_descriptor desc;
-  libusb_get_device_descriptor(libusb_get_device(handle), &desc);
-  const int max_packet_size_0 = desc.bMaxPacketSize0;
-
-  if ((r = send_hid_descriptor(handle, REPORT_DESC_MOUSE, REPORT_DESC_SIZE(REPORT_DESC_MOUSE), max_packet_size_0, 0)))
-  {
-	log_error("Sending HID Descriptor for Mouse failed.");
-  }
-
-  if ((r = send_hid_descriptor(handle, REPORT_DESC_KB, REPORT_DESC_SIZE(REPORT_DESC_KB), max_packet_size_0, 1)))
-  {
-	log_error("Sending HID Descriptor for Keyboard failed.");
-  }
-
-  if ((r = send_hid_descriptor(handle, REPORT_DESC_TOUCHPAD, REPORT_DESC_SIZE(REPORT_DESC_TOUCHPAD), max_packet_size_0, 2)))
-  {
-	log_error("Sending HID Descriptor for Touchpad failed.");
+  SDL_AtomicSet(&nkroKeyboard, 0);
+  if (hs != NULL && aoa_prepareHids(hs, transport, handle) == 0) {
+	if (aoa_run(transport, hs, 1) == 1) {
+	  // The NKRO keyboard is the only optional step
+	  SDL_AtomicSet(&nkroKeyboard, hs->stats.skipped == 0);
+	  ret = 0;
+	} else if (hs->stats.error == LIBUSB_ERROR_PIPE) {
+	  // Phone without AOA2 HID support, keep streaming without input
+	  log_warn("Phone rejected HID registration in %s", hs->stats.failedName);
+	  ret = 0;
+	} else {
+	  log_error("Registering HIDs failed in %s: %s", hs->stats.failedName, libusb_error_name(hs->stats.error));
+	}
+	hidStats = hs->stats;
   }
-  return 0;
+  memstat_free(MEM_TRANSPORT, hs);
+  return ret;
 }
 
-libusb_device_handle *usb_getHandle(struct aoakvmConfig_t *cfg) {
+libusb_device_handle *usb_getHandle(struct aoakvmConfig_t *cfg, SDL_Renderer *screenRenderer) {
 
-	libusb_device **list = NULL;
+	struct libusb_device_descriptor list[TRANSPORT_MAX_DEVICES];
 	libusb_device_handle *handle = NULL;
+	libusb_device_handle *candidates[USB_MAX_CANDIDATES];
+	int candidateCount = 0;
 
-  	if (context == NULL) {
-		if (libusb_init(&context) < 0) {
-	  	log_error("libusb init failed\n");
-	  	libusb_exit(context);
-	  	context = NULL;
+  	if (writeMutex == NULL && (writeMutex = SDL_CreateMutex()) == NULL) {
+		log_error("usb: out of memory");
+		return NULL;
+  	}
+  	if (transport == NULL) {
+		transport = cfg->mock != NULL ? transport_mock(cfg->mock) : transport_libusb();
+		if (transport->init() < 0) {
+	  	log_error("%s init failed\n", transport->name);
+	  	transport = NULL;
 	  	return NULL;
 		}
  	 }
 
-  	ssize_t count = libusb_get_device_list(context, &list);
-  	if (count <= 0) {
-		log_error("libusb get device list failed\n");
-		libusb_free_device_list(list, count);
-		libusb_exit(context);
-		context = NULL;
+  	profile_begin(PHASE_ENUMERATE);
+  	int count = transport->getDevices(list, TRANSPORT_MAX_DEVICES);
+  	if (count < 0) {
+		log_error("%s get device list failed\n", transport->name);
+		transport->exit();
+		transport = NULL;
 		return NULL;
   	}
 
-  	for (ssize_t idx = 0; idx < count; ++idx) {
-		libusb_device *device = list[idx];
-		struct libusb_device_descriptor desc;
-
-		if (libusb_get_device_descriptor(device, &desc) < 0) {
-			log_error("error get devicedescriptor\n");
-		}
+  	for (int idx = 0; idx < count; ++idx) {
+		struct libusb_device_descriptor desc = list[idx];
 
 		if (desc.bDeviceClass == 0x00) {
 			if (desc.idVendor == ACCESSORY_VID) {
-				if (desc.idProduct == ACCESSORY_PID_ALT || desc.idProduct == ACCESSORY_PID) {
-					handle = usb_get_aoa_handle();
+				if (IS_ACCESSORY(desc.idProduct)) {
+					// Already in accessory mode, e.g. after a restart of aoakvm
+					profile_end(PHASE_ENUMERATE);
+					profile_begin(PHASE_REENUMERATE);
+					handle = usb_get_aoa_handle(screenRenderer);
+					profile_end(PHASE_REENUMERATE);
 					if (handle != NULL) {
-					libusb_free_device_list(list, count);
+					for (int i = 0; i < candidateCount; i++) {
+						transport->close(candidates[i]);
+					}
 					return handle;
 					} else {
-						libusb_close(handle);
 						continue;
 					}
 			}
@@ -115,70 +132,61 @@ libusb_device_handle *usb_getHandle(struct aoakvmConfig_t *cfg) {
 
 	  	log_info("INIT AOA: %04x:%04x", desc.idVendor, desc.idProduct);
 
-	  	if (libusb_open(device, &handle) < 0) {
+	  	// Collect the candidates, the handshakes run concurrently below
+	  	if (candidateCount == USB_MAX_CANDIDATES || transport->open(idx, &candidates[candidateCount]) < 0) {
 			log_info("Error!");
-			libusb_free_device_list(list, count);
-			libusb_close(handle);
-			libusb_exit(context);
-			context = NULL;
-			return NULL;
-	  	}
-
-	  	int ret = usb_initAOA(handle, cfg);
-		  log_debug("usb_initAOA ret: %d", ret);
-	  	if (ret == -2) {
-			libusb_free_device_list(list, count);
-			libusb_close(handle);
-			handle = NULL;
-			return NULL;
-	  	} else if (ret == -1) {
-			libusb_close(handle);
-			handle = NULL;
 			continue;
-	  	} else {
-			libusb_free_device_list(list, count);
-			return usb_get_aoa_handle();
 	  	}
+	  	candidateCount++;
 	}
   }
-  libusb_free_device_list(list, count);
-  libusb_close(handle);
+  profile_end(PHASE_ENUMERATE);
+
+  if (candidateCount > 0) {
+	profile_begin(PHASE_AOA_SWITCH);
+  }
+  int ret = usb_initAOA(candidates, candidateCount, cfg);
+  log_debug("usb_initAOA ret: %d", ret);
+  for (int i = 0; i < candidateCount; i++) {
+	transport->close(candidates[i]);
+  }
+  if (ret > 0) {
+	profile_end(PHASE_AOA_SWITCH);
+	profile_begin(PHASE_REENUMERATE);
+	handle = usb_get_aoa_handle(screenRenderer);
+	profile_end(PHASE_REENUMERATE);
+	return handle;
+  }
+
   SDL_Delay(100);
   return NULL;
 }
 
-libusb_device_handle *usb_get_aoa_handle() {
+libusb_device_handle *usb_get_aoa_handle(SDL_Renderer *screenRenderer) {
 	libusb_device_handle *handle = NULL;
-  	libusb_device **list = NULL;
+  	struct libusb_device_descriptor list[TRANSPORT_MAX_DEVICES];
 
-	window_changeMsgscreenTo(screens, renderer, mainwindow, AOA_INITIALIZED);
+	window_changeMsgscreenTo(screens, screenRenderer, mainwindow, AOA_INITIALIZED);
 
   	for (int i = 0; i < 10; i++) {
 		  log_debug("Test");
-		size_t count = libusb_get_device_list(context, &list);
-		for (size_t idx = 0; idx < count; ++idx) {
-			libusb_device *device = list[idx];
-	 		struct libusb_device_descriptor info = {0};
-
-	  		if (libusb_get_device_descriptor(device, &info) < 0) {
-				return NULL;
-	  		}
+		int count = transport->getDevices(list, TRANSPORT_MAX_DEVICES);
+		for (int idx = 0; idx < count; ++idx) {
+	 		struct libusb_device_descriptor info = list[idx];
 
 	  		if (info.idVendor == ACCESSORY_VID) {
 				log_debug("Android-Device: %04x:%04x:%04x\n", info.idVendor, info.idProduct, info.bDeviceClass);
 
-				if (info.idProduct == ACCESSORY_PID_ALT || info.idProduct == ACCESSORY_PID) {
+				if (IS_ACCESSORY(info.idProduct)) {
 		  			log_info("Init: %04x:%04x", info.idVendor, info.idProduct);
-		  			handle = libusb_open_device_with_vid_pid(context, info.idVendor, info.idProduct);
 
-			  		if (libusb_open(device, &handle) < 0) {
+			  		if (transport->open(idx, &handle) < 0) {
 						log_info("Error!");
 						return NULL;
 		  			}
 
 		  			if (handle != NULL) {
-						libusb_claim_interface(handle, 0);
-						libusb_free_device_list(list, count);
+						transport->claimInterface(handle, 0);
 						return handle;
 		  			}
 				} else {
@@ -186,7 +194,6 @@ libusb_device_handle *usb_get_aoa_handle() {
 				}
 	  		}
 		}
-		libusb_free_device_list(list, count);
 		SDL_Delay(20);
   	}
 	  return NULL;
@@ -208,98 +215,61 @@ void usb_setConnectionState(enum aoakvm_usb_status_e state) {
 }
 
 int usb_registerHIDS(libusb_device_handle *handle) {
-	return init_HIDS(handle);
+	profile_begin(PHASE_HID_REGISTER);
+	int ret = init_HIDS(handle);
+	profile_end(PHASE_HID_REGISTER);
+	return ret;
 }
 
-static int usb_initAOA(libusb_device_handle *handle, struct aoakvmConfig_t *cfg) {
-
-	libusb_claim_interface(handle, 0);
-
-  unsigned char ioBuffer[2];
-  int devVersion;
-  int ret = libusb_control_transfer(
-	  handle,   //handle
-	  0xC0,     //bmRequestType
-	  51,       //bRequest
-	  0,        //wValue
-	  0,        //wIndex
-	  ioBuffer, //data
-	  2,        //wLength
-	  0         //timeout
-  );
-
-  if (ret < 0) {
-	log_debug("Device does not support AOA %s", cfg->serialNumber);
-	return -1;
+/*
+	Puts all candidates into accessory mode at once. Devices that do not answer a step within
+	AOA_STEP_TIMEOUT_MS (plus retries) are dropped instead of blocking the others.
+	Returns the number of devices that accepted AOA_START.
+*/
+static int usb_initAOA(libusb_device_handle **handles, int count, struct aoakvmConfig_t *cfg) {
+  if (count == 0) {
+	return 0;
   }
 
-  devVersion = (int)ioBuffer[1] << 8 | ioBuffer[0];
-  log_debug("AOA Version: %04x\n", devVersion);
-
-  /* manufacturer */
-  ret = libusb_control_transfer(handle, 0x40, 52, 0, 0,
-									 (unsigned char *)cfg->manufacturer, strlen(cfg->manufacturer), 0);
-  if (ret < 0) {
-	log_error(libusb_error_name(ret));
-	return -2;
+  struct aoaHandshake_t *hs = memstat_calloc(MEM_TRANSPORT, count, sizeof(struct aoaHandshake_t));
+  if (hs == NULL) {
+	return -1;
   }
 
-  /* modelName */
-  ret = libusb_control_transfer(handle, 0x40, 52, 0, 1,
-									 (unsigned char *)cfg->modelName, strlen(cfg->modelName) + 1, 0);
-  if (ret < 0) {
-	log_error(libusb_error_name(ret));
-	return -2;
+  for (int i = 0; i < count; i++) {
+	transport->claimInterface(handles[i], 0);
+	aoa_prepareAccessory(&hs[i], transport, handles[i], cfg);
   }
 
-  /* description */
-  ret = libusb_control_transfer(handle, 0x40, 52, 0, 2,
-									 (unsigned char *)cfg->description, strlen(cfg->description) + 1, 0);
-  if (ret < 0)
-  {
-	log_error(libusb_error_name(ret));
-	return -2;
+  int ret = aoa_run(transport, hs, count);
+  for (int i = 0; i < count; i++) {
+	if (hs[i].state == AOA_HANDSHAKE_DONE) {
+	  log_info("AOA %d.%d handshake took %llu us", hs[i].stats.protocol >> 8, hs[i].stats.protocol & 0xff,
+			   (unsigned long long)hs[i].stats.duration);
+	  accessoryStats = hs[i].stats;
+	} else if (hs[i].stats.failedStep == 0) {
+	  log_debug("Device does not support AOA %s", cfg->serialNumber);
+	} else {
+	  log_error("AOA handshake failed in %s: %s", hs[i].stats.failedName, libusb_error_name(hs[i].stats.error));
+	}
   }
+  memstat_free(MEM_TRANSPORT, hs);
 
-  /* version */
-  ret = libusb_control_transfer(handle, 0x40, 52, 0, 3,
-									 (unsigned char *)cfg->version, strlen(cfg->version) + 1, 0);
-  if (ret < 0)
-  {
-	log_error(libusb_error_name(ret));
-	return -2;
-  }
+  log_debug("Attempted to put device into accessory mode\n");
+  return ret;
+}
 
-  /* uri */
-  ret = libusb_control_transfer(handle, 0x40, 52, 0, 4,
-									 (unsigned char *)cfg->uri, strlen(cfg->uri) + 1, 0);
-  if (ret < 0)
-  {
-	log_error(libusb_error_name(ret));
-	return -2;
-  }
+const struct usbTransport_t *usb_transport() {
+  return transport;
+}
 
-  /* serial number */
-  ret = libusb_control_transfer(handle, 0x40, 52, 0, 5,
-									 (unsigned char *)cfg->serialNumber, strlen(cfg->serialNumber) + 1, 0);
-  if (ret < 0)
-  {
-	log_error(libusb_error_name(ret));
-	return -2;
+void usb_getHandshakeStats(struct aoakvmHandshakeStats_t *accessory, struct aoakvmHandshakeStats_t *hids) {
+  if (accessory != NULL) {
+	*accessory = accessoryStats;
   }
-
-  ret = libusb_control_transfer(handle, 0x40, 53, 0, 0, NULL, 0, 0);
-  if (ret < 0)
-  {
-	log_error(libusb_error_name(ret));
-	return -2;
+  if (hids != NULL) {
+	*hids = hidStats;
   }
-
-  	libusb_close(handle);
-	handle = NULL;
-
-  log_debug("Attempted to put device into accessory mode\n");
-  return 0;
 }
 
 int usb_read_stream(void *data) {
@@ -308,6 +278,8 @@ int usb_read_stream(void *data) {
   AVFormatContext *fmt_ctx = render->fmt_ctx;
   AVCodecContext *codec_ctx = render->codec_ctx;
 
+  affinity_apply(THREAD_STREAM);
+
   AVFrame *frame = av_frame_alloc();
   AVPacket *pkt = av_packet_alloc();
 
@@ -316,6 +288,7 @@ int usb_read_stream(void *data) {
 	log_error("failed to allocate Frame/Packet structure");
 	exit(1);
   }
+  memstat_track(MEM_DECODER, 2, 0);
 
   while (ret >= 0) {
 	ret = av_read_frame(fmt_ctx, pkt);
@@ -330,7 +303,13 @@ int usb_read_stream(void *data) {
 	}
 
 	if (pkt->stream_index == 0) {
+	  video_selectFrames(fmt_ctx, codec_ctx, pkt);
+	  if (codec_ctx->skip_frame != AVDISCARD_DEFAULT) {
+		watchdog_onSkippedPacket();
+	  }
+	  uint64_t cpu = clock_threadCpuUs();
 	  ret = avcodec_send_packet(codec_ctx, pkt);
+	  video_countDecodeTime(clock_threadCpuUs() - cpu);
 
 	  int ignore_this_frame_flag = 0;
 	  switch (ret) {
@@ -366,7 +345,9 @@ int usb_read_stream(void *data) {
 
 	  if (ignore_this_frame_flag != 1) {
 		while (ret >= 0) {
+		  cpu = clock_threadCpuUs();
 		  ret = avcodec_receive_frame(codec_ctx, frame);
+		  video_countDecodeTime(clock_threadCpuUs() - cpu);
 
 		  if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
 			ret = 0;
@@ -380,6 +361,7 @@ int usb_read_stream(void *data) {
 		  while (ret != 0) {
 			if (usbCon->status == NOT_CONNECTED) {
 			  log_debug("readPackagesFromStream connection loss");
+			  free_decode_buffers(&frame, &pkt);
 			  return 0;
 			}
 
@@ -392,29 +374,61 @@ int usb_read_stream(void *data) {
 	ret = 0;
   }
 
+  free_decode_buffers(&frame, &pkt);
   return -1;
 }
 
-void usb_writeToPhone(struct usbRequest_t req) {
+static void free_decode_buffers(AVFrame **frame, AVPacket **pkt) {
+  av_frame_free(frame);
+  av_packet_free(pkt);
+  memstat_track(MEM_DECODER, -2, 0);
+}
 
-	if (usbCon->status != CONNECTED) {
-		return;
-	}
+int usb_writeToPhone(struct usbRequest_t req) {
+    int ret = LIBUSB_ERROR_NO_DEVICE;
 
-    int ret;
-    ret = libusb_control_transfer(usbCon->handle, req.requestType, req.request, req.value, req.index, req.buffer, req.length, req.timeout);
-    if(ret < 0) {
-        if (ret == LIBUSB_ERROR_NO_DEVICE) {
+    SDL_LockMutex(writeMutex);
+    if (usbCon->status == CONNECTED && usbCon->handle != NULL) {
+        ret = transport->controlTransfer(usbCon->handle, req.requestType, req.request, req.value, req.index, req.buffer, req.length, req.timeout);
+    }
+    SDL_UnlockMutex(writeMutex);
+
+    // Writers run on the input threads, only the main loop closes the session
+    if (ret == LIBUSB_ERROR_NO_DEVICE && usbCon->status == CONNECTED) {
         usb_setConnectionState(NOT_CONNECTED);
-        libusb_close(usbCon->handle);
-        usbCon->handle = NULL;
-        } else { // This is not allowed to happen
-        // TODO: Error Handling
+    } else if (ret < 0 && ret != LIBUSB_ERROR_NO_DEVICE) {
         log_error("libusb_control_transfer: Error while transferrig %s", libusb_error_name(ret));
-        return;
-        }
     }
+	return ret;
+}
 
+void usb_closeHandle() {
+    SDL_LockMutex(writeMutex);
+    if (usbCon->handle != NULL) {
+        transport->close(usbCon->handle);
+        usbCon->handle = NULL;
+    }
+    SDL_UnlockMutex(writeMutex);
+}
 
-	return;
+int usb_hasNkroKeyboard() {
+	return SDL_AtomicGet(&nkroKeyboard);
+}
+
+int usb_sendHidEvent(int hidId, unsigned char *report, uint16_t length) {
+	struct usbRequest_t req = {
+		.requestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+		.request = AOA_SEND_HID_EVENT,
+		.value = hidId,
+		.index = 0,
+		.buffer = report,
+		.length = length,
+		.timeout = DEFAULT_TIMEOUT,
+	};
+	uint64_t started = clock_nowUs();
+	int ret = usb_writeToPhone(req);
+	if (ret >= 0) {
+		hud_onHidSend(clock_nowUs() - started);
+	}
+	return ret;
 }
\ No newline at end of file
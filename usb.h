@@ -2,22 +2,78 @@
 #define AOAKVM_USB
 
 #include "aoakvm.h"
+#include "transport.h"
 
 /*
-    libusb_device_handle usb_getHandle(libusb_context *ctx);
+    libusb_device_handle usb_getHandle(struct aoakvmConfig_t *cfg, SDL_Renderer *screenRenderer);
 
-    Initializes the given context and returns a libusb_device_handle which is found by the
-    properties of accessory vid and accessory pid or altenative accessory pid.
+    Initializes the transport (the mock device of cfg->mock or libusb) and returns a
+    libusb_device_handle which is found by the properties of accessory vid and accessory pid
+    or altenative accessory pid. The AOA_INITIALIZED screen is drawn with screenRenderer, the
+    one of the session's message screens, NULL headless and for a tile of the wall.
 */
-libusb_device_handle *usb_getHandle(struct aoakvmConfig_t*);
-libusb_device_handle *usb_get_aoa_handle();
+libusb_device_handle *usb_getHandle(struct aoakvmConfig_t*, SDL_Renderer*);
+libusb_device_handle *usb_get_aoa_handle(SDL_Renderer*);
 
+/*
+    int usb_registerHIDS(libusb_device_handle *handle);
+
+    Registers all HIDs with one asynchronous handshake (see aoa_prepareHids). Returns -1 if the
+    phone did not answer in time, a phone that rejects HIDs is kept without input.
+*/
 int usb_registerHIDS(libusb_device_handle*);
 
+/*
+    int usb_hasNkroKeyboard();
+
+    1 if the phone of the session took HID_ID_KEYBOARD_NKRO, otherwise keyboard reports go to
+    the six key boot keyboard HID_ID_KEYBOARD. Safe to call from any thread.
+*/
+int usb_hasNkroKeyboard();
+
+/*
+    void usb_getHandshakeStats(struct aoakvmHandshakeStats_t *accessory,
+                               struct aoakvmHandshakeStats_t *hids);
+
+    Timing of the last successful switch into accessory mode and of the last HID registration.
+    Either pointer may be NULL.
+*/
+void usb_getHandshakeStats(struct aoakvmHandshakeStats_t*, struct aoakvmHandshakeStats_t*);
+
+/*
+    const struct usbTransport_t *usb_transport();
+
+    The transport chosen by the first usb_getHandle call, every operation on the handles it
+    returned must go through it. NULL before.
+*/
+const struct usbTransport_t *usb_transport();
+
 void usb_setConnectionState(enum aoakvm_usb_status_e);
 
 int usb_read_stream(void*);
 
-void usb_writeToPhone(struct usbRequest_t);
+/*
+    int usb_writeToPhone(struct usbRequest_t req);
+
+    Sends a control request to the connected phone, callable from any thread. A phone that is
+    gone sets the connection state to NOT_CONNECTED, the main loop then closes the session.
+    Returns the libusb result, LIBUSB_ERROR_NO_DEVICE if no phone is connected.
+*/
+int usb_writeToPhone(struct usbRequest_t);
+
+/*
+    void usb_closeHandle();
+
+    Closes the handle of the session once no usb_writeToPhone uses it. Only called by the main
+    loop when it tears the session down.
+*/
+void usb_closeHandle();
+
+/*
+    int usb_sendHidEvent(int hidId, unsigned char *report, uint16_t length);
+
+    Sends one AOA_SEND_HID_EVENT report for the HID registered as hidId (HID_ID_xxx).
+*/
+int usb_sendHidEvent(int, unsigned char*, uint16_t);
 
 #endif
\ No newline at end of file
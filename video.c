@@ -1,12 +1,34 @@
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
 #include "aoakvm.h"
+#include "aoakvm_clock.h"
 #include "video.h"
 #include "usb.h"
+#include "tilehash.h"
+#include "fanout.h"
+#include "latency.h"
+#include "profile.h"
+#include "watchdog.h"
+#include "memstat.h"
+#include "busmon.h"
+#include "window.h"
+#include "hud.h"
+#include "sink.h"
 
 // Defines
 #define MIDDLE_BUFFER_SIZE 1024
 #define AVIO_BUFFER_SIZE 4 * 1024
 #define IN 0x81 //0x85
+/* Bulk reads return this often without data so the watchdog gets a say */
+#define READ_TIMEOUT_MS 100
 #define LENGTH_FRAME_QUEUE 30
+/* How often the render loop looks at the window while it is hidden */
+#define IDLE_POLL_MS 20
+/* Deviations beyond this re-anchor the jitter buffer instead of growing its delay */
+#define JITTER_RESET_US 2000000
+/* Without timestamps a pause this long in the arrivals starts a new frame cadence */
+#define JITTER_GAP_US 250000
 
 // Struct Definition
 
@@ -14,6 +36,10 @@
 struct usb_source_context
 {
   libusb_device_handle *device;
+  AVCodecContext *codec; // set by video_openStream, flushed by the watchdog
+  SDL_atomic_t stop;     // set by video_stopStream
+  int bus;               // busmon session
+  uint64_t lastPreview;  // clock_nowUs() of the last keyframe decoded for the preview
   uint8_t *ptr; // points to datastart
   int size;     // how much data should be copied
 };
@@ -25,29 +51,79 @@ struct usb_source_context
         int nextRead;
         int nextWrite;
         SDL_mutex *frameQueueMutex;
-        AVFrame frame[LENGTH_FRAME_QUEUE];
+        AVFrame *frame[LENGTH_FRAME_QUEUE];     each slot holds its own reference
+        AVFrame *latest;                        reference to the last decoded frame
+        struct tilehash_t hash[LENGTH_FRAME_QUEUE];  luma tile hashes, computed on the decode thread
+        uint64_t presentAt[LENGTH_FRAME_QUEUE];     clock_nowUs() the jitter buffer releases the frame at
+        uint64_t decodedAt[LENGTH_FRAME_QUEUE];     clock_nowUs() the frame was queued at
 */
 struct FrameQueue {
   int nextRead;
   int nextWrite;
   SDL_mutex *frameQueueMutex;
-  AVFrame frame[LENGTH_FRAME_QUEUE];
+  AVFrame *frame[LENGTH_FRAME_QUEUE];
+  AVFrame *latest;
+  struct tilehash_t hash[LENGTH_FRAME_QUEUE];
+  uint64_t presentAt[LENGTH_FRAME_QUEUE];
+  uint64_t decodedAt[LENGTH_FRAME_QUEUE];
+};
+
+/*
+    Presentation jitter buffer, guarded by the frame queue mutex. All times are in us. The
+    offset of a frame is its arrival minus its media time, the smallest offset seen (base) is
+    that of a frame which came without delay and the deviation from it is the frame's jitter.
+*/
+struct jitterBuffer_t {
+  int64_t minDelay;
+  int64_t maxDelay;     // 0 presents frames as soon as they are decoded
+  AVRational timeBase;  // of the video stream
+  int timestamps;       // the demuxer delivers real PTS, raw elementary streams do not
+  int anchored;
+  int64_t base;
+  int64_t peak;         // decaying peak of the deviation
+  int64_t target;       // peak clamped to minDelay and maxDelay
+  int64_t lastArrival;  // arrival cadence used in place of missing timestamps
+  int64_t lastMedia;
+  int64_t interval;
+  struct aoakvmJitterStats_t stats;
 };
 
 // Static Functions
 static void fq_incrementReadIndex();
 static void fq_incrementWriteIndex();
+static void fq_skipToLatest();
 
-static int fq_getFrameFromQueue(AVFrame *frame);
+static int fq_getFrameFromQueue(AVFrame *frame, struct tilehash_t *hash);
+static void fq_swapHash(struct tilehash_t *a, struct tilehash_t *b);
+static void fq_unrefFrame(AVFrame *frame);
+static int fq_refFrame(AVFrame *dst, const AVFrame *src);
+static void fq_updateScreenActivity(AVFrame *frame);
 
-static int create_texture(SDL_Renderer **renderer, SDL_Texture **texture, AVCodecContext *codec_ctx);
+static void jb_startStream(const AVFormatContext *format);
+static uint64_t jb_presentAt(const AVFrame *frame, int64_t arrival);
+static int64_t jb_mediaTime(const AVFrame *frame, int64_t arrival);
+
+static int upload_dirty_tiles(AVFrame *frame, int dirty);
+static int present(SDL_Renderer *renderer);
+
+static int create_texture(SDL_Renderer **renderer, SDL_Texture **texture, int w, int h);
 
 static int read_packet(void *opaque, uint8_t *buf, int buf_size);
+static int read_bulk(struct usb_source_context *ctx);
+static int recover_stream(struct usb_source_context *ctx, int step);
+
+static enum AVCodecID probe_codec(struct usb_source_context *ctx, const char **demuxer);
+static enum AVCodecID detect_codec(const uint8_t *data, int size, const char **demuxer);
+static int read_leb128(const uint8_t **data, const uint8_t *end, uint64_t *value);
+static AVFrame *convert_for_upload(AVFrame *frame);
 
 // Local Variables
 unsigned char middle_buffer[MIDDLE_BUFFER_SIZE];
 
 SDL_Texture *texture;
+int64_t textureBytes;
+AVFrame *renderFrame;
+uint64_t renderDecodedAt; // of renderFrame until it was presented once
 
 struct FrameQueue frameQueue = {
     .nextRead = 0,
@@ -59,16 +135,56 @@ int stream_height = 0;
 int screen_width = 0;
 int screen_height = 0;
 
+/* Tile hashes of the frame being rendered and of what the texture currently shows */
+struct tilehash_t renderHash;
+struct tilehash_t textureHash;
+uint8_t *dirtyTiles;
+int dirtyTilesCount;
+
+/* Decode side change detection */
+struct tilehash_t decodeHash;
+struct tilehash_t prevDecodeHash;
+SDL_mutex *activityMutex;
+struct aoakvmScreenActivity_t screenActivity;
 
-static int create_texture(SDL_Renderer **renderer, SDL_Texture **texture, AVCodecContext *codec_ctx) {
+Uint32 SCREEN_CHANGED_EVENT = ((Uint32)-1);
+
+struct jitterBuffer_t jitter;
+
+/* Idle mode while the window is hidden, see video_setIdleKeyframes */
+int idleKeyframes;
+/* ms between preview keyframes, 0 decodes everything, see video_setPreview */
+SDL_atomic_t previewInterval;
+int renderPaused;
+
+/* Codec of the current stream, bytes are counted on the ingest side, the rest on the decode thread */
+SDL_SpinLock codecStatsLock;
+struct aoakvmCodecStats_t codecStats;
+
+/* busmon session of the current stream for video_getBusStats, -1 between streams */
+SDL_atomic_t busSession = { -1 };
+
+/* Decoder output that is not 8 bit 4:2:0 gets converted on the decode thread */
+struct SwsContext *uploadSws;
+AVFrame *uploadFrame;
+
+
+static int create_texture(SDL_Renderer **renderer, SDL_Texture **texture, int w, int h) {
 #define DIFF_TO_EDGE 100
 
-	int w = stream_width = codec_ctx->width;
-	int h = stream_height = codec_ctx->height;
+	stream_width = w;
+	stream_height = h;
 	log_trace("Stream Resolution: \t %d x %d", w, h);
 
+	video_destroyTexture();
+
 	*texture = SDL_CreateTexture(*renderer, SDL_PIXELFORMAT_YV12, SDL_TEXTUREACCESS_STATIC, w, h);
+	if (*texture != NULL) {
+		textureBytes = (int64_t)w * h * 3 / 2;
+		memstat_track(MEM_TEXTURES, 1, textureBytes);
+	}
 	log_debug("Texture Created");
+	textureHash.valid = 0;
 	SDL_Rect rect;
 	SDL_GetDisplayUsableBounds(0, &rect);
 
@@ -86,7 +202,6 @@ static int create_texture(SDL_Renderer **renderer, SDL_Texture **texture, AVCode
 
 static int read_packet(void *opaque, uint8_t *buf, int buf_size) {
   struct usb_source_context *ctx = (struct usb_source_context *)opaque;
-  int response = 0;
   int transferred = 0;
 
   if (buf_size == 0) {
@@ -108,10 +223,52 @@ static int read_packet(void *opaque, uint8_t *buf, int buf_size) {
     return size;
   }
 
+  transferred = read_bulk(ctx);
+  if (transferred < 0) {
+    return transferred;
+  }
+
+  // Hand the raw elementary stream to remote viewers before it is demuxed
+  fanout_feed(middle_buffer, transferred);
+
+  if (transferred > buf_size) {
+    memcpy(buf, middle_buffer, buf_size);
+    ctx->ptr = middle_buffer + buf_size;
+    ctx->size = transferred - buf_size;
+    return buf_size;
+  }
+
+  memcpy(buf, middle_buffer, transferred);
+
+  return transferred;
+}
+
+/*
+    Reads the next chunk from the bulk endpoint into middle_buffer. Returns the number of bytes
+    or < 0 if the connection is gone.
+*/
+static int read_bulk(struct usb_source_context *ctx) {
+  int response = 0;
+  int transferred = 0;
+
   while (transferred == 0) {
-    response = libusb_bulk_transfer(ctx->device, IN, middle_buffer, MIDDLE_BUFFER_SIZE, &transferred, 0);
+    // The session is being torn down, let av_read_frame fail
+    if (SDL_AtomicGet(&ctx->stop)) {
+      return LIBUSB_ERROR_NO_DEVICE;
+    }
+
+    int step = watchdog_check();
+    if (step != WATCHDOG_NONE && (response = recover_stream(ctx, step)) < 0) {
+      return response;
+    }
+
+    uint64_t started = clock_nowUs();
+    response = usb_transport()->bulkTransfer(ctx->device, IN, middle_buffer, MIDDLE_BUFFER_SIZE, &transferred, READ_TIMEOUT_MS);
+    if (transferred > 0) {
+      busmon_onTransfer(ctx->bus, transferred, clock_nowUs() - started);
+    }
 
-    if (response < 0 && response != LIBUSB_ERROR_IO) {
+    if (response < 0 && response != LIBUSB_ERROR_IO && response != LIBUSB_ERROR_TIMEOUT) {
       log_debug("libusb_bulk_transfer failed: %s \t %d\n", libusb_error_name(response), transferred);
       if (response == LIBUSB_ERROR_NO_DEVICE) {
         //Send SDL_Event connection lost;
@@ -120,63 +277,390 @@ static int read_packet(void *opaque, uint8_t *buf, int buf_size) {
     }
   }
 
-  if (transferred > buf_size) {
-    memcpy(buf, middle_buffer, buf_size);
-    ctx->ptr = middle_buffer + buf_size;
-    ctx->size = transferred - buf_size;
-    return buf_size;
+  watchdog_onBytes(transferred);
+  SDL_AtomicLock(&codecStatsLock);
+  codecStats.bytes += transferred;
+  SDL_AtomicUnlock(&codecStatsLock);
+  return transferred;
+}
+
+/*
+    Reads the first chunk of the stream and leaves it pending in the context, so read_packet
+    hands it to libavformat as if nothing happened. Returns AV_CODEC_ID_NONE if the chunk
+    does not tell.
+*/
+static enum AVCodecID probe_codec(struct usb_source_context *ctx, const char **demuxer) {
+  int transferred = read_bulk(ctx);
+  if (transferred < 0) {
+    return AV_CODEC_ID_NONE;
   }
 
-  memcpy(buf, middle_buffer, transferred);
+  enum AVCodecID codec = detect_codec(middle_buffer, transferred, demuxer);
+  if (codec != AV_CODEC_ID_NONE && fanout_setCodec(codec) < 0) {
+    log_warn("fanout: %s streams are not served", avcodec_get_name(codec));
+  }
+  fanout_feed(middle_buffer, transferred);
 
-  return transferred;
+  ctx->ptr = middle_buffer;
+  ctx->size = transferred;
+  return codec;
+}
+
+/*
+    Annex-B streams (H.264, HEVC) start with a start code. The NAL header after each start code
+    is checked against both syntaxes, parameter sets count double. AV1 comes either as low
+    overhead OBUs beginning with a temporal delimiter or sequence header, or in the Annex-B
+    length delimited format whose first OBU is a temporal delimiter.
+*/
+static enum AVCodecID detect_codec(const uint8_t *data, int size, const char **demuxer) {
+  if (size >= 4 && data[0] == 0 && data[1] == 0 && (data[2] == 1 || (data[2] == 0 && data[3] == 1))) {
+    int h264 = 0;
+    int hevc = 0;
+
+    for (int i = 0; i + 4 < size; i++) {
+      if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+        continue;
+      }
+      uint8_t b0 = data[i + 3];
+      uint8_t b1 = data[i + 4];
+      i += 2;
+      if (b0 & 0x80) {
+        continue;
+      }
+
+      // H.264: nal_ref_idc must be set for IDR slices and parameter sets and clear for SEI to end of stream
+      int type = b0 & 0x1f;
+      int ref = b0 >> 5;
+      if ((type == 5 || type == 7 || type == 8) && ref != 0) {
+        h264 += type == 5 ? 1 : 2;
+      } else if ((type == 1 || (type >= 2 && type <= 4 && ref != 0)) || (type >= 6 && type <= 12 && ref == 0)) {
+        h264++;
+      }
+
+      // HEVC: two byte header with nuh_layer_id 0 and nuh_temporal_id_plus1 > 0
+      type = (b0 >> 1) & 0x3f;
+      if ((b0 & 1) || (b1 >> 3) != 0 || (b1 & 7) == 0) {
+        continue;
+      }
+      if (type >= 32 && type <= 34) {
+        hevc += 2;
+      } else if (type <= 9 || (type >= 16 && type <= 21) || (type >= 35 && type <= 40)) {
+        hevc++;
+      }
+    }
+
+    if (hevc > h264) {
+      *demuxer = "hevc";
+      return AV_CODEC_ID_HEVC;
+    }
+    if (h264 > 0) {
+      *demuxer = "h264";
+      return AV_CODEC_ID_H264;
+    }
+    return AV_CODEC_ID_NONE;
+  }
+
+  // Temporal delimiter (type 2) with obu_has_size_field and size 0, or a sequence header (type 1)
+  if (size >= 2 && ((data[0] == 0x12 && data[1] == 0x00) || data[0] == 0x0a)) {
+    *demuxer = "obu";
+    return AV_CODEC_ID_AV1;
+  }
+
+  // temporal_unit_size, frame_unit_size, obu_length of a temporal delimiter without size field
+  const uint8_t *p = data;
+  uint64_t temporalUnit, frameUnit, obu;
+  if (read_leb128(&p, data + size, &temporalUnit) == 0 && read_leb128(&p, data + size, &frameUnit) == 0 &&
+      read_leb128(&p, data + size, &obu) == 0 && p < data + size &&
+      obu == 1 && *p == 0x10 && frameUnit < temporalUnit) {
+    *demuxer = "av1";
+    return AV_CODEC_ID_AV1;
+  }
+  return AV_CODEC_ID_NONE;
+}
+
+static int read_leb128(const uint8_t **data, const uint8_t *end, uint64_t *value) {
+  *value = 0;
+  for (int i = 0; i < 8; i++) {
+    if (*data == end) {
+      return -1;
+    }
+    uint8_t byte = *(*data)++;
+    *value |= (uint64_t)(byte & 0x7f) << (i * 7);
+    if (!(byte & 0x80)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+    Carries out a watchdog step on the stream thread, which owns the decoder and the bulk
+    endpoint. Returns < 0 if the connection has to be dropped.
+*/
+static int recover_stream(struct usb_source_context *ctx, int step) {
+  const struct usbTransport_t *transport = usb_transport();
+
+  switch (step) {
+  case WATCHDOG_RESYNC:
+    if (ctx->codec != NULL) {
+      avcodec_flush_buffers(ctx->codec);
+    }
+    return 0;
+
+  case WATCHDOG_CANCEL:
+    ctx->size = 0;
+    if (transport->clearHalt(ctx->device, IN) < 0) {
+      log_warn("watchdog: clearing the bulk endpoint failed");
+    }
+    return 0;
+
+  case WATCHDOG_RESET:
+    ctx->size = 0;
+    if (transport->resetDevice(ctx->device) == 0) {
+      return 0;
+    }
+    // The phone re-enumerated, only a new connection helps
+    /* fall through */
+  case WATCHDOG_REENUMERATE:
+  default:
+    usb_setConnectionState(NOT_CONNECTED);
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+}
+
+int video_initFrameQueue() {
+  if (frameQueue.frameQueueMutex != NULL) {
+    return 0;
+  }
+
+  activityMutex = SDL_CreateMutex();
+  for (int i = 0; i < LENGTH_FRAME_QUEUE; i++) {
+    frameQueue.frame[i] = av_frame_alloc();
+  }
+  frameQueue.latest = av_frame_alloc();
+  renderFrame = av_frame_alloc();
+  frameQueue.frameQueueMutex = SDL_CreateMutex();
+  return frameQueue.frameQueueMutex != NULL ? 0 : -1;
 }
 
 AVIOContext *video_setupAVContext(libusb_device_handle *handle) {
   struct usb_source_context *ctx;
   uint8_t *avio_buffer = NULL;
 
-  ctx = malloc(sizeof(struct usb_source_context));
+  if (video_initFrameQueue() < 0) {
+    log_error("failed to allocate the frame queue");
+    return NULL;
+  }
+
+  ctx = memstat_alloc(MEM_AVIO, sizeof(struct usb_source_context));
+  if (ctx == NULL) {
+    return NULL;
+  }
   ctx->device = handle;
+  ctx->codec = NULL;
+  SDL_AtomicSet(&ctx->stop, 0);
+  ctx->bus = busmon_attach(handle);
+  ctx->lastPreview = 0;
 
   ctx->ptr = middle_buffer;
   ctx->size = 0;
 
+  SDL_AtomicLock(&codecStatsLock);
+  memset(&codecStats, 0, sizeof(codecStats));
+  codecStats.started = clock_nowUs();
+  SDL_AtomicUnlock(&codecStatsLock);
+
   avio_buffer = av_malloc(AVIO_BUFFER_SIZE + AV_INPUT_BUFFER_PADDING_SIZE);
   if (!avio_buffer) {
     log_error("failed to allocate memory for avio_buffer");
+    busmon_detach(ctx->bus);
+    memstat_free(MEM_AVIO, ctx);
     return NULL;
   }
 
-  return avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 0, ctx, &read_packet, NULL, NULL);
+  AVIOContext *reader = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 0, ctx, &read_packet, NULL, NULL);
+  if (reader == NULL) {
+    av_free(avio_buffer);
+    busmon_detach(ctx->bus);
+    memstat_free(MEM_AVIO, ctx);
+    return NULL;
+  }
+  memstat_track(MEM_AVIO, 1, AVIO_BUFFER_SIZE + AV_INPUT_BUFFER_PADDING_SIZE);
+  SDL_AtomicSet(&busSession, ctx->bus);
+  return reader;
+}
+
+void video_stopStream(AVIOContext *reader) {
+  if (reader != NULL) {
+    SDL_AtomicSet(&((struct usb_source_context *)reader->opaque)->stop, 1);
+  }
+}
+
+void video_closeStream(AVIOContext **reader, struct aoakvmAVCtx_t *av) {
+  struct aoakvmCodecStats_t stats;
+  // Frames of the simulated device came without a stream
+  if (video_getCodecStats(&stats) == 0 && stats.frames > 0) {
+    uint64_t duration = SDL_max(clock_nowUs() - stats.started, 1);
+    log_info("video: %s %d bit, %llu kbit/s, %llu us decode CPU per frame, %llu of %llu frames converted",
+             avcodec_get_name(stats.codec), stats.bitDepth,
+             (unsigned long long)(stats.bytes * 8000 / duration),
+             (unsigned long long)(stats.decodeCpuUs / stats.frames),
+             (unsigned long long)stats.converted, (unsigned long long)stats.frames);
+  }
+
+  struct aoakvmJitterStats_t jitterStats;
+  if (video_getJitterStats(&jitterStats) == 0 && jitterStats.maxDelay > 0 && jitterStats.presented > 0) {
+    log_info("video: jitter buffer at %u ms for %u ms jitter, %llu frames presented, %llu late, %llu resets",
+             jitterStats.targetDelay, jitterStats.jitter, (unsigned long long)jitterStats.presented,
+             (unsigned long long)jitterStats.late, (unsigned long long)jitterStats.resets);
+  }
+
+  if (av->codec_ctx != NULL) {
+    avcodec_free_context(&av->codec_ctx);
+    memstat_track(MEM_DECODER, -1, 0);
+  }
+  // With a custom AVIO the reader stays ours
+  if (av->fmt_ctx != NULL) {
+    avformat_close_input(&av->fmt_ctx);
+    memstat_track(MEM_DECODER, -1, 0);
+  }
+
+  if (*reader != NULL) {
+    SDL_AtomicSet(&busSession, -1);
+    busmon_detach(((struct usb_source_context *)(*reader)->opaque)->bus);
+    memstat_free(MEM_AVIO, (*reader)->opaque);
+    av_freep(&(*reader)->buffer);
+    avio_context_free(reader);
+    memstat_track(MEM_AVIO, -1, -(AVIO_BUFFER_SIZE + AV_INPUT_BUFFER_PADDING_SIZE));
+  }
+
+  // Decoded frames keep decoder buffers alive
+  if (frameQueue.frameQueueMutex != NULL) {
+    SDL_LockMutex(frameQueue.frameQueueMutex);
+    for (int i = 0; i < LENGTH_FRAME_QUEUE; i++) {
+      fq_unrefFrame(frameQueue.frame[i]);
+    }
+    fq_unrefFrame(frameQueue.latest);
+    fq_unrefFrame(renderFrame);
+    frameQueue.nextRead = frameQueue.nextWrite;
+    SDL_UnlockMutex(frameQueue.frameQueueMutex);
+  }
+  if (uploadFrame != NULL) {
+    av_frame_unref(uploadFrame);
+  }
+  textureHash.valid = 0;
+  video_destroyTexture();
+}
+
+void video_destroyTexture() {
+  if (texture != NULL) {
+    SDL_DestroyTexture(texture);
+    texture = NULL;
+    memstat_track(MEM_TEXTURES, -1, -textureBytes);
+  }
 }
 
 int video_initRenderer(struct aoakvmAVCtx_t *data, SDL_Renderer **renderer){
-	create_texture(renderer, &texture, data->codec_ctx);
+	create_texture(renderer, &texture, data->codec_ctx->width, data->codec_ctx->height);
   return 0;
 }
 
+int video_initRendererSize(SDL_Renderer **renderer, int width, int height) {
+  create_texture(renderer, &texture, width, height);
+  return texture != NULL ? 0 : -1;
+}
+
+/*
+    Uploads the tiles marked in dirtyTiles. Consecutive dirty tiles of a tile row are merged into
+    one rectangle, more than half of the frame dirty falls back to a single full upload.
+*/
+static int upload_dirty_tiles(AVFrame *frame, int dirty) {
+    if (dirtyTiles == NULL || dirty * 2 > renderHash.cols * renderHash.rows) {
+      return SDL_UpdateYUVTexture(texture, NULL,
+                                  frame->data[0], frame->linesize[0],
+                                  frame->data[1], frame->linesize[1],
+                                  frame->data[2], frame->linesize[2]);
+    }
+
+    for (int r = 0; r < renderHash.rows; r++) {
+      for (int c = 0; c < renderHash.cols; c++) {
+        if (!dirtyTiles[r * renderHash.cols + c]) {
+          continue;
+        }
+
+        int first = c;
+        while (c + 1 < renderHash.cols && dirtyTiles[r * renderHash.cols + c + 1]) {
+          c++;
+        }
+
+        SDL_Rect rect;
+        rect.x = first * TILEHASH_TILE_SIZE;
+        rect.y = r * TILEHASH_TILE_SIZE;
+        rect.w = SDL_min((c + 1) * TILEHASH_TILE_SIZE, frame->width) - rect.x;
+        rect.h = SDL_min((r + 1) * TILEHASH_TILE_SIZE, frame->height) - rect.y;
+
+        int ret = SDL_UpdateYUVTexture(texture, &rect,
+                                       frame->data[0] + rect.y * frame->linesize[0] + rect.x, frame->linesize[0],
+                                       frame->data[1] + rect.y / 2 * frame->linesize[1] + rect.x / 2, frame->linesize[1],
+                                       frame->data[2] + rect.y / 2 * frame->linesize[2] + rect.x / 2, frame->linesize[2]);
+        if (ret < 0) {
+          return ret;
+        }
+      }
+    }
+    return 0;
+}
+
 int video_rendering(SDL_Renderer *renderer) {
     int ret = 0;
 
+    // Hidden: no uploads and no presents, the decoder keeps the latest frame up to date
+    if (!window_isVisible()) {
+      renderPaused = 1;
+      SDL_Delay(IDLE_POLL_MS);
+      return 0;
+    }
+
+    // Shown again: continue with the newest frame and present even if it did not change
+    int resumed = renderPaused;
+    if (renderPaused) {
+      renderPaused = 0;
+      fq_skipToLatest();
+    }
+
+    // The overlay is refreshed on its own schedule, also on a static screen
+    int redraw = resumed || (hud_isDue() && textureHash.valid);
+
     // Get a Frame from the Queue
-    AVFrame frame;
-    ret = fq_getFrameFromQueue(&frame);
-    if (ret >= 0) {
-      ret = SDL_UpdateYUVTexture(texture, NULL,
-                                 frame.data[0], frame.linesize[0],
-                                 frame.data[1], frame.linesize[1],
-                                 frame.data[2], frame.linesize[2]);
-
-      if (ret < 0) {
-        log_error("Update YUV Texture failed: %s", SDL_GetError());
-        return 0;
-      }
-    } else {
+    ret = fq_getFrameFromQueue(renderFrame, &renderHash);
+    if (ret < 0) {
+      return redraw ? present(renderer) : 0;
+    }
+
+    if (renderHash.cols * renderHash.rows != dirtyTilesCount) {
+      free(dirtyTiles);
+      dirtyTilesCount = renderHash.cols * renderHash.rows;
+      dirtyTiles = malloc(dirtyTilesCount);
+    }
+
+    // Static screen: the texture already shows this frame, skip upload and present
+    int dirty = tilehash_diff(&renderHash, &textureHash, dirtyTiles);
+    if (dirty == 0) {
+      renderDecodedAt = 0;
+      return redraw ? present(renderer) : 0;
+    }
+
+    if (upload_dirty_tiles(renderFrame, dirty) < 0) {
+      log_error("Update YUV Texture failed: %s", SDL_GetError());
+      textureHash.valid = 0;
       return 0;
     }
+    tilehash_copy(&textureHash, &renderHash);
+    return present(renderer);
+}
 
-    ret = SDL_RenderClear(renderer);
+static int present(SDL_Renderer *renderer) {
+    int ret = SDL_RenderClear(renderer);
     if (ret < 0){
       log_error("SDL_RenderClear failed.");
       return ret;
@@ -188,7 +672,14 @@ int video_rendering(SDL_Renderer *renderer) {
       return ret;
     }
 
+    hud_draw(renderer);
     SDL_RenderPresent(renderer);
+    latency_onPresent(renderFrame);
+    hud_onPresent(renderDecodedAt);
+    renderDecodedAt = 0;
+    if (profile_end(PHASE_FIRST_FRAME)) {
+      profile_log();
+    }
     return 0;
 }
 
@@ -205,8 +696,21 @@ int video_openStream(AVIOContext *source, AVFormatContext **format, AVCodecConte
       return AVERROR(ENOMEM);
     }
 
+    // Pick the demuxer from the first bytes instead of letting libavformat probe a whole megabyte
+    const char *demuxer = NULL;
+    const AVInputFormat *input = NULL;
+    enum AVCodecID codecId = probe_codec((struct usb_source_context *)source->opaque, &demuxer);
+    if (codecId != AV_CODEC_ID_NONE && (input = av_find_input_format(demuxer)) == NULL) {
+      log_warn("No %s demuxer in this libavformat, probing the stream", demuxer);
+    }
+    log_info("Stream codec: %s", codecId != AV_CODEC_ID_NONE ? avcodec_get_name(codecId) : "unknown");
+
+    SDL_AtomicLock(&codecStatsLock);
+    codecStats.codec = codecId;
+    SDL_AtomicUnlock(&codecStatsLock);
+
     (*format)->pb = source;
-    (*format)->video_codec_id = AV_CODEC_ID_H264;
+    (*format)->video_codec_id = codecId;
     (*format)->audio_codec_id = AV_CODEC_ID_NONE;
     (*format)->probesize = 1024 * 1024;
     (*format)->format_probesize = 1024 * 1024;
@@ -218,17 +722,24 @@ int video_openStream(AVIOContext *source, AVFormatContext **format, AVCodecConte
     log_info("");
     log_info("Sollte der der Stream nicht Starten. Stoppen und starten sie die Übertragung neu.");
 
-    if (avformat_open_input(format, NULL, NULL, NULL) < 0) {
+    profile_begin(PHASE_OPEN_INPUT);
+    if (avformat_open_input(format, NULL, input, NULL) < 0) {
       log_error("Could not open input stream.");
       return -1;
     }
+    memstat_track(MEM_DECODER, 1, 0);
+    profile_end(PHASE_OPEN_INPUT);
 
+    profile_begin(PHASE_FIND_STREAM_INFO);
     if (avformat_find_stream_info(*format, NULL) < 0) {
       log_error("Could not find stream information");
       return -1;
     }
+    profile_end(PHASE_FIND_STREAM_INFO);
+    jb_startStream(*format);
 
     /* allocate codec */
+    profile_begin(PHASE_DECODER_OPEN);
     AVCodecParameters *codec_params = (*format)->streams[0]->codecpar;
     AVCodec *cd = avcodec_find_decoder(codec_params->codec_id);
     if (cd == NULL || codec_params == NULL)
@@ -255,6 +766,7 @@ int video_openStream(AVIOContext *source, AVFormatContext **format, AVCodecConte
       log_error("failed to allocate codec context");
       return -1;
     }
+    memstat_track(MEM_DECODER, 1, 0);
 
     if (avcodec_parameters_to_context(*codec, codec_params) < 0)
     {
@@ -269,6 +781,8 @@ int video_openStream(AVIOContext *source, AVFormatContext **format, AVCodecConte
       log_error("could not open codec");
       return -1;
     }
+    ((struct usb_source_context *)source->opaque)->codec = *codec;
+    profile_end(PHASE_DECODER_OPEN);
 
   return 0;
 }
@@ -286,6 +800,8 @@ static void fq_incrementReadIndex() {
 static void fq_incrementWriteIndex() {
 	if ((frameQueue.nextWrite == LENGTH_FRAME_QUEUE - 1 && frameQueue.nextRead == 0) || ((frameQueue.nextWrite + 1) == (frameQueue.nextRead)))
 	{
+		// Full, the oldest frame is overwritten
+		jitter.stats.overrun++;
 		fq_incrementReadIndex();
 		fq_incrementWriteIndex();
     	return;
@@ -297,25 +813,344 @@ static void fq_incrementWriteIndex() {
     return;
 }
 
-static int fq_getFrameFromQueue(AVFrame *frame) {
+/* Drops all queued frames but the newest */
+static void fq_skipToLatest() {
+	SDL_LockMutex(frameQueue.frameQueueMutex);
+	if (frameQueue.nextRead != frameQueue.nextWrite) {
+		frameQueue.nextRead = (frameQueue.nextWrite + LENGTH_FRAME_QUEUE - 1) % LENGTH_FRAME_QUEUE;
+	}
+	SDL_UnlockMutex(frameQueue.frameQueueMutex);
+}
+
+static int fq_getFrameFromQueue(AVFrame *frame, struct tilehash_t *hash) {
 	if (frameQueue.nextRead == frameQueue.nextWrite) {
 		SDL_Delay(1);
     	return -1;
     }
 
 	SDL_LockMutex(frameQueue.frameQueueMutex);
+	uint64_t now = clock_nowUs();
+	if (jitter.maxDelay > 0) {
+		// Several frames due at once: only the newest of them is presented
+		int next = (frameQueue.nextRead + 1) % LENGTH_FRAME_QUEUE;
+		while (next != frameQueue.nextWrite && frameQueue.presentAt[next] <= now) {
+			fq_unrefFrame(frameQueue.frame[frameQueue.nextRead]);
+			fq_incrementReadIndex();
+			jitter.stats.late++;
+			next = (frameQueue.nextRead + 1) % LENGTH_FRAME_QUEUE;
+		}
+	}
+	if (frameQueue.presentAt[frameQueue.nextRead] > now) {
+		SDL_UnlockMutex(frameQueue.frameQueueMutex);
+		SDL_Delay(1);
+		return -1;
+	}
+
 	int ret = 0;
-	*frame = frameQueue.frame[frameQueue.nextRead];
+	jitter.stats.presented++;
+	fq_unrefFrame(frame);
+	av_frame_move_ref(frame, frameQueue.frame[frameQueue.nextRead]);
+	renderDecodedAt = frameQueue.decodedAt[frameQueue.nextRead];
+	fq_swapHash(hash, &frameQueue.hash[frameQueue.nextRead]);
 	fq_incrementReadIndex();
 	SDL_UnlockMutex(frameQueue.frameQueueMutex);
 	return ret;
 }
 
 int fq_pushFrameIntoQueue(AVFrame *frame) {
+	watchdog_onFrame();
+
+	frame = convert_for_upload(frame);
+	if (frame == NULL) {
+		return 0;
+	}
+	// Compared with references of the latest frame, which is 8 bit as well
+	latency_onFrame(frame);
+
+	// Hash the luma plane here on the decode thread, the renderer only compares hashes
+	if (tilehash_alloc(&decodeHash, frame->width, frame->height) >= 0) {
+		tilehash_compute(&decodeHash, frame->data[0], frame->linesize[0]);
+		fq_updateScreenActivity(frame);
+	} else {
+		decodeHash.valid = 0;
+	}
+
 	SDL_LockMutex(frameQueue.frameQueueMutex);
 	//log_debug("Write at %d", renderQueue.nextWrite);
-	frameQueue.frame[frameQueue.nextWrite] = *frame;
+	fq_unrefFrame(frameQueue.frame[frameQueue.nextWrite]);
+	if (fq_refFrame(frameQueue.frame[frameQueue.nextWrite], frame) < 0) {
+		log_error("failed to reference decoded frame");
+		SDL_UnlockMutex(frameQueue.frameQueueMutex);
+		return 0;
+	}
+	fq_unrefFrame(frameQueue.latest);
+	fq_refFrame(frameQueue.latest, frame);
+	fq_swapHash(&decodeHash, &frameQueue.hash[frameQueue.nextWrite]);
+	frameQueue.decodedAt[frameQueue.nextWrite] = clock_nowUs();
+	frameQueue.presentAt[frameQueue.nextWrite] = jb_presentAt(frame, frameQueue.decodedAt[frameQueue.nextWrite]);
 	fq_incrementWriteIndex();
 	SDL_UnlockMutex(frameQueue.frameQueueMutex);
+
+	// After the renderer got the frame, sinks only take references and never wait
+	sink_pushFrame(frame);
 	return 0;
-}
\ No newline at end of file
+}
+
+/*
+    The texture, the tile hashes and the snapshot encoder expect 8 bit YUV 4:2:0 planes. Other
+    decoder output, mostly 10 bit HEVC and AV1, is converted into a new frame per call as the
+    queue keeps references. Returns NULL if the frame has to be dropped.
+*/
+static AVFrame *convert_for_upload(AVFrame *frame) {
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	int converted = frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P;
+
+	SDL_AtomicLock(&codecStatsLock);
+	codecStats.frames++;
+	codecStats.converted += converted;
+	codecStats.bitDepth = desc != NULL ? desc->comp[0].depth : 0;
+	SDL_AtomicUnlock(&codecStatsLock);
+
+	if (!converted) {
+		return frame;
+	}
+
+	uploadSws = sws_getCachedContext(uploadSws, frame->width, frame->height, frame->format,
+	                                 frame->width, frame->height, AV_PIX_FMT_YUV420P,
+	                                 SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	if (uploadSws == NULL) {
+		log_error("No conversion from %s for the texture", av_get_pix_fmt_name(frame->format));
+		return NULL;
+	}
+
+	if (uploadFrame == NULL && (uploadFrame = av_frame_alloc()) == NULL) {
+		return NULL;
+	}
+	av_frame_unref(uploadFrame);
+	uploadFrame->format = AV_PIX_FMT_YUV420P;
+	uploadFrame->width = frame->width;
+	uploadFrame->height = frame->height;
+	if (av_frame_get_buffer(uploadFrame, 0) < 0 || av_frame_copy_props(uploadFrame, frame) < 0) {
+		av_frame_unref(uploadFrame);
+		return NULL;
+	}
+
+	sws_scale(uploadSws, (const uint8_t *const *)frame->data, frame->linesize, 0, frame->height,
+	          uploadFrame->data, uploadFrame->linesize);
+	return uploadFrame;
+}
+
+/* Frames owned by the queue and the renderer, counted as MEM_FRAME_QUEUE */
+static void fq_unrefFrame(AVFrame *frame) {
+	if (frame->buf[0] != NULL) {
+		memstat_track(MEM_FRAME_QUEUE, -1, -memstat_frameSize(frame));
+		av_frame_unref(frame);
+	}
+}
+
+static int fq_refFrame(AVFrame *dst, const AVFrame *src) {
+	int ret = av_frame_ref(dst, src);
+	if (ret >= 0) {
+		memstat_track(MEM_FRAME_QUEUE, 1, memstat_frameSize(dst));
+	}
+	return ret;
+}
+
+static void fq_swapHash(struct tilehash_t *a, struct tilehash_t *b) {
+	struct tilehash_t tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static void fq_updateScreenActivity(AVFrame *frame) {
+	int changed = tilehash_diff(&decodeHash, &prevDecodeHash, NULL);
+	tilehash_copy(&prevDecodeHash, &decodeHash);
+
+	SDL_LockMutex(activityMutex);
+	int wasStatic = screenActivity.changedTiles == 0;
+	screenActivity.frames++;
+	screenActivity.changedTiles = changed;
+	screenActivity.totalTiles = decodeHash.cols * decodeHash.rows;
+	if (changed > 0) {
+		screenActivity.changedFrames++;
+		screenActivity.lastChange = SDL_GetTicks();
+	}
+	SDL_UnlockMutex(activityMutex);
+
+	// Only signal the transition from a static to a changing screen
+	if (changed > 0 && wasStatic) {
+		aoakvm_push_event(&SCREEN_CHANGED_EVENT, (void *)(intptr_t)changed, NULL);
+	}
+}
+
+/* A new stream starts with a new clock, the delay settings stay */
+static void jb_startStream(const AVFormatContext *format) {
+	SDL_LockMutex(frameQueue.frameQueueMutex);
+	jitter.timeBase = format->streams[0]->time_base;
+	// Raw H.264, HEVC and AV1 come without timestamps, libavformat makes them up from a guessed rate
+	jitter.timestamps = format->iformat != NULL && !(format->iformat->flags & AVFMT_NOTIMESTAMPS);
+	jitter.anchored = 0;
+	jitter.peak = jitter.target = jitter.minDelay;
+	jitter.lastArrival = jitter.lastMedia = jitter.interval = 0;
+	memset(&jitter.stats, 0, sizeof(jitter.stats));
+	SDL_UnlockMutex(frameQueue.frameQueueMutex);
+}
+
+/*
+    Time the renderer presents the frame at: its arrival minus its own deviation, plus the target
+    delay. A frame that was late by more than the target is due right away. Runs on the decode
+    thread with the frame queue mutex held.
+*/
+static uint64_t jb_presentAt(const AVFrame *frame, int64_t arrival) {
+	if (jitter.maxDelay == 0) {
+		return 0;
+	}
+
+	int64_t offset = arrival - jb_mediaTime(frame, arrival);
+	if (!jitter.anchored || llabs(offset - jitter.base) > JITTER_RESET_US) {
+		// First frame, a timestamp jump or a stall: this frame defines the clock anew
+		jitter.stats.resets += jitter.anchored;
+		jitter.anchored = 1;
+		jitter.base = offset;
+		jitter.peak = jitter.minDelay;
+	} else if (offset < jitter.base) {
+		jitter.base = offset;
+	} else {
+		// Follows a drift between the clock of the phone and ours
+		jitter.base += (offset - jitter.base) / 256;
+	}
+
+	int64_t deviation = offset - jitter.base;
+	jitter.peak = deviation > jitter.peak ? deviation : jitter.peak - jitter.peak / 128;
+	jitter.target = SDL_clamp(jitter.peak, jitter.minDelay, jitter.maxDelay);
+	return arrival - deviation + jitter.target;
+}
+
+static int64_t jb_mediaTime(const AVFrame *frame, int64_t arrival) {
+	int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+	if (jitter.timestamps && pts != AV_NOPTS_VALUE) {
+		return av_rescale_q(pts, jitter.timeBase, (AVRational){1, 1000000});
+	}
+
+	// No timestamps: the arrivals smoothed to the average frame interval, pulled towards the arrival against drift
+	int64_t delta = arrival - jitter.lastArrival;
+	int64_t media = jitter.lastMedia + jitter.interval;
+	if (jitter.lastArrival == 0 || delta > JITTER_GAP_US || llabs(arrival - media) > JITTER_GAP_US) {
+		media = arrival;
+	} else {
+		jitter.interval = jitter.interval == 0 ? delta : jitter.interval + (delta - jitter.interval) / 8;
+		media += (arrival - media) / 32;
+	}
+	jitter.lastArrival = arrival;
+	jitter.lastMedia = media;
+	return media;
+}
+
+int video_getScreenActivity(struct aoakvmScreenActivity_t *activity) {
+	if (activityMutex == NULL) {
+		return -1;
+	}
+
+	SDL_LockMutex(activityMutex);
+	*activity = screenActivity;
+	SDL_UnlockMutex(activityMutex);
+	return 0;
+}
+
+int video_refLatestFrame(AVFrame *dst) {
+	int ret = -1;
+
+	if (frameQueue.frameQueueMutex == NULL) {
+		return -1;
+	}
+
+	SDL_LockMutex(frameQueue.frameQueueMutex);
+	if (frameQueue.latest->buf[0] != NULL) {
+		ret = av_frame_ref(dst, frameQueue.latest);
+	}
+	SDL_UnlockMutex(frameQueue.frameQueueMutex);
+	return ret;
+}
+
+int video_getCodecStats(struct aoakvmCodecStats_t *stats) {
+	SDL_AtomicLock(&codecStatsLock);
+	*stats = codecStats;
+	SDL_AtomicUnlock(&codecStatsLock);
+	return stats->started != 0 ? 0 : -1;
+}
+
+void video_countDecodeTime(uint64_t cpuUs) {
+	SDL_AtomicLock(&codecStatsLock);
+	codecStats.decodeCpuUs += cpuUs;
+	SDL_AtomicUnlock(&codecStatsLock);
+}
+
+int video_getBusStats(struct aoakvmBusStats_t *stats) {
+	return busmon_getStats(SDL_AtomicGet(&busSession), stats);
+}
+
+void video_setIdleKeyframes(int enabled) {
+	idleKeyframes = enabled;
+}
+
+void video_setPreview(uint32_t intervalMs) {
+	SDL_AtomicSet(&previewInterval, intervalMs);
+}
+
+/*
+    The bulk endpoint is always drained so the phone keeps encoding, what is left out is decode
+    work: all but keyframes for the preview and a hidden window, non-reference frames while
+    the bus sheds for a session with a higher priority.
+*/
+void video_selectFrames(AVFormatContext *format, AVCodecContext *codec, const AVPacket *pkt) {
+	struct usb_source_context *ctx = format->pb->opaque;
+	uint32_t interval = SDL_AtomicGet(&previewInterval);
+	int key = pkt->flags & AV_PKT_FLAG_KEY;
+	int keyOnly = interval > 0 || (idleKeyframes && !window_isVisible());
+
+	// Back to full decoding at the next keyframe, the references of the delta frames before it were skipped
+	if (!keyOnly && codec->skip_frame >= AVDISCARD_NONKEY && !key) {
+		return;
+	}
+
+	if (keyOnly) {
+		uint64_t now = clock_nowUs();
+		if (interval > 0 && key && now - ctx->lastPreview < (uint64_t)interval * 1000) {
+			codec->skip_frame = AVDISCARD_ALL;
+			return;
+		}
+		ctx->lastPreview = key ? now : ctx->lastPreview;
+		codec->skip_frame = AVDISCARD_NONKEY;
+		return;
+	}
+
+	codec->skip_frame = busmon_shouldShed(ctx->bus) ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
+
+void video_setJitterBuffer(const struct aoakvmJitterConfig_t *cfg) {
+	if (video_initFrameQueue() < 0) {
+		return;
+	}
+
+	SDL_LockMutex(frameQueue.frameQueueMutex);
+	jitter.maxDelay = cfg != NULL ? (int64_t)cfg->maxDelay * 1000 : 0;
+	jitter.minDelay = cfg != NULL ? (int64_t)SDL_min(cfg->minDelay, cfg->maxDelay) * 1000 : 0;
+	jitter.peak = jitter.target = jitter.minDelay;
+	SDL_UnlockMutex(frameQueue.frameQueueMutex);
+}
+
+int video_getJitterStats(struct aoakvmJitterStats_t *stats) {
+	if (frameQueue.frameQueueMutex == NULL) {
+		return -1;
+	}
+
+	SDL_LockMutex(frameQueue.frameQueueMutex);
+	*stats = jitter.stats;
+	stats->maxDelay = jitter.maxDelay / 1000;
+	stats->targetDelay = jitter.target / 1000;
+	stats->jitter = jitter.peak / 1000;
+	stats->timestamps = jitter.timestamps;
+	stats->queued = (frameQueue.nextWrite - frameQueue.nextRead + LENGTH_FRAME_QUEUE) % LENGTH_FRAME_QUEUE;
+	SDL_UnlockMutex(frameQueue.frameQueueMutex);
+	return 0;
+}
@@ -10,10 +10,135 @@
 */
 AVIOContext *video_setupAVContext(libusb_device_handle*);
 
+/*
+    int video_initFrameQueue();
+
+    Allocates the frame queue. Called by video_setupAVContext, sources that push frames without
+    a USB stream (the simulated device of the latency harness) call it themselves.
+*/
+int video_initFrameQueue();
+
+/*
+    void video_stopStream(AVIOContext *reader);
+
+    Makes the reader fail from its next read on, so the stream thread ends within the bulk
+    read timeout even if the phone still sends.
+*/
+void video_stopStream(AVIOContext*);
+
+/*
+    void video_closeStream(AVIOContext **reader, struct aoakvmAVCtx_t *av);
+
+    Session teardown after the stream thread ended: frees the decoder, the format context, the
+    reader with its buffer, the frames still queued and the stream texture. Safe to call
+    after any failed step of the setup, freed pointers are set to NULL.
+*/
+void video_closeStream(AVIOContext**, struct aoakvmAVCtx_t*);
+void video_destroyTexture();
+
 int video_initRenderer(struct aoakvmAVCtx_t*, SDL_Renderer**);
+
+/*
+    int video_initRendererSize(SDL_Renderer **renderer, int width, int height);
+
+    video_initRenderer for sources without a decoder, the simulated device of the latency
+    harness. Returns -1 if the texture could not be created.
+*/
+int video_initRendererSize(SDL_Renderer**, int, int);
+
+/*
+    int video_rendering(SDL_Renderer *renderer);
+
+    Uploads and presents the next queued frame. While the window is hidden (window_isVisible)
+    it only sleeps, when it is shown again it presents the newest frame right away.
+*/
 int video_rendering(SDL_Renderer *renderer);
 int video_openStream(AVIOContext*, AVFormatContext**, AVCodecContext**);
 
 int fq_pushFrameIntoQueue(AVFrame *frame);
 
+/*
+    int video_getScreenActivity(struct aoakvmScreenActivity_t *activity);
+
+    Copies the current screen change state. Returns -1 before the first stream was set up.
+*/
+int video_getScreenActivity(struct aoakvmScreenActivity_t*);
+
+/*
+    int video_refLatestFrame(AVFrame *dst);
+
+    Makes dst a new reference to the last decoded frame. Only takes the queue lock for the
+    duration of av_frame_ref. Returns -1 if no frame has been decoded yet.
+*/
+int video_refLatestFrame(AVFrame*);
+
+/*
+    int video_getCodecStats(struct aoakvmCodecStats_t *stats);
+
+    Copies the codec, bitrate and decode cost figures of the current stream, which are also
+    logged when the stream is closed. Returns -1 before the first stream was set up.
+*/
+int video_getCodecStats(struct aoakvmCodecStats_t*);
+
+/*
+    void video_countDecodeTime(uint64_t cpuUs);
+
+    Adds thread CPU time spent in avcodec_send_packet/avcodec_receive_frame, called by the
+    stream thread.
+*/
+void video_countDecodeTime(uint64_t);
+
+/*
+    int video_getBusStats(struct aoakvmBusStats_t *stats);
+
+    Throughput and transfer latency of the current stream and of its USB bus, see
+    busmon_getStats. Returns -1 between streams or if the device location is unknown. Safe
+    to call from any thread.
+*/
+int video_getBusStats(struct aoakvmBusStats_t*);
+
+/*
+    void video_setIdleKeyframes(int enabled);
+
+    Decode only keyframes while the window is hidden or minimized. Once it is shown again the
+    newest keyframe is presented and full decoding resumes at the next keyframe. A window that
+    is only covered by others keeps full decoding, see window_isVisible.
+*/
+void video_setIdleKeyframes(int);
+
+/*
+    void video_setPreview(uint32_t intervalMs);
+
+    Preview mode for overviews of many sessions: only keyframes are decoded, at most one per
+    intervalMs. The stream keeps being read, 0 switches back to full decoding, which starts
+    at the next keyframe. Stays set across reconnections, safe to call from any thread.
+*/
+void video_setPreview(uint32_t);
+
+/*
+    void video_selectFrames(AVFormatContext *format, AVCodecContext *codec, const AVPacket *pkt);
+
+    Sets skip_frame of the decoder for pkt according to preview, idle mode and bus shedding.
+    Called by the stream thread before every avcodec_send_packet.
+*/
+void video_selectFrames(AVFormatContext*, AVCodecContext*, const AVPacket*);
+
+/*
+    void video_setJitterBuffer(const struct aoakvmJitterConfig_t *cfg);
+
+    Paces video_rendering by the timestamps of the stream, or by the arrival cadence if it has
+    none, delayed by the jitter measured within the limits of cfg. When the render loop falls
+    behind, frames that are overdue are dropped. NULL or a maxDelay of 0 presents every frame
+    as soon as it is decoded. The wall and video_refLatestFrame are not delayed.
+*/
+void video_setJitterBuffer(const struct aoakvmJitterConfig_t*);
+
+/*
+    int video_getJitterStats(struct aoakvmJitterStats_t *stats);
+
+    Current delay, measured jitter and frame counts of the jitter buffer for the current
+    stream. Returns -1 before the frame queue was set up.
+*/
+int video_getJitterStats(struct aoakvmJitterStats_t*);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,401 @@
+#include "aoakvm.h"
+#include "wall.h"
+#include "window.h"
+#include "keyboard.h"
+#include "hud.h"
+
+/* How long wall_render waits when nothing changed, presents are paced by vsync otherwise */
+#define WALL_IDLE_MS 5
+
+// Struct Definition
+
+/*
+    struct WallTile
+
+    Fields:
+        int used;
+        char name[32];
+        aoakvmWallInput_t input;
+        void *userdata;
+        AVFrame *pending;       latest pushed frame, not yet uploaded
+        SDL_Texture *texture;   only touched by wall_render
+        int width;              size of texture
+        int height;
+        SDL_Rect video;         where the video was drawn, in renderer pixels
+        int touching;           the left mouse button went down inside the video
+*/
+struct WallTile {
+    int used;
+    char name[32];
+    aoakvmWallInput_t input;
+    void *userdata;
+    AVFrame *pending;
+    SDL_Texture *texture;
+    int width;
+    int height;
+    SDL_Rect video;
+    int touching;
+};
+
+// Static Functions
+static void layout(int count, int outW, int outH, SDL_Rect *cells);
+static void fit(const SDL_Rect *cell, int w, int h, SDL_Rect *video);
+static int upload(struct WallTile *tile, AVFrame *frame);
+static int tile_at(int x, int y);
+static void to_renderer(int *x, int *y);
+static int route(int tile, const struct aoakvmInputEvent_t *event);
+static int input_watch(void *data, SDL_Event *event);
+
+// Local Variables
+static const struct aoakvmWallConfig_t *config;
+static SDL_Window *wallWindow;
+static SDL_Renderer *wallRenderer;
+static SDL_mutex *wallMutex;
+static struct WallTile tiles[WALL_MAX_TILES];
+static int focus = -1;
+/* Tiles were added, removed or focused, the wall has to be drawn even without a new frame */
+static int layoutChanged;
+static AVFrame *uploadFrame;
+
+
+int wall_init(const struct aoakvmWallConfig_t *cfg, SDL_Window *window, SDL_Renderer *renderer) {
+    config = cfg;
+    wallWindow = window;
+    wallRenderer = renderer;
+
+    wallMutex = SDL_CreateMutex();
+    uploadFrame = av_frame_alloc();
+    if (wallMutex == NULL || uploadFrame == NULL) {
+        log_error("wall: out of memory");
+        return -1;
+    }
+
+    // One present per refresh no matter how many tiles changed
+    if (SDL_RenderSetVSync(renderer, 1) < 0) {
+        log_warn("wall: no vsync, presents are not paced: %s", SDL_GetError());
+    }
+    SDL_SetWindowResizable(window, SDL_TRUE);
+    SDL_AddEventWatch(input_watch, NULL);
+    layoutChanged = 1;
+    return 0;
+}
+
+int wall_addTile(const char *name, aoakvmWallInput_t input, void *userdata) {
+    int tile = -1;
+
+    SDL_LockMutex(wallMutex);
+    for (int i = 0; i < WALL_MAX_TILES; i++) {
+        if (!tiles[i].used) {
+            tile = i;
+            break;
+        }
+    }
+    if (tile >= 0) {
+        struct WallTile *t = &tiles[tile];
+        t->used = 1;
+        t->input = input;
+        t->userdata = userdata;
+        t->touching = 0;
+        SDL_strlcpy(t->name, name, sizeof(t->name));
+        focus = focus < 0 ? tile : focus;
+        layoutChanged = 1;
+    }
+    SDL_UnlockMutex(wallMutex);
+    return tile;
+}
+
+/* The texture stays until wall_render runs on the renderer thread */
+void wall_removeTile(int tile) {
+    SDL_LockMutex(wallMutex);
+    tiles[tile].used = 0;
+    tiles[tile].input = NULL;
+    av_frame_free(&tiles[tile].pending);
+    focus = focus == tile ? -1 : focus;
+    layoutChanged = 1;
+    SDL_UnlockMutex(wallMutex);
+}
+
+int wall_pushFrame(int tile, const AVFrame *frame) {
+    int ret = -1;
+
+    SDL_LockMutex(wallMutex);
+    if (tiles[tile].used) {
+        av_frame_free(&tiles[tile].pending);
+        tiles[tile].pending = av_frame_clone(frame);
+        ret = tiles[tile].pending != NULL ? 0 : -1;
+    }
+    SDL_UnlockMutex(wallMutex);
+    return ret;
+}
+
+int wall_getFocus() {
+    SDL_LockMutex(wallMutex);
+    int ret = focus;
+    SDL_UnlockMutex(wallMutex);
+    return ret;
+}
+
+int wall_isActive() {
+    return wallWindow != NULL;
+}
+
+static void layout(int count, int outW, int outH, SDL_Rect *cells) {
+    int cols = config->cols;
+    int rows = config->rows;
+
+    if (cols <= 0 || rows <= 0 || cols * rows < count) {
+        for (cols = 1; cols * cols < count; cols++);
+        rows = SDL_max(1, (count + cols - 1) / cols);
+    }
+
+    int w = (outW - config->gap * (cols + 1)) / cols;
+    int h = (outH - config->gap * (rows + 1)) / rows;
+    for (int i = 0; i < count; i++) {
+        cells[i].x = config->gap + (i % cols) * (w + config->gap);
+        cells[i].y = config->gap + (i / cols) * (h + config->gap);
+        cells[i].w = SDL_max(w, 1);
+        cells[i].h = SDL_max(h, 1);
+    }
+}
+
+/* Largest rectangle of the video's aspect ratio centered in cell */
+static void fit(const SDL_Rect *cell, int w, int h, SDL_Rect *video) {
+    if (w <= 0 || h <= 0) {
+        *video = *cell;
+        return;
+    }
+
+    video->w = cell->w;
+    video->h = (int)((int64_t)cell->w * h / w);
+    if (video->h > cell->h) {
+        video->h = cell->h;
+        video->w = (int)((int64_t)cell->h * w / h);
+    }
+    video->x = cell->x + (cell->w - video->w) / 2;
+    video->y = cell->y + (cell->h - video->h) / 2;
+}
+
+static int upload(struct WallTile *tile, AVFrame *frame) {
+    if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P) {
+        log_error("wall: tile %s sends %s, only YUV 4:2:0 is shown", tile->name, av_get_pix_fmt_name(frame->format));
+        return -1;
+    }
+
+    if (tile->texture == NULL || tile->width != frame->width || tile->height != frame->height) {
+        if (tile->texture != NULL) {
+            SDL_DestroyTexture(tile->texture);
+        }
+        tile->texture = SDL_CreateTexture(wallRenderer, SDL_PIXELFORMAT_YV12, SDL_TEXTUREACCESS_STATIC,
+                                          frame->width, frame->height);
+        if (tile->texture == NULL) {
+            log_error("wall: texture for %s failed: %s", tile->name, SDL_GetError());
+            return -1;
+        }
+        tile->width = frame->width;
+        tile->height = frame->height;
+    }
+
+    return SDL_UpdateYUVTexture(tile->texture, NULL,
+                                frame->data[0], frame->linesize[0],
+                                frame->data[1], frame->linesize[1],
+                                frame->data[2], frame->linesize[2]);
+}
+
+int wall_render() {
+    int changed = 0;
+    int outW, outH;
+
+    // Like video_rendering, a hidden window gets no uploads, pushed frames just replace each other
+    if (!window_isVisible()) {
+        SDL_Delay(WALL_IDLE_MS);
+        return 0;
+    }
+
+    if (SDL_GetRendererOutputSize(wallRenderer, &outW, &outH) < 0) {
+        return -1;
+    }
+
+    // Upload outside the lock, decode threads only wait for a pointer swap
+    for (int i = 0; i < WALL_MAX_TILES; i++) {
+        SDL_LockMutex(wallMutex);
+        int used = tiles[i].used;
+        int pending = tiles[i].pending != NULL;
+        if (pending) {
+            av_frame_move_ref(uploadFrame, tiles[i].pending);
+            av_frame_free(&tiles[i].pending);
+        }
+        SDL_UnlockMutex(wallMutex);
+
+        if (!used && tiles[i].texture != NULL) {
+            SDL_DestroyTexture(tiles[i].texture);
+            tiles[i].texture = NULL;
+            changed = 1;
+        }
+        if (pending) {
+            changed |= upload(&tiles[i], uploadFrame) == 0;
+            av_frame_unref(uploadFrame);
+        }
+    }
+
+    SDL_LockMutex(wallMutex);
+    // The overlay is refreshed on its own schedule, also when no tile moves
+    changed |= layoutChanged || hud_isDue();
+    layoutChanged = 0;
+    if (!changed) {
+        SDL_UnlockMutex(wallMutex);
+        SDL_Delay(WALL_IDLE_MS);
+        return 0;
+    }
+
+    int count = 0;
+    int order[WALL_MAX_TILES];
+    SDL_Rect cells[WALL_MAX_TILES];
+    for (int i = 0; i < WALL_MAX_TILES; i++) {
+        if (tiles[i].used) {
+            order[count++] = i;
+        }
+    }
+    layout(count, outW, outH, cells);
+    for (int i = 0; i < count; i++) {
+        struct WallTile *tile = &tiles[order[i]];
+        fit(&cells[i], tile->width, tile->height, &tile->video);
+    }
+    int focused = focus;
+    SDL_UnlockMutex(wallMutex);
+
+    SDL_SetRenderDrawColor(wallRenderer, 0, 0, 0, 255);
+    if (SDL_RenderClear(wallRenderer) < 0) {
+        log_error("wall: SDL_RenderClear failed: %s", SDL_GetError());
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct WallTile *tile = &tiles[order[i]];
+        if (tile->texture != NULL && SDL_RenderCopy(wallRenderer, tile->texture, NULL, &tile->video) < 0) {
+            log_error("wall: SDL_RenderCopy failed: %s", SDL_GetError());
+            return -1;
+        }
+        if (order[i] == focused) {
+            SDL_Rect border = { cells[i].x - 2, cells[i].y - 2, cells[i].w + 4, cells[i].h + 4 };
+            SDL_SetRenderDrawColor(wallRenderer, 255, 200, 0, 255);
+            SDL_RenderDrawRect(wallRenderer, &border);
+        }
+    }
+
+    hud_draw(wallRenderer);
+    SDL_RenderPresent(wallRenderer);
+    hud_onPresent(0);
+    return 0;
+}
+
+/* Needs wallMutex */
+static int tile_at(int x, int y) {
+    SDL_Point point = { x, y };
+
+    for (int i = 0; i < WALL_MAX_TILES; i++) {
+        if (tiles[i].used && SDL_PointInRect(&point, &tiles[i].video)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Mouse events come in window coordinates, the layout is in renderer pixels (HiDPI) */
+static void to_renderer(int *x, int *y) {
+    int winW, winH, outW, outH;
+
+    SDL_GetWindowSize(wallWindow, &winW, &winH);
+    if (winW <= 0 || winH <= 0 || SDL_GetRendererOutputSize(wallRenderer, &outW, &outH) < 0) {
+        return;
+    }
+    *x = *x * outW / winW;
+    *y = *y * outH / winH;
+}
+
+/* Needs wallMutex */
+static int route(int tile, const struct aoakvmInputEvent_t *event) {
+    if (tile < 0 || tiles[tile].input == NULL) {
+        return -1;
+    }
+    return tiles[tile].input(event, tiles[tile].userdata);
+}
+
+/*
+    Runs in the thread that pumps the events. A left click focuses the tile under the cursor
+    and, like a drag, is sent to it as a touch of contact 0; keys and the wheel go to the
+    focused tile.
+*/
+static int input_watch(void *data, SDL_Event *event) {
+    struct aoakvmInputEvent_t in = {0};
+    int x = 0, y = 0;
+
+    if ((event->type == SDL_MOUSEBUTTONDOWN || event->type == SDL_MOUSEBUTTONUP) &&
+        event->button.button == SDL_BUTTON_LEFT) {
+        x = event->button.x;
+        y = event->button.y;
+    } else if (event->type == SDL_MOUSEMOTION) {
+        x = event->motion.x;
+        y = event->motion.y;
+    } else if (event->type != SDL_KEYDOWN && event->type != SDL_KEYUP && event->type != SDL_MOUSEWHEEL &&
+               event->type != SDL_WINDOWEVENT) {
+        return 0;
+    }
+    to_renderer(&x, &y);
+
+    SDL_LockMutex(wallMutex);
+    switch (event->type) {
+    case SDL_WINDOWEVENT:
+        layoutChanged |= event->window.event == SDL_WINDOWEVENT_SIZE_CHANGED || event->window.event == SDL_WINDOWEVENT_EXPOSED;
+        break;
+
+    case SDL_MOUSEBUTTONDOWN: {
+        int tile = tile_at(x, y);
+        if (tile >= 0 && tile != focus) {
+            if (focus >= 0 && tiles[focus].touching) {
+                struct aoakvmInputEvent_t up = { .type = INPUT_TOUCH, .pressed = 0 };
+                route(focus, &up);
+                tiles[focus].touching = 0;
+            }
+            focus = tile;
+            layoutChanged = 1;
+        }
+        if (tile < 0) {
+            break;
+        }
+        tiles[tile].touching = 1;
+    }
+        /* fall through */
+    case SDL_MOUSEMOTION:
+    case SDL_MOUSEBUTTONUP:
+        if (focus < 0 || !tiles[focus].touching) {
+            break;
+        }
+        SDL_Rect *video = &tiles[focus].video;
+        in.type = INPUT_TOUCH;
+        in.x = SDL_clamp((int64_t)(x - video->x) * 10000 / SDL_max(video->w, 1), 0, 10000);
+        in.y = SDL_clamp((int64_t)(y - video->y) * 10000 / SDL_max(video->h, 1), 0, 10000);
+        in.pressed = event->type != SDL_MOUSEBUTTONUP;
+        tiles[focus].touching = in.pressed;
+        route(focus, &in);
+        break;
+
+    case SDL_MOUSEWHEEL:
+        in.type = INPUT_MOUSE_WHEEL;
+        in.x = event->wheel.y;
+        route(focus, &in);
+        break;
+
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+        if (event->key.repeat || keyboard_usage(event->key.keysym.scancode) == 0) {
+            break;
+        }
+        in.type = INPUT_KEY;
+        in.code = keyboard_usage(event->key.keysym.scancode);
+        in.pressed = event->type == SDL_KEYDOWN;
+        route(focus, &in);
+        break;
+    }
+    SDL_UnlockMutex(wallMutex);
+    return 0;
+}
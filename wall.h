@@ -0,0 +1,54 @@
+#ifndef AOAKVM_WALL
+#define AOAKVM_WALL
+
+#include "aoakvm.h"
+
+#define WALL_MAX_TILES 64
+
+/*
+    int wall_init(const struct aoakvmWallConfig_t *cfg, SDL_Window *window, SDL_Renderer *renderer);
+
+    Turns window into a video wall: every tile gets its own texture, wall_render draws all of
+    them with a single present synchronized to vsync. An event watch gives the focus to the
+    tile that is clicked and routes mouse, wheel and keyboard input to the focused tile only.
+    cfg must stay valid. Returns -1 if the wall could not be set up.
+*/
+int wall_init(const struct aoakvmWallConfig_t*, SDL_Window*, SDL_Renderer*);
+
+/*
+    int wall_addTile(const char *name, aoakvmWallInput_t input, void *userdata);
+    void wall_removeTile(int tile);
+
+    Adds a tile at the next free grid position, input may be NULL for view only tiles.
+    Returns the tile or -1 if all WALL_MAX_TILES are in use. Thread safe.
+*/
+int wall_addTile(const char*, aoakvmWallInput_t, void*);
+void wall_removeTile(int);
+
+/*
+    int wall_pushFrame(int tile, const AVFrame *frame);
+
+    Makes frame (YUV 4:2:0) the next picture of tile, a frame not rendered yet is replaced.
+    Only takes a reference, callable from any decode thread.
+*/
+int wall_pushFrame(int, const AVFrame*);
+
+/*
+    int wall_render();
+
+    Uploads the tiles that got a new frame and presents the wall if anything changed. Called
+    in a loop on the thread that owns the renderer, which does not wait for any phone, so the
+    tiles keep moving while the local session connects. Returns < 0 on renderer errors.
+*/
+int wall_render();
+
+int wall_getFocus();
+
+/*
+    int wall_isActive();
+
+    1 once wall_init set up the wall, the input then goes to the tiles only.
+*/
+int wall_isActive();
+
+#endif
@@ -0,0 +1,146 @@
+#include "aoakvm.h"
+#include "aoakvm_clock.h"
+#include "watchdog.h"
+
+// Static Functions
+static uint32_t threshold(int step);
+
+// Local Variables
+static const char *STEP_NAMES[WATCHDOG_STEPS] = {
+    [WATCHDOG_RESYNC] = "decoder resync",
+    [WATCHDOG_CANCEL] = "transfer cancel",
+    [WATCHDOG_RESET] = "device reset",
+    [WATCHDOG_REENUMERATE] = "re-enumeration",
+};
+
+static SDL_SpinLock watchdogLock;
+static const struct aoakvmWatchdogConfig_t *config;
+
+static uint64_t lastFrame;
+static uint64_t lastBytes;
+static int nextStep;
+/* Step whose recovery time is measured, WATCHDOG_NONE if the stream is fine */
+static int recovering = WATCHDOG_NONE;
+static uint64_t stepTaken;
+static struct aoakvmWatchdogStats_t stats;
+
+
+static uint32_t threshold(int step) {
+    switch (step) {
+    case WATCHDOG_RESYNC:
+        return config->resync;
+    case WATCHDOG_CANCEL:
+        return config->cancel;
+    case WATCHDOG_RESET:
+        return config->reset;
+    case WATCHDOG_REENUMERATE:
+        return config->reenumerate;
+    default:
+        return 0;
+    }
+}
+
+void watchdog_start(const struct aoakvmWatchdogConfig_t *cfg) {
+    config = cfg;
+    watchdog_newConnection();
+}
+
+void watchdog_newConnection() {
+    uint64_t now = clock_nowUs();
+
+    SDL_AtomicLock(&watchdogLock);
+    lastFrame = now;
+    lastBytes = now;
+    nextStep = WATCHDOG_RESYNC;
+    SDL_AtomicUnlock(&watchdogLock);
+}
+
+void watchdog_onBytes(int count) {
+    uint64_t now = clock_nowUs();
+
+    SDL_AtomicLock(&watchdogLock);
+    lastBytes = now;
+    stats.bytes += count;
+    // The transport works again, another stall of it starts over at the first USB step
+    if (nextStep > WATCHDOG_CANCEL) {
+        nextStep = WATCHDOG_CANCEL;
+    }
+    SDL_AtomicUnlock(&watchdogLock);
+}
+
+void watchdog_onFrame() {
+    uint64_t now = clock_nowUs();
+    int recovered = WATCHDOG_NONE;
+    uint64_t took = 0;
+
+    SDL_AtomicLock(&watchdogLock);
+    if (recovering != WATCHDOG_NONE) {
+        struct aoakvmWatchdogStep_t *step = &stats.steps[recovering];
+        took = now - stepTaken;
+        step->recovered++;
+        step->last = took;
+        step->total += took;
+        step->max = SDL_max(step->max, took);
+        recovered = recovering;
+        recovering = WATCHDOG_NONE;
+    }
+    lastFrame = now;
+    nextStep = WATCHDOG_RESYNC;
+    stats.frames++;
+    SDL_AtomicUnlock(&watchdogLock);
+
+    if (recovered != WATCHDOG_NONE) {
+        log_info("watchdog: stream back %.1f ms after %s", took / 1000.0, STEP_NAMES[recovered]);
+    }
+}
+
+void watchdog_onSkippedPacket() {
+    uint64_t now = clock_nowUs();
+
+    SDL_AtomicLock(&watchdogLock);
+    lastFrame = now;
+    SDL_AtomicUnlock(&watchdogLock);
+}
+
+int watchdog_check() {
+    if (config == NULL) {
+        return WATCHDOG_NONE;
+    }
+
+    uint64_t now = clock_nowUs();
+    int step = WATCHDOG_NONE;
+    uint64_t sinceFrame;
+    uint64_t sinceBytes;
+
+    SDL_AtomicLock(&watchdogLock);
+    while (nextStep < WATCHDOG_STEPS && threshold(nextStep) == 0) {
+        nextStep++;
+    }
+
+    sinceFrame = now - lastFrame;
+    sinceBytes = now - lastBytes;
+    // Only the decoder is resynced while data still arrives, a slow decoder is no USB fault
+    uint64_t since = nextStep == WATCHDOG_RESYNC ? sinceFrame : sinceBytes;
+    if (nextStep < WATCHDOG_STEPS && since >= (uint64_t)threshold(nextStep) * 1000) {
+        step = nextStep++;
+        if (recovering == WATCHDOG_NONE) {
+            stats.stalls++;
+        }
+        stats.steps[step].taken++;
+        recovering = step;
+        stepTaken = now;
+    }
+    SDL_AtomicUnlock(&watchdogLock);
+
+    if (step != WATCHDOG_NONE) {
+        log_warn("watchdog: no frame for %llu ms, no data for %llu ms, trying %s",
+                 (unsigned long long)sinceFrame / 1000, (unsigned long long)sinceBytes / 1000, STEP_NAMES[step]);
+    }
+    return step;
+}
+
+void watchdog_getStats(struct aoakvmWatchdogStats_t *out) {
+    SDL_AtomicLock(&watchdogLock);
+    *out = stats;
+    SDL_AtomicUnlock(&watchdogLock);
+}
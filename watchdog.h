@@ -0,0 +1,49 @@
+#ifndef AOAKVM_WATCHDOG
+#define AOAKVM_WATCHDOG
+
+#include "aoakvm.h"
+
+/* watchdog_check: nothing to do */
+#define WATCHDOG_NONE -1
+
+/*
+    void watchdog_start(const struct aoakvmWatchdogConfig_t *cfg);
+
+    Enables the watchdog, cfg must stay valid. Without it watchdog_check never asks for a step.
+*/
+void watchdog_start(const struct aoakvmWatchdogConfig_t*);
+
+/*
+    void watchdog_newConnection();
+
+    Restarts the stall clock when a stream starts. A recovery that is still being timed, e.g.
+    after WATCHDOG_REENUMERATE, keeps running until the first frame of the new stream.
+*/
+void watchdog_newConnection();
+
+/*
+    void watchdog_onBytes(int count);
+    void watchdog_onFrame();
+    void watchdog_onSkippedPacket();
+
+    Progress of the stream, called by the stream thread for received bytes, decoded frames and
+    demuxed packets the decoder was told to skip (preview, idle keyframes, bus shedding). The
+    latter count as decoder progress, so skipping frames on purpose never looks like a stall.
+*/
+void watchdog_onBytes(int);
+void watchdog_onFrame();
+void watchdog_onSkippedPacket();
+
+/*
+    int watchdog_check();
+
+    Returns the next recovery step (aoakvm_watchdog_step_e) once its threshold passed,
+    WATCHDOG_NONE otherwise. WATCHDOG_RESYNC counts from the last frame, the USB steps from the
+    last received bytes. Every step is returned once per stall, the caller has to carry it
+    out. Called from the stream thread while it waits for data.
+*/
+int watchdog_check();
+
+void watchdog_getStats(struct aoakvmWatchdogStats_t*);
+
+#endif
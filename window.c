@@ -2,8 +2,15 @@
 
 #include "aoakvm.h"
 #include "window.h"
+#include "memstat.h"
 #include <unistd.h>
 
+// Static Functions
+static int visibility_watch(void *data, SDL_Event *event);
+
+// Local Variables
+static SDL_atomic_t visible = { 1 };
+
 int
 window_initWindow(  struct aoakvmMSGScreens *msgScreen,
                     struct aoakvmWindowProperties_t *props,
@@ -35,9 +42,41 @@ window_initWindow(  struct aoakvmMSGScreens *msgScreen,
     log_debug("create renderer");
     window_changeMsgscreenTo(msgScreen ,*renderer, window, WAIT_FOR_DEVICE);
     mainwindow = window;
+    SDL_AddEventWatch(visibility_watch, NULL);
     return 0;
 }
 
+/* Runs in the thread that pumps the events, before the event thread sees them */
+static int visibility_watch(void *data, SDL_Event *event) {
+    if (event->type != SDL_WINDOWEVENT || mainwindow == NULL || event->window.windowID != SDL_GetWindowID(mainwindow)) {
+        return 0;
+    }
+
+    switch (event->window.event) {
+    case SDL_WINDOWEVENT_HIDDEN:
+    case SDL_WINDOWEVENT_MINIMIZED:
+        if (SDL_AtomicSet(&visible, 0)) {
+            log_debug("window hidden, rendering paused");
+        }
+        break;
+    case SDL_WINDOWEVENT_SHOWN:
+    case SDL_WINDOWEVENT_EXPOSED:
+    case SDL_WINDOWEVENT_RESTORED:
+    case SDL_WINDOWEVENT_MAXIMIZED:
+        if (!SDL_AtomicSet(&visible, 1)) {
+            log_debug("window visible, rendering resumed");
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+int window_isVisible() {
+    return SDL_AtomicGet(&visible);
+}
+
 int
 window_setMsgscreens(struct aoakvmMSGScreens *msgScreen,
                     const char *waitDevice,
@@ -73,6 +112,11 @@ window_changeMsgscreenTo(struct aoakvmMSGScreens *msgScreens,
 
     SDL_Surface *image = NULL;
 
+    // Headless, there is nothing to show
+    if (renderer == NULL) {
+        return 0;
+    }
+
     switch (img_num) {
     case WAIT_FOR_DEVICE:
         image = msgScreens->waitForDevice;
@@ -90,10 +134,16 @@ window_changeMsgscreenTo(struct aoakvmMSGScreens *msgScreens,
     }
 
     SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, image);
+    if (texture == NULL) {
+        log_error("Could not create message screen texture: %s", SDL_GetError());
+        return -1;
+    }
+    memstat_track(MEM_TEXTURES, 1, (int64_t)image->w * image->h * 4);
     SDL_SetWindowSize(window, image->w / 2, image->h / 2);
     SDL_SetWindowResizable(window, false);
     SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_DestroyTexture(texture);
+    memstat_track(MEM_TEXTURES, -1, -(int64_t)image->w * image->h * 4);
     SDL_RenderPresent(renderer);
     return 0;
 }
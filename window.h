@@ -16,4 +16,14 @@
  int window_setMsgscreens(struct aoakvmMSGScreens*, const char*, const char*, const char*);
  int window_changeMsgscreenTo(struct aoakvmMSGScreens*, SDL_Renderer*, SDL_Window*, enum aoakvm_msgscreen_states_enum);
 
+/*
+    int window_isVisible();
+
+    0 while the main window is hidden or minimized, tracked with an event watch so it works
+    no matter which thread polls the events. Always 1 without a window. A window that is
+    fully covered by others still counts as visible: SDL2 reports no occlusion, and
+    compositing window managers keep drawing covered windows anyway.
+*/
+ int window_isVisible();
+
  #endif
\ No newline at end of file
@@ -0,0 +1,433 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "aoakvm.h"
+#include "yuv.h"
+
+/* Channels are computed in 1/64, 16 bit lanes hold them with room for the chroma terms */
+#define YUV_SHIFT 6
+
+// Struct Definition
+
+/*
+    struct YuvCoeffs
+
+    Matrix of one conversion in the order of the output channels. first is the chroma plane of
+    channel 0 (V for RGBA, U for BGRA), second the one of channel 2:
+        ys = (Y * 257 * yg >> 16) + yBias
+        c0 = (ys + (first - 128) * c0) >> YUV_SHIFT
+        c1 = (ys - (first - 128) * c1a - (second - 128) * c1b) >> YUV_SHIFT
+        c2 = (ys + (second - 128) * c2) >> YUV_SHIFT
+    clamped to 0..255. The saturating 16 bit sums of the SIMD kernels only saturate where the
+    clamp cuts anyway, so all kernels give the same bytes.
+*/
+struct YuvCoeffs {
+    uint16_t yg;
+    int16_t yBias;
+    int16_t c0;
+    int16_t c1a;
+    int16_t c1b;
+    int16_t c2;
+    int vFirst;     // NV12 stores U before V, the kernels swap the pair if V goes first
+};
+
+/*
+    struct YuvKernel
+
+    Row functions of one instruction set. Both convert width pixels of one row, the chroma
+    rows are those of the luma row / 2.
+*/
+struct YuvKernel {
+    const char *name;
+    SDL_bool (*available)(void);
+    void (*planar)(const uint8_t *y, const uint8_t *first, const uint8_t *second, uint8_t *dst, int width, const struct YuvCoeffs *k);
+    void (*nv12)(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width, const struct YuvCoeffs *k);
+};
+
+// Static Functions
+static int convert(const struct YuvKernel *kern, const AVFrame *src, enum AVPixelFormat fmt, uint8_t *dst, int stride);
+static void coefficients(const AVFrame *src, int bgra, struct YuvCoeffs *k);
+static const struct YuvKernel *select_kernel();
+static SDL_bool scalar_available();
+
+static void planar_tail(const uint8_t *y, const uint8_t *first, const uint8_t *second, uint8_t *dst, int x, int width, const struct YuvCoeffs *k);
+static void nv12_tail(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int x, int width, const struct YuvCoeffs *k);
+static void planar_scalar(const uint8_t *y, const uint8_t *first, const uint8_t *second, uint8_t *dst, int width, const struct YuvCoeffs *k);
+static void nv12_scalar(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width, const struct YuvCoeffs *k);
+#if defined(YUV_X86)
+static void planar_sse41(const uint8_t *y, const uint8_t *first, const uint8_t *second, uint8_t *dst, int width, const struct YuvCoeffs *k);
+static void nv12_sse41(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width, const struct YuvCoeffs *k);
+static void planar_avx2(const uint8_t *y, const uint8_t *first, const uint8_t *second, uint8_t *dst, int width, const struct YuvCoeffs *k);
+static void nv12_avx2(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width, const struct YuvCoeffs *k);
+#elif defined(__ARM_NEON)
+static void planar_neon(const uint8_t *y, const uint8_t *first, const uint8_t *second, uint8_t *dst, int width, const struct YuvCoeffs *k);
+static void nv12_neon(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width, const struct YuvCoeffs *k);
+#endif
+
+// Local Variables
+
+/* Fastest first, the scalar kernel is always available */
+static const struct YuvKernel kernels[] = {
+#if defined(YUV_X86)
+    { "avx2", SDL_HasAVX2, planar_avx2, nv12_avx2 },
+    { "sse4.1", SDL_HasSSE41, planar_sse41, nv12_sse41 },
+#elif defined(__ARM_NEON)
+    { "neon", SDL_HasNEON, planar_neon, nv12_neon },
+#endif
+    { "scalar", scalar_available, planar_scalar, nv12_scalar },
+};
+#define KERNELS ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+static void *selected;
+
+
+int yuv_toRgb(const AVFrame *src, enum AVPixelFormat fmt, uint8_t *dst, int stride) {
+    return convert(select_kernel(), src, fmt, dst, stride);
+}
+
+const char *yuv_kernelName() {
+    return select_kernel()->name;
+}
+
+int yuv_setKernel(const char *name) {
+    if (name == NULL) {
+        SDL_AtomicSetPtr(&selected, NULL);
+        return 0;
+    }
+    for (int i = 0; i < KERNELS; i++) {
+        if (strcmp(kernels[i].name, name) == 0 && kernels[i].available()) {
+            SDL_AtomicSetPtr(&selected, (void *)&kernels[i]);
+            log_debug("yuv: using the %s kernel", kernels[i].name);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+/*
+    Scalar kernel, the reference of the others and the tail of their rows
+*/
+
+static inline uint8_t clamp8(int v) {
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static inline void put_pixel(uint8_t *d, int y, int first, int second, const struct YuvCoeffs *k) {
+    int ys = (int)(((uint32_t)y * 257 * k->yg) >> 16) + k->yBias;
+
+    first -= 128;
+    second -= 128;
+    d[0] = clamp8((ys + first * k->c0) >> YUV_SHIFT);
+    d[1] = clamp8((ys - first * k->c1a - second * k->c1b) >> YUV_SHIFT);
+    d[2] = clamp8((ys + second * k->c2) >> YUV_SHIFT);
+    d[3] = 255;
+}
+
+static void planar_tail(const uint8_t *y, const uint8_t *first, const uint8_t *second, uint8_t *dst, int x, int width, const struct YuvCoeffs *k) {
+    for (; x < width; x++) {
+        put_pixel(dst + 4 * x, y[x], first[x / 2], second[x / 2], k);
+    }
+}
+
+static void nv12_tail(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int x, int width, const struct YuvCoeffs *k) {
+    for (; x < width; x++) {
+        const uint8_t *c = uv + (x / 2) * 2;
+        put_pixel(dst + 4 * x, y[x], c[k->vFirst], c[!k->vFirst], k);
+    }
+}
+
+static void planar_scalar(const uint8_t *y, const uint8_t *first, const uint8_t *second, uint8_t *dst, int width, const struct YuvCoeffs *k) {
+    planar_tail(y, first, second, dst, 0, width, k);
+}
+
+static void nv12_scalar(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width, const struct YuvCoeffs *k) {
+    nv12_tail(y, uv, dst, 0, width, k);
+}
+
+static SDL_bool scalar_available() {
+    return SDL_TRUE;
+}
+
+#if defined(YUV_X86)
+
+/*
+    SSE4.1, 16 pixels per step. f and s hold the 8 chroma samples of the step minus 128.
+    Y * 257 is the luma byte unpacked next to itself.
+*/
+__attribute__((target("sse4.1")))
+static inline void sse41_pixels(__m128i y8, __m128i f, __m128i s, uint8_t *dst, const struct YuvCoeffs *k) {
+    __m128i t0 = _mm_mullo_epi16(f, _mm_set1_epi16(k->c0));
+    __m128i t1 = _mm_add_epi16(_mm_mullo_epi16(f, _mm_set1_epi16(k->c1a)), _mm_mullo_epi16(s, _mm_set1_epi16(k->c1b)));
+    __m128i t2 = _mm_mullo_epi16(s, _mm_set1_epi16(k->c2));
+    __m128i yg = _mm_set1_epi16((short)k->yg);
+    __m128i yBias = _mm_set1_epi16(k->yBias);
+    __m128i ysLo = _mm_adds_epi16(_mm_mulhi_epu16(_mm_unpacklo_epi8(y8, y8), yg), yBias);
+    __m128i ysHi = _mm_adds_epi16(_mm_mulhi_epu16(_mm_unpackhi_epi8(y8, y8), yg), yBias);
+
+    // Every chroma term is used by two neighbouring pixels
+    __m128i c0 = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(ysLo, _mm_unpacklo_epi16(t0, t0)), YUV_SHIFT),
+                                  _mm_srai_epi16(_mm_adds_epi16(ysHi, _mm_unpackhi_epi16(t0, t0)), YUV_SHIFT));
+    __m128i c1 = _mm_packus_epi16(_mm_srai_epi16(_mm_subs_epi16(ysLo, _mm_unpacklo_epi16(t1, t1)), YUV_SHIFT),
+                                  _mm_srai_epi16(_mm_subs_epi16(ysHi, _mm_unpackhi_epi16(t1, t1)), YUV_SHIFT));
+    __m128i c2 = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(ysLo, _mm_unpacklo_epi16(t2, t2)), YUV_SHIFT),
+                                  _mm_srai_epi16(_mm_adds_epi16(ysHi, _mm_unpackhi_epi16(t2, t2)), YUV_SHIFT));
+    __m128i c3 = _mm_set1_epi8(-1);
+
+    __m128i lo01 = _mm_unpacklo_epi8(c0, c1);
+    __m128i hi01 = _mm_unpackhi_epi8(c0, c1);
+    __m128i lo23 = _mm_unpacklo_epi8(c2, c3);
+    __m128i hi23 = _mm_unpackhi_epi8(c2, c3);
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(lo01, lo23));
+    _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(lo01, lo23));
+    _mm_storeu_si128((__m128i *)(dst + 32), _mm_unpacklo_epi16(hi01, hi23));
+    _mm_storeu_si128((__m128i *)(dst + 48), _mm_unpackhi_epi16(hi01, hi23));
+}
+
+__attribute__((target("sse4.1")))
+static void planar_sse41(const uint8_t *y, const uint8_t *first, const uint8_t *second, uint8_t *dst, int width, const struct YuvCoeffs *k) {
+    __m128i bias = _mm_set1_epi16(128);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i f = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(first + x / 2))), bias);
+        __m128i s = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(second + x / 2))), bias);
+        sse41_pixels(_mm_loadu_si128((const __m128i *)(y + x)), f, s, dst + 4 * x, k);
+    }
+    planar_tail(y, first, second, dst, x, width, k);
+}
+
+__attribute__((target("sse4.1")))
+static void nv12_sse41(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width, const struct YuvCoeffs *k) {
+    __m128i bias = _mm_set1_epi16(128);
+    __m128i low = _mm_set1_epi16(0xff);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i pairs = _mm_loadu_si128((const __m128i *)(uv + x));
+        __m128i u = _mm_sub_epi16(_mm_and_si128(pairs, low), bias);
+        __m128i v = _mm_sub_epi16(_mm_srli_epi16(pairs, 8), bias);
+        sse41_pixels(_mm_loadu_si128((const __m128i *)(y + x)), k->vFirst ? v : u, k->vFirst ? u : v, dst + 4 * x, k);
+    }
+    nv12_tail(y, uv, dst, x, width, k);
+}
+
+/*
+    AVX2, 32 pixels per step. f and s hold the 16 chroma samples of the step minus 128. The
+    unpack and pack instructions work within 128 bit lanes, the permutes put the duplicated
+    chroma terms and the stored pixels back in order.
+*/
+__attribute__((target("avx2")))
+static inline void avx2_channel(__m256i ysLo, __m256i ysHi, __m256i t, int sub, __m256i *out) {
+    __m256i lo = _mm256_unpacklo_epi16(t, t);
+    __m256i hi = _mm256_unpackhi_epi16(t, t);
+    __m256i dupLo = _mm256_permute2x128_si256(lo, hi, 0x20);
+    __m256i dupHi = _mm256_permute2x128_si256(lo, hi, 0x31);
+
+    if (sub) {
+        ysLo = _mm256_subs_epi16(ysLo, dupLo);
+        ysHi = _mm256_subs_epi16(ysHi, dupHi);
+    } else {
+        ysLo = _mm256_adds_epi16(ysLo, dupLo);
+        ysHi = _mm256_adds_epi16(ysHi, dupHi);
+    }
+    // Pixels 0-7, 16-23 | 8-15, 24-31
+    *out = _mm256_packus_epi16(_mm256_srai_epi16(ysLo, YUV_SHIFT), _mm256_srai_epi16(ysHi, YUV_SHIFT));
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_pixels(const uint8_t *y, __m256i f, __m256i s, uint8_t *dst, const struct YuvCoeffs *k) {
+    __m256i t0 = _mm256_mullo_epi16(f, _mm256_set1_epi16(k->c0));
+    __m256i t1 = _mm256_add_epi16(_mm256_mullo_epi16(f, _mm256_set1_epi16(k->c1a)), _mm256_mullo_epi16(s, _mm256_set1_epi16(k->c1b)));
+    __m256i t2 = _mm256_mullo_epi16(s, _mm256_set1_epi16(k->c2));
+    __m256i yg = _mm256_set1_epi16((short)k->yg);
+    __m256i yBias = _mm256_set1_epi16(k->yBias);
+    __m256i yLo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)y));
+    __m256i yHi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + 16)));
+    __m256i ysLo = _mm256_adds_epi16(_mm256_mulhi_epu16(_mm256_or_si256(_mm256_slli_epi16(yLo, 8), yLo), yg), yBias);
+    __m256i ysHi = _mm256_adds_epi16(_mm256_mulhi_epu16(_mm256_or_si256(_mm256_slli_epi16(yHi, 8), yHi), yg), yBias);
+    __m256i c0, c1, c2;
+    __m256i c3 = _mm256_set1_epi8(-1);
+
+    avx2_channel(ysLo, ysHi, t0, 0, &c0);
+    avx2_channel(ysLo, ysHi, t1, 1, &c1);
+    avx2_channel(ysLo, ysHi, t2, 0, &c2);
+
+    // 0-7 | 8-15 and 16-23 | 24-31
+    __m256i lo01 = _mm256_unpacklo_epi8(c0, c1);
+    __m256i hi01 = _mm256_unpackhi_epi8(c0, c1);
+    __m256i lo23 = _mm256_unpacklo_epi8(c2, c3);
+    __m256i hi23 = _mm256_unpackhi_epi8(c2, c3);
+    // 0-3 | 8-11, 4-7 | 12-15, 16-19 | 24-27, 20-23 | 28-31
+    __m256i q0 = _mm256_unpacklo_epi16(lo01, lo23);
+    __m256i q1 = _mm256_unpackhi_epi16(lo01, lo23);
+    __m256i q2 = _mm256_unpacklo_epi16(hi01, hi23);
+    __m256i q3 = _mm256_unpackhi_epi16(hi01, hi23);
+    _mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(q0, q1, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 32), _mm256_permute2x128_si256(q0, q1, 0x31));
+    _mm256_storeu_si256((__m256i *)(dst + 64), _mm256_permute2x128_si256(q2, q3, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 96), _mm256_permute2x128_si256(q2, q3, 0x31));
+}
+
+__attribute__((target("avx2")))
+static void planar_avx2(const uint8_t *y, const uint8_t *first, const uint8_t *second, uint8_t *dst, int width, const struct YuvCoeffs *k) {
+    __m256i bias = _mm256_set1_epi16(128);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m256i f = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(first + x / 2))), bias);
+        __m256i s = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(second + x / 2))), bias);
+        avx2_pixels(y + x, f, s, dst + 4 * x, k);
+    }
+    planar_tail(y, first, second, dst, x, width, k);
+}
+
+__attribute__((target("avx2")))
+static void nv12_avx2(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width, const struct YuvCoeffs *k) {
+    __m256i bias = _mm256_set1_epi16(128);
+    __m256i low = _mm256_set1_epi16(0xff);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m256i pairs = _mm256_loadu_si256((const __m256i *)(uv + x));
+        __m256i u = _mm256_sub_epi16(_mm256_and_si256(pairs, low), bias);
+        __m256i v = _mm256_sub_epi16(_mm256_srli_epi16(pairs, 8), bias);
+        avx2_pixels(y + x, k->vFirst ? v : u, k->vFirst ? u : v, dst + 4 * x, k);
+    }
+    nv12_tail(y, uv, dst, x, width, k);
+}
+
+#elif defined(__ARM_NEON)
+
+/*
+    NEON, 16 pixels per step. f and s hold the 8 chroma samples of the step minus 128, vst4
+    interleaves the channels.
+*/
+static inline int16x8_t neon_luma(uint8x8_t y, uint16_t yg, int16x8_t yBias) {
+    uint16x8_t y257 = vmulq_n_u16(vmovl_u8(y), 257);
+    uint16x4_t lo = vshrn_n_u32(vmull_n_u16(vget_low_u16(y257), yg), 16);
+    uint16x4_t hi = vshrn_n_u32(vmull_n_u16(vget_high_u16(y257), yg), 16);
+    return vqaddq_s16(vreinterpretq_s16_u16(vcombine_u16(lo, hi)), yBias);
+}
+
+static inline void neon_pixels(uint8x16_t y8, int16x8_t f, int16x8_t s, uint8_t *dst, const struct YuvCoeffs *k) {
+    int16x8_t yBias = vdupq_n_s16(k->yBias);
+    int16x8_t ysLo = neon_luma(vget_low_u8(y8), k->yg, yBias);
+    int16x8_t ysHi = neon_luma(vget_high_u8(y8), k->yg, yBias);
+    int16x8x2_t t0 = vzipq_s16(vmulq_n_s16(f, k->c0), vmulq_n_s16(f, k->c0));
+    int16x8_t t1 = vaddq_s16(vmulq_n_s16(f, k->c1a), vmulq_n_s16(s, k->c1b));
+    int16x8x2_t t1d = vzipq_s16(t1, t1);
+    int16x8x2_t t2 = vzipq_s16(vmulq_n_s16(s, k->c2), vmulq_n_s16(s, k->c2));
+    uint8x16x4_t out;
+
+    out.val[0] = vcombine_u8(vqmovun_s16(vshrq_n_s16(vqaddq_s16(ysLo, t0.val[0]), YUV_SHIFT)),
+                             vqmovun_s16(vshrq_n_s16(vqaddq_s16(ysHi, t0.val[1]), YUV_SHIFT)));
+    out.val[1] = vcombine_u8(vqmovun_s16(vshrq_n_s16(vqsubq_s16(ysLo, t1d.val[0]), YUV_SHIFT)),
+                             vqmovun_s16(vshrq_n_s16(vqsubq_s16(ysHi, t1d.val[1]), YUV_SHIFT)));
+    out.val[2] = vcombine_u8(vqmovun_s16(vshrq_n_s16(vqaddq_s16(ysLo, t2.val[0]), YUV_SHIFT)),
+                             vqmovun_s16(vshrq_n_s16(vqaddq_s16(ysHi, t2.val[1]), YUV_SHIFT)));
+    out.val[3] = vdupq_n_u8(255);
+    vst4q_u8(dst, out);
+}
+
+static void planar_neon(const uint8_t *y, const uint8_t *first, const uint8_t *second, uint8_t *dst, int width, const struct YuvCoeffs *k) {
+    int16x8_t bias = vdupq_n_s16(128);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        int16x8_t f = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(first + x / 2))), bias);
+        int16x8_t s = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(second + x / 2))), bias);
+        neon_pixels(vld1q_u8(y + x), f, s, dst + 4 * x, k);
+    }
+    planar_tail(y, first, second, dst, x, width, k);
+}
+
+static void nv12_neon(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width, const struct YuvCoeffs *k) {
+    int16x8_t bias = vdupq_n_s16(128);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        uint8x8x2_t pairs = vld2_u8(uv + x);
+        int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(pairs.val[0])), bias);
+        int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(pairs.val[1])), bias);
+        neon_pixels(vld1q_u8(y + x), k->vFirst ? v : u, k->vFirst ? u : v, dst + 4 * x, k);
+    }
+    nv12_tail(y, uv, dst, x, width, k);
+}
+
+#endif
+
+
+
+static int convert(const struct YuvKernel *kern, const AVFrame *src, enum AVPixelFormat fmt, uint8_t *dst, int stride) {
+    struct YuvCoeffs k;
+    int nv12 = src->format == AV_PIX_FMT_NV12;
+
+    if ((fmt != AV_PIX_FMT_RGBA && fmt != AV_PIX_FMT_BGRA) ||
+        (!nv12 && src->format != AV_PIX_FMT_YUV420P && src->format != AV_PIX_FMT_YUVJ420P)) {
+        return -1;
+    }
+    coefficients(src, fmt == AV_PIX_FMT_BGRA, &k);
+
+    for (int row = 0; row < src->height; row++) {
+        const uint8_t *y = src->data[0] + (ptrdiff_t)row * src->linesize[0];
+        uint8_t *out = dst + (ptrdiff_t)row * stride;
+
+        if (nv12) {
+            kern->nv12(y, src->data[1] + (ptrdiff_t)(row / 2) * src->linesize[1], out, src->width, &k);
+        } else {
+            const uint8_t *u = src->data[1] + (ptrdiff_t)(row / 2) * src->linesize[1];
+            const uint8_t *v = src->data[2] + (ptrdiff_t)(row / 2) * src->linesize[2];
+            kern->planar(y, k.vFirst ? v : u, k.vFirst ? u : v, out, src->width, &k);
+        }
+    }
+    return 0;
+}
+
+static inline int16_t fixed(double v) {
+    return (int16_t)(v < 0 ? v - 0.5 : v + 0.5);
+}
+
+/*
+    BT.601 or BT.709 from Kr and Kb, limited range expands 16-235 luma and 16-240 chroma.
+    The luma scale is a 16 bit fraction of Y * 257, which keeps its error below 0.1 levels.
+*/
+static void coefficients(const AVFrame *src, int bgra, struct YuvCoeffs *k) {
+    int bt709 = src->colorspace == AVCOL_SPC_BT709;
+    int full = src->format == AV_PIX_FMT_YUVJ420P || src->color_range == AVCOL_RANGE_JPEG;
+    double kr = bt709 ? 0.2126 : 0.299;
+    double kb = bt709 ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    double ymul = full ? 1.0 : 255.0 / 219.0;
+    double cmul = (full ? 1.0 : 255.0 / 224.0) * (1 << YUV_SHIFT);
+    int16_t vr = fixed(2 * (1 - kr) * cmul);
+    int16_t ub = fixed(2 * (1 - kb) * cmul);
+    int16_t ug = fixed(2 * (1 - kb) * kb / kg * cmul);
+    int16_t vg = fixed(2 * (1 - kr) * kr / kg * cmul);
+
+    k->yg = (uint16_t)(ymul * (1 << YUV_SHIFT) * 65536 / 257 + 0.5);
+    k->yBias = fixed(-(full ? 0 : 16) * ymul * (1 << YUV_SHIFT)) + (1 << (YUV_SHIFT - 1));
+    k->vFirst = !bgra;
+    k->c0 = bgra ? ub : vr;
+    k->c1a = bgra ? ug : vg;
+    k->c1b = bgra ? vg : ug;
+    k->c2 = bgra ? vr : ub;
+}
+
+static const struct YuvKernel *select_kernel() {
+    const struct YuvKernel *kern = SDL_AtomicGetPtr(&selected);
+
+    if (kern == NULL) {
+        for (kern = kernels; !kern->available(); kern++) {
+        }
+        SDL_AtomicSetPtr(&selected, (void *)kern);
+        log_info("yuv: using the %s kernel", kern->name);
+    }
+    return kern;
+}
@@ -0,0 +1,34 @@
+#ifndef AOAKVM_YUV
+#define AOAKVM_YUV
+
+#include "aoakvm.h"
+
+/*
+    int yuv_toRgb(const AVFrame *src, enum AVPixelFormat fmt, uint8_t *dst, int stride);
+
+    Converts a decoded YUV420P, YUVJ420P or NV12 frame to AV_PIX_FMT_RGBA or AV_PIX_FMT_BGRA
+    at stride bytes per row of dst, e.g. in a frame sink or for screenshots. BT.709 frames
+    use its matrix, all others BT.601, full range for YUVJ420P and AVCOL_RANGE_JPEG. Chroma
+    is taken from the nearest sample like SWS_POINT. The AVX2, SSE4.1 or NEON kernel is chosen
+    by the CPU the first time, all give the same bytes as the scalar one. Returns -1 for
+    other formats, the caller then falls back to libswscale.
+*/
+int yuv_toRgb(const AVFrame*, enum AVPixelFormat, uint8_t*, int);
+
+/*
+    const char *yuv_kernelName();
+
+    Name of the kernel yuv_toRgb uses on this CPU: "avx2", "sse4.1", "neon" or "scalar".
+*/
+const char *yuv_kernelName();
+
+/*
+    int yuv_setKernel(const char *name);
+
+    Makes yuv_toRgb use the kernel of that name instead of the fastest one, e.g. to compare
+    the kernels in tests/yuv_test.c. NULL goes back to choosing by the CPU. Returns -1 if the
+    kernel is not built in or this CPU lacks its instructions.
+*/
+int yuv_setKernel(const char*);
+
+#endif